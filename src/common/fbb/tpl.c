@@ -51,6 +51,20 @@
     offset += len; \
   } while (0);
 
+/* Make the serializer return 0, i.e. fail, if size bytes don't fit in the buffer at offset.
+ * Uses the "capacity" variable of the serializer. The offset must not exceed the capacity. */
+#define RESERVE(offset, size) do { \
+    if ((size) > capacity - (offset)) { \
+      return 0; \
+    } \
+  } while (0);
+
+/* Pad like PAD(), if there is room for the padding. */
+#define PAD_BOUNDED(p, offset) do { \
+    RESERVE(offset, (fbb_size_t) (7 - ((offset + 7) & 0x07))); \
+    PAD(p, offset); \
+  } while (0);
+
 /* Beginning of extra_c */
 {{ extra_c }}
 /* End of extra_c */
@@ -235,6 +249,16 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_measure(const {{ NS }}_Builder *bld
     len +=  {{ ns }}_builder_measure({{ ns }}_builder_{{ msg }}_get_{{ var }}_at(msgbldr, idx));  /* already includes padding */
   }
 ###     endif
+###   endfor
+
+    /* The indexes of indexed arrays */
+###   for (quant, type, var, dbgfn) in fields
+###     if var in indexed.get(msg, {})
+  if (msgbldr->wire.{{ var }}_count_ > 0) {
+    len += {{ ns }}_index_bucket_count(msgbldr->wire.{{ var }}_count_) * sizeof(fbb_size_t);
+    ADD_PADDING_LEN(len);
+  }
+###     endif
 ###   endfor
 
   ADD_PADDING_LEN(len);
@@ -242,12 +266,14 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_measure(const {{ NS }}_Builder *bld
 }
 
 /*
- * Builder - Serialize a '{{ msg }}' message to memory
+ * Builder - Serialize a '{{ msg }}' message to memory of the given capacity
  *
  * Has to be kept in sync (wrt. paddings and such) with {{ ns }}_builder_{{ msg }}_measure()
  * to make sure that they return the same length.
+ *
+ * Returns 0 if the message does not fit.
  */
-static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *bldr, char *dst) {
+static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *bldr, char *dst, fbb_size_t capacity) {
   const {{ NS }}_Builder_{{ msg }} *msgbldr = ({{ NS }}_Builder_{{ msg }}*)bldr;
 #ifdef FB_EXTRA_DEBUG
   /* Verify that the required fields were set */
@@ -265,6 +291,7 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
   fbb_size_t offset = 0;  /* relative to the beginning of this (sub)message */
 
   /* The wire structure */
+  RESERVE(offset, sizeof(msgbldr->wire));
   memcpy(dst, &msgbldr->wire, sizeof(msgbldr->wire));
   offset = sizeof(msgbldr->wire);
 
@@ -275,13 +302,14 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
 ###   if jinjans.has_relptr
   /* First hop relptrs. Zero out, just in case there's a padding at the end of this structure that we
    * won't initialize (or we could go with attribute packed, too). Will set the actual values soon. */
+  RESERVE(offset, sizeof({{ NS }}_Relptrs_{{ msg }}));
   {{ NS }}_Relptrs_{{ msg }} *relptrs = ({{ NS }}_Relptrs_{{ msg }} *) (dst + offset);
   memset(dst + offset, 0, sizeof({{ NS }}_Relptrs_{{ msg }}));
   offset += sizeof({{ NS }}_Relptrs_{{ msg }});
 ###   endif
 
   /* Padding */
-  PAD(dst, offset);
+  PAD_BOUNDED(dst, offset);
 
   /* Arrays of scalars */
 ###   for (quant, type, var, dbgfn) in fields
@@ -289,9 +317,10 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
   if (msgbldr->wire.{{ var }}_count_ > 0) {
     relptrs->{{ var }}_relptr_ = offset;
     fbb_size_t size = msgbldr->wire.{{ var }}_count_ * sizeof(msgbldr->{{ var }}_[0]);
+    RESERVE(offset, size);
     memcpy(dst + offset, msgbldr->{{ var }}_, size);
     offset += size;
-    PAD(dst, offset);
+    PAD_BOUNDED(dst, offset);
   } else {
     relptrs->{{ var }}_relptr_ = 0;
   }
@@ -304,9 +333,10 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
   if (msgbldr->{{ var }}_ != NULL) {
     relptrs->{{ var }}_relptr_ = offset;
     fbb_size_t size = msgbldr->wire.{{ var }}_len_ + 1;
+    RESERVE(offset, size);
     memcpy(dst + offset, msgbldr->{{ var }}_, size);
     offset += size;
-    PAD(dst, offset);
+    PAD_BOUNDED(dst, offset);
   } else {
     relptrs->{{ var }}_relptr_ = 0;
   }
@@ -318,7 +348,10 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
 ###     if quant in [REQUIRED, OPTIONAL] and type == FBB
   if (msgbldr->{{ var }}_ != NULL) {
     relptrs->{{ var }}_relptr_ = offset;
-    fbb_size_t size = {{ ns }}_builder_serialize(msgbldr->{{ var }}_, dst + offset);
+    fbb_size_t size = {{ ns }}_builder_serialize_bounded(msgbldr->{{ var }}_, dst + offset, capacity - offset);
+    if (size == 0) {
+      return 0;
+    }
     offset += size;
     /* FBB is serialized with a final padding, so no more padding is added here */
   } else {
@@ -334,17 +367,19 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
     relptrs->{{ var }}_relptr_ = offset;
     fbb_size_t *hops = (fbb_size_t *) (dst + offset);
     fbb_size_t size = 2 * msgbldr->wire.{{ var }}_count_ * sizeof(fbb_size_t);  /* room for alternating list of offsets and lengths */
+    RESERVE(offset, size);
     offset += size;
-    PAD(dst, offset);
+    PAD_BOUNDED(dst, offset);
     for (fbb_size_t idx = 0; idx < msgbldr->wire.{{ var }}_count_; idx++) {
       fbb_size_t len = 0;
       const char *str = {{ ns }}_builder_{{ msg }}_get_{{ var }}_with_len_at(msgbldr, idx, &len);
       size = len + 1;
+      RESERVE(offset, size);
       *hops++ = offset;  /* build up an alternating list of offsets and lengths */
       *hops++ = len;
       memcpy(dst + offset, str, size);
       offset += size;
-      PAD(dst, offset);
+      PAD_BOUNDED(dst, offset);
     }
   } else {
     relptrs->{{ var }}_relptr_ = 0;
@@ -359,12 +394,17 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
     relptrs->{{ var }}_relptr_ = offset;
     fbb_size_t *hops = (fbb_size_t *) (dst + offset);
     fbb_size_t size = msgbldr->wire.{{ var }}_count_ * sizeof(fbb_size_t);
+    RESERVE(offset, size);
     offset += size;
-    PAD(dst, offset);
+    PAD_BOUNDED(dst, offset);
     for (fbb_size_t idx = 0; idx < msgbldr->wire.{{ var }}_count_; idx++) {
       *hops++ = offset;
       const {{ NS }}_Builder *fbb = {{ ns }}_builder_{{ msg }}_get_{{ var }}_at(msgbldr, idx);
-      offset += {{ ns }}_builder_serialize(fbb, dst + offset);  /* recurse */
+      size = {{ ns }}_builder_serialize_bounded(fbb, dst + offset, capacity - offset);  /* recurse */
+      if (size == 0) {
+        return 0;
+      }
+      offset += size;
       /* FBB is serialized with a final padding, so no more padding is added here */
     }
   } else {
@@ -373,7 +413,41 @@ static fbb_size_t {{ ns }}_builder_{{ msg }}_serialize(const {{ NS }}_Builder *b
 ###     endif
 ###   endfor
 
-  PAD(dst, offset);
+  /* Indexes of indexed arrays, hash tables of the item index + 1 with 0 marking empty buckets */
+###   for (quant, type, var, dbgfn) in fields
+###     if var in indexed.get(msg, {})
+###       set key_tag, key_field = indexed[msg][var]
+  if (msgbldr->wire.{{ var }}_count_ > 0) {
+    relptrs->{{ var }}_index_relptr_ = offset;
+    fbb_size_t *buckets = (fbb_size_t *) (dst + offset);
+    const fbb_size_t bucket_count = {{ ns }}_index_bucket_count(msgbldr->wire.{{ var }}_count_);
+    RESERVE(offset, bucket_count * sizeof(fbb_size_t));
+    memset(buckets, 0, bucket_count * sizeof(fbb_size_t));
+    offset += bucket_count * sizeof(fbb_size_t);
+    PAD_BOUNDED(dst, offset);
+    for (fbb_size_t idx = 0; idx < msgbldr->wire.{{ var }}_count_; idx++) {
+      fbb_size_t len = 0;
+###       if type == STRING
+      const char *key = {{ ns }}_builder_{{ msg }}_get_{{ var }}_with_len_at(msgbldr, idx, &len);
+###       else
+      const {{ NS }}_Builder *fbb = {{ ns }}_builder_{{ msg }}_get_{{ var }}_at(msgbldr, idx);
+      assert({{ ns }}_builder_get_tag(fbb) == {{ NS }}_TAG_{{ key_tag }});
+      const char *key = {{ ns }}_builder_{{ key_tag }}_get_{{ key_field }}_with_len((const {{ NS }}_Builder_{{ key_tag }} *) fbb, &len);
+###       endif
+      /* Linear probing, the first item with a given key gets found first. */
+      fbb_size_t bucket = {{ ns }}_index_hash(key, len) & (bucket_count - 1);
+      while (buckets[bucket] != 0) {
+        bucket = (bucket + 1) & (bucket_count - 1);
+      }
+      buckets[bucket] = idx + 1;
+    }
+  } else {
+    relptrs->{{ var }}_index_relptr_ = 0;
+  }
+###     endif
+###   endfor
+
+  PAD_BOUNDED(dst, offset);
   return offset;
 }
 
@@ -480,36 +554,43 @@ fbb_size_t {{ ns }}_builder_measure(const {{ NS }}_Builder *msgbldr) {
 /*
  * Builder - Lookup array for the serializer function of a particular message tag
  */
-static fbb_size_t (*{{ ns }}_builder_serializers_array[])(const {{ NS }}_Builder *, char *) = {
+static fbb_size_t (*{{ ns }}_builder_serializers_array[])(const {{ NS }}_Builder *, char *, fbb_size_t) = {
   NULL,
 ### for (msg, _) in msgs
-  (fbb_size_t (*) (const {{ NS }}_Builder *, char *)) {{ ns }}_builder_{{ msg }}_serialize,
+  (fbb_size_t (*) (const {{ NS }}_Builder *, char *, fbb_size_t)) {{ ns }}_builder_{{ msg }}_serialize,
 ### endfor
 };
 
 /*
- * Builder - Serialize any message to memory
+ * Builder - Serialize any message to memory of the given capacity
  *
  * See the documentation in tpl.h.
  */
-fbb_size_t {{ ns }}_builder_serialize(const {{ NS }}_Builder *msgbldr, char *dst) {
-#ifdef FB_EXTRA_DEBUG
-  /* If the measured value is incorrect then a nasty buffer overrun can occur.
-   * In order to guarantee FBB's correct behavior, let's do the debug assertion internally here in
-   * FBB, rather than the caller having to do it. Which means we need to run measure() again (the
-   * caller has already run it but we don't know that value). */
-  fbb_size_t len_measured = {{ ns }}_builder_measure(msgbldr);
-#endif
-
+fbb_size_t {{ ns }}_builder_serialize_bounded(const {{ NS }}_Builder *msgbldr, char *dst, fbb_size_t capacity) {
   /* Invoke the particular serializer for this message type */
   int tag = * ((int *) msgbldr);
   assert(tag >= 1 && tag < {{ NS }}_TAG_NEXT);
-  fbb_size_t len = (*{{ ns }}_builder_serializers_array[tag])(msgbldr, dst);
+  fbb_size_t len = (*{{ ns }}_builder_serializers_array[tag])(msgbldr, dst, capacity);
 
 #ifdef FB_EXTRA_DEBUG
-  assert(len == len_measured);
+  /* If the serializer and the measurer disagree then a nasty buffer overrun can occur when the
+   * caller allocates the buffer based on measure(). In order to guarantee FBB's correct behavior,
+   * let's do the debug assertion internally here in FBB, rather than the caller having to do it. */
+  assert(len == 0 || len == {{ ns }}_builder_measure(msgbldr));
 #endif
   return len;
 }
 
+/*
+ * Builder - Serialize any message to memory
+ *
+ * See the documentation in tpl.h.
+ */
+fbb_size_t {{ ns }}_builder_serialize(const {{ NS }}_Builder *msgbldr, char *dst) {
+  /* The buffer is large enough, as guaranteed by the caller. */
+  fbb_size_t len = {{ ns }}_builder_serialize_bounded(msgbldr, dst, (fbb_size_t) -1);
+  assert(len > 0);
+  return len;
+}
+
 #pragma GCC diagnostic pop
@@ -159,6 +159,16 @@ fbb_size_t {{ ns }}_builder_measure(const {{ NS }}_Builder *msg);
  */
 fbb_size_t {{ ns }}_builder_serialize(const {{ NS }}_Builder *msg, char *dst);
 
+/*
+ * Builder - Serialize any message to memory of the given capacity, in a single pass
+ *
+ * Does not need a preceding {{ ns }}_builder_measure() call, but the buffer's contents are
+ * undefined if the serialized form does not fit in capacity bytes.
+ *
+ * Return the length of the serialized form, or 0 if it does not fit.
+ */
+fbb_size_t {{ ns }}_builder_serialize_bounded(const {{ NS }}_Builder *msg, char *dst, fbb_size_t capacity);
+
 /* These are just so that you can "FBB_Builder *" or "FBB_Serialized *" instead of the more generic "void *",
  * resulting in nicer code. */
 #ifdef __cplusplus
@@ -179,6 +189,9 @@ typedef struct _{{ NS }}_Builder {
   inline fbb_size_t serialize(char *dst) const {
     return {{ ns }}_builder_serialize(this, dst);
   }
+  inline fbb_size_t serialize_bounded(char *dst, fbb_size_t capacity) const {
+    return {{ ns }}_builder_serialize_bounded(this, dst, capacity);
+  }
   inline void debug(FILE *f) const {
     {{ ns }}_builder_debug(f, this);
   }
@@ -234,6 +247,37 @@ static inline int {{ ns }}_serialized_get_tag(const {{ NS }}_Serialized *msg) {
   return msg->{{ ns }}_tag_;
 }
 
+/*
+ * Number of the buckets in the index of an indexed array with the given number of items
+ *
+ * The index is an open addressing hash table with linear probing, at most half full.
+ */
+static inline fbb_size_t {{ ns }}_index_bucket_count(fbb_size_t count) {
+  fbb_size_t buckets = 2;
+  while (buckets < 2 * count) {
+    buckets *= 2;
+  }
+  return buckets;
+}
+
+/*
+ * Hash of a key in the index of an indexed array, processing 8 bytes at a time
+ */
+static inline fbb_size_t {{ ns }}_index_hash(const char *key, fbb_size_t len) {
+  const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+  uint64_t hash = len * mul;
+  uint64_t word;
+  for (; len >= 8; key += 8, len -= 8) {
+    memcpy(&word, key, 8);
+    hash = (hash ^ word) * mul;
+    hash ^= hash >> 32;
+  }
+  word = 0;
+  memcpy(&word, key, len);
+  hash = (hash ^ word) * mul;
+  return (fbb_size_t) (hash ^ (hash >> 32));
+}
+
 #ifdef __cplusplus
 }  /* close extern "C" for the inline methods so that we can use C++ function overloading */
 #endif
@@ -1497,6 +1541,55 @@ inline std::vector<{{ "std::string" if type == STRING else ctype }}> get_{{ var
 ###       do serialized_funcs.append((comment, cfunc, cxxfunc, 'c++'))
 {# ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^ #}
 
+###       if var in indexed.get(msg, {})
+###         set key_tag, key_field = indexed[msg][var]
+
+{# .......................................................................... #}
+###         set comment
+/*
+ * Serialized lookup - index of the first item with the given key in an indexed array, or -1
+ * {{ type }}[] {{ var }}
+ */
+###         endset
+###         set cfunc
+static inline int {{ ns }}_serialized_{{ msg }}_find_{{ var }}_idx(const {{ NS }}_Serialized_{{ msg }} *msg, const char *key, fbb_size_t len) {
+  assert(msg->{{ ns }}_tag_ == {{ NS }}_TAG_{{ msg }});
+
+  if (msg->{{ var }}_count_ == 0) {
+    return -1;
+  }
+  const {{ NS }}_Relptrs_{{ msg }} *relptrs = (const {{ NS }}_Relptrs_{{ msg }} *) ((const {{ NS }}_Serialized_{{ msg }} *) &msg[1]);  /* the area immediately followed by the {{ NS }}_Serialized_{{ msg }} structure */
+  const void *buckets_void = (const char *)msg + relptrs->{{ var }}_index_relptr_;
+  const fbb_size_t *buckets = (const fbb_size_t *)buckets_void;
+  const fbb_size_t mask = {{ ns }}_index_bucket_count(msg->{{ var }}_count_) - 1;
+  /* Buckets hold the item index + 1, 0 marks an empty bucket. */
+  for (fbb_size_t bucket = {{ ns }}_index_hash(key, len) & mask; buckets[bucket] != 0;
+       bucket = (bucket + 1) & mask) {
+    const fbb_size_t idx = buckets[bucket] - 1;
+    fbb_size_t item_len;
+###         if type == STRING
+    const char *item_key = {{ ns }}_serialized_{{ msg }}_get_{{ var }}_with_len_at(msg, idx, &item_len);
+###         else
+    const {{ NS }}_Serialized *item = {{ ns }}_serialized_{{ msg }}_get_{{ var }}_at(msg, idx);
+    assert({{ ns }}_serialized_get_tag(item) == {{ NS }}_TAG_{{ key_tag }});
+    const char *item_key = {{ ns }}_serialized_{{ key_tag }}_get_{{ key_field }}_with_len((const {{ NS }}_Serialized_{{ key_tag }} *) item, &item_len);
+###         endif
+    if (item_len == len && memcmp(item_key, key, len) == 0) {
+      return (int) idx;
+    }
+  }
+  return -1;
+}
+###         endset
+###         set cxxfunc
+inline int find_{{ var }}_idx(const char *key, fbb_size_t len) const {
+  return {{ ns }}_serialized_{{ msg }}_find_{{ var }}_idx(this, key, len);
+}
+###         endset
+###         do serialized_funcs.append((comment, cfunc, cxxfunc, 'c'))
+{# ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^ #}
+
+###       endif
 ###     endif
 ###   endfor
 
@@ -1599,6 +1692,9 @@ typedef struct _{{ NS }}_Relptrs_{{ msg }} {
 ###       if quant == ARRAY or type in [STRING, FBB]
   fbb_size_t {{ var }}_relptr_;
 ###       endif
+###       if var in indexed.get(msg, {})
+  fbb_size_t {{ var }}_index_relptr_;
+###       endif
 ###     endfor
 } {{ NS }}_Relptrs_{{ msg }};
 ###   else
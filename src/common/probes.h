@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef COMMON_PROBES_H_
+#define COMMON_PROBES_H_
+
+/*
+ * USDT (statically defined tracing) probes in the "firebuild" provider, to be traced by bpftrace,
+ * perf, SystemTap or similar tools, for example:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/firebuild:firebuild:shortcut_hit { @[str(arg0)] = count(); }'
+ *
+ * A disabled probe is a single nop instruction plus an ELF note describing the arguments, thus the
+ * probes are compiled in whenever <sys/sdt.h> is available at build time (FB_USDT_PROBES is
+ * defined by CMake). Arguments should be cheap to evaluate, since they are evaluated even when no
+ * tracer is attached.
+ */
+
+#ifdef FB_USDT_PROBES
+#include <sys/sdt.h>
+
+#define FB_PROBE(name) DTRACE_PROBE(firebuild, name)
+#define FB_PROBE1(name, a1) DTRACE_PROBE1(firebuild, name, a1)
+#define FB_PROBE2(name, a1, a2) DTRACE_PROBE2(firebuild, name, a1, a2)
+#define FB_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(firebuild, name, a1, a2, a3)
+#else
+#define FB_PROBE(name) do {} while (0)
+#define FB_PROBE1(name, a1) do { (void)(a1); } while (0)
+#define FB_PROBE2(name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#define FB_PROBE3(name, a1, a2, a3) do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#endif
+
+#endif  /* COMMON_PROBES_H_ */
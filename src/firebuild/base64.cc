@@ -26,8 +26,7 @@ bool Base64::valid_ascii(const char* const str, const int length) {
   int i;
   /* The last character could be from a limited set, depending on the length of the input
    * that's encoded in this base64-like ASCII representation. This is not checked here
-   * because the ASCII representation is never decoded to get the input bits back in this
-   * program. */
+   * because the ASCII representation is decoded only when importing cache bundles. */
   for (i = 0; i < length; i++) {
     if ((str[i] >= 'A' && str[i] <= 'Z') ||
         (str[i] >= 'a' && str[i] <= 'z') ||
@@ -96,4 +95,40 @@ void Base64::encode(const unsigned char* in, char *out, int in_length) {
   }
 }
 
+int Base64::decode_char(char c) {
+  if (c == '+') {
+    return 0;
+  } else if (c >= '0' && c <= '9') {
+    return c - '0' + 1;
+  } else if (c >= 'A' && c <= 'Z') {
+    return c - 'A' + 11;
+  } else if (c == '^') {
+    return 37;
+  } else if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 38;
+  } else {
+    return -1;
+  }
+}
+
+bool Base64::decode(const char* in, unsigned char* out, int out_length) {
+  /* Decode the full 3 byte blocks, then the remaining 1 or 2 bytes. */
+  uint32_t val = 0;
+  int bits = 0;
+  int written = 0;
+  for (const char* c = in; written < out_length; c++) {
+    const int sextet = decode_char(*c);
+    if (sextet == -1) {
+      return false;
+    }
+    val = (val << 6) | sextet;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out[written++] = (val >> bits) & 0xff;
+    }
+  }
+  return true;
+}
+
 }  /* namespace firebuild */
@@ -22,7 +22,7 @@
 namespace firebuild {
 
 /**
- * Base64 variant with encoding only.
+ * Base64 variant.
  *
  * The two non-alphanumeric characters of our base64 alphabet are '+' and '^' and
  * none of the characters are at their usual position.
@@ -35,8 +35,15 @@ class Base64 {
  public:
   static bool valid_ascii(const char* const str, const int length);
   static void encode(const unsigned char* in, char* out, int in_length);
+  /**
+   * Decode the ASCII representation of in_length bytes of binary data.
+   * @return whether str is a valid ASCII representation
+   */
+  static bool decode(const char* in, unsigned char* out, int out_length);
 
  private:
+  /** @return the 6 bits encoded by c, or -1 if c is not in the alphabet */
+  static int decode_char(char c);
   static void encode_3byte_block(const unsigned char *in, char *out);
   static void encode_2byte_block(const unsigned char *in, char *out);
   static void encode_1byte_block(const unsigned char *in, char *out);
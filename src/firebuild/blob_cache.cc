@@ -19,28 +19,28 @@
 #include "firebuild/blob_cache.h"
 
 #include <dirent.h>
-#ifdef __APPLE__
-#include <copyfile.h>
-#endif
 #include <fcntl.h>
-#ifdef __linux__
-#include <linux/fs.h>
-#endif
 #include <stdio.h>
-#include <sys/ioctl.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <tsl/hopscotch_set.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include "common/probes.h"
 #include "firebuild/ascii_hash.h"
+#include "firebuild/cache_access_log.h"
 #include "firebuild/config.h"
 #include "firebuild/execed_process_cacher.h"
 #include "firebuild/debug.h"
 #include "firebuild/file_name.h"
 #include "firebuild/hash.h"
+#include "firebuild/remote_cache.h"
 #include "firebuild/utils.h"
 
 namespace firebuild {
@@ -48,69 +48,25 @@ namespace firebuild {
 /* singleton */
 BlobCache *blob_cache;
 
-BlobCache::BlobCache(const std::string &base_dir) : base_dir_(base_dir) {
+BlobCache::BlobCache(const std::string &base_dir, const std::vector<std::string> &lower_dirs)
+    : base_dir_(base_dir), lower_dirs_(lower_dirs), packs_(base_dir + "/packs", true) {
   mkdir(base_dir_.c_str(), 0700);
-}
-
-/*
- * Copy the contents from an open file descriptor to another,
- * preferring advanced technologies like copy on write.
- * Might skip the beginning of the input file.
- * Might append to the target file instead of replacing its contents. O_APPEND should _not_ be set
- * on fd_dst because then the fast copy_file_range() method doesn't work.
- */
-static bool copy_file(int fd_src, loff_t src_skip_bytes, int fd_dst, bool append,
-                      const struct stat64 *src_stat_ptr = NULL) {
-  /* Try CoW first. */
-  if (src_skip_bytes == 0 && !append) {
-#ifdef __APPLE__
-  if (fcopyfile(fd_src, fd_dst, nullptr, COPYFILE_DATA) == 0) {
-#else
-    if (ioctl(fd_dst, FICLONE, fd_src) == 0) {
-#endif
-      /* CoW succeeded. Moo! */
-      return true;
-    }
-  } else {
-    // FIXME try FICLONERANGE
-  }
-
-  /* Try copy_file_range(). Gotta get the source file's size, and in append mode also the
-   * destination file's size */
-  struct stat64 src_st_local;
-  if (!src_stat_ptr && fstat64(fd_src, &src_st_local) == -1) {
-    fb_perror("fstat");
-    assert(0);
-    return false;
-  }
-  const struct stat64 *src_st = src_stat_ptr ? src_stat_ptr : &src_st_local;
-  if (!S_ISREG(src_st->st_mode)) {
-    FB_DEBUG(FB_DEBUG_CACHING, "not a regular file");
-    return false;
+  for (const std::string& lower_dir : lower_dirs_) {
+    lower_packs_.push_back(new BlobPacks(lower_dir + "/packs", false));
+    lower_dirs_max_length_ = std::max(lower_dirs_max_length_, lower_dir.length());
   }
+}
 
-  struct stat64 dst_st_local;
-  const struct stat64 *dst_st = nullptr;
-  if (append) {
-    if (fstat64(fd_dst, &dst_st_local) == -1) {
-      fb_perror("fstat");
-      assert(0);
-      return false;
-    }
-    dst_st = &dst_st_local;
-    if (!S_ISREG(dst_st->st_mode)) {
-      FB_DEBUG(FB_DEBUG_CACHING, "not a regular file");
-      return false;
-    }
+BlobCache::~BlobCache() {
+  for (BlobPacks* lower_packs : lower_packs_) {
+    delete lower_packs;
   }
-
-  off_t len = src_st->st_size >= src_skip_bytes ? src_st->st_size - src_skip_bytes : 0;
-  loff_t dst_skip_bytes = append ? dst_st->st_size : 0;
-  return fb_copy_file_range(fd_src, &src_skip_bytes, fd_dst, &dst_skip_bytes, len, 0) == len;
 }
 
 /* /x/xx/<ascii key> */
 static size_t kBlobCachePathLength = 1 + 1 + 1 + 2 + 1 + Hash::kAsciiLength;
+/* Temporary files not modified for this long were left behind by killed processes. */
+static const time_t kStaleTmpFileAgeSec = 3600;
 
 /*
  * Constructs the filename where the cached file is to be stored, or
@@ -148,6 +104,32 @@ static void cleanup_free_tmpfile(int fd, char* tmpfile) {
   free(tmpfile);
 }
 
+void BlobCache::upload(const char* path) {
+  if (remote_cache) {
+    remote_cache->upload_async("blobs" + std::string(path + base_dir_.length()), path);
+  }
+}
+
+bool BlobCache::store_packed(const Hash &key, int fd, loff_t size) {
+  if (size <= 0 || size > max_packed_blob_size) {
+    return false;
+  }
+  bool added;
+  std::string pack_path;
+  loff_t offset;
+  if (!packs_.add(key, fd, 0, size, &added, &pack_path, &offset)) {
+    return false;
+  }
+  if (added && remote_cache) {
+    /* The remote cache stores each blob separately. */
+    char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kBlobCachePathLength + 1));
+    construct_cached_file_name(base_dir_, key, false, path);
+    remote_cache->upload_async("blobs" + std::string(path + base_dir_.length()), pack_path,
+                               offset, size);
+  }
+  return true;
+}
+
 bool BlobCache::store_file(const FileName *path,
                            int max_writers,
                            int fd_src,
@@ -250,7 +232,7 @@ bool BlobCache::store_file(const FileName *path,
     if (!compress_file(fd_dst, fd_compressed, dst_st.st_size, compression_level)) {
       FB_DEBUG(FB_DEBUG_CACHING, "failed to compress file");
       cleanup_free_tmpfile(fd_dst, tmpfile);
-      cleanup_free_tmpfile(fd_dst, tmpfile_compressed);
+      cleanup_free_tmpfile(fd_compressed, tmpfile_compressed);
       return false;
     }
 
@@ -259,19 +241,28 @@ bool BlobCache::store_file(const FileName *path,
     if (fstat64(fd_compressed, &compressed_st) == -1) {
       fb_perror("fstat on compressed file");
       cleanup_free_tmpfile(fd_dst, tmpfile);
-      cleanup_free_tmpfile(fd_dst, tmpfile_compressed);
+      cleanup_free_tmpfile(fd_compressed, tmpfile_compressed);
       return false;
     }
     final_size = compressed_st.st_size;
 
     /* Remove the uncompressed temp file and use the compressed one */
     cleanup_free_tmpfile(fd_dst, tmpfile);
-    close(fd_compressed);
+    fd_dst = fd_compressed;
     tmpfile = tmpfile_compressed;
-  } else {
-    close(fd_dst);
   }
 
+  if (store_packed(key, fd_dst, final_size)) {
+    cleanup_free_tmpfile(fd_dst, tmpfile);
+    FB_DEBUG(FB_DEBUG_CACHING, "  => " + d(key) + " (packed)");
+    FB_PROBE3(blob_store, dst_st.st_size, final_size, true);
+    if (key_out != NULL) {
+      *key_out = key;
+    }
+    return true;
+  }
+  close(fd_dst);
+
   char* path_dst = reinterpret_cast<char*>(alloca(base_dir_.length() + kBlobCachePathLength + 1));
   construct_cached_file_name(base_dir_, key, true, path_dst);
   if (fb_renameat2(AT_FDCWD, tmpfile, AT_FDCWD, path_dst, RENAME_NOREPLACE) == -1) {
@@ -281,11 +272,13 @@ bool BlobCache::store_file(const FileName *path,
     } else {
       fb_perror("Failed renaming file while storing it");
       assert(0);
+      unlink(tmpfile);
       free(tmpfile);
       return false;
     }
   } else {
     execed_process_cacher->update_cached_bytes(final_size);
+    upload(path_dst);
   }
   free(tmpfile);
 
@@ -306,6 +299,7 @@ bool BlobCache::store_file(const FileName *path,
     close(debugfd);
   }
 
+  FB_PROBE3(blob_store, dst_st.st_size, final_size, false);
   if (key_out != NULL) {
     *key_out = key;
   }
@@ -318,7 +312,10 @@ bool BlobCache::move_store_file(const std::string &path,
                                 Hash *key_out) {
   TRACK(FB_DEBUG_CACHING, "path=%s, fd=%d, size=%" PRIloff, D(path), fd, size);
 
-  FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: storing blob by moving " + path);
+  /* An empty path means that fd refers to an unnamed temporary file. */
+  const bool unnamed = path.empty();
+  FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: storing blob by moving "
+           + (unnamed ? "unnamed file " + d_fd(fd) : path));
 
   Hash key;
   assert(size > 0);
@@ -331,27 +328,36 @@ bool BlobCache::move_store_file(const std::string &path,
   if (!key.set_from_fd(fd, &st, NULL)) {
     FB_DEBUG(FB_DEBUG_CACHING, "failed to compute hash");
     close(fd);
-    unlink(path.c_str());
+    if (!unnamed) {
+      unlink(path.c_str());
+    }
     return false;
   }
 
   /* If compression is enabled, compress the file in place */
   off_t final_size = size;
   if (compress_cache) {
-    char *tmpfile_compressed;
-    if (asprintf(&tmpfile_compressed, "%s.compressed", path.c_str()) < 0) {
-      fb_perror("asprintf");
-      assert(0);
-      close(fd);
-      unlink(path.c_str());
-      return false;
+    char *tmpfile_compressed = NULL;
+    int fd_compressed;
+    if (unnamed) {
+      fd_compressed = fb_open_tmpfile(base_dir_.c_str());
+    } else {
+      if (asprintf(&tmpfile_compressed, "%s.compressed", path.c_str()) < 0) {
+        fb_perror("asprintf");
+        assert(0);
+        close(fd);
+        unlink(path.c_str());
+        return false;
+      }
+      fd_compressed = open(tmpfile_compressed, O_CREAT|O_RDWR|O_TRUNC, 0600);
     }
-    int fd_compressed = open(tmpfile_compressed, O_CREAT|O_RDWR|O_TRUNC, 0600);
     if (fd_compressed == -1) {
       fb_perror("Failed opening compressed file");
       assert(0);
       close(fd);
-      unlink(path.c_str());
+      if (!unnamed) {
+        unlink(path.c_str());
+      }
       free(tmpfile_compressed);
       return false;
     }
@@ -360,8 +366,10 @@ bool BlobCache::move_store_file(const std::string &path,
       FB_DEBUG(FB_DEBUG_CACHING, "failed to compress file");
       close(fd);
       close(fd_compressed);
-      unlink(path.c_str());
-      unlink(tmpfile_compressed);
+      if (!unnamed) {
+        unlink(path.c_str());
+        unlink(tmpfile_compressed);
+      }
       free(tmpfile_compressed);
       return false;
     }
@@ -372,8 +380,10 @@ bool BlobCache::move_store_file(const std::string &path,
       fb_perror("fstat on compressed file");
       close(fd);
       close(fd_compressed);
-      unlink(path.c_str());
-      unlink(tmpfile_compressed);
+      if (!unnamed) {
+        unlink(path.c_str());
+        unlink(tmpfile_compressed);
+      }
       free(tmpfile_compressed);
       return false;
     }
@@ -381,24 +391,68 @@ bool BlobCache::move_store_file(const std::string &path,
     final_size = compressed_st.st_size;
 
     close(fd);
-    close(fd_compressed);
-    /* Remove the original file and rename the compressed one */
-    unlink(path.c_str());
-    if (rename(tmpfile_compressed, path.c_str()) == -1) {
-      fb_perror("Failed renaming compressed file");
-      assert(0);
-      unlink(tmpfile_compressed);
+    if (unnamed) {
+      /* The compressed unnamed file is linked to the cache instead of the original. */
+      fd = fd_compressed;
+    } else {
+      close(fd_compressed);
+      /* Remove the original file and rename the compressed one */
+      unlink(path.c_str());
+      if (rename(tmpfile_compressed, path.c_str()) == -1) {
+        fb_perror("Failed renaming compressed file");
+        assert(0);
+        unlink(tmpfile_compressed);
+        free(tmpfile_compressed);
+        return false;
+      }
       free(tmpfile_compressed);
-      return false;
     }
-    free(tmpfile_compressed);
-  } else {
+  } else if (!unnamed) {
     close(fd);
   }
 
+  if (final_size <= max_packed_blob_size) {
+    const int fd_packed = unnamed ? fd : open(path.c_str(), O_RDONLY);
+    const bool packed = fd_packed != -1 && store_packed(key, fd_packed, final_size);
+    if (!unnamed && fd_packed != -1) {
+      close(fd_packed);
+    }
+    if (packed) {
+      if (unnamed) {
+        close(fd);
+      } else {
+        unlink(path.c_str());
+      }
+      FB_DEBUG(FB_DEBUG_CACHING, "  => " + key.to_ascii() + " (packed)");
+      FB_PROBE3(blob_store, size, final_size, true);
+      if (key_out != NULL) {
+        *key_out = key;
+      }
+      return true;
+    }
+  }
+
   char* path_dst = reinterpret_cast<char*>(alloca(base_dir_.length() + kBlobCachePathLength + 1));
   construct_cached_file_name(base_dir_, key, true, path_dst);
-  if (fb_renameat2(AT_FDCWD, path.c_str(), AT_FDCWD, path_dst, RENAME_NOREPLACE) == -1) {
+  if (unnamed) {
+    /* The data never left the kernel and the file gets its only name here. */
+    int ret = fb_link_tmpfile(fd, path_dst);
+    int link_errno = errno;
+    close(fd);
+    if (ret == -1) {
+      if (link_errno == EEXIST) {
+        FB_DEBUG(FB_DEBUG_CACHING, "blob is already stored");
+      } else {
+        errno = link_errno;
+        fb_perror("Failed linking file to cache");
+        assert(0);
+        return false;
+      }
+    } else {
+      execed_process_cacher->update_cached_bytes(final_size);
+      upload(path_dst);
+    }
+  } else if (fb_renameat2(AT_FDCWD, path.c_str(), AT_FDCWD, path_dst, RENAME_NOREPLACE) == -1) {
     if (errno == EEXIST) {
       FB_DEBUG(FB_DEBUG_CACHING, "blob is already stored");
       unlink(path.c_str());
@@ -410,6 +464,7 @@ bool BlobCache::move_store_file(const std::string &path,
     }
   } else {
     execed_process_cacher->update_cached_bytes(final_size);
+    upload(path_dst);
   }
 
   if (FB_DEBUGGING(FB_DEBUG_CACHING)) {
@@ -419,7 +474,8 @@ bool BlobCache::move_store_file(const std::string &path,
   if (FB_DEBUGGING(FB_DEBUG_CACHE)) {
     /* Place meta info in the cache, for easier debugging. */
     std::string path_debug = std::string(path_dst) + kDebugPostfix;
-    std::string txt(pretty_timestamp() + "  Moved from " + path + "\n");
+    std::string txt(pretty_timestamp() + "  Moved from "
+                    + (unnamed ? "an unnamed file" : path) + "\n");
     int debugfd = open(path_debug.c_str(), O_CREAT|O_WRONLY|O_APPEND, 0600);
     ssize_t written = write(debugfd, txt.c_str(), txt.size());
     if (written < 0) {
@@ -432,17 +488,18 @@ bool BlobCache::move_store_file(const std::string &path,
     close(debugfd);
   }
 
+  FB_PROBE3(blob_store, size, final_size, false);
   if (key_out != NULL) {
     *key_out = key;
   }
   return true;
 }
 
-bool BlobCache::retrieve_file(int blob_fd,
+bool BlobCache::retrieve_file(const blob_fd_t& blob,
                               const FileName *path_dst,
                               bool append,
                               bool decompress) {
-  TRACK(FB_DEBUG_CACHING, "blob_fd=%d, path_dst=%s, append=%s", blob_fd, D(path_dst), D(append));
+  TRACK(FB_DEBUG_CACHING, "blob_fd=%d, path_dst=%s, append=%s", blob.fd, D(path_dst), D(append));
 
   int flags = append ? O_WRONLY : (O_WRONLY|O_CREAT|O_TRUNC);
   int fd_dst = open(path_dst->c_str(), flags, 0666);
@@ -457,45 +514,282 @@ bool BlobCache::retrieve_file(int blob_fd,
   bool success;
   if (decompress) {
     /* Decompress the file */
-    success = decompress_file(blob_fd, fd_dst);
+    if (append && lseek(fd_dst, 0, SEEK_END) == -1) {
+      success = false;
+    } else if (blob.packed) {
+      /* Packed blobs are small, decompress them in memory. */
+      uint8_t* compressed = static_cast<uint8_t*>(malloc(blob.size));
+      uint8_t* decompressed = nullptr;
+      size_t decompressed_size = 0;
+      if (pread(blob.fd, compressed, blob.size, blob.offset) == blob.size) {
+        decompressed = decompress_zstd(compressed, blob.size, &decompressed_size);
+      }
+      free(compressed);
+      success = decompressed
+          && fb_write(fd_dst, decompressed, decompressed_size)
+          == static_cast<ssize_t>(decompressed_size);
+      free(decompressed);
+    } else {
+      success = decompress_file(blob.fd, fd_dst);
+    }
     if (!success) {
       FB_DEBUG(FB_DEBUG_CACHING, "Decompressing file from cache failed");
-      assert(0);
-      close(blob_fd);
-      close(fd_dst);
-      if (!append) {
-        unlink(path_dst->c_str());
-      }
-      return false;
     }
   } else {
     /* Copy the file as-is */
-    success = copy_file(blob_fd, 0, fd_dst, append);
+    if (blob.packed) {
+      /* Copy the blob's region of the pack, not cloning the whole pack. */
+      loff_t off_src = blob.offset;
+      loff_t off_dst = append ? lseek(fd_dst, 0, SEEK_END) : 0;
+      success = off_dst != -1
+          && fb_copy_file_range(blob.fd, &off_src, fd_dst, &off_dst, blob.size, 0) == blob.size;
+    } else {
+      /* In order to save an fstat64() call in copy_file(), create a "fake" stat result here. */
+      struct stat64 src_st;
+      src_st.st_mode = S_IFREG;
+      src_st.st_size = blob.size;
+      success = copy_file(blob.fd, 0, fd_dst, append, &src_st);
+    }
     if (!success) {
       FB_DEBUG(FB_DEBUG_CACHING, "Copying file from cache failed");
-      assert(0);
-      close(blob_fd);
-      close(fd_dst);
-      if (!append) {
-        unlink(path_dst->c_str());
-      }
-      return false;
     }
   }
+  if (!success) {
+    assert(0);
+    close(fd_dst);
+    if (!append) {
+      unlink(path_dst->c_str());
+    }
+    return false;
+  }
 
   close(fd_dst);
+  FB_PROBE3(blob_retrieve, blob.size, blob.packed, decompress);
+  return true;
+}
+
+/**
+ * Check if the blob's data, or its decompressed version for blobs stored compressed, has the
+ * expected hash.
+ */
+static bool blob_matches_key(const Hash &key, const uint8_t* data, size_t size) {
+  Hash hash;
+  hash.set_from_data(data, size);
+  if (hash == key) {
+    return true;
+  } else if (size == 0) {
+    return false;
+  }
+  size_t decompressed_size = 0;
+  uint8_t* decompressed = decompress_zstd(data, size, &decompressed_size);
+  if (!decompressed) {
+    return false;
+  }
+  hash.set_from_data(decompressed, decompressed_size);
+  free(decompressed);
+  return hash == key;
+}
+
+/** Check if the blob in the file has the expected hash, see blob_matches_key(). */
+static bool blob_file_matches_key(const Hash &key, int fd) {
+  struct stat64 st;
+  if (fstat64(fd, &st) == -1) {
+    return false;
+  } else if (st.st_size == 0) {
+    return blob_matches_key(key, nullptr, 0);
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  const bool matches = blob_matches_key(key, reinterpret_cast<uint8_t*>(data), st.st_size);
+  munmap(data, st.st_size);
+  return matches;
+}
+
+bool BlobCache::import_blob(const Hash &key, const uint8_t* data, size_t size) {
+  char* path_dst = reinterpret_cast<char*>(alloca(base_dir_.length() + kBlobCachePathLength + 1));
+  construct_cached_file_name(base_dir_, key, false, path_dst);
+  if (access(path_dst, F_OK) == 0 || packs_.contains(key)) {
+    return true;
+  }
+  if (!blob_matches_key(key, data, size)) {
+    fb_error("Imported blob does not match its key: " + key.to_ascii());
+    return false;
+  }
+  std::string tmpfile = base_dir_ + "/new.XXXXXX";
+  int fd = mkstemp(&tmpfile[0]);
+  if (fd == -1) {
+    fb_perror("Failed mkstemp() for importing blob");
+    return false;
+  }
+  if (fb_write(fd, data, size) != static_cast<ssize_t>(size)) {
+    fb_perror("Failed writing blob");
+    close(fd);
+    unlink(tmpfile.c_str());
+    return false;
+  }
+  const bool packed = store_packed(key, fd, size);
+  close(fd);
+  if (packed) {
+    unlink(tmpfile.c_str());
+    return true;
+  }
+  construct_cached_file_name(base_dir_, key, true, path_dst);
+  if (fb_renameat2(AT_FDCWD, tmpfile.c_str(), AT_FDCWD, path_dst, RENAME_NOREPLACE) == -1) {
+    unlink(tmpfile.c_str());
+    return errno == EEXIST;
+  }
+  execed_process_cacher->update_cached_bytes(size);
+  upload(path_dst);
+  return true;
+}
+
+/**
+ * Take over a blob file's fd, filling in blob.
+ * @return whether succeeded
+ */
+static bool set_blob_fd(int fd, blob_fd_t* blob) {
+  struct stat64 st;
+  if (fstat64(fd, &st) == -1) {
+    fb_perror("fstat");
+    close(fd);
+    return false;
+  }
+  blob->fd = fd;
+  blob->offset = 0;
+  blob->size = st.st_size;
+  blob->packed = false;
   return true;
 }
 
-int BlobCache::get_fd_for_file(const Hash &key) {
+bool BlobCache::open_blob(const Hash &key, blob_fd_t* blob, bool local_only) {
   if (FB_DEBUGGING(FB_DEBUG_CACHING)) {
-    FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: getting fd for blob " + key.to_ascii());
+    FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: opening blob " + key.to_ascii());
   }
 
   char* path_src = reinterpret_cast<char*>(alloca(base_dir_.length() + kBlobCachePathLength + 1));
   construct_cached_file_name(base_dir_, key, false, path_src);
 
-  return open(path_src, O_RDONLY);
+  int fd = open(path_src, O_RDONLY);
+  if (fd != -1) {
+    if (cache_access_log) {
+      cache_access_log->record(path_src, 0, 0);
+    }
+    return set_blob_fd(fd, blob);
+  }
+  if ((blob->fd = packs_.open_blob(key, &blob->offset, &blob->size)) != -1) {
+    blob->packed = true;
+    return true;
+  }
+  if (local_only) {
+    return false;
+  }
+  char* path_lower =
+      reinterpret_cast<char*>(alloca(lower_dirs_max_length_ + kBlobCachePathLength + 1));
+  for (size_t i = 0; i < lower_dirs_.size(); i++) {
+    const std::string& lower_dir = lower_dirs_[i];
+    construct_cached_file_name(lower_dir, key, false, path_lower);
+    if (access(path_lower, R_OK) == 0) {
+      /* Promote the blob to the writable layer to keep it available and to let GC manage it. */
+      construct_cached_file_name(base_dir_, key, true, path_src);
+      off_t size = copy_file_atomically(path_lower, base_dir_.c_str(), path_src);
+      if (size >= 0) {
+        FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: promoted blob from " + lower_dir);
+        execed_process_cacher->update_cached_bytes(size);
+      }
+      /* If promoting failed, use the blob from the lower layer directly. */
+      const char* used_path = size >= 0 ? path_src : path_lower;
+      fd = open(used_path, O_RDONLY);
+      if (fd == -1) {
+        return false;
+      }
+      if (cache_access_log) {
+        cache_access_log->record(used_path, 0, 0);
+      }
+      return set_blob_fd(fd, blob);
+    }
+    loff_t lower_offset, lower_size;
+    fd = lower_packs_[i]->open_blob(key, &lower_offset, &lower_size);
+    if (fd != -1) {
+      /* Promote the packed blob, too. */
+      bool added;
+      std::string pack_path;
+      loff_t offset;
+      if (packs_.add(key, fd, lower_offset, lower_size, &added, &pack_path, &offset)
+          && (blob->fd = packs_.open_blob(key, &blob->offset, &blob->size)) != -1) {
+        FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: promoted packed blob from " + lower_dir);
+        close(fd);
+      } else {
+        /* Use the blob from the lower layer directly. */
+        blob->fd = fd;
+        blob->offset = lower_offset;
+        blob->size = lower_size;
+      }
+      blob->packed = true;
+      return true;
+    }
+  }
+  if (remote_cache) {
+    construct_cached_file_name(base_dir_, key, true, path_src);
+    const off_t size = remote_cache->download(
+        "blobs" + std::string(path_src + base_dir_.length()), base_dir_.c_str(), path_src,
+        [&key](int fd) {return blob_file_matches_key(key, fd);});
+    if (size >= 0) {
+      execed_process_cacher->update_cached_bytes(size);
+      fd = open(path_src, O_RDONLY);
+      return fd != -1 && set_blob_fd(fd, blob);
+    }
+  }
+  return false;
+}
+
+void BlobCache::prefetch(const std::vector<Hash>& keys) {
+  if (!remote_cache || keys.empty()) {
+    return;
+  }
+  std::vector<remote_download_t> downloads;
+  char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kBlobCachePathLength + 1));
+  char* path_lower =
+      reinterpret_cast<char*>(alloca(lower_dirs_max_length_ + kBlobCachePathLength + 1));
+  for (const Hash& key : keys) {
+    construct_cached_file_name(base_dir_, key, false, path);
+    if (access(path, R_OK) == 0 || packs_.contains(key)) {
+      continue;
+    }
+    bool in_lower_layer = false;
+    for (size_t i = 0; i < lower_dirs_.size(); i++) {
+      construct_cached_file_name(lower_dirs_[i], key, false, path_lower);
+      if (access(path_lower, R_OK) == 0 || lower_packs_[i]->contains(key)) {
+        in_lower_layer = true;
+        break;
+      }
+    }
+    if (!in_lower_layer) {
+      construct_cached_file_name(base_dir_, key, true, path);
+      downloads.push_back({"blobs" + std::string(path + base_dir_.length()), path, -1,
+                           [key](int fd) {return blob_file_matches_key(key, fd);}});
+    }
+  }
+  FB_DEBUG(FB_DEBUG_CACHING, "BlobCache: downloading " + d(downloads.size()) + " blobs");
+  remote_cache->download_parallel(base_dir_.c_str(), &downloads);
+  for (const remote_download_t& download : downloads) {
+    if (download.size >= 0) {
+      execed_process_cacher->update_cached_bytes(download.size);
+    }
+  }
+}
+
+bool BlobCache::is_tmp_file(DIR* dir, const char* name, bool* stale) {
+  /* "new.XXXXXX" and "new_compressed.XXXXXX" */
+  if (strncmp(name, "new", strlen("new")) != 0
+      || (name[3] != '.' && strncmp(name + 3, "_compressed.", strlen("_compressed.")) != 0)) {
+    return false;
+  }
+  struct stat st;
+  *stale = fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0
+      && time(NULL) - st.st_mtim.tv_sec > kStaleTmpFileAgeSec;
+  return true;
 }
 
 void BlobCache::delete_entries(const std::string& path,
@@ -547,7 +841,9 @@ void BlobCache::gc_blob_cache_dir(const std::string& path,
   /* Visit dirs recursively and check all the files. */
   struct dirent *dirent;
   std::vector<std::string> entries_to_delete;
+  std::vector<std::string> stale_tmp_files;
   std::vector<std::string> subdirs_to_visit;
+  bool stale;
   while ((dirent = readdir(dir)) != NULL) {
     const char* name = dirent->d_name;
     if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
@@ -556,7 +852,10 @@ void BlobCache::gc_blob_cache_dir(const std::string& path,
 
     switch (fixed_dirent_type(dirent, dir, path)) {
       case DT_DIR: {
-        subdirs_to_visit.push_back(name);
+        /* The pack files are collected separately. */
+        if (path != base_dir_ || strcmp(name, "packs") != 0) {
+          subdirs_to_visit.push_back(name);
+        }
         break;
       }
       case DT_REG: {
@@ -594,6 +893,11 @@ void BlobCache::gc_blob_cache_dir(const std::string& path,
               /* Removing old debugging file later to not break next readdir(). */
               entries_to_delete.push_back(name);
             }
+          } else if (is_tmp_file(dir, name, &stale)) {
+            /* Being written by a parallel process, or left behind by a killed one. */
+            if (stale) {
+              stale_tmp_files.push_back(name);
+            }
           } else {
             fb_error("Regular file among cache blobs has unexpected name, keeping it: " +
                      path + "/" + d(name));
@@ -608,6 +912,12 @@ void BlobCache::gc_blob_cache_dir(const std::string& path,
     }
   }
   delete_entries(path, entries_to_delete, kDebugPostfix, debug_bytes);
+  for (const auto& tmp_file : stale_tmp_files) {
+    /* Not counted in the cache size. */
+    if (unlinkat(dirfd(dir), tmp_file.c_str(), 0) != 0) {
+      fb_perror("unlinkat");
+    }
+  }
   for (const auto& subdir : subdirs_to_visit) {
     gc_blob_cache_dir(path + "/" + subdir, referenced_blobs, cache_bytes, debug_bytes,
                       unexpected_file_bytes);
@@ -635,6 +945,7 @@ void BlobCache::gc_blob_cache_dir(const std::string& path,
 void BlobCache::gc(const tsl::hopscotch_set<AsciiHash>& referenced_blobs, off_t* cache_bytes,
                    off_t* debug_bytes, off_t* unexpected_file_bytes) {
   gc_blob_cache_dir(base_dir_, referenced_blobs, cache_bytes, debug_bytes, unexpected_file_bytes);
+  packs_.gc(referenced_blobs, cache_bytes, unexpected_file_bytes);
 }
 
 }  /* namespace firebuild */
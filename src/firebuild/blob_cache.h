@@ -19,6 +19,7 @@
 #ifndef FIREBUILD_BLOB_CACHE_H_
 #define FIREBUILD_BLOB_CACHE_H_
 
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <tsl/hopscotch_set.h>
@@ -28,14 +29,30 @@
 #include <vector>
 
 #include "firebuild/ascii_hash.h"
+#include "firebuild/blob_packs.h"
 #include "firebuild/file_name.h"
 #include "firebuild/hash.h"
 
 namespace firebuild {
 
+/** An opened blob, either a separate file or a region of a pack file. */
+typedef struct blob_fd_ {
+  int fd = -1;
+  /** The blob's offset in the file, 0 for separate files */
+  loff_t offset = 0;
+  loff_t size = 0;
+  /** Whether the fd refers to a pack file */
+  bool packed = false;
+} blob_fd_t;
+
 class BlobCache {
  public:
-  explicit BlobCache(const std::string &base_dir);
+  /**
+   * @param base_dir the writable blob cache directory
+   * @param lower_dirs read-only blob cache directories to look up blobs in, after base_dir
+   */
+  explicit BlobCache(const std::string &base_dir,
+                     const std::vector<std::string> &lower_dirs = {});
   ~BlobCache();
 
   /**
@@ -71,7 +88,8 @@ class BlobCache {
    *
    * This API is designed for PipeRecorder in order to place the recorded data in the cache.
    *
-   * @param path The file to move to the cache
+   * @param path The file to move to the cache, or empty if fd refers to an unnamed file opened
+   *             with fb_open_tmpfile() which is then linked to the cache
    * @param fd A fd referring to this file
    * @param size The file's size
    * @param key_out Optionally store the key (hash) here
@@ -90,27 +108,49 @@ class BlobCache {
    *
    * In append mode the file must already exist, the cache entry will be appended to it.
    *
-   * Uses advanced technologies, such as copy on write, if available.
+   * Uses advanced technologies, such as copy on write, if available. Packed blobs are copied with
+   * copy_file_range() from the pack.
    *
-   * @param blob_fd opened file descriptor of the blob to be used
+   * @param blob the opened blob to be used
    * @param path_dst Where to place the file
    * @param append Whether to use append mode
    * @param decompress Whether to decompress the blob during retrieval
    * @return Whether succeeded
    */
-  bool retrieve_file(int blob_fd,
+  bool retrieve_file(const blob_fd_t& blob,
                      const FileName *path_dst,
                      bool append,
                      bool decompress);
   /**
-   * Get a read-only fd for a given entry in the cache.
+   * Open a given entry in the cache for reading.
    *
    * This is comfy when shortcutting a process and replaying what it wrote to a pipe.
    *
+   * Blobs found only in a lower layer are copied (reflinked if possible) to the writable layer
+   * first.
+   *
    * @param key The key (the file's hash)
-   * @return A read-only fd, or -1
+   * @param[out] blob The opened blob, the caller has to close its fd
+   * @param local_only Look up the blob only in the writable layer
+   * @return Whether the blob could be opened
+   */
+  bool open_blob(const Hash &key, blob_fd_t* blob, bool local_only = false);
+  /**
+   * Place a blob exported from another cache in the writable layer, unless it is already present.
+   *
+   * @param key The blob's key
+   * @param data The blob as stored on disk, possibly compressed
+   * @param size The blob's size
+   * @return Whether the blob is stored
    */
-  int get_fd_for_file(const Hash &key);
+  bool import_blob(const Hash &key, const uint8_t* data, size_t size);
+  /**
+   * Download blobs found neither in the writable nor in the lower layers from the remote cache
+   * tier concurrently, to have them in place for open_blob().
+   *
+   * @param keys The blobs' keys
+   */
+  void prefetch(const std::vector<Hash>& keys);
   /**
    * Garbage collect the blob cache
    * @param referenced_blobs blobs referenced from the object cache, they won't be deleted
@@ -129,6 +169,13 @@ class BlobCache {
    * @param debug_postfix string to prepend to entries to get the related debug entries
    * @param[in,out] debug_bytes decremented when removing a debug entry
    */
+  /**
+   * Check if the regular file is a temporary one, created while storing a blob or an entry.
+   * @param dir the directory containing the file
+   * @param name the file's name
+   * @param[out] stale set if the file is old enough to be left behind by a killed process
+   */
+  static bool is_tmp_file(DIR* dir, const char* name, bool* stale);
   static void delete_entries(const std::string& path, const std::vector<std::string>& entries,
                              const std::string& debug_postfix, off_t* debug_bytes);
   /** Returns total size of all stored blob files including debug and invalid entries. */
@@ -148,8 +195,26 @@ class BlobCache {
                          const tsl::hopscotch_set<AsciiHash>& referenced_blobs,
                          off_t* cache_bytes, off_t* debug_bytes,
                          off_t* unexpected_file_bytes);
+  /** Queue a newly stored blob for uploading to the remote cache tier if it is configured. */
+  void upload(const char* path);
+  /**
+   * Store a blob in the writable layer's pack if it is small enough.
+   * @param key The blob's key
+   * @param fd The blob's data, from the beginning of the file
+   * @param size The blob's size
+   * @return Whether the blob is stored in the pack
+   */
+  bool store_packed(const Hash &key, int fd, loff_t size);
   /* Including the "blobs" subdir. */
   std::string base_dir_;
+  /* Read-only lower layers, including the "blobs" subdir, in lookup order. */
+  std::vector<std::string> lower_dirs_;
+  /* Length of the longest lower layer's path, for sizing path buffers */
+  size_t lower_dirs_max_length_ {0};
+  /* Small blobs of the writable layer. */
+  BlobPacks packs_;
+  /* Small blobs of the lower layers, in the same order as lower_dirs_. */
+  std::vector<BlobPacks*> lower_packs_ {};
   static constexpr char kDebugPostfix[] = "_debug.txt";
 };
 
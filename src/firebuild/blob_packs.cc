@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/blob_packs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "firebuild/cache_access_log.h"
+#include "firebuild/debug.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+static const char kIndexMagic[8] = {'F', 'B', 'P', 'A', 'C', 'K', 'S', '\0'};
+static const uint32_t kIndexVersion = 1;
+/** The index is created with this many entries and it is grown by doubling its size. */
+static const uint32_t kInitialCapacity = 1024;
+/** A new pack file is started when appending to the active one would make it bigger than this. */
+static const loff_t kMaxPackSize = 64 * 1024 * 1024;
+static const char kPackSuffix[] = ".pack";
+
+BlobPacks::BlobPacks(const std::string& dir, bool writable)
+    : dir_(dir), index_path_(dir + "/index"), writable_(writable) {
+}
+
+BlobPacks::~BlobPacks() {
+  unmap_index();
+  if (lock_fd_ != -1) {
+    close(lock_fd_);
+  }
+  if (append_fd_ != -1) {
+    close(append_fd_);
+  }
+  for (const auto& pair : pack_fds_) {
+    close(pair.second);
+  }
+}
+
+bool BlobPacks::lock(int operation) {
+  if (lock_fd_ == -1) {
+    const std::string lock_path = dir_ + "/lock";
+    lock_fd_ = writable_ ? open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600)
+        : open(lock_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (lock_fd_ == -1) {
+      return false;
+    }
+  }
+  while (flock(lock_fd_, operation) == -1) {
+    if (errno != EINTR) {
+      fb_perror("flock");
+      return false;
+    }
+  }
+  return true;
+}
+
+void BlobPacks::unlock() {
+  flock(lock_fd_, LOCK_UN);
+}
+
+bool BlobPacks::map_index() {
+  int fd = open(index_path_.c_str(), (writable_ ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat64 st;
+  if (fstat64(fd, &st) == -1 || std::cmp_less(st.st_size, sizeof(index_header_t))) {
+    close(fd);
+    return false;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ | (writable_ ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  index_header_t* header = reinterpret_cast<index_header_t*>(p);
+  if (memcmp(header->magic, kIndexMagic, sizeof(kIndexMagic)) != 0
+      || header->version != kIndexVersion
+      || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0
+      || std::cmp_not_equal(st.st_size, sizeof(index_header_t)
+                            + header->capacity * sizeof(index_entry_t))) {
+    fb_error("Invalid blob pack index " + index_path_);
+    munmap(p, st.st_size);
+    return false;
+  }
+  unmap_index();
+  index_ = header;
+  index_mapped_size_ = st.st_size;
+  return true;
+}
+
+void BlobPacks::unmap_index() {
+  if (index_) {
+    munmap(index_, index_mapped_size_);
+    index_ = nullptr;
+    index_mapped_size_ = 0;
+  }
+}
+
+bool BlobPacks::ensure_index_mapped() {
+  return (index_ && !index_->replaced) || map_index();
+}
+
+BlobPacks::index_entry_t* BlobPacks::probe(index_entry_t* entries, uint32_t capacity,
+                                           uint64_t key_low, uint64_t key_high) {
+  /* Linear probing. The table is kept at most half full, thus there is always an unused entry. */
+  const uint32_t mask = capacity - 1;
+  for (uint32_t i = key_low & mask; ; i = (i + 1) & mask) {
+    if (entries[i].size == 0
+        || (entries[i].key_low == key_low && entries[i].key_high == key_high)) {
+      return &entries[i];
+    }
+  }
+}
+
+BlobPacks::index_entry_t* BlobPacks::find(const Hash& key) const {
+  const XXH128_hash_t hash = key.get();
+  return probe(entries(), index_->capacity, hash.low64, hash.high64);
+}
+
+bool BlobPacks::write_index(uint32_t capacity, uint32_t active_pack, uint32_t next_pack,
+                            const index_entry_t* src_entries, size_t src_count) {
+  const size_t size = sizeof(index_header_t) + capacity * sizeof(index_entry_t);
+  std::string tmp_path = index_path_ + ".XXXXXX";
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd == -1) {
+    fb_perror("Failed mkstemp() for creating the blob pack index");
+    return false;
+  }
+  if (ftruncate(fd, size) == -1) {
+    fb_perror("ftruncate");
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fb_perror("mmap");
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  index_header_t* header = reinterpret_cast<index_header_t*>(p);
+  memcpy(header->magic, kIndexMagic, sizeof(kIndexMagic));
+  header->version = kIndexVersion;
+  header->capacity = capacity;
+  header->active_pack = active_pack;
+  header->next_pack = next_pack;
+  index_entry_t* new_entries = reinterpret_cast<index_entry_t*>(header + 1);
+  for (size_t i = 0; i < src_count; i++) {
+    if (src_entries[i].size != 0) {
+      *probe(new_entries, capacity, src_entries[i].key_low, src_entries[i].key_high) =
+          src_entries[i];
+      header->count++;
+    }
+  }
+  munmap(p, size);
+
+  const off_t old_size = index_size();
+  if (rename(tmp_path.c_str(), index_path_.c_str()) == -1) {
+    fb_perror("Failed renaming the blob pack index");
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  if (index_) {
+    /* Let the other processes know that they should map the new index. */
+    index_->replaced = 1;
+  }
+  execed_process_cacher->update_cached_bytes(size - old_size);
+  return map_index();
+}
+
+std::string BlobPacks::pack_path(uint32_t pack) const {
+  return dir_ + "/" + std::to_string(pack) + kPackSuffix;
+}
+
+int BlobPacks::pack_fd(uint32_t pack) {
+  auto it = pack_fds_.find(pack);
+  if (it != pack_fds_.end()) {
+    return it->second;
+  }
+  int fd = open(pack_path(pack).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    pack_fds_[pack] = fd;
+  }
+  return fd;
+}
+
+void BlobPacks::forget_pack_fd(uint32_t pack) {
+  auto it = pack_fds_.find(pack);
+  if (it != pack_fds_.end()) {
+    close(it->second);
+    pack_fds_.erase(it);
+  }
+  if (append_fd_ != -1 && append_pack_ == pack) {
+    close(append_fd_);
+    append_fd_ = -1;
+  }
+}
+
+off_t BlobPacks::index_size() const {
+  return index_ ? index_mapped_size_ : 0;
+}
+
+int BlobPacks::open_pack(const Hash& key, loff_t* offset, loff_t* size, uint32_t* pack) {
+  if (!index_ && !map_index()) {
+    return -1;
+  }
+  if (!lock(LOCK_SH)) {
+    return -1;
+  }
+  int fd = -1;
+  if (ensure_index_mapped()) {
+    const index_entry_t* entry = find(key);
+    if (entry->size != 0) {
+      /* Open the pack while holding the lock, a parallel GC run may remove it afterwards. */
+      const int cached_fd = pack_fd(entry->pack);
+      if (cached_fd != -1) {
+        fd = fcntl(cached_fd, F_DUPFD_CLOEXEC, 0);
+        *offset = entry->offset;
+        *size = entry->size;
+        *pack = entry->pack;
+      }
+    }
+  }
+  unlock();
+  return fd;
+}
+
+int BlobPacks::open_blob(const Hash& key, loff_t* offset, loff_t* size) {
+  uint32_t pack;
+  const int fd = open_pack(key, offset, size, &pack);
+  if (fd != -1 && cache_access_log) {
+    cache_access_log->record(pack_path(pack), *offset, *size);
+  }
+  return fd;
+}
+
+bool BlobPacks::contains(const Hash& key) {
+  loff_t offset, size;
+  uint32_t pack;
+  const int fd = open_pack(key, &offset, &size, &pack);
+  if (fd == -1) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+bool BlobPacks::add(const Hash& key, int fd_src, loff_t src_offset, loff_t size, bool* added,
+                    std::string* path, loff_t* offset) {
+  assert(writable_);
+  assert_cmp(size, >, 0);
+  *added = false;
+  if (size > std::numeric_limits<decltype(index_entry_t::size)>::max()) {
+    /* The size would not fit in the index entry. */
+    return false;
+  }
+  if (!index_) {
+    mkdir(dir_.c_str(), 0700);
+  }
+  if (!lock(LOCK_EX)) {
+    return false;
+  }
+  if (!ensure_index_mapped() && !write_index(kInitialCapacity, 1, 2, nullptr, 0)) {
+    unlock();
+    return false;
+  }
+
+  index_entry_t* entry = find(key);
+  if (entry->size != 0) {
+    FB_DEBUG(FB_DEBUG_CACHING, "blob is already stored in a pack");
+    *path = pack_path(entry->pack);
+    *offset = entry->offset;
+    unlock();
+    return true;
+  }
+  if ((index_->count + 1) * 2 > index_->capacity) {
+    if (!write_index(index_->capacity * 2, index_->active_pack, index_->next_pack, entries(),
+                     index_->capacity)) {
+      unlock();
+      return false;
+    }
+    entry = find(key);
+  }
+
+  /* Open the active pack, or start a new one if it would grow too big. */
+  if (append_fd_ != -1 && append_pack_ != index_->active_pack) {
+    close(append_fd_);
+    append_fd_ = -1;
+  }
+  loff_t dst_offset = 0;
+  for (int i = 0; i < 2; i++) {
+    if (append_fd_ == -1) {
+      append_pack_ = index_->active_pack;
+      append_fd_ = open(pack_path(append_pack_).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+      if (append_fd_ == -1) {
+        fb_perror("Failed opening blob pack");
+        unlock();
+        return false;
+      }
+    }
+    struct stat64 st;
+    if (fstat64(append_fd_, &st) == -1) {
+      fb_perror("fstat");
+      unlock();
+      return false;
+    }
+    dst_offset = st.st_size;
+    if (dst_offset == 0 || dst_offset + size <= kMaxPackSize) {
+      break;
+    }
+    close(append_fd_);
+    append_fd_ = -1;
+    index_->active_pack = index_->next_pack++;
+  }
+
+  loff_t src_off = src_offset, dst_off = dst_offset;
+  if (fb_copy_file_range(fd_src, &src_off, append_fd_, &dst_off, size, 0) != size) {
+    fb_perror("Failed appending blob to pack");
+    /* Don't leave partial data behind. */
+    if (ftruncate(append_fd_, dst_offset) == -1) {
+      fb_perror("ftruncate");
+    }
+    unlock();
+    return false;
+  }
+  entry->key_low = key.get().low64;
+  entry->key_high = key.get().high64;
+  entry->offset = dst_offset;
+  entry->pack = append_pack_;
+  /* Setting the size makes the entry used. */
+  entry->size = size;
+  index_->count++;
+  *path = pack_path(append_pack_);
+  unlock();
+
+  *added = true;
+  *offset = dst_offset;
+  execed_process_cacher->update_cached_bytes(size);
+  return true;
+}
+
+void BlobPacks::gc(const tsl::hopscotch_set<AsciiHash>& referenced_blobs, off_t* cache_bytes,
+                   off_t* unexpected_file_bytes) {
+  assert(writable_);
+  DIR* dir = opendir(dir_.c_str());
+  if (dir == NULL) {
+    return;
+  }
+  if (!lock(LOCK_EX)) {
+    closedir(dir);
+    return;
+  }
+  ensure_index_mapped();
+
+  /* Collect the pack files. */
+  tsl::hopscotch_map<uint32_t, off_t> pack_sizes;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    const char* name = dirent->d_name;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
+    }
+    if (strcmp(name, "index") == 0 || strcmp(name, "lock") == 0) {
+      continue;
+    }
+    char* end;
+    const unsigned long pack = strtoul(name, &end, 10);  // NOLINT(runtime/int)
+    if (end != name && strcmp(end, kPackSuffix) == 0) {
+      pack_sizes[pack] = file_size(dir, name);
+    } else if (strncmp(name, "index.", strlen("index.")) == 0) {
+      /* Left behind by a crashed process, it can't be in use while holding the lock. */
+      unlinkat(dirfd(dir), name, 0);
+    } else {
+      fb_error("File among blob packs has unexpected name, keeping it: " + dir_ + "/" + d(name));
+      *unexpected_file_bytes += file_size(dir, name);
+    }
+  }
+  closedir(dir);
+
+  /* Keep the referenced blobs. */
+  std::vector<index_entry_t> kept;
+  tsl::hopscotch_map<uint32_t, off_t> live_bytes;
+  uint32_t active_pack = 1, next_pack = 2;
+  if (index_) {
+    active_pack = index_->active_pack;
+    next_pack = index_->next_pack;
+    char ascii[Hash::kAsciiLength + 1];
+    for (uint32_t i = 0; i < index_->capacity; i++) {
+      const index_entry_t& entry = entries()[i];
+      if (entry.size == 0 || pack_sizes.find(entry.pack) == pack_sizes.end()) {
+        continue;
+      }
+      Hash(XXH128_hash_t {entry.key_low, entry.key_high}).to_ascii(ascii);
+      if (referenced_blobs.find(AsciiHash(ascii)) != referenced_blobs.end()) {
+        kept.push_back(entry);
+        live_bytes[entry.pack] += entry.size;
+      }
+    }
+  }
+
+  /* Rewrite the packs that are mostly unused. */
+  tsl::hopscotch_set<uint32_t> rewritten;
+  for (const auto& pair : pack_sizes) {
+    const off_t live = live_bytes[pair.first];
+    if (live == 0 || (pair.second - live) * 4 > pair.second) {
+      rewritten.insert(pair.first);
+    }
+  }
+  std::vector<uint32_t> new_packs;
+  int out_fd = -1;
+  loff_t out_offset = 0;
+  off_t new_bytes = 0;
+  for (index_entry_t& entry : kept) {
+    if (rewritten.find(entry.pack) == rewritten.end()) {
+      continue;
+    }
+    if (out_fd == -1 || out_offset + entry.size > kMaxPackSize) {
+      if (out_fd != -1) {
+        close(out_fd);
+      }
+      new_packs.push_back(next_pack++);
+      out_fd = open(pack_path(new_packs.back()).c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      out_offset = 0;
+    }
+    const int src_fd = pack_fd(entry.pack);
+    loff_t src_off = entry.offset, dst_off = out_offset;
+    if (out_fd == -1 || src_fd == -1
+        || fb_copy_file_range(src_fd, &src_off, out_fd, &dst_off, entry.size, 0) != entry.size) {
+      fb_perror("Failed compacting blob pack");
+      /* Forget the blob, the cache entries referencing it will not be used. */
+      entry.size = 0;
+      continue;
+    }
+    entry.pack = new_packs.back();
+    entry.offset = out_offset;
+    out_offset += entry.size;
+    new_bytes += entry.size;
+  }
+  if (out_fd != -1) {
+    close(out_fd);
+  }
+  if (rewritten.find(active_pack) != rewritten.end()) {
+    active_pack = next_pack++;
+  }
+
+  uint32_t capacity = kInitialCapacity;
+  while (capacity < kept.size() * 4) {
+    capacity *= 2;
+  }
+  off_t removed_bytes = 0;
+  if (write_index(capacity, active_pack, next_pack, kept.data(), kept.size())) {
+    for (const uint32_t pack : rewritten) {
+      forget_pack_fd(pack);
+      if (unlink(pack_path(pack).c_str()) == 0) {
+        removed_bytes += pack_sizes[pack];
+        pack_sizes.erase(pack);
+      } else {
+        fb_perror("unlink");
+      }
+    }
+  } else {
+    /* Keep using the old packs. */
+    for (const uint32_t pack : new_packs) {
+      unlink(pack_path(pack).c_str());
+    }
+    new_bytes = 0;
+  }
+  for (const auto& pair : pack_sizes) {
+    *cache_bytes += pair.second;
+  }
+  *cache_bytes += new_bytes + index_size();
+  unlock();
+
+  FB_DEBUG(FB_DEBUG_CACHING, "BlobPacks: kept " + d(kept.size()) + " blobs, rewrote "
+           + d(rewritten.size()) + " packs");
+  execed_process_cacher->update_cached_bytes(new_bytes - removed_bytes);
+}
+
+}  /* namespace firebuild */
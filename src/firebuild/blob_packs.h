@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_BLOB_PACKS_H_
+#define FIREBUILD_BLOB_PACKS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <tsl/hopscotch_map.h>
+#include <tsl/hopscotch_set.h>
+
+#include <string>
+
+#include "firebuild/ascii_hash.h"
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/hash.h"
+
+namespace firebuild {
+
+/**
+ * Small blobs stored back to back in append-only pack files, to save the inode, the directory
+ * entry and the partially used file system block each of them would take as a separate file.
+ *
+ * The "packs" directory contains the numbered pack files ("1.pack", "2.pack", ...), the "index"
+ * file and the "lock" file. The index is a memory mapped open addressing hash table mapping the
+ * blobs' keys to their pack, offset and size. Adding blobs and garbage collection holds an
+ * exclusive flock() on the lock file, lookups hold a shared one while opening the pack.
+ *
+ * The index file is never modified in place when it is resized or rebuilt. A new one is renamed
+ * over it and the old one is marked as replaced, which makes the other processes map the new one.
+ * Pack files are not reused after compacting them either, thus an opened pack stays valid.
+ */
+class BlobPacks {
+ public:
+  /**
+   * @param dir the "packs" directory
+   * @param writable whether blobs can be added and garbage collected
+   */
+  BlobPacks(const std::string& dir, bool writable);
+  ~BlobPacks();
+
+  /**
+   * Look up a packed blob.
+   * @param key the blob's key
+   * @param[out] offset the blob's offset in the pack
+   * @param[out] size the blob's size
+   * @return a new read-only fd of the pack file containing the blob, or -1
+   */
+  int open_blob(const Hash& key, loff_t* offset, loff_t* size);
+  /** Whether the blob is stored in a pack. */
+  bool contains(const Hash& key);
+  /**
+   * Append a blob to the active pack file.
+   * @param key the blob's key
+   * @param fd_src the blob's data is read from here
+   * @param src_offset the blob's offset in fd_src
+   * @param size the blob's size, it must be positive
+   * @param[out] added whether the blob has been added, false if it was already stored
+   * @param[out] pack_path the pack's path the blob is stored in
+   * @param[out] offset the blob's offset in the pack
+   * @return whether the blob is stored
+   */
+  bool add(const Hash& key, int fd_src, loff_t src_offset, loff_t size, bool* added,
+           std::string* pack_path, loff_t* offset);
+  /**
+   * Forget unreferenced blobs and rewrite the pack files having a significant portion of unused
+   * space.
+   * @param referenced_blobs blobs referenced from the object cache, they won't be deleted
+   * @param[in,out] cache_bytes increased by the size of the kept pack files and the index
+   * @param[in,out] unexpected_file_bytes increased by every found and kept file's size that has
+                    unexpected name
+   */
+  void gc(const tsl::hopscotch_set<AsciiHash>& referenced_blobs, off_t* cache_bytes,
+          off_t* unexpected_file_bytes);
+
+ private:
+  typedef struct index_header_ {
+    char magic[8];
+    uint32_t version;
+    /** Number of entries, a power of 2 */
+    uint32_t capacity;
+    /** Number of used entries */
+    uint32_t count;
+    /** The pack new blobs are appended to */
+    uint32_t active_pack;
+    /** The next unused pack number */
+    uint32_t next_pack;
+    /** Set when a new index file has been renamed over this one */
+    uint32_t replaced;
+  } index_header_t;
+
+  typedef struct index_entry_ {
+    uint64_t key_low;
+    uint64_t key_high;
+    uint64_t offset;
+    uint32_t pack;
+    /** The blob's size, 0 for unused entries */
+    uint32_t size;
+  } index_entry_t;
+
+  /** Like open_blob(), also returning the pack's number. */
+  int open_pack(const Hash& key, loff_t* offset, loff_t* size, uint32_t* pack);
+  bool lock(int operation);
+  void unlock();
+  /** Map the index file if it exists, unmapping the previous one. */
+  bool map_index();
+  void unmap_index();
+  /** Map the index file if it has not been mapped yet or it has been replaced. */
+  bool ensure_index_mapped();
+  index_entry_t* entries() const {
+    return reinterpret_cast<index_entry_t*>(index_ + 1);
+  }
+  /** @return the key's entry, or the unused entry where it should be inserted */
+  static index_entry_t* probe(index_entry_t* entries, uint32_t capacity, uint64_t key_low,
+                              uint64_t key_high);
+  index_entry_t* find(const Hash& key) const;
+  /**
+   * Write a new index file with the used entries of src_entries, rename it over the current one
+   * and map it. Must be called with the exclusive lock held.
+   */
+  bool write_index(uint32_t capacity, uint32_t active_pack, uint32_t next_pack,
+                   const index_entry_t* src_entries, size_t src_count);
+  std::string pack_path(uint32_t pack) const;
+  /** @return a cached read-only fd of the pack, or -1 */
+  int pack_fd(uint32_t pack);
+  void forget_pack_fd(uint32_t pack);
+  off_t index_size() const;
+
+  std::string dir_;
+  std::string index_path_;
+  bool writable_;
+  int lock_fd_ = -1;
+  index_header_t* index_ = nullptr;
+  size_t index_mapped_size_ = 0;
+  /** The fd of the active pack opened for appending and its number */
+  int append_fd_ = -1;
+  uint32_t append_pack_ = 0;
+  tsl::hopscotch_map<uint32_t, int> pack_fds_ {};
+  DISALLOW_COPY_AND_ASSIGN(BlobPacks);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_BLOB_PACKS_H_
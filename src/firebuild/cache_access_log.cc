@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/cache_access_log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "firebuild/debug.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/hash.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+CacheAccessLog* cache_access_log = nullptr;
+
+static const char kAccessLogsDir[] = "access-logs";
+/* Don't let a huge build make the log grow without bounds. */
+static const size_t kMaxEntries = 100000;
+/* Logs kept by the garbage collection, the most recently saved ones */
+static const size_t kMaxLogs = 1000;
+/* Logs not saved for this long are removed by the garbage collection. */
+static const time_t kMaxLogAgeSec = 30 * 24 * 3600;
+/* Temporary files not saved for this long are left behind by crashed runs. */
+static const time_t kMaxTmpFileAgeSec = 3600;
+
+CacheAccessLog::CacheAccessLog(const std::string& cache_dir, const std::string& build_key,
+                               bool store)
+    : cache_dir_(cache_dir), log_path_(), store_(store) {
+  Hash hash;
+  hash.set_from_data(build_key.c_str(), build_key.length());
+  log_path_ = cache_dir_ + "/" + kAccessLogsDir + "/" + hash.to_ascii();
+  load(log_path_, &previous_);
+}
+
+CacheAccessLog::~CacheAccessLog() {
+  stop_prefetching();
+}
+
+void CacheAccessLog::load(const std::string& path, std::vector<access_t>* accesses) {
+  FILE* f = fopen(path.c_str(), "re");
+  if (!f) {
+    return;
+  }
+  char* line = nullptr;
+  size_t line_size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &line_size, f)) > 0 && accesses->size() < kMaxEntries) {
+    if (line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+    }
+    int64_t offset, length;
+    int path_start;
+    if (sscanf(line, "%" SCNd64 " %" SCNd64 " %n", &offset, &length, &path_start) != 2
+        || line[path_start] == '\0') {
+      FB_DEBUG(FB_DEBUG_CACHING, "Ignoring invalid line in " + path);
+      continue;
+    }
+    accesses->push_back({line + path_start, offset, length});
+  }
+  free(line);
+  fclose(f);
+  FB_DEBUG(FB_DEBUG_CACHING, "Loaded " + d(accesses->size()) + " entries from " + path);
+}
+
+void CacheAccessLog::recent_paths(const std::string& cache_dir, size_t max_logs,
+                                  std::vector<std::string>* paths) {
+  const std::string dir = cache_dir + "/" + kAccessLogsDir;
+  DIR* dirp = opendir(dir.c_str());
+  if (!dirp) {
+    return;
+  }
+  /* {mtime, name} of the logs, the most recent first */
+  std::vector<std::pair<struct timespec, std::string>> logs;
+  struct dirent* dirent;
+  while ((dirent = readdir(dirp)) != NULL) {
+    struct stat st;
+    if (Hash::valid_ascii(dirent->d_name)
+        && fstatat(dirfd(dirp), dirent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+      logs.push_back({st.st_mtim, dirent->d_name});
+    }
+  }
+  closedir(dirp);
+  std::sort(logs.begin(), logs.end(), [](const auto& a, const auto& b) {
+    return a.first.tv_sec > b.first.tv_sec
+        || (a.first.tv_sec == b.first.tv_sec && a.first.tv_nsec > b.first.tv_nsec);
+  });
+  if (max_logs > 0 && logs.size() > max_logs) {
+    logs.resize(max_logs);
+  }
+  tsl::hopscotch_set<std::string> seen;
+  for (const auto& log : logs) {
+    std::vector<access_t> accesses;
+    load(dir + "/" + log.second, &accesses);
+    for (access_t& access : accesses) {
+      if (access.path[0] != '/' && seen.insert(access.path).second) {
+        paths->push_back(std::move(access.path));
+      }
+    }
+  }
+}
+
+void CacheAccessLog::gc(const std::string& cache_dir, off_t* cache_bytes) {
+  const std::string dir = cache_dir + "/" + kAccessLogsDir;
+  DIR* dirp = opendir(dir.c_str());
+  if (!dirp) {
+    return;
+  }
+  const time_t now = time(NULL);
+  /* {mtime, name, size} of the logs, to keep the most recent ones */
+  std::vector<std::tuple<struct timespec, std::string, off_t>> logs;
+  struct dirent* dirent;
+  while ((dirent = readdir(dirp)) != NULL) {
+    struct stat st;
+    if (fstatat(dirfd(dirp), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0
+        || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (Hash::valid_ascii(dirent->d_name)) {
+      if (now - st.st_mtim.tv_sec <= kMaxLogAgeSec) {
+        logs.push_back({st.st_mtim, dirent->d_name, st.st_size});
+        continue;
+      }
+    } else if (now - st.st_mtim.tv_sec <= kMaxTmpFileAgeSec) {
+      /* A log being saved by a parallel run. */
+      *cache_bytes += st.st_size;
+      continue;
+    }
+    FB_DEBUG(FB_DEBUG_CACHING, "Removing old access log: " + std::string(dirent->d_name));
+    if (unlinkat(dirfd(dirp), dirent->d_name, 0) != 0) {
+      fb_perror("unlinkat");
+    }
+  }
+  std::sort(logs.begin(), logs.end(), [](const auto& a, const auto& b) {
+    return std::get<0>(a).tv_sec > std::get<0>(b).tv_sec
+        || (std::get<0>(a).tv_sec == std::get<0>(b).tv_sec
+            && std::get<0>(a).tv_nsec > std::get<0>(b).tv_nsec);
+  });
+  for (size_t i = 0; i < logs.size(); i++) {
+    if (i < kMaxLogs) {
+      *cache_bytes += std::get<2>(logs[i]);
+    } else if (unlinkat(dirfd(dirp), std::get<1>(logs[i]).c_str(), 0) != 0) {
+      fb_perror("unlinkat");
+    }
+  }
+  closedir(dirp);
+}
+
+off_t CacheAccessLog::total_size(const std::string& cache_dir) {
+  const std::string dir = cache_dir + "/" + kAccessLogsDir;
+  DIR* dirp = opendir(dir.c_str());
+  if (!dirp) {
+    return 0;
+  }
+  off_t total = 0;
+  struct dirent* dirent;
+  while ((dirent = readdir(dirp)) != NULL) {
+    struct stat st;
+    if (fstatat(dirfd(dirp), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+        && S_ISREG(st.st_mode)) {
+      total += st.st_size;
+    }
+  }
+  closedir(dirp);
+  return total;
+}
+
+void CacheAccessLog::prefetch() {
+  if (previous_.empty() || prefetcher_.joinable()) {
+    return;
+  }
+  prefetcher_ = start_thread_without_signals([this] {prefetch_loop();});
+}
+
+void CacheAccessLog::prefetch_loop() {
+  std::string last_listed_dir;
+  for (const access_t& access : previous_) {
+    if (stopping_.load(std::memory_order_relaxed)) {
+      break;
+    }
+    const std::string path =
+        access.path[0] == '/' ? access.path : cache_dir_ + "/" + access.path;
+    if (access.path.compare(0, 5, "objs/") == 0) {
+      /* The obj entries are found by listing their directory, warm up the listing, too. */
+      const std::string dir = path.substr(0, path.rfind('/'));
+      if (dir != last_listed_dir) {
+        DIR* dirp = opendir(dir.c_str());
+        if (dirp) {
+          while (readdir(dirp) != NULL) {}
+          closedir(dirp);
+        }
+        last_listed_dir = dir;
+      }
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      continue;
+    }
+#ifdef __APPLE__
+    struct radvisory advice;
+    advice.ra_offset = access.offset;
+    if (access.len > 0) {
+      advice.ra_count = access.len;
+    } else {
+      struct stat st;
+      advice.ra_count = fstat(fd, &st) == 0 ? st.st_size - access.offset : 0;
+    }
+    if (advice.ra_count > 0) {
+      fcntl(fd, F_RDADVISE, &advice);
+    }
+#else
+    /* Initiates reading the data in the background without waiting for it. */
+    posix_fadvise(fd, access.offset, access.len, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+  }
+}
+
+void CacheAccessLog::record(const char* path, loff_t offset, loff_t len) {
+  if (!recording_ || current_.size() >= kMaxEntries) {
+    return;
+  }
+  const size_t cache_dir_len = cache_dir_.length();
+  if (strncmp(path, cache_dir_.c_str(), cache_dir_len) == 0 && path[cache_dir_len] == '/') {
+    path += cache_dir_len + 1;
+  }
+  std::string entry = std::to_string(offset) + " " + std::to_string(len) + " " + path;
+  if (recorded_.insert(entry).second) {
+    current_.push_back({path, offset, len});
+  }
+}
+
+void CacheAccessLog::stop_prefetching() {
+  stopping_ = true;
+  if (prefetcher_.joinable()) {
+    prefetcher_.join();
+  }
+}
+
+void CacheAccessLog::finish() {
+  if (!recording_) {
+    return;
+  }
+  recording_ = false;
+  stop_prefetching();
+  if (store_ && !current_.empty()) {
+    save();
+  }
+}
+
+bool CacheAccessLog::save() {
+  const std::string dir = cache_dir_ + "/" + kAccessLogsDir;
+  if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    fb_perror("Failed creating the access logs directory");
+    return false;
+  }
+  std::string tmp_path = log_path_ + ".XXXXXX";
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd == -1) {
+    fb_perror("Failed mkstemp() for saving the access log");
+    return false;
+  }
+  FILE* f = fdopen(fd, "w");
+  if (!f) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  for (const access_t& access : current_) {
+    fprintf(f, "%" PRId64 " %" PRId64 " %s\n", static_cast<int64_t>(access.offset),
+            static_cast<int64_t>(access.len), access.path.c_str());
+  }
+  const off_t size = ftello(f);
+  struct stat st;
+  const off_t previous_size = stat(log_path_.c_str(), &st) == 0 ? st.st_size : 0;
+  /* Replace the previous log atomically, parallel builds may be reading it. */
+  if (fclose(f) != 0 || rename(tmp_path.c_str(), log_path_.c_str()) == -1) {
+    fb_perror("Failed saving the access log");
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  execed_process_cacher->update_cached_bytes(size - previous_size);
+  return true;
+}
+
+}  /* namespace firebuild */
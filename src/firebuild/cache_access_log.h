@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_CACHE_ACCESS_LOG_H_
+#define FIREBUILD_CACHE_ACCESS_LOG_H_
+
+#include <sys/types.h>
+#include <tsl/hopscotch_set.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+
+namespace firebuild {
+
+/**
+ * The cache files used by the previous run of the same build command, to warm them up in the
+ * page cache while the build starts.
+ *
+ * The log is stored in the "access-logs" directory of the cache, in a file named after the hash
+ * of the working directory and the build command. Each line is one accessed region of an obj
+ * entry or a (loose or packed) blob in the order of the first access:
+ *   <offset> <length> <path>
+ * where length is 0 for the whole file and the path is relative to the cache directory unless it
+ * is in a lower cache layer.
+ *
+ * The previous log is read at startup and a background thread asks the kernel to read ahead the
+ * listed regions, while the current run's accesses are collected and saved at the end, replacing
+ * the previous log.
+ *
+ * The logs count in the cache's size and are removed by the garbage collection after a while.
+ */
+class CacheAccessLog {
+ public:
+  /**
+   * @param cache_dir the writable cache directory
+   * @param build_key identifies the build command, e.g. its working directory and arguments
+   * @param store whether to save this run's log
+   */
+  CacheAccessLog(const std::string& cache_dir, const std::string& build_key, bool store);
+  ~CacheAccessLog();
+
+  /** Start warming up the files listed in the previous run's log in a background thread. */
+  void prefetch();
+  /**
+   * Record an access to a cache file.
+   * @param path the accessed file
+   * @param offset start of the accessed region
+   * @param len length of the accessed region, 0 for the whole file
+   */
+  void record(const char* path, loff_t offset, loff_t len);
+  void record(const std::string& path, loff_t offset, loff_t len) {
+    record(path.c_str(), offset, len);
+  }
+  /** Stop prefetching and recording, and replace the previous log with the collected accesses. */
+  void finish();
+  /**
+   * Collect the paths relative to the cache directory from the most recently saved logs.
+   * @param cache_dir the writable cache directory
+   * @param max_logs the number of the most recent logs to read, 0 for all of them
+   * @param[out] paths the paths in the order of the logs and the accesses, without duplicates
+   */
+  static void recent_paths(const std::string& cache_dir, size_t max_logs,
+                           std::vector<std::string>* paths);
+  /**
+   * Garbage collect the saved logs. Remove the logs not saved for a long time, the ones beyond
+   * the most recent ones allowed to be kept, and the temporary files left behind.
+   * @param cache_dir the writable cache directory
+   * @param[in,out] cache_bytes increased by the kept files' size
+   */
+  static void gc(const std::string& cache_dir, off_t* cache_bytes);
+  /** Total size of the files in the logs' directory. */
+  static off_t total_size(const std::string& cache_dir);
+
+ private:
+  typedef struct access_ {
+    std::string path;
+    loff_t offset;
+    loff_t len;
+  } access_t;
+
+  /** Read the log at path. */
+  static void load(const std::string& path, std::vector<access_t>* accesses);
+  void stop_prefetching();
+  void prefetch_loop();
+  bool save();
+
+  std::string cache_dir_;
+  std::string log_path_;
+  bool store_;
+  /** The previous run's accesses to prefetch */
+  std::vector<access_t> previous_ {};
+  /** This run's accesses, in the order of the first access */
+  std::vector<access_t> current_ {};
+  tsl::hopscotch_set<std::string> recorded_ {};
+  bool recording_ {true};
+  std::atomic<bool> stopping_ {false};
+  std::thread prefetcher_ {};
+  DISALLOW_COPY_AND_ASSIGN(CacheAccessLog);
+};
+
+/* singleton, NULL if the access log is not used */
+extern CacheAccessLog *cache_access_log;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_CACHE_ACCESS_LOG_H_
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/cache_bundle.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <tsl/hopscotch_set.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/firebuild_common.h"
+#include "firebuild/ascii_hash.h"
+#include "firebuild/blob_cache.h"
+#include "firebuild/cache_access_log.h"
+#include "firebuild/cache_daemon.h"
+#include "firebuild/config.h"
+#include "firebuild/debug.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/hash.h"
+#include "firebuild/obj_cache.h"
+#include "firebuild/remote_cache.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+static const char kBundleMagic[8] = {'F', 'B', 'B', 'U', 'N', 'D', 'L', '\0'};
+static const uint32_t kBundleVersion = 1;
+static const uint8_t kZstdMagicHeader[] = {0x28, 0xb5, 0x2f, 0xfd};
+/* Large enough for any sane cache entry or blob, rejects corrupted sizes. */
+static const uint64_t kMaxMemberSize = 1ULL << 40;
+static const uint32_t kMaxNameLength = 4096;
+static const size_t kStreamBufferSize = 1024 * 1024;
+
+/** Read size bytes from fd at offset into buf. */
+static bool read_region(int fd, loff_t offset, size_t size, std::vector<uint8_t>* buf) {
+  buf->resize(size);
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t ret = pread(fd, buf->data() + done, size - done, offset + done);
+    if (ret <= 0) {
+      return false;
+    }
+    done += ret;
+  }
+  return true;
+}
+
+bool CacheBundle::write_member(FILE* f, member_type type, const std::string& name,
+                               const uint8_t* data, size_t size,
+                               std::vector<uint64_t>* offsets) {
+  /* Files compressed in the cache are not compressed again. */
+  char* compressed_data = nullptr;
+  size_t compressed_size = 0;
+  if (size < sizeof(kZstdMagicHeader)
+      || memcmp(data, kZstdMagicHeader, sizeof(kZstdMagicHeader)) != 0) {
+    compressed_data = compress_zstd(reinterpret_cast<const char*>(data), size, &compressed_size,
+                                    compression_level);
+    if (compressed_data && compressed_size >= size) {
+      free(compressed_data);
+      compressed_data = nullptr;
+    }
+  }
+  member_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.type = type;
+  header.name_len = name.length();
+  header.compressed = compressed_data != nullptr;
+  header.stored_size = compressed_data ? compressed_size : size;
+  header.size = size;
+  offsets->push_back(ftello(f));
+  const bool written = fwrite(&header, sizeof(header), 1, f) == 1
+      && fwrite(name.c_str(), name.length(), 1, f) == 1
+      && (header.stored_size == 0
+          || fwrite(compressed_data ? reinterpret_cast<const uint8_t*>(compressed_data) : data,
+                    header.stored_size, 1, f) == 1);
+  free(compressed_data);
+  return written;
+}
+
+bool CacheBundle::export_cache(const std::string& bundle_path, size_t max_runs) {
+  const std::string& cache_dir = execed_process_cacher->cache_dir();
+  std::vector<std::string> paths;
+  CacheAccessLog::recent_paths(cache_dir, max_runs, &paths);
+
+  /* Select the usable entries and collect the blobs they reference. */
+  static const char kObjsPrefix[] = "objs/";
+  std::vector<std::string> entries;
+  /* The blobs referenced by each selected entry */
+  std::vector<std::vector<AsciiHash>> entry_blobs;
+  tsl::hopscotch_set<AsciiHash> referenced_blobs;
+  for (const std::string& path : paths) {
+    if (path.compare(0, strlen(kObjsPrefix), kObjsPrefix) != 0) {
+      continue;
+    }
+    const std::string entry_path = cache_dir + "/" + path;
+    /* The entry may have been removed by a garbage collection since it was logged. */
+    if (access(entry_path.c_str(), R_OK) != 0) {
+      continue;
+    }
+    uint8_t* entry_buf;
+    size_t entry_len, compressed_len = 0;
+    bool munmap_entry = false;
+    if (!obj_cache->retrieve(entry_path.c_str(), &entry_buf, &entry_len, &compressed_len,
+                             &munmap_entry)) {
+      continue;
+    }
+    tsl::hopscotch_set<AsciiHash> blobs;
+    if (execed_process_cacher->is_entry_usable(entry_buf, &blobs)) {
+      entries.push_back(path);
+      entry_blobs.emplace_back(blobs.begin(), blobs.end());
+      referenced_blobs.insert(blobs.begin(), blobs.end());
+    }
+    ObjCache::free_entry(entry_buf, entry_len, munmap_entry);
+  }
+
+  std::string tmp_path = bundle_path + ".XXXXXX";
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd == -1) {
+    fb_perror("Failed mkstemp() for exporting the cache");
+    return false;
+  }
+  FILE* f = fdopen(fd, "w");
+  if (!f) {
+    fb_perror("fdopen");
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  setvbuf(f, NULL, _IOFBF, kStreamBufferSize);
+
+  bundle_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+  header.version = kBundleVersion;
+  header.cache_format = ExecedProcessCacher::current_cache_format();
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+  std::vector<uint64_t> offsets;
+  std::vector<uint8_t> buf;
+  /* The blobs which could not be exported, the entries referencing them are not exported either. */
+  tsl::hopscotch_set<AsciiHash> missing_blobs;
+  for (const AsciiHash& ascii_key : referenced_blobs) {
+    if (!ok) {
+      break;
+    }
+    Hash key;
+    blob_fd_t blob;
+    if (!key.set_from_ascii(ascii_key.c_str()) || !blob_cache->open_blob(key, &blob, true)) {
+      missing_blobs.insert(ascii_key);
+      continue;
+    }
+    const bool read = read_region(blob.fd, blob.offset, blob.size, &buf);
+    close(blob.fd);
+    if (read) {
+      ok = write_member(f, BUNDLE_BLOB, ascii_key.c_str(), buf.data(), buf.size(), &offsets);
+    } else {
+      missing_blobs.insert(ascii_key);
+    }
+  }
+  size_t exported_entries = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (!ok) {
+      break;
+    }
+    if (std::any_of(entry_blobs[i].begin(), entry_blobs[i].end(),
+                    [&](const AsciiHash& blob) {return missing_blobs.contains(blob);})) {
+      FB_DEBUG(FB_DEBUG_CACHING, "Not exporting " + entries[i] + ", a referenced blob is missing");
+      continue;
+    }
+    const std::string& path = entries[i];
+    int entry_fd = open((cache_dir + "/" + path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (entry_fd == -1) {
+      continue;
+    }
+    struct stat st;
+    const bool read = fstat(entry_fd, &st) == 0 && read_region(entry_fd, 0, st.st_size, &buf);
+    close(entry_fd);
+    if (read) {
+      ok = write_member(f, BUNDLE_OBJ, path.substr(strlen(kObjsPrefix)), buf.data(), buf.size(),
+                        &offsets);
+      exported_entries++;
+    }
+  }
+
+  /* Finish the bundle with the index and the final header. */
+  header.index_offset = ftello(f);
+  header.count = offsets.size();
+  ok = ok && (offsets.empty()
+              || fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), f) == offsets.size())
+      && fseeko(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+  if (fclose(f) != 0 || !ok || rename(tmp_path.c_str(), bundle_path.c_str()) == -1) {
+    fb_perror(("Failed writing " + bundle_path).c_str());
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  FB_DEBUG(FB_DEBUG_CACHING, "Exported " + d(exported_entries) + " entries and "
+           + d(offsets.size() - exported_entries) + " blobs");
+  return true;
+}
+
+bool CacheBundle::import_cache(const std::string& bundle_path) {
+  FILE* f = fopen(bundle_path.c_str(), "re");
+  if (!f) {
+    fb_perror(("Failed opening " + bundle_path).c_str());
+    return false;
+  }
+  /* Read the bundle in large chunks, it is processed sequentially. */
+  setvbuf(f, NULL, _IOFBF, kStreamBufferSize);
+  bundle_header_t header;
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || memcmp(header.magic, kBundleMagic, sizeof(kBundleMagic)) != 0
+      || header.version != kBundleVersion || header.index_offset == 0) {
+    fb_error(bundle_path + " is not a valid cache bundle");
+    fclose(f);
+    return false;
+  }
+  if (header.cache_format != ExecedProcessCacher::current_cache_format()) {
+    fb_error(bundle_path + " has been exported from a cache with a different format");
+    fclose(f);
+    return false;
+  }
+
+  bool ok = true;
+  std::string name;
+  std::vector<uint8_t> buf;
+  for (uint64_t i = 0; ok && i < header.count; i++) {
+    member_header_t member;
+    if (fread(&member, sizeof(member), 1, f) != 1 || member.name_len == 0
+        || member.name_len > kMaxNameLength || member.stored_size > kMaxMemberSize
+        || member.size > kMaxMemberSize) {
+      ok = false;
+      break;
+    }
+    name.resize(member.name_len);
+    buf.resize(member.stored_size);
+    if (fread(&name[0], member.name_len, 1, f) != 1
+        || (member.stored_size > 0 && fread(buf.data(), member.stored_size, 1, f) != 1)) {
+      ok = false;
+      break;
+    }
+    const uint8_t* data = buf.data();
+    uint8_t* decompressed = nullptr;
+    if (member.compressed) {
+      size_t decompressed_size = 0;
+      decompressed = decompress_zstd(buf.data(), buf.size(), &decompressed_size);
+      if (!decompressed || decompressed_size != member.size) {
+        free(decompressed);
+        ok = false;
+        break;
+      }
+      data = decompressed;
+    } else if (member.stored_size != member.size) {
+      ok = false;
+      break;
+    }
+    if (member.type == BUNDLE_BLOB) {
+      Hash key;
+      ok = key.set_from_ascii(name.c_str()) && blob_cache->import_blob(key, data, member.size);
+    } else if (member.type == BUNDLE_OBJ) {
+      ok = obj_cache->import_entry(name, data, member.size);
+    } else {
+      ok = false;
+    }
+    free(decompressed);
+  }
+  fclose(f);
+  if (!ok) {
+    fb_error("Failed importing " + bundle_path);
+  }
+  if (cache_daemon) {
+    /* Let the daemon list the new entries' directories again. */
+    cache_daemon->forget_subkeys();
+  }
+  if (remote_cache) {
+    remote_cache->finish_uploads();
+  }
+  return ok;
+}
+
+}  /* namespace firebuild */
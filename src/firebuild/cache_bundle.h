@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_CACHE_BUNDLE_H_
+#define FIREBUILD_CACHE_BUNDLE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+namespace firebuild {
+
+/**
+ * A single file holding a subset of the cache, to be transferred between machines, for example
+ * between the stages of a CI pipeline, instead of archiving the whole cache directory.
+ *
+ * The bundle starts with a header, followed by the members, then the index:
+ * - bundle_header_t
+ * - member_header_t, the member's name, the member's data, for every member
+ * - the offsets of the member headers as uint64_t values
+ *
+ * Members are blobs, named by their key, and obj cache entries, named by their path relative to
+ * the obj cache directory. Their data is the file as stored in the cache, compressed with zstd
+ * unless it is compressed already. The blobs precede the entries referencing them, thus when the
+ * bundle is imported by reading it sequentially the entries are usable as soon as they appear.
+ */
+class CacheBundle {
+ public:
+  /**
+   * Export the obj cache entries used or stored by the most recently run build commands and the
+   * blobs they reference.
+   * @param bundle_path the bundle to write
+   * @param max_runs the number of the most recently run build commands to export the entries of,
+   *                 0 for all the build commands having an access log
+   * @return whether the bundle has been written
+   */
+  static bool export_cache(const std::string& bundle_path, size_t max_runs);
+  /**
+   * Import the entries and blobs of a bundle into the writable cache.
+   * @return whether the bundle has been imported
+   */
+  static bool import_cache(const std::string& bundle_path);
+
+ private:
+  enum member_type : uint32_t {
+    BUNDLE_OBJ = 1,
+    BUNDLE_BLOB,
+  };
+
+  typedef struct bundle_header_ {
+    char magic[8];
+    uint32_t version;
+    /** The format of the cache the bundle was exported from */
+    uint32_t cache_format;
+    /** The offset of the index, 0 if the bundle has not been finished */
+    uint64_t index_offset;
+    /** Number of members */
+    uint64_t count;
+  } bundle_header_t;
+
+  typedef struct member_header_ {
+    uint32_t type;
+    uint32_t name_len;
+    /** Whether the data is compressed in the bundle */
+    uint32_t compressed;
+    uint32_t padding;
+    /** The data's size in the bundle */
+    uint64_t stored_size;
+    /** The file's size in the cache */
+    uint64_t size;
+  } member_header_t;
+
+  /** Append a member to the bundle, recording its offset in offsets. */
+  static bool write_member(FILE* f, member_type type, const std::string& name,
+                           const uint8_t* data, size_t size, std::vector<uint64_t>* offsets);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_CACHE_BUNDLE_H_
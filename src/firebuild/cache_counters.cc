@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/cache_counters.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "common/firebuild_common.h"
+#include "firebuild/debug.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+static const char kCountersMagic[8] = {'F', 'B', 'C', 'O', 'U', 'N', 'T', '\0'};
+static const uint32_t kCountersVersion = 1;
+
+CacheCounters::counters_file_t* CacheCounters::map(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size != sizeof(counters_file_t)) {
+    close(fd);
+    return nullptr;
+  }
+  void* p = mmap(NULL, sizeof(counters_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  counters_file_t* data = reinterpret_cast<counters_file_t*>(p);
+  if (memcmp(data->magic, kCountersMagic, sizeof(kCountersMagic)) != 0
+      || data->version != kCountersVersion) {
+    munmap(p, sizeof(counters_file_t));
+    return nullptr;
+  }
+  return data;
+}
+
+CacheCounters* CacheCounters::open(const std::string& path, bool* created) {
+  *created = false;
+  counters_file_t* data = map(path);
+  if (data) {
+    return new CacheCounters(data);
+  }
+  const bool invalid = access(path.c_str(), F_OK) == 0;
+  if (invalid) {
+    fb_error("Invalid counters file " + path + ", recreating it.");
+  }
+
+  /* Prepare the new file under a temporary name to never expose a partially written one. */
+  std::string tmp_path = path + ".XXXXXX";
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd == -1) {
+    fb_perror("Failed mkstemp() for creating the counters file");
+    return nullptr;
+  }
+  counters_file_t initial;
+  memset(&initial, 0, sizeof(initial));
+  memcpy(initial.magic, kCountersMagic, sizeof(kCountersMagic));
+  initial.version = kCountersVersion;
+  const bool written = fb_write(fd, &initial, sizeof(initial)) == sizeof(initial);
+  close(fd);
+  if (!written) {
+    fb_perror("Failed writing the counters file");
+    unlink(tmp_path.c_str());
+    return nullptr;
+  }
+  if (invalid) {
+    if (rename(tmp_path.c_str(), path.c_str()) == 0) {
+      *created = true;
+    } else {
+      unlink(tmp_path.c_str());
+    }
+  } else {
+    /* Don't replace the file if a parallel firebuild process has just created it. */
+    if (link(tmp_path.c_str(), path.c_str()) == 0) {
+      *created = true;
+    } else if (errno != EEXIST) {
+      fb_perror("Failed creating the counters file");
+    }
+    unlink(tmp_path.c_str());
+  }
+
+  data = map(path);
+  if (!data) {
+    fb_error("Could not map the counters file " + path);
+    return nullptr;
+  }
+  return new CacheCounters(data);
+}
+
+CacheCounters::~CacheCounters() {
+  munmap(data_, sizeof(counters_file_t));
+}
+
+}  /* namespace firebuild */
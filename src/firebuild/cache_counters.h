@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_CACHE_COUNTERS_H_
+#define FIREBUILD_CACHE_COUNTERS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/phase_timers.h"
+
+namespace firebuild {
+
+/** Layers of the cache, in lookup order. */
+enum cache_tier {
+  /** The writable local cache directory */
+  FB_CACHE_TIER_LOCAL,
+  /** The read-only lower_cache_dirs */
+  FB_CACHE_TIER_LOWER,
+  /** The remote cache server */
+  FB_CACHE_TIER_REMOTE,
+  FB_CACHE_TIER_COUNT,
+};
+
+/** The counters stored in the cache directory. New ones can be added to the end. */
+enum cache_counter {
+  /** Bytes stored in the writable cache directory */
+  FB_COUNTER_CACHED_BYTES,
+  FB_COUNTER_SHORTCUT_ATTEMPTS,
+  FB_COUNTER_SHORTCUT_HITS,
+  FB_COUNTER_NOT_SHORTCUTTING,
+  FB_COUNTER_GC_RUNS,
+  FB_COUNTER_SAVED_CPU_MS,
+  /** Cache entry lookups served by each tier */
+  FB_COUNTER_TIER_HITS,
+  /** Cache entry lookups not served by each tier */
+  FB_COUNTER_TIER_MISSES = FB_COUNTER_TIER_HITS + FB_CACHE_TIER_COUNT,
+  FB_COUNTER_REMOTE_DOWNLOADED_BYTES = FB_COUNTER_TIER_MISSES + FB_CACHE_TIER_COUNT,
+  FB_COUNTER_REMOTE_UPLOADED_BYTES,
+  /** Nanoseconds spent in each phase */
+  FB_COUNTER_PHASE_NS,
+  /** Number of timed calls of each phase */
+  FB_COUNTER_PHASE_CALLS = FB_COUNTER_PHASE_NS + FB_PHASE_COUNT,
+  /** Nanoseconds the intercepted processes spent waiting for ACKs */
+  FB_COUNTER_ACK_WAIT_NS = FB_COUNTER_PHASE_CALLS + FB_PHASE_COUNT,
+  /** Number of ACK waits of the intercepted processes */
+  FB_COUNTER_ACK_WAITS,
+  FB_COUNTER_COUNT,
+};
+
+/**
+ * Counters shared by all firebuild processes using the same cache directory.
+ *
+ * The counters live in a small memory mapped file, and they are updated with atomic operations,
+ * thus parallel builds don't lose each other's updates and reading them is cheap.
+ */
+class CacheCounters {
+ public:
+  /**
+   * Map the counters file, creating it with all counters set to 0 if it is missing or invalid.
+   * @param path the counters file
+   * @param[out] created whether the file has just been created
+   * @return the counters, or nullptr if the file could not be mapped
+   */
+  static CacheCounters* open(const std::string& path, bool* created);
+  ~CacheCounters();
+  int64_t get(cache_counter counter) const {
+    return std::atomic_ref<int64_t>(data_->values[counter]).load(std::memory_order_relaxed);
+  }
+  /** Add delta to the counter, @return the counter's previous value */
+  int64_t add(cache_counter counter, int64_t delta) {
+    return std::atomic_ref<int64_t>(data_->values[counter]).fetch_add(delta,
+                                                                      std::memory_order_relaxed);
+  }
+  void set(cache_counter counter, int64_t value) {
+    std::atomic_ref<int64_t>(data_->values[counter]).store(value, std::memory_order_relaxed);
+  }
+
+  /** Number of counters the file has room for. */
+  static const int kMaxCounters {254};
+
+ private:
+  typedef struct counters_file_ {
+    char magic[8];
+    uint32_t version;
+    uint32_t padding;
+    alignas(8) int64_t values[kMaxCounters];
+  } counters_file_t;
+  static_assert(FB_COUNTER_COUNT <= kMaxCounters, "counters file is too small");
+
+  explicit CacheCounters(counters_file_t* data) : data_(data) {}
+  static counters_file_t* map(const std::string& path);
+  counters_file_t* data_;
+  DISALLOW_COPY_AND_ASSIGN(CacheCounters);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_CACHE_COUNTERS_H_
@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/cache_daemon.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <tsl/hopscotch_map.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "firebuild/debug.h"
+#include "firebuild/epoll.h"
+#include "firebuild/obj_cache.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+CacheDaemonClient *cache_daemon = nullptr;
+
+/** Requests larger than this are considered to be protocol errors. */
+static const uint32_t kMaxPayloadLength = 64 * 1024;
+/** Clients not reading the responses for this long are disconnected to not stall the others. */
+static const struct timeval kDaemonSendTimeout = {1, 0};
+/** Maximum number of files' hashes kept by the daemon. */
+static const size_t kMaxDaemonHashes = 200000;
+/** Maximum number of keys' subkey lists kept by the daemon. */
+static const size_t kMaxDaemonSubkeyLists = 100000;
+
+static bool fill_sockaddr(const std::string& socket_path, struct sockaddr_un* addr) {
+  if (socket_path.length() >= sizeof(addr->sun_path)) {
+    return false;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, socket_path.c_str(), socket_path.length() + 1);
+  return true;
+}
+
+static int connect_to_daemon(const std::string& socket_path) {
+  struct sockaddr_un addr;
+  if (!fill_sockaddr(socket_path, &addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (TEMP_FAILURE_RETRY(connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                                 sizeof(addr))) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Write all the data, without raising SIGPIPE when the other side has gone away. */
+static bool send_all(int fd, const std::string& data) {
+  size_t sent_total = 0;
+  while (sent_total < data.size()) {
+    ssize_t sent = TEMP_FAILURE_RETRY(::send(fd, data.data() + sent_total,
+                                             data.size() - sent_total, MSG_NOSIGNAL));
+    if (sent <= 0) {
+      return false;
+    }
+    sent_total += sent;
+  }
+  return true;
+}
+
+static void file_version_from_entry(const HashCacheEntry& entry,
+                                    CacheDaemon::file_version_t* version) {
+  memset(version, 0, sizeof(*version));
+  version->size = entry.info.size();
+  version->mtime_sec = entry.mtime.tv_sec;
+  version->mtime_nsec = entry.mtime.tv_nsec;
+  version->inode = entry.inode;
+  version->type = entry.info.type();
+}
+
+/*
+ * Server side
+ */
+
+typedef struct daemon_file_hash_ {
+  CacheDaemon::file_version_t version;
+  XXH128_hash_t hash;
+} daemon_file_hash_t;
+
+/* Files' hashes by path */
+static tsl::hopscotch_map<std::string, daemon_file_hash_t> daemon_hashes;
+/* Subkeys by the key's raw bytes, in the order returned by ObjCache::list_subkeys() */
+static tsl::hopscotch_map<std::string, std::vector<Subkey>> daemon_subkeys;
+/* Partially received requests by connection */
+static tsl::hopscotch_map<int, std::string> daemon_conn_buffers;
+
+/** Evict an arbitrary entry if the map is full, to keep the daemon's memory usage bounded. */
+template <typename Map>
+static void daemon_make_room(Map* map, size_t max_size) {
+  if (map->size() >= max_size) {
+    map->erase(map->begin());
+  }
+}
+
+static void daemon_close_conn(int fd) {
+  epoll->maybe_del_fd(fd, EPOLLIN);
+  close(fd);
+  daemon_conn_buffers.erase(fd);
+}
+
+static bool daemon_respond(int fd, const void* data, uint32_t len) {
+  std::string response(reinterpret_cast<const char*>(&len), sizeof(len));
+  if (len > 0) {
+    response.append(reinterpret_cast<const char*>(data), len);
+  }
+  return send_all(fd, response);
+}
+
+static Hash hash_from_bytes(const char* bytes) {
+  XXH128_hash_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return Hash(value);
+}
+
+/**
+ * Process one request.
+ * @return false on protocol errors
+ */
+static bool daemon_process_request(int fd, uint32_t type, const char* payload, uint32_t len) {
+  const size_t version_len = sizeof(CacheDaemon::file_version_t);
+  const size_t key_len = sizeof(XXH128_hash_t);
+  switch (type) {
+    case CacheDaemon::GET_HASH: {
+      if (len < version_len) {
+        return false;
+      }
+      const std::string path(payload + version_len, len - version_len);
+      auto it = daemon_hashes.find(path);
+      if (it != daemon_hashes.end()
+          && memcmp(&it->second.version, payload, version_len) == 0) {
+        FB_DEBUG(FB_DEBUG_CACHING, "Cache daemon serving the hash of " + path);
+        return daemon_respond(fd, &it->second.hash, sizeof(it->second.hash));
+      }
+      return daemon_respond(fd, nullptr, 0);
+    }
+    case CacheDaemon::PUT_HASH: {
+      if (len < version_len + key_len) {
+        return false;
+      }
+      daemon_file_hash_t file_hash;
+      memcpy(&file_hash.version, payload, version_len);
+      memcpy(&file_hash.hash, payload + version_len, key_len);
+      const std::string path(payload + version_len + key_len, len - version_len - key_len);
+      auto it = daemon_hashes.find(path);
+      if (it != daemon_hashes.end()) {
+        it.value() = file_hash;
+      } else {
+        daemon_make_room(&daemon_hashes, kMaxDaemonHashes);
+        daemon_hashes.emplace(path, file_hash);
+      }
+      return true;
+    }
+    case CacheDaemon::LIST_SUBKEYS: {
+      if (len != key_len) {
+        return false;
+      }
+      const std::string key(payload, len);
+      auto it = daemon_subkeys.find(key);
+      if (it == daemon_subkeys.end()) {
+        daemon_make_room(&daemon_subkeys, kMaxDaemonSubkeyLists);
+        it = daemon_subkeys.emplace(key, obj_cache->list_subkeys(hash_from_bytes(payload))).first;
+      }
+      FB_DEBUG(FB_DEBUG_CACHING, "Cache daemon serving the subkeys of "
+               + hash_from_bytes(payload).to_ascii());
+      std::string response;
+      for (const Subkey& subkey : it->second) {
+        response.append(subkey.c_str(), Subkey::kAsciiLength);
+      }
+      return daemon_respond(fd, response.data(), response.size());
+    }
+    case CacheDaemon::ADD_SUBKEY: {
+      if (len != key_len + Subkey::kAsciiLength) {
+        return false;
+      }
+      char subkey_str[Subkey::kAsciiLength + 1];
+      memcpy(subkey_str, payload + key_len, Subkey::kAsciiLength);
+      subkey_str[Subkey::kAsciiLength] = '\0';
+      if (!Subkey::valid_ascii(subkey_str)) {
+        return false;
+      }
+      /* Keys not listed yet will be listed from the file system when they are needed. */
+      auto it = daemon_subkeys.find(std::string(payload, key_len));
+      if (it != daemon_subkeys.end()) {
+        const Subkey subkey(subkey_str);
+        std::vector<Subkey>& subkeys = it.value();
+        if (std::find(subkeys.begin(), subkeys.end(), subkey) == subkeys.end()) {
+          /* Newly stored subkeys are the latest ones. */
+          subkeys.insert(subkeys.begin(), subkey);
+        }
+      }
+      return true;
+    }
+    case CacheDaemon::FORGET_SUBKEYS: {
+      daemon_subkeys.clear();
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+static void daemon_conn_readable(const struct epoll_event* event, void *arg) {
+  (void)arg;  /* unused */
+  const int fd = Epoll::event_fd(event);
+  char buf[4096];
+  ssize_t received = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)));
+  if (received <= 0) {
+    daemon_close_conn(fd);
+    return;
+  }
+  std::string& pending = daemon_conn_buffers[fd];
+  pending.append(buf, received);
+  size_t offset = 0;
+  while (pending.size() - offset >= sizeof(CacheDaemon::message_header_t)) {
+    CacheDaemon::message_header_t header;
+    memcpy(&header, pending.data() + offset, sizeof(header));
+    if (header.payload_len > kMaxPayloadLength) {
+      daemon_close_conn(fd);
+      return;
+    }
+    if (pending.size() - offset < sizeof(header) + header.payload_len) {
+      break;
+    }
+    if (!daemon_process_request(fd, header.type, pending.data() + offset + sizeof(header),
+                                header.payload_len)) {
+      FB_DEBUG(FB_DEBUG_CACHING,
+               "Closing cache daemon connection after an invalid request or a failed response");
+      daemon_close_conn(fd);
+      return;
+    }
+    offset += sizeof(header) + header.payload_len;
+  }
+  pending.erase(0, offset);
+}
+
+static void daemon_accept(const struct epoll_event* event, void *arg) {
+  (void)arg;  /* unused */
+  int fd = TEMP_FAILURE_RETRY(accept4(Epoll::event_fd(event), NULL, NULL, SOCK_CLOEXEC));
+  if (fd == -1) {
+    fb_perror("accept");
+    return;
+  }
+  /* Responses are sent with blocking writes, don't let one client stall the others for long. */
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &kDaemonSendTimeout, sizeof(kDaemonSendTimeout));
+  epoll->add_fd(fd, EPOLLIN, daemon_conn_readable, NULL);
+}
+
+int CacheDaemon::serve(const std::string& socket_path) {
+  struct sockaddr_un addr;
+  if (!fill_sockaddr(socket_path, &addr)) {
+    fb_error("Cache daemon socket path is too long: " + socket_path);
+    return EXIT_FAILURE;
+  }
+  int existing = connect_to_daemon(socket_path);
+  if (existing != -1) {
+    close(existing);
+    fb_error("A cache daemon is already running on " + socket_path);
+    return EXIT_FAILURE;
+  }
+  /* Remove the socket left behind by a previous daemon. */
+  unlink(socket_path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    fb_perror("socket");
+    return EXIT_FAILURE;
+  }
+  if (bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+    fb_perror("bind");
+    close(listener);
+    return EXIT_FAILURE;
+  }
+  if (listen(listener, 500) == -1) {
+    fb_perror("listen");
+    close(listener);
+    return EXIT_FAILURE;
+  }
+
+  epoll = new Epoll();
+  epoll->add_fd(listener, EPOLLIN, daemon_accept, NULL);
+  fb_info("Cache daemon is listening on " + socket_path);
+  while (true) {
+    epoll->wait();
+    epoll->process_all_events();
+  }
+}
+
+/*
+ * Client side
+ */
+
+CacheDaemonClient* CacheDaemonClient::connect(const std::string& socket_path) {
+  int fd = connect_to_daemon(socket_path);
+  if (fd == -1) {
+    return nullptr;
+  }
+  /* Don't let a stuck daemon block the build forever. */
+  struct timeval timeout = {10, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  return new CacheDaemonClient(fd);
+}
+
+CacheDaemonClient::~CacheDaemonClient() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+bool CacheDaemonClient::fail() {
+  if (fd_ != -1) {
+    fb_info("Lost connection to the cache daemon, continuing without it");
+    close(fd_);
+    fd_ = -1;
+  }
+  return false;
+}
+
+bool CacheDaemonClient::send(uint32_t type, const void* payload1, size_t len1,
+                             const void* payload2, size_t len2,
+                             const void* payload3, size_t len3) {
+  if (fd_ == -1) {
+    return false;
+  }
+  const CacheDaemon::message_header_t header =
+      {type, static_cast<uint32_t>(len1 + len2 + len3)};
+  std::string message(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const auto& [payload, len] : {std::make_pair(payload1, len1),
+                                     std::make_pair(payload2, len2),
+                                     std::make_pair(payload3, len3)}) {
+    if (len > 0) {
+      message.append(reinterpret_cast<const char*>(payload), len);
+    }
+  }
+  if (!send_all(fd_, message)) {
+    return fail();
+  }
+  return true;
+}
+
+/* Read exactly len bytes, unlike fb_read() which does not report partial reads. */
+static bool read_exactly(int fd, void* buf, size_t len) {
+  char* p = reinterpret_cast<char*>(buf);
+  while (len > 0) {
+    ssize_t received = TEMP_FAILURE_RETRY(read(fd, p, len));
+    if (received <= 0) {
+      return false;
+    }
+    p += received;
+    len -= received;
+  }
+  return true;
+}
+
+bool CacheDaemonClient::receive(std::string* response) {
+  if (fd_ == -1) {
+    return false;
+  }
+  uint32_t len;
+  if (!read_exactly(fd_, &len, sizeof(len)) || len > kMaxPayloadLength * 16) {
+    return fail();
+  }
+  response->resize(len);
+  if (!read_exactly(fd_, &(*response)[0], len)) {
+    return fail();
+  }
+  return true;
+}
+
+bool CacheDaemonClient::lookup_hash(const FileName* path, const HashCacheEntry& entry,
+                                    Hash* hash) {
+  CacheDaemon::file_version_t version;
+  file_version_from_entry(entry, &version);
+  std::string response;
+  if (!send(CacheDaemon::GET_HASH, &version, sizeof(version), path->c_str(), path->length())
+      || !receive(&response) || response.size() != sizeof(XXH128_hash_t)) {
+    return false;
+  }
+  *hash = hash_from_bytes(response.data());
+  return true;
+}
+
+bool CacheDaemonClient::publish_hash(const FileName* path, const HashCacheEntry& entry,
+                                     const Hash& hash) {
+  CacheDaemon::file_version_t version;
+  file_version_from_entry(entry, &version);
+  return send(CacheDaemon::PUT_HASH, &version, sizeof(version),
+              hash.get_ptr(), sizeof(XXH128_hash_t), path->c_str(), path->length());
+}
+
+bool CacheDaemonClient::list_subkeys(const Hash& key, std::vector<Subkey>* subkeys) {
+  std::string response;
+  if (!send(CacheDaemon::LIST_SUBKEYS, key.get_ptr(), sizeof(XXH128_hash_t))
+      || !receive(&response) || response.size() % Subkey::kAsciiLength != 0) {
+    return false;
+  }
+  char subkey_str[Subkey::kAsciiLength + 1];
+  subkey_str[Subkey::kAsciiLength] = '\0';
+  for (size_t i = 0; i < response.size(); i += Subkey::kAsciiLength) {
+    memcpy(subkey_str, response.data() + i, Subkey::kAsciiLength);
+    subkeys->push_back(Subkey(subkey_str));
+  }
+  return true;
+}
+
+bool CacheDaemonClient::add_subkey(const Hash& key, const Subkey& subkey) {
+  return send(CacheDaemon::ADD_SUBKEY, key.get_ptr(), sizeof(XXH128_hash_t),
+              subkey.c_str(), Subkey::kAsciiLength);
+}
+
+bool CacheDaemonClient::forget_subkeys() {
+  return send(CacheDaemon::FORGET_SUBKEYS, nullptr, 0);
+}
+
+}  /* namespace firebuild */
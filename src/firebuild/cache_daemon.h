@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_CACHE_DAEMON_H_
+#define FIREBUILD_CACHE_DAEMON_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/file_name.h"
+#include "firebuild/hash.h"
+#include "firebuild/hash_cache.h"
+#include "firebuild/subkey.h"
+
+namespace firebuild {
+
+/**
+ * The cache daemon is a long-lived process started with "firebuild --cache-daemon", shared by the
+ * firebuild supervisors using the same cache directory on the machine (with use_cache_daemon
+ * enabled). It listens on the "daemon.sock" unix socket in the cache directory and owns:
+ *
+ * - the hashes of files in read-only locations, saving each supervisor from hashing the same
+ *   compilers and headers again,
+ * - the list of subkeys (ProcessInputsOutputs entries) of the fingerprints, saving listing the
+ *   same obj cache directories again.
+ *
+ * Supervisors fall back to the file system when the daemon is not running or it goes away.
+ * Entries stored or removed by supervisors not using the daemon are not noticed by it until the
+ * next garbage collection done through the daemon.
+ */
+class CacheDaemon {
+ public:
+  /**
+   * Serve requests forever.
+   * @return exit status if the daemon could not be started
+   */
+  static int serve(const std::string& socket_path);
+
+  /** Requests sent by the supervisors. */
+  enum request_type : uint32_t {
+    /** file's version + path -> hash, or empty response if not known */
+    GET_HASH = 1,
+    /** file's version + hash + path, no response */
+    PUT_HASH,
+    /** key -> subkeys of the key, most recently stored or used first */
+    LIST_SUBKEYS,
+    /** key + subkey, no response. The subkey has just been stored. */
+    ADD_SUBKEY,
+    /** no response. Entries have been removed from the cache. */
+    FORGET_SUBKEYS,
+  };
+
+  /** The version of a file in a read-only location, as stat() sees it. */
+  typedef struct file_version_ {
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t inode;
+    uint32_t type;
+    uint32_t padding;
+  } file_version_t;
+
+  typedef struct message_header_ {
+    uint32_t type;
+    uint32_t payload_len;
+  } message_header_t;
+};
+
+/**
+ * A supervisor's connection to the cache daemon.
+ *
+ * Each method returns false when the daemon could not be reached, then the connection is closed and
+ * the caller should fall back to using the file system.
+ */
+class CacheDaemonClient {
+ public:
+  /** Connect to the daemon, @return the client or nullptr if the daemon is not running. */
+  static CacheDaemonClient* connect(const std::string& socket_path);
+  ~CacheDaemonClient();
+  /** Look up the hash of a file in a read-only location, matching the entry's stat info. */
+  bool lookup_hash(const FileName* path, const HashCacheEntry& entry, Hash* hash);
+  /** Share the computed hash of a file in a read-only location. */
+  bool publish_hash(const FileName* path, const HashCacheEntry& entry, const Hash& hash);
+  bool list_subkeys(const Hash& key, std::vector<Subkey>* subkeys);
+  bool add_subkey(const Hash& key, const Subkey& subkey);
+  bool forget_subkeys();
+
+ private:
+  explicit CacheDaemonClient(int fd) : fd_(fd) {}
+  bool send(uint32_t type, const void* payload1, size_t len1,
+            const void* payload2 = nullptr, size_t len2 = 0,
+            const void* payload3 = nullptr, size_t len3 = 0);
+  /** Receive a response, @return false on errors */
+  bool receive(std::string* response);
+  bool fail();
+  int fd_;
+  DISALLOW_COPY_AND_ASSIGN(CacheDaemonClient);
+};
+
+/* singleton, NULL if the daemon is not used */
+extern CacheDaemonClient *cache_daemon;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_CACHE_DAEMON_H_
@@ -61,6 +61,7 @@ ExeMatcher* shortcut_allow_list_matcher = nullptr;
 ExeMatcher* dont_shortcut_matcher = nullptr;
 ExeMatcher* dont_intercept_matcher = nullptr;
 ExeMatcher* skip_cache_matcher = nullptr;
+ExeMatcher* format_insensitive_matcher = nullptr;
 tsl::hopscotch_set<std::string>* shells = nullptr;
 bool ccache_disabled = false;
 /** Store results of processes consuming more CPU time (system + user) in microseconds than this. */
@@ -69,8 +70,12 @@ int shortcut_tries = 0;
 int64_t max_cache_size = 0;
 off_t max_entry_size = 0;
 off_t max_inline_blob_size = 4096;  /* Default 4KB */
+off_t max_packed_blob_size = 64 * 1024;  /* Default 64KB */
 bool compress_cache = false;  /* Default: compression disabled */
 int compression_level = 1;  /* Default: level 1 */
+bool inherit_supervisor_connection = false;
+bool direct_pipe_handoff = false;
+bool pidfd_child_tracking = false;
 int quirks = 0;
 
 #ifndef __APPLE__
@@ -364,6 +369,25 @@ void read_config(libconfig::Config *cfg, const char *custom_cfg_file,
     }
   }
 
+  if (cfg->exists("max_packed_blob_size")) {
+    libconfig::Setting& max_packed_blob_size_cfg = cfg->getRoot()["max_packed_blob_size"];
+    if (max_packed_blob_size_cfg.isNumber()) {
+      double max_packed_blob_size_kb = max_packed_blob_size_cfg;
+      if (max_packed_blob_size_kb < 0) {
+        /* Fix up negative numbers. */
+        max_packed_blob_size_kb = 0;
+      }
+      if (max_packed_blob_size_kb * 1024 > std::numeric_limits<uint32_t>::max()) {
+        /* The pack index stores 32 bit sizes. */
+        fb_error("max_packed_blob_size is too large, using "
+                 + std::to_string(std::numeric_limits<uint32_t>::max() / 1024) + " KB instead");
+        max_packed_blob_size = std::numeric_limits<uint32_t>::max() / 1024 * 1024;
+      } else {
+        max_packed_blob_size = max_packed_blob_size_kb * 1024;
+      }
+    }
+  }
+
   if (cfg->exists("compress_cache")) {
     libconfig::Setting& compress_cache_cfg = cfg->getRoot()["compress_cache"];
     if (compress_cache_cfg.getType() == libconfig::Setting::TypeBoolean) {
@@ -383,6 +407,27 @@ void read_config(libconfig::Config *cfg, const char *custom_cfg_file,
     }
   }
 
+  if (cfg->exists("inherit_supervisor_connection")) {
+    libconfig::Setting& inherit_cfg = cfg->getRoot()["inherit_supervisor_connection"];
+    if (inherit_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      inherit_supervisor_connection = inherit_cfg;
+    }
+  }
+
+  if (cfg->exists("direct_pipe_handoff")) {
+    libconfig::Setting& handoff_cfg = cfg->getRoot()["direct_pipe_handoff"];
+    if (handoff_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      direct_pipe_handoff = handoff_cfg;
+    }
+  }
+
+  if (cfg->exists("pidfd_child_tracking")) {
+    libconfig::Setting& pidfd_cfg = cfg->getRoot()["pidfd_child_tracking"];
+    if (pidfd_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      pidfd_child_tracking = pidfd_cfg;
+    }
+  }
+
   assert(FileName::isDbEmpty());
 
 #ifndef __APPLE__
@@ -413,6 +458,7 @@ void read_config(libconfig::Config *cfg, const char *custom_cfg_file,
   init_matcher(&dont_shortcut_matcher, cfg, "dont_shortcut");
   init_matcher(&dont_intercept_matcher, cfg, "dont_intercept");
   init_matcher(&skip_cache_matcher, cfg, "skip_cache");
+  init_matcher(&format_insensitive_matcher, cfg, "format_insensitive");
 
   shells = new tsl::hopscotch_set<std::string>();
   try {
@@ -40,6 +40,7 @@ extern ExeMatcher* shortcut_allow_list_matcher;
 extern ExeMatcher* dont_shortcut_matcher;
 extern ExeMatcher* dont_intercept_matcher;
 extern ExeMatcher* skip_cache_matcher;
+extern ExeMatcher* format_insensitive_matcher;
 extern tsl::hopscotch_set<std::string>* shells;
 extern bool ccache_disabled;
 
@@ -75,6 +76,11 @@ extern off_t max_entry_size;
  */
 extern off_t max_inline_blob_size;
 
+/**
+ * Maximum size of a blob to store in a pack file of the blob cache instead of a separate file.
+ */
+extern off_t max_packed_blob_size;
+
 /**
  * Whether to compress cache objects and blobs.
  */
@@ -85,6 +91,21 @@ extern bool compress_cache;
  */
 extern int compression_level;
 
+/**
+ * Whether exec()-ed processes take over the supervisor connection of the pre-exec image
+ * instead of connecting to the supervisor again.
+ */
+extern bool inherit_supervisor_connection;
+
+/**
+ * Whether exec()-ed processes that can't be shortcut and whose outputs are not recorded write
+ * directly to pipes instead of the data being forwarded by the supervisor.
+ */
+extern bool direct_pipe_handoff;
+
+/** Whether exits of the supervisor's children are watched using pidfds instead of SIGCHLD. */
+extern bool pidfd_child_tracking;
+
 /** Enabled quirks represented as flags. See "quirks" in etc/firebuild.conf. */
 extern int quirks;
 #define FB_QUIRK_IGNORE_TMP_LISTING  0x01
@@ -45,6 +45,18 @@ class ConnectionContext {
   explicit ConnectionContext(int conn)
       : buffer_(), conn_(conn) {}
   ~ConnectionContext() {
+    finish_proc();
+    assert(conn_ >= 0);
+    epoll->maybe_del_fd(conn_, EPOLLIN);
+    close(conn_);
+    conn_ = -1;
+  }
+  /**
+   * Finish the process served by this connection, as if the connection was closed.
+   *
+   * Also used when an exec()-ed image takes over the connection of its exec parent.
+   */
+  void finish_proc() {
     if (proc) {
       auto exec_child_sock = proc_tree->Pid2ExecChildSock(proc->pid());
       if (exec_child_sock) {
@@ -54,13 +66,11 @@ class ConnectionContext {
         proc_tree->DropQueuedExecChild(proc->pid());
       }
       proc->finish();
+      proc = nullptr;
     }
-    assert(conn_ >= 0);
-    epoll->maybe_del_fd(conn_, EPOLLIN);
-    close(conn_);
-    conn_ = -1;
   }
   LinearBuffer& buffer() {return buffer_;}
+  int fd() const {return conn_;}
   Process * proc = nullptr;
 
  private:
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "firebuild/content_normalizer.h"
+
+#include <string.h>
+
+#include <string>
+
+namespace firebuild {
+
+static const CFamilyNormalizer c_family_normalizer;
+
+static const struct {
+  const char* extension;
+  const ContentNormalizer* normalizer;
+} normalizers[] = {
+  {"c", &c_family_normalizer},
+  {"h", &c_family_normalizer},
+  {"cc", &c_family_normalizer},
+  {"cp", &c_family_normalizer},
+  {"cpp", &c_family_normalizer},
+  {"cxx", &c_family_normalizer},
+  {"c++", &c_family_normalizer},
+  {"C", &c_family_normalizer},
+  {"hh", &c_family_normalizer},
+  {"hpp", &c_family_normalizer},
+  {"hxx", &c_family_normalizer},
+  {"h++", &c_family_normalizer},
+  {"H", &c_family_normalizer},
+  {"inl", &c_family_normalizer},
+  {"ipp", &c_family_normalizer},
+  {"tcc", &c_family_normalizer},
+  {"m", &c_family_normalizer},
+  {"mm", &c_family_normalizer},
+};
+
+Hash ContentNormalizer::hash(const char* data, size_t length) const {
+  std::string normalized;
+  normalize(data, length, &normalized);
+  Hash hash;
+  hash.set_from_data(normalized.data(), normalized.size());
+  return hash;
+}
+
+const ContentNormalizer* ContentNormalizer::for_file(const FileName* path) {
+  const char* name = path->c_str();
+  const char* dot = strrchr(name, '.');
+  if (!dot || strchr(dot, '/')) {
+    return nullptr;
+  }
+  for (const auto& entry : normalizers) {
+    if (strcmp(dot + 1, entry.extension) == 0) {
+      return entry.normalizer;
+    }
+  }
+  return nullptr;
+}
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static bool is_word_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static bool is_raw_string_prefix(const char* prefix, size_t length) {
+  static const char* const prefixes[] = {"R", "LR", "uR", "UR", "u8R"};
+  for (const char* raw_prefix : prefixes) {
+    if (length == strlen(raw_prefix) && memcmp(prefix, raw_prefix, length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void CFamilyNormalizer::normalize(const char* data, size_t length, std::string* out) const {
+  out->reserve(out->size() + length);
+  /* White space or a comment has been skipped since the last copied character. */
+  bool pending_space = false;
+  /* Nothing has been copied since the last line break, white space is dropped here. */
+  bool line_start = true;
+  /* Start of the identifier or number being copied in out, or npos */
+  size_t word_start = std::string::npos;
+  auto flush_space = [&]() {
+    if (pending_space && !line_start) {
+      out->push_back(' ');
+    }
+    pending_space = false;
+    line_start = false;
+  };
+
+  size_t i = 0;
+  while (i < length) {
+    const char c = data[i];
+    if (c == '\n') {
+      out->push_back('\n');
+      pending_space = false;
+      line_start = true;
+      word_start = std::string::npos;
+      i++;
+    } else if (is_space(c)) {
+      pending_space = true;
+      word_start = std::string::npos;
+      i++;
+    } else if (c == '\\' && i + 1 < length && data[i + 1] == '\n') {
+      /* Line splice, the white space at the beginning of the next line is significant. */
+      flush_space();
+      out->append("\\\n");
+      i += 2;
+    } else if (c == '/' && i + 1 < length && data[i + 1] == '/') {
+      /* Line comment, which can be continued by line splices. */
+      for (i += 2; i < length && data[i] != '\n'; i++) {
+        if (data[i] == '\\' && i + 1 < length && data[i + 1] == '\n') {
+          flush_space();
+          out->append("\\\n");
+          i++;
+        }
+      }
+      pending_space = true;
+      word_start = std::string::npos;
+    } else if (c == '/' && i + 1 < length && data[i + 1] == '*') {
+      /* Block comment, keep the line count with splices which also keep a directive continued. */
+      for (i += 2; i < length && !(data[i] == '*' && i + 1 < length && data[i + 1] == '/'); i++) {
+        if (data[i] == '\n') {
+          flush_space();
+          out->append("\\\n");
+        }
+      }
+      i = i + 2 < length ? i + 2 : length;
+      pending_space = true;
+      word_start = std::string::npos;
+    } else if (c == '"' && word_start != std::string::npos
+               && is_raw_string_prefix(out->data() + word_start, out->size() - word_start)) {
+      /* Raw string literal, R"delimiter(...)delimiter" */
+      const char* open_paren = static_cast<const char*>(memchr(data + i, '(', length - i));
+      const char* end = data + length;
+      if (open_paren) {
+        std::string terminator(")");
+        terminator.append(data + i + 1, open_paren - (data + i + 1)).push_back('"');
+        const char* found = static_cast<const char*>(
+            memmem(open_paren, end - open_paren, terminator.data(), terminator.size()));
+        if (found) {
+          end = found + terminator.size();
+        }
+      }
+      out->append(data + i, end - (data + i));
+      i = end - data;
+      word_start = std::string::npos;
+    } else if (c == '"' || (c == '\'' && (word_start == std::string::npos
+                                          || !((*out)[word_start] >= '0'
+                                               && (*out)[word_start] <= '9')))) {
+      /* String or character literal, an apostrophe in a number is a digit separator instead. */
+      flush_space();
+      out->push_back(c);
+      for (i++; i < length && data[i] != '\n'; i++) {
+        out->push_back(data[i]);
+        if (data[i] == '\\' && i + 1 < length) {
+          out->push_back(data[++i]);
+        } else if (data[i] == c) {
+          i++;
+          break;
+        }
+      }
+      word_start = std::string::npos;
+    } else {
+      flush_space();
+      if (c == '\'') {
+        /* Digit separator, the number continues. */
+      } else if (!is_word_char(c)) {
+        word_start = std::string::npos;
+      } else if (word_start == std::string::npos) {
+        word_start = out->size();
+      }
+      out->push_back(c);
+      i++;
+    }
+  }
+}
+
+}  /* namespace firebuild */
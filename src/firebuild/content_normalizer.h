@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef FIREBUILD_CONTENT_NORMALIZER_H_
+#define FIREBUILD_CONTENT_NORMALIZER_H_
+
+#include <string>
+
+#include "firebuild/file_name.h"
+#include "firebuild/hash.h"
+
+namespace firebuild {
+
+/**
+ * A normalizer keeps only the semantic content of the files of a given type, dropping e.g.
+ * comments and indentation.
+ *
+ * The hash of the normalized content is stored as the input files' alt_hash in the cache entries
+ * of the processes listed in processes.format_insensitive, and it is compared when the input's raw
+ * hash does not match, letting those processes be shortcut after formatting changes.
+ *
+ * Note: Update kCacheFormatVersion when changing the normalization of a file type.
+ */
+class ContentNormalizer {
+ public:
+  virtual ~ContentNormalizer() {}
+  /** Append the normalized form of data to out. */
+  virtual void normalize(const char* data, size_t length, std::string* out) const = 0;
+  /** The hash of the normalized form of data. */
+  Hash hash(const char* data, size_t length) const;
+  /** @return the normalizer of the file's type based on its name, or nullptr */
+  static const ContentNormalizer* for_file(const FileName* path);
+};
+
+/**
+ * Normalizer for C, C++ and Objective-C sources and headers.
+ *
+ * Comments are dropped, runs of white space are collapsed into a single space and white space is
+ * dropped at the beginning and the end of the lines. Literals are kept intact. Line breaks are kept
+ * to not change __LINE__, those in dropped multi-line comments are replaced by line splices.
+ */
+class CFamilyNormalizer : public ContentNormalizer {
+ public:
+  void normalize(const char* data, size_t length, std::string* out) const override;
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_CONTENT_NORMALIZER_H_
@@ -236,13 +236,13 @@ void Epoll::del_timer(int timer_id) {
    * already elapsed. */
 }
 
-void Epoll::wait() {
+void Epoll::wait(bool block) {
 #ifndef __APPLE__
-    int timeout_ms = -1;
+    int timeout_ms = block ? -1 : 0;
 #else
-    struct timespec diff;
+    struct timespec diff = {0, 0};
 #endif
-    if (next_timer_ >= 0) {
+    if (block && next_timer_ >= 0) {
       struct timespec now;
 #ifndef __APPLE__
       struct timespec diff;
@@ -262,7 +262,7 @@ void Epoll::wait() {
 #ifdef __APPLE__
     event_count_ = TEMP_FAILURE_RETRY(
         kevent(main_fd_, nullptr, 0, events_, sizeof(events_) / sizeof(events_[0]),
-               (next_timer_ >= 0) ? &diff : nullptr));
+               (!block || next_timer_ >= 0) ? &diff : nullptr));
 #else
     event_count_ = TEMP_FAILURE_RETRY(
         epoll_wait(main_fd_, events_, sizeof(events_) / sizeof(events_[0]), timeout_ms));
@@ -142,8 +142,14 @@ class Epoll {
   }
 #endif
 
-  /** Wrapper around epoll_wait(). Places the result in events_ and event_count_. */
-  void wait();
+  /**
+   * Wrapper around epoll_wait(). Places the result in events_ and event_count_.
+   * @param block wait for the next event or timer, otherwise just collect the pending events
+   */
+  void wait(bool block = true);
+
+  /** Number of events returned by the last wait(). */
+  int event_count() const {return event_count_;}
 
   /** Call the relevant callback for all the returned events in events_, and all the expired
    *  timers. */
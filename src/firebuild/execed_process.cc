@@ -34,8 +34,10 @@
 #include "firebuild/hash_cache.h"
 #endif
 #include "firebuild/options.h"
+#include "firebuild/phase_timers.h"
 #include "firebuild/process_debug_suppressor.h"
 #include "firebuild/process_tree.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 
 namespace firebuild {
@@ -65,6 +67,9 @@ ExecedProcess::ExecedProcess(const int pid, const int ppid,
          "pid=%d, ppid=%d, initial_wd=%s, executable=%s, umask=%03o, parent=%s",
          pid, ppid, D(initial_wd), D(executable), umask, D(parent));
 
+  if (trace_events) {
+    start_ns_ = PhaseTimers::now_ns();
+  }
   if (parent) {
     if (parent->state() != FB_PROC_TERMINATED) {
       if (parent->is_qemu()) {
@@ -259,6 +264,10 @@ void ExecedProcess::do_finalize() {
   for (const auto& pipe : created_pipes_) {
     pipe->finish();
   }
+  if (trace_events) {
+    /* The process will be garbage collected, add it to the trace while it's available. */
+    trace_events->add_process(this);
+  }
   proc_tree->QueueExecProcForGC(this);
 }
 
@@ -327,7 +336,7 @@ bool ExecedProcess::register_file_usage_update(const FileName *name,
            * always be incremented by one. Otherwise the file could have been changed outside of the
            * process's subtree wich makes the process not shortcutable. */
           proc->disable_shortcutting_only_this(
-              Options::generate_report()
+              Options::collect_shortcut_results()
               ? deduplicated_string("A parallel process modified " + d(name)).c_str()
               : "A parallel process modified the file");
           /* Still bubble up to the root because an ancestor may still be shortcutable and also
@@ -347,7 +356,7 @@ bool ExecedProcess::register_file_usage_update(const FileName *name,
        * case, in the next iteration of the loop "update" will already contain this value. */
       fu_new = fu->merge(update, propagated);
       if (!fu_new) {
-        if (FB_DEBUGGING(FB_DEBUG_FS) || Options::generate_report()) {
+        if (FB_DEBUGGING(FB_DEBUG_FS) || Options::collect_shortcut_results()) {
           std::string reason("Could not merge " + d(name) + " file usage " + d(fu) + " with "
                              + d(update));
           FB_DEBUG(FB_DEBUG_FS, reason);
@@ -460,7 +469,7 @@ void ExecedProcess::disable_shortcutting_bubble_up_to_excl(
     bool shortcutable_ancestor_is_set) {
   disable_shortcutting_bubble_up_to_excl(
       stop,
-      Options::generate_report() ? reason_with_fd(reason, fd) : reason,
+      Options::collect_shortcut_results() ? reason_with_fd(reason, fd) : reason,
       p, shortcutable_ancestor, shortcutable_ancestor_is_set);
   FB_DEBUG(FB_DEBUG_PROC, "fd: " + d(fd));
 }
@@ -475,7 +484,7 @@ void ExecedProcess::disable_shortcutting_bubble_up(const char* reason,
                                                    const int fd,
                                                    const ExecedProcess *p) {
   disable_shortcutting_bubble_up(
-      Options::generate_report() ? reason_with_fd(reason, fd) : reason, p);
+      Options::collect_shortcut_results() ? reason_with_fd(reason, fd) : reason, p);
   FB_DEBUG(FB_DEBUG_PROC, "fd: " + d(fd));
 }
 
@@ -483,8 +492,8 @@ void ExecedProcess::disable_shortcutting_bubble_up(const char* reason,
                                                    const FileName& file,
                                                    const ExecedProcess *p) {
   disable_shortcutting_bubble_up(
-      Options::generate_report() ? deduplicated_string(std::string(reason) + " file: "
-                                                       + d(file)).c_str()
+      Options::collect_shortcut_results()
+      ? deduplicated_string(std::string(reason) + " file: " + d(file)).c_str()
       : reason, p);
   FB_DEBUG(FB_DEBUG_PROC, "file: " + d(file));
 }
@@ -493,7 +502,8 @@ void ExecedProcess::disable_shortcutting_bubble_up(const char* reason,
                                                    const std::string& str,
                                                    const ExecedProcess *p) {
   disable_shortcutting_bubble_up(
-      Options::generate_report() ? deduplicated_string(std::string(reason) + " " + d(str)).c_str()
+      Options::collect_shortcut_results()
+      ? deduplicated_string(std::string(reason) + " " + d(str)).c_str()
       : reason, p);
   FB_DEBUG(FB_DEBUG_PROC, d(str));
 }
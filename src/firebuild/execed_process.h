@@ -118,6 +118,15 @@ class ExecedProcess : public Process {
   void add_shortcut_cpu_time_ms(const int64_t t) {shortcut_cpu_time_ms_ += t;}
   int64_t shortcut_cpu_time_ms() const {return shortcut_cpu_time_ms_;}
   int64_t aggr_cpu_time_u() const {return cpu_time_u() + children_cpu_time_u_;}
+  void add_ack_waits(int64_t ns, int64_t waits) {
+    ack_wait_ns_ += ns;
+    ack_waits_ += waits;
+  }
+  int64_t ack_wait_ns() const {return ack_wait_ns_;}
+  int64_t ack_waits() const {return ack_waits_;}
+  uint64_t start_ns() const {return start_ns_;}
+  uint64_t end_ns() const {return end_ns_;}
+  void set_end_ns(uint64_t ns) {end_ns_ = ns;}
   const FileName* initial_wd() const {return initial_wd_;}
   const tsl::hopscotch_set<const FileName*>& wds() const {return wds_;}
   const tsl::hopscotch_set<const FileName*>& wds() {return wds_;}
@@ -280,6 +289,14 @@ class ExecedProcess : public Process {
    * Sum of user and system time in microseconds for all finalized exec()-ed children.
    * Shortcut processes are treated as if their CPU time was 0. */
   int64_t children_cpu_time_u_ = 0;
+  /** Time in nanoseconds this process and its forked but not exec()-ed children spent waiting for
+   *  the supervisor's ACKs, and the number of waits */
+  int64_t ack_wait_ns_ = 0;
+  int64_t ack_waits_ = 0;
+  /** When the process started and terminated, as PhaseTimers::now_ns(), recorded only for the
+   *  trace events */
+  uint64_t start_ns_ = 0;
+  uint64_t end_ns_ = 0;
   /**
    * Aggregate CPU time saved by shortcutting in all transitive children and this process.
    * It becomes final when all exec()-ed children are finalized. */
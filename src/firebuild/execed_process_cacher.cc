@@ -24,12 +24,17 @@
 #include <algorithm>
 #include <cinttypes>
 #include <cstdio>
+#include <deque>
 #include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "common/probes.h"
+#include "firebuild/cache_access_log.h"
+#include "firebuild/cache_counters.h"
+#include "firebuild/cache_daemon.h"
 #include "firebuild/config.h"
 #include "firebuild/debug.h"
 #include "firebuild/execed_process.h"
@@ -37,9 +42,12 @@
 #include "firebuild/file_name.h"
 #include "firebuild/hash_cache.h"
 #include "firebuild/options.h"
+#include "firebuild/path_remapper.h"
+#include "firebuild/phase_timers.h"
 #include "firebuild/fbbfp.h"
 #include "firebuild/fbbstore.h"
 #include "firebuild/process_tree.h"
+#include "firebuild/remote_cache.h"
 
 namespace firebuild {
 
@@ -63,9 +71,12 @@ class InlineDataMapCleaner {
 };
 
 static const XXH64_hash_t kFingerprintVersion = 0;
-static const unsigned int kCacheFormatVersion = 3;
-static const char kCacheStatsFile[] = "stats";
-static const char kCacheSizeFile[] = "size";
+static const unsigned int kCacheFormatVersion = 5;
+static const char kCacheCountersFile[] = "counters";
+/* Files used before the counters file, imported when creating the counters file. */
+static const char kLegacyCacheStatsFile[] = "stats";
+static const char kLegacyCacheSizeFile[] = "size";
+static const char kCacheDaemonSocket[] = "daemon.sock";
 
 unsigned int ExecedProcessCacher::cache_format_ = 0;
 
@@ -162,12 +173,130 @@ void ExecedProcessCacher::init(const libconfig::Config* cfg) {
   }
   free(cache_format_file);
 
-  blob_cache = new BlobCache(cache_dir + "/blobs");
-  obj_cache = new ObjCache(cache_dir + "/objs");
+  /* Read-only lower cache layers, shared by multiple machines, for example. */
+  std::vector<std::string> lower_blob_dirs, lower_obj_dirs;
+  if (cfg->exists("lower_cache_dirs")) {
+    const libconfig::Setting& items = cfg->getRoot()["lower_cache_dirs"];
+    for (int i = 0; i < items.getLength(); i++) {
+      const std::string lower_dir(items[i].c_str());
+      unsigned int lower_cache_format = 0;
+      FILE* f = fopen((lower_dir + "/cache-format").c_str(), "r");
+      if (f) {
+        if (fscanf(f, "%u\n", &lower_cache_format) != 1) {
+          lower_cache_format = 0;
+        }
+        fclose(f);
+      }
+      if (lower_cache_format != kCacheFormatVersion) {
+        fb_info("Skipping lower cache layer " + lower_dir + " with missing or different format");
+        continue;
+      }
+      lower_blob_dirs.push_back(lower_dir + "/blobs");
+      lower_obj_dirs.push_back(lower_dir + "/objs");
+    }
+  }
+
+  /* Remote cache tier, shared by multiple machines. */
+  if (cfg->exists("remote_cache_url") && !(no_fetch && no_store)) {
+    int parallel_downloads = 8;
+    if (cfg->exists("remote_cache_parallel_downloads")) {
+      const libconfig::Setting& parallel_downloads_cfg =
+          cfg->getRoot()["remote_cache_parallel_downloads"];
+      if (parallel_downloads_cfg.isNumber()) {
+        parallel_downloads = parallel_downloads_cfg;
+      }
+    }
+    remote_cache = new RemoteCache(cfg->getRoot()["remote_cache_url"].c_str(), parallel_downloads);
+    std::string remote_cache_format;
+    if (remote_cache->get("cache-format", &remote_cache_format)) {
+      if (strtoul(remote_cache_format.c_str(), NULL, 10) != kCacheFormatVersion) {
+        fb_info("Not using the remote cache with different cache format");
+        delete remote_cache;
+        remote_cache = nullptr;
+      }
+    } else if (remote_cache->usable()) {
+      /* The remote cache is empty. */
+      if (!no_store) {
+        remote_cache->upload_async("cache-format", cache_dir + "/cache-format");
+      }
+    } else {
+      delete remote_cache;
+      remote_cache = nullptr;
+    }
+  }
+
+  blob_cache = new BlobCache(cache_dir + "/blobs", lower_blob_dirs);
+  obj_cache = new ObjCache(cache_dir + "/objs", lower_obj_dirs);
   PipeRecorder::set_base_dir((cache_dir + "/tmp").c_str());
   hash_cache = new HashCache();
 
   execed_process_cacher = new ExecedProcessCacher(no_store, no_fetch, cache_dir, cfg);
+
+  /* Cache daemon shared by the supervisors on the machine, unless this is the daemon itself. */
+  if (cfg->exists("use_cache_daemon") && !Options::cache_daemon()) {
+    const libconfig::Setting& use_cache_daemon_cfg = cfg->getRoot()["use_cache_daemon"];
+    if (use_cache_daemon_cfg.getType() == libconfig::Setting::TypeBoolean
+        && static_cast<bool>(use_cache_daemon_cfg)) {
+      cache_daemon = CacheDaemonClient::connect(execed_process_cacher->daemon_socket_path());
+      if (!cache_daemon) {
+        fb_info("The cache daemon is not running, start it with \"firebuild --cache-daemon\"");
+      }
+    }
+  }
+
+  /* Warm up the cache entries used by the previous run of the same build command. */
+  bool prefetch_cache = true;
+  if (cfg->exists("prefetch_cache")) {
+    const libconfig::Setting& prefetch_cache_cfg = cfg->getRoot()["prefetch_cache"];
+    if (prefetch_cache_cfg.getType() == libconfig::Setting::TypeBoolean) {
+      prefetch_cache = prefetch_cache_cfg;
+    }
+  }
+  if (prefetch_cache && !no_fetch && Options::build_cmd()) {
+    std::string build_key;
+    char* cwd = getcwd(NULL, 0);
+    if (cwd) {
+      build_key.append(cwd).push_back('\0');
+      free(cwd);
+    }
+    if (Options::directory()) {
+      build_key.append(Options::directory());
+    }
+    for (size_t i = 0; i < Options::build_cmd_argc(); i++) {
+      build_key.push_back('\0');
+      build_key.append(Options::build_cmd()[i]);
+    }
+    cache_access_log = new CacheAccessLog(cache_dir, build_key, !no_store);
+  }
+
+  /* Let the same project built in different directories share cache entries. */
+  if (cfg->exists("relocation_root")) {
+    std::string root(cfg->getRoot()["relocation_root"].c_str());
+    if (!root.empty() && root[0] != '/') {
+      char* cwd = getcwd(NULL, 0);
+      if (cwd) {
+        root = std::string(cwd) + "/" + root;
+        free(cwd);
+      }
+    }
+    char* canonical_root = realpath(root.c_str(), NULL);
+    if (!canonical_root) {
+      fb_error("Could not resolve relocation_root " + root + ", not relocating the cache entries");
+    } else if (strcmp(canonical_root, "/") == 0) {
+      fb_error("relocation_root must not be /, not relocating the cache entries");
+    } else {
+      path_remapper = new PathRemapper(canonical_root);
+    }
+    free(canonical_root);
+  }
+}
+
+unsigned int ExecedProcessCacher::current_cache_format() {
+  return kCacheFormatVersion;
+}
+
+std::string ExecedProcessCacher::daemon_socket_path() const {
+  return cache_dir_ + "/" + kCacheDaemonSocket;
 }
 
 /**
@@ -221,6 +350,31 @@ static void add_to_hash_state(XXH3_state_t* state, const int i) {
   }
 }
 
+/**
+ * Add file_name to fingerprint as it is stored in the cache entries, see PathRemapper.
+ */
+static void add_path_to_hash_state(XXH3_state_t* state, const FileName* file_name) {
+  if (path_remapper) {
+    std::deque<std::string> storage;
+    const cstring_view path = path_remapper->stored_path(file_name, &storage);
+    add_to_hash_state(state, path.c_str, path.length);
+  } else {
+    add_to_hash_state(state, file_name);
+  }
+}
+
+/**
+ * Add an argument or an environment variable to fingerprint with the root directory's path
+ * replaced, see PathRemapper.
+ */
+static void add_relocated_to_hash_state(XXH3_state_t* state, const std::string& str) {
+  if (path_remapper) {
+    add_to_hash_state(state, path_remapper->remap_string(str));
+  } else {
+    add_to_hash_state(state, str);
+  }
+}
+
 static Hash state_to_hash(XXH3_state_t* state) {
   const XXH128_hash_t digest = XXH3_128bits_digest(state);
   return Hash(digest);
@@ -265,6 +419,50 @@ ExecedProcessCacher::ExecedProcessCacher(bool no_store,
   }
   ignore_locations_hash_ = state_to_hash(state);
   maybe_XXH3_freeState(state);
+
+  bool created;
+  counters_ = CacheCounters::open(cache_dir_ + "/" + kCacheCountersFile, &created);
+  if (!counters_) {
+    exit(EXIT_FAILURE);
+  }
+  if (created) {
+    import_legacy_counters();
+  }
+}
+
+void ExecedProcessCacher::import_legacy_counters() {
+  const std::string size_file = cache_dir_ + "/" + kLegacyCacheSizeFile;
+  FILE* f;
+  off_t cached_bytes = -1;
+  if ((f = fopen(size_file.c_str(), "r"))) {
+    if (fscanf(f, "%" SCNoff "\n", &cached_bytes) != 1) {
+      cached_bytes = -1;
+    }
+    fclose(f);
+  }
+  if (cached_bytes >= 0) {
+    counters_->add(FB_COUNTER_CACHED_BYTES, cached_bytes);
+  } else {
+    fix_stored_bytes();
+  }
+  unlink(size_file.c_str());
+
+  const std::string stats_file = cache_dir_ + "/" + kLegacyCacheStatsFile;
+  unsigned int shortcut_attempts, shortcut_hits, not_shortcutting, gc_runs;
+  int64_t saved_cpu_ms;
+  if ((f = fopen(stats_file.c_str(), "r"))) {
+    if (fscanf(f, "attempts: %u\nhits: %u\nskips: %u\ngc_runs: %u\nsaved_cpu_ms: %" SCNd64 "\n",
+               &shortcut_attempts, &shortcut_hits, &not_shortcutting, &gc_runs,
+               &saved_cpu_ms) == 5) {
+      counters_->add(FB_COUNTER_SHORTCUT_ATTEMPTS, shortcut_attempts);
+      counters_->add(FB_COUNTER_SHORTCUT_HITS, shortcut_hits);
+      counters_->add(FB_COUNTER_NOT_SHORTCUTTING, not_shortcutting);
+      counters_->add(FB_COUNTER_GC_RUNS, gc_runs);
+      counters_->add(FB_COUNTER_SAVED_CPU_MS, saved_cpu_ms);
+    }
+    fclose(f);
+    unlink(stats_file.c_str());
+  }
 }
 
 bool ExecedProcessCacher::env_fingerprintable(const std::string& name_and_value) const {
@@ -320,6 +518,7 @@ static void hash_param_file(XXH3_state_t* state, const ExecedProcess *proc,
  */
 bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
   TRACK(FB_DEBUG_PROC, "proc=%s", D(proc));
+  PhaseTimer timer(FB_PHASE_FINGERPRINT);
 
 #ifdef XXH_INLINE_ALL
   XXH3_state_t state_struct;
@@ -331,7 +530,11 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     abort();
   }
   add_to_hash_state(state, ignore_locations_hash_);
-  add_to_hash_state(state, proc->initial_wd());
+  if (path_remapper) {
+    /* Never mix relocated and not relocated entries. */
+    add_to_hash_state(state, std::string(PathRemapper::kRootPlaceholder));
+  }
+  add_path_to_hash_state(state, proc->initial_wd());
   /* Size is added to not allow collisions between elements of different containers.
    * Otherwise "cmd foo BAR=1" would collide with "env BAR=1 cmd foo". */
   add_to_hash_state(state, proc->args().size());
@@ -340,7 +543,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
   std::string found_param_file;
   Hash found_param_file_hash;
   for (const auto& arg : args) {
-    add_to_hash_state(state, arg);
+    add_relocated_to_hash_state(state, arg);
     /* Since we are already iterating over the args let's find a hint for hash_param_files(). */
     if (guess_file_params && (arg == "conftest.c" || arg == "objs/autotest.c")) {
       found_param_file = arg;
@@ -362,12 +565,12 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
   add_to_hash_state(state, proc->env_vars().size());
   for (const auto& env : proc->env_vars()) {
     if (env_fingerprintable(env)) {
-      add_to_hash_state(state, env);
+      add_relocated_to_hash_state(state, env);
     }
   }
 
   /* The executable and its hash */
-  add_to_hash_state(state, proc->executable());
+  add_path_to_hash_state(state, proc->executable());
   Hash hash;
   if (!hash_cache->get_hash(proc->executable(), 0, &hash)) {
     FB_DEBUG(FB_DEBUG_PROC, "Could not get hash of executable: " + d(proc->executable()));
@@ -378,10 +581,10 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
 
   if (proc->executable() == proc->executed_path()) {
     /* Those often match. Don't calculate the same hash twice then. */
-    add_to_hash_state(state, proc->executable());
+    add_path_to_hash_state(state, proc->executable());
     add_to_hash_state(state, hash);
   } else {
-    add_to_hash_state(state, proc->executed_path());
+    add_path_to_hash_state(state, proc->executed_path());
     if (!hash_cache->get_hash(proc->executed_path(), 0, &hash)) {
       FB_DEBUG(FB_DEBUG_PROC, "Could not get hash of executed path: " + d(proc->executed_path()));
       maybe_XXH3_freeState(state);
@@ -390,7 +593,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     add_to_hash_state(state, hash);
   }
 
-  add_to_hash_state(state, proc->original_executed_path());
+  add_relocated_to_hash_state(state, proc->original_executed_path());
 
   add_to_hash_state(state, proc->libs().size());
   for (const auto lib : proc->libs()) {
@@ -405,7 +608,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
       return false;
 #endif
     }
-    add_to_hash_state(state, lib);
+    add_path_to_hash_state(state, lib);
     add_to_hash_state(state, hash);
   }
 
@@ -439,8 +642,28 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     }
     fp.set_ignore_locations(ignore_locations_vec);
 
-    fp.set_wd(proc->initial_wd()->c_str());
-    fp.set_args(proc->args());
+    /* Keep the relocated strings alive until the message is serialized. */
+    std::deque<std::string> relocated_strings;
+    auto relocated_path = [&relocated_strings](const FileName* path) {
+      return path_remapper ? path_remapper->stored_path(path, &relocated_strings).c_str
+          : path->c_str();
+    };
+    auto relocated = [&relocated_strings](const char* str) {
+      return path_remapper
+          ? relocated_strings.emplace_back(path_remapper->remap_string(str)).c_str() : str;
+    };
+
+    fp.set_wd(relocated_path(proc->initial_wd()));
+    std::vector<std::string> relocated_args;
+    if (path_remapper) {
+      relocated_args.reserve(proc->args().size());
+      for (const auto& arg : proc->args()) {
+        relocated_args.push_back(path_remapper->remap_string(arg));
+      }
+      fp.set_args(relocated_args);
+    } else {
+      fp.set_args(proc->args());
+    }
 
     if (guess_file_params && found_param_file.size() > 0) {
       fp.set_param_file_hash(found_param_file_hash.get());
@@ -451,7 +674,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
     c_env.reserve(proc->env_vars().size());  /* likely minor optimization */
     for (const auto& env : proc->env_vars()) {
       if (env_fingerprintable(env)) {
-        c_env.push_back(env.c_str());
+        c_env.push_back(relocated(env.c_str()));
       }
     }
     fp.set_env_with_count(c_env.data(), c_env.size());
@@ -463,7 +686,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
       maybe_XXH3_freeState(state);
       return false;
     }
-    executable.set_path(proc->executable()->c_str());
+    executable.set_path(relocated_path(proc->executable()));
     executable.set_hash(hash.get());
     fp.set_executable(reinterpret_cast<FBBFP_Builder *>(&executable));
 
@@ -477,12 +700,12 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
         maybe_XXH3_freeState(state);
         return false;
       }
-      executed_path.set_path(proc->executed_path()->c_str());
+      executed_path.set_path(relocated_path(proc->executed_path()));
       executed_path.set_hash(hash.get());
       fp.set_executed_path(reinterpret_cast<FBBFP_Builder *>(&executed_path));
     }
 
-    fp.set_original_executed_path(proc->original_executed_path());
+    fp.set_original_executed_path(relocated(proc->original_executed_path()));
 
     /* The linked libraries */
     std::vector<FBBFP_Builder_file> lib_builders;
@@ -501,7 +724,7 @@ bool ExecedProcessCacher::fingerprint(const ExecedProcess *proc) {
 #endif
       }
       FBBFP_Builder_file& lib_builder = lib_builders.emplace_back();
-      lib_builder.set_path(lib->c_str());
+      lib_builder.set_path(relocated_path(lib));
       lib_builder.set_hash(hash.get());
     }
     fp.set_libs_item_fn(lib_builders.size(), fbbfp_builder_file_vector_item_fn, &lib_builders);
@@ -537,11 +760,22 @@ void ExecedProcessCacher::erase_fingerprint(const ExecedProcess *proc) {
   }
 }
 
-static void add_file(std::vector<FBBSTORE_Builder_file>* files, const FileName* file_name,
+/**
+ * The path to store in the cache entry, see PathRemapper.
+ * @param storage holds the relocated path, if needed
+ */
+static cstring_view stored_path(const FileName* path, std::deque<std::string>* storage) {
+  return path_remapper ? path_remapper->stored_path(path, storage)
+      : cstring_view {path->c_str(), path->length()};
+}
+
+static void add_file(std::vector<FBBSTORE_Builder_file>* files,
+                     std::deque<std::string>* relocated_paths, const FileName* file_name,
                      const FileInfo& fi, bool output_file, const FileUsage* fu = nullptr,
                      const char* inline_data = nullptr, size_t inline_data_len = 0) {
   FBBSTORE_Builder_file& new_file = files->emplace_back();
-  new_file.set_path_with_length(file_name->c_str(), file_name->length());
+  const cstring_view path = stored_path(file_name, relocated_paths);
+  new_file.set_path_with_length(path.c_str, path.length);
   new_file.set_type(fi.type());
   if (fi.size_known()) {
     new_file.set_size(fi.size());
@@ -565,9 +799,38 @@ static void add_file(std::vector<FBBSTORE_Builder_file>* files, const FileName*
   }
   /* Only store timestamp_source if the file still exists (wasn't deleted/temporary) */
   if (output_file && fu && fu->timestamp_source() && fi.type() != NOTEXIST) {
-    const FileName* ts_src = fu->timestamp_source();
-    new_file.set_timestamp_source_with_length(ts_src->c_str(), ts_src->length());
+    const cstring_view ts_src = stored_path(fu->timestamp_source(), relocated_paths);
+    new_file.set_timestamp_source_with_length(ts_src.c_str, ts_src.length);
+  }
+}
+
+/** Whether the stored blob contains the relocated root directory's path. */
+static bool blob_embeds_root(const Hash& key, bool compressed) {
+  blob_fd_t blob;
+  if (!blob_cache->open_blob(key, &blob, true)) {
+    /* Be on the safe side. */
+    return true;
   }
+  bool ret;
+  if (!compressed) {
+    ret = path_remapper->fd_embeds_root(blob.fd, blob.offset, blob.size);
+  } else {
+    const loff_t map_offset = blob.offset & ~static_cast<loff_t>(sysconf(_SC_PAGESIZE) - 1);
+    const size_t map_size = blob.offset - map_offset + blob.size;
+    uint8_t* mapped = static_cast<uint8_t*>(mmap(NULL, map_size, PROT_READ, MAP_PRIVATE,
+                                                 blob.fd, map_offset));
+    uint8_t* decompressed = nullptr;
+    size_t decompressed_size = 0;
+    if (mapped != MAP_FAILED) {
+      decompressed = decompress_zstd(mapped + (blob.offset - map_offset), blob.size,
+                                     &decompressed_size);
+      munmap(mapped, map_size);
+    }
+    ret = !decompressed || path_remapper->embeds_root(decompressed, decompressed_size);
+    free(decompressed);
+  }
+  close(blob.fd);
+  return ret;
 }
 
 static const FBBSTORE_Builder* file_item_fn(int idx, const void *user_data) {
@@ -579,7 +842,9 @@ static bool dir_created_or_could_exist(
     const char* filename, const size_t length,
     const tsl::hopscotch_set<const FileName*>& out_path_isdir_filename_ptrs,
     const tsl::hopscotch_map<const FileName*, const FileUsage*>& file_usages) {
-  const FileName* parent_dir = FileName::GetParentDir(filename, length);
+  const FileName* parent_dir = path_remapper
+      ? path_remapper->file_name(filename, length)->parent_dir()
+      : FileName::GetParentDir(filename, length);
   while (parent_dir != nullptr) {
     const auto it = file_usages.find(parent_dir);
     const FileUsage* fu = it->second;
@@ -633,6 +898,17 @@ static bool consistent_implicit_parent_dirs(
   return true;
 }
 
+/** Whether the process wrote anything to a pipe it inherited. */
+static bool wrote_to_inherited_pipe(const ExecedProcess* proc) {
+  for (const inherited_file_t& inherited_file : proc->inherited_files()) {
+    if (inherited_file.type == FD_PIPE_OUT && inherited_file.recorder
+        && !inherited_file.recorder->empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
 static bool tmp_file_or_on_tmp_path(const FileUsage* fu, const FileName* filename,
                                     const FileName* tmpdir) {
   if (fu->tmp_file()) {
@@ -674,6 +950,7 @@ static bool rustc_ignored_dir(const ExecedProcess* const proc, const FileName* c
 
 void ExecedProcessCacher::store(ExecedProcess *proc) {
   TRACK(FB_DEBUG_PROC, "proc=%s", D(proc));
+  PhaseTimer timer(FB_PHASE_STORE);
 
   if (no_store_) {
     /* This is when FIREBUILD_READONLY is set. We could have decided not to create PipeRecorders
@@ -733,6 +1010,8 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
 
   std::vector<FBBSTORE_Builder_file> in_path;
   std::vector<cstring_view> in_path_notexist;
+  /* Paths in the relocated root directory as stored in the cache entry */
+  std::deque<std::string> relocated_paths;
 
   /* File outputs */
   FBBSTORE_Builder_process_outputs po;
@@ -744,6 +1023,11 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
   size_t in_path_non_system_count {0},
       in_path_notexist_non_system_count {0};
 
+  /* Let processes insensitive to the formatting of their inputs be shortcut after formatting
+   * changes, too, unless they wrote to pipes, because diagnostics can quote the changed lines. */
+  const bool store_alt_hashes = format_insensitive_matcher->match(proc)
+      && !wrote_to_inherited_pipe(proc);
+
   /* Construct in_path_* in 2 passes. First collect the non-system paths and then the system paths,
    * for better performance. */
   for (int pass = 0; pass < 2; pass++) {
@@ -760,7 +1044,7 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
         FB_DEBUG(FB_DEBUG_CACHING,
                  "A file (" + d(filename)+ ") changed since the process used it.");
         proc->disable_shortcutting_only_this(
-            Options::generate_report()
+            Options::collect_shortcut_results()
             ? deduplicated_string("A file (" + d(filename)
                                   + ") changed since the process used it.").c_str()
             : "A file could not be stored because it changed since the process used it.");
@@ -775,7 +1059,7 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
           break;
         case NOTEXIST:
           /* NOTEXIST is handled specially to save space in the FBB. */
-          in_path_notexist.push_back({filename->c_str(), filename->length()});
+          in_path_notexist.push_back(stored_path(filename, &relocated_paths));
           break;
         case ISDIR:
           if (fu->initial_state().hash_known()
@@ -783,7 +1067,7 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
                   || rustc_ignored_dir(proc, filename))) {
             FileInfo no_hash_initial_state(fu->initial_state());
             no_hash_initial_state.set_hash(nullptr);
-            add_file(&in_path, filename, no_hash_initial_state, false);
+            add_file(&in_path, &relocated_paths, filename, no_hash_initial_state, false);
             break;
           }
           [[fallthrough]];
@@ -794,7 +1078,16 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
                      + d(filename) + ", which is a temporary file");
             return;
           }
-          add_file(&in_path, filename, fu->initial_state(), false);
+          add_file(&in_path, &relocated_paths, filename, fu->initial_state(), false);
+          if (store_alt_hashes && fu->initial_state().type() == ISREG && !fu->written()
+              && fu->initial_state().hash_known()) {
+            Hash hash, alt_hash;
+            /* The file is not modified, thus the normalized content is that of the initial. */
+            if (hash_cache->get_hash(filename, 0, &hash) && hash == fu->initial_state().hash()
+                && hash_cache->get_alt_hash(filename, &alt_hash)) {
+              in_path.back().set_alt_hash(alt_hash.get());
+            }
+          }
           break;
       }
     }
@@ -836,6 +1129,12 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
           Hash new_hash;
           /* TODO don't store and don't record if it was read with the same hash. */
           int fd = open(filename->c_str(), O_RDONLY);
+          if (fd >= 0 && path_remapper && path_remapper->fd_embeds_root(fd, 0, st.st_size)) {
+            FB_DEBUG(FB_DEBUG_CACHING, "Not storing cache entry because " + d(filename)
+                     + " contains the relocated root directory's path");
+            close(fd);
+            return;
+          }
           if (fd >= 0) {
             off_t stored_bytes = 0;
             char *inline_data = nullptr;
@@ -902,10 +1201,10 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
         {
           auto it = inline_data_map.find(filename);
           if (it != inline_data_map.end()) {
-            add_file(&out_path_isreg, filename, new_file_info, true, fu,
+            add_file(&out_path_isreg, &relocated_paths, filename, new_file_info, true, fu,
                      it->second.first, it->second.second);
           } else {
-            add_file(&out_path_isreg, filename, new_file_info, true, fu);
+            add_file(&out_path_isreg, &relocated_paths, filename, new_file_info, true, fu);
           }
         }
         break;
@@ -917,12 +1216,12 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
           proc->disable_shortcutting_only_this("Process created a temporary dir");
           return;
         }
-        add_file(&out_path_isdir, filename, new_file_info, true, fu);
+        add_file(&out_path_isdir, &relocated_paths, filename, new_file_info, true, fu);
         out_path_isdir_filename_ptrs.insert(filename);
         break;
       case NOTEXIST:
         if (fu->initial_type() != NOTEXIST) {
-          out_path_notexist.push_back(filename->c_str());
+          out_path_notexist.push_back(stored_path(filename, &relocated_paths).c_str);
         }
         break;
       default:
@@ -964,6 +1263,13 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
             return;
           }
 
+          if (!is_empty && path_remapper
+              && (inline_data ? path_remapper->embeds_root(inline_data, inline_data_len)
+                  : blob_embeds_root(hash, compress_cache))) {
+            FB_DEBUG(FB_DEBUG_CACHING, "Not storing cache entry because the output written to fd "
+                     + d(fd) + " contains the relocated root directory's path");
+            return;
+          }
           if (!is_empty) {
             /* Note: pipes with no traffic are just simply not mentioned here in the "outputs" section.
              * They were taken into account when computing the process's fingerprint. */
@@ -1005,6 +1311,20 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
               "File shrank during appending, not writing shortcut info");
           return;
         } else if (st.st_size > inherited_file.start_offset) {
+          if (path_remapper) {
+            int file_fd = open(inherited_file.filename->c_str(), O_RDONLY);
+            const bool embeds_root = file_fd < 0 || path_remapper->fd_embeds_root(
+                file_fd, inherited_file.start_offset, st.st_size - inherited_file.start_offset);
+            if (file_fd >= 0) {
+              close(file_fd);
+            }
+            if (embeds_root) {
+              FB_DEBUG(FB_DEBUG_CACHING, "Not storing cache entry because the data appended to "
+                       + d(inherited_file.filename)
+                       + " contains the relocated root directory's path");
+              return;
+            }
+          }
           /* Note: files that weren't appended to are just simply not mentioned here in the
            * "outputs" section. They were taken into account when computing the fingerprint. */
           if (!blob_cache->store_file(inherited_file.filename, 1, -1, inherited_file.start_offset,
@@ -1105,14 +1425,14 @@ void ExecedProcessCacher::store(ExecedProcess *proc) {
 
 void ExecedProcessCacher::update_cached_bytes(off_t bytes) {
   this_runs_cached_bytes_ += bytes;
+  counters_->add(FB_COUNTER_CACHED_BYTES, bytes);
 #ifdef FB_EXTRA_DEBUG
   off_t total = obj_cache->gc_collect_total_objects_size()
-      + blob_cache->gc_collect_total_blobs_size();
+      + blob_cache->gc_collect_total_blobs_size() + CacheAccessLog::total_size(cache_dir_);
   off_t stored = get_stored_bytes_from_cache();
   FB_DEBUG(FB_DEBUG_CACHING, " Cache-size real: " + d(total)
-           + " calculated: " + d(stored + this_runs_cached_bytes_)
            + " stored: " + d(stored));
-  assert_cmp(total, ==, stored + this_runs_cached_bytes_);
+  assert_cmp(total, ==, stored);
 #endif
 }
 
@@ -1148,13 +1468,26 @@ static FileUsageUpdate file_to_file_usage_update(const FileName *filename,
 
 static const FBBSTORE_Serialized_file* find_input_file(const FBBSTORE_Serialized_process_inputs *pi,
                                                        const FileName* path) {
-  for (size_t i = 0; i < pi->get_path_count(); i++) {
-    auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(pi->get_path_at(i));
-    if (FileName::Get(file->get_path(), file->get_path_len()) == path) {
-      return file;
-    }
+  std::deque<std::string> relocated_paths;
+  const cstring_view key = stored_path(path, &relocated_paths);
+  const int idx = pi->find_path_idx(key.c_str, key.length);
+  return idx == -1 ? nullptr
+      : reinterpret_cast<const FBBSTORE_Serialized_file *>(pi->get_path_at(idx));
+}
+
+/**
+ * Check whether the input file's normalized content matches the stored alt_hash, see
+ * ContentNormalizer.
+ */
+static bool alt_hash_matches(const FileName* path, const FBBSTORE_Serialized_file *file) {
+  if (!file->has_alt_hash()) {
+    return false;
   }
-  return nullptr;
+  FileInfo query(file->get_type());
+  query.set_mode_bits(file->get_mode_with_fallback(0), file->get_mode_mask_with_fallback(0));
+  Hash alt_hash;
+  return hash_cache->file_info_matches(path, query) && hash_cache->get_alt_hash(path, &alt_hash)
+      && alt_hash == Hash(file->get_alt_hash());
 }
 
 /**
@@ -1171,15 +1504,17 @@ static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *can
       reinterpret_cast<const FBBSTORE_Serialized_process_inputs *>(inputs_fbb);
 
   size_t i;
+  const bool format_insensitive = format_insensitive_matcher->match(proc);
 
   for (i = 0; i < inputs->get_path_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(inputs->get_path_at(i));
-    const auto path = FileName::Get(file->get_path(), file->get_path_len());
+    const auto path = stored_path_to_file_name(file->get_path(), file->get_path_len());
     const FileInfo query = file_to_file_info(file);
-    if (!hash_cache->file_info_matches(path, query)) {
+    if (!hash_cache->file_info_matches(path, query)
+        && !(format_insensitive && alt_hash_matches(path, file))) {
       FB_DEBUG(FB_DEBUG_SHORTCUT, "│   " + d(subkey) + " mismatches e.g. at " + d(path));
       /* Store only the first mismatch. */
-      if (Options::generate_report() && !proc->shortcut_result()) {
+      if (Options::collect_shortcut_results() && !proc->shortcut_result()) {
         proc->set_shortcut_result(deduplicated_string(
             d(subkey) + " mismatches e.g. at " + d(path)).c_str());
       }
@@ -1188,12 +1523,12 @@ static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *can
   }
 
   for (i = 0; i < inputs->get_path_notexist_count(); i++) {
-    const auto path = FileName::Get(inputs->get_path_notexist_at(i),
-                                    inputs->get_path_notexist_len_at(i));
+    const auto path = stored_path_to_file_name(inputs->get_path_notexist_at(i),
+                                               inputs->get_path_notexist_len_at(i));
     const FileInfo query(NOTEXIST);
     if (!hash_cache->file_info_matches(path, query)) {
       /* Store only the first mismatch. */
-      if (Options::generate_report() && !proc->shortcut_result()) {
+      if (Options::collect_shortcut_results() && !proc->shortcut_result()) {
         proc->set_shortcut_result(deduplicated_string(
             d(subkey) + + " mismatches e.g. at " + d(path)
             +  ": path expected to be missing, existing object is found").c_str());
@@ -1214,18 +1549,21 @@ static bool pio_matches_fs(const FBBSTORE_Serialized_process_inputs_outputs *can
   // TODO(rbalint) extend these checks
   for (i = 0; i < outputs->get_path_isreg_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
-    if (file->get_type() == ISREG && access(file->get_path(), W_OK) == -1) {
+    if (file->get_type() != ISREG) {
+      continue;
+    }
+    const auto path = stored_path_to_file_name(file->get_path(), file->get_path_len());
+    if (access(path->c_str(), W_OK) == -1) {
       if (errno == EACCES) {
         /* The regular file can't be written, let's see if that was expected. */
-        const auto path = FileName::Get(file->get_path(), file->get_path_len());
         const FBBSTORE_Serialized_file* input_file = find_input_file(inputs, path);
         if (input_file && (file_to_file_info(file).mode_mask() & 0200)) {
           /* The file has already been checked to be not writable and will be replaced while
            * applying the shortcut. */
         } else {
-          if (Options::generate_report() && !proc->shortcut_result()) {
+          if (Options::collect_shortcut_results() && !proc->shortcut_result()) {
             proc->set_shortcut_result(deduplicated_string(
-                std::string("file to be written is not writable: ") + file->get_path()).c_str());
+                std::string("file to be written is not writable: ") + path->c_str()).c_str());
           }
           return false;
         }
@@ -1242,6 +1580,7 @@ const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::find_sho
     bool *munmap_entry,
     Subkey* subkey_out) {
   TRACK(FB_DEBUG_PROC, "proc=%s", D(proc));
+  PhaseTimer timer(FB_PHASE_FIND_SHORTCUT);
 
   const FBBSTORE_Serialized_process_inputs_outputs *inouts = nullptr;
   int shortcut_attempts {0};
@@ -1251,14 +1590,24 @@ const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::find_sho
   Hash fingerprint = fingerprints_[proc];  // FIXME error handling
 
   FB_DEBUG(FB_DEBUG_SHORTCUT, "│ Candidates:");
-  const std::vector<Subkey> subkeys = obj_cache->list_subkeys(fingerprint);
-  if (subkeys.empty()) {
-    if (Options::generate_report()) {
-      proc->set_shortcut_result(deduplicated_string("no candidate found").c_str());
+  std::vector<Subkey> subkeys = obj_cache->list_subkeys(fingerprint);
+  /* Ask the remote cache tier only when no local candidate matched, to save round trips. */
+  bool remote_listed = false;
+  for (size_t i = 0; ; i++) {
+    if (i == subkeys.size()) {
+      if (inouts || remote_listed || !remote_cache) {
+        break;
+      }
+      remote_listed = true;
+      /* Download only as many candidates as can be tried. */
+      const int remaining_tries = shortcut_tries + 1 - shortcut_attempts;
+      obj_cache->list_remote_subkeys(fingerprint, &subkeys,
+                                     static_cast<size_t>(std::max(remaining_tries, 0)));
+      if (i == subkeys.size()) {
+        break;
+      }
     }
-    FB_DEBUG(FB_DEBUG_SHORTCUT, "│   None found");
-  }
-  for (const Subkey& subkey : subkeys) {
+    const Subkey subkey = subkeys[i];
     uint8_t *candidate_inouts_buf;
     size_t candidate_inouts_buf_len;
     bool candidate_munmap_entry = false;
@@ -1270,7 +1619,7 @@ const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::find_sho
     if (!obj_cache->retrieve(fingerprint, subkey.c_str(),
                              &candidate_inouts_buf, &candidate_inouts_buf_len, nullptr,
                              &candidate_munmap_entry)) {
-      if (Options::generate_report()) {
+      if (Options::collect_shortcut_results()) {
         proc->set_shortcut_result(deduplicated_string(
             "could not retrieve " + d(subkey) + " from objcache").c_str());
       }
@@ -1318,6 +1667,12 @@ const FBBSTORE_Serialized_process_inputs_outputs * ExecedProcessCacher::find_sho
       ObjCache::free_entry(candidate_inouts_buf, candidate_inouts_buf_len, candidate_munmap_entry);
     }
   }
+  if (subkeys.empty()) {
+    if (Options::collect_shortcut_results()) {
+      proc->set_shortcut_result(deduplicated_string("no candidate found").c_str());
+    }
+    FB_DEBUG(FB_DEBUG_SHORTCUT, "│   None found");
+  }
   /* The retval is currently the same as the memory address to unmap (i.e. *inouts_buf).
    * They used to be different, and could easily become different again in the future,
    * so leave the two for now. */
@@ -1357,7 +1712,7 @@ static bool restore_dirs(
     const FBBSTORE_Serialized *dir_generic = outputs->get_path_isdir_at(indices[i]);
     assert_cmp(dir_generic->get_tag(), ==, FBBSTORE_TAG_file);
     auto dir = reinterpret_cast<const FBBSTORE_Serialized_file *>(dir_generic);
-    const auto path = FileName::Get(dir->get_path(), dir->get_path_len());
+    const auto path = stored_path_to_file_name(dir->get_path(), dir->get_path_len());
     assert(dir->has_mode());
     mode_t mode = dir->get_mode();
     FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Creating directory: " + d(path));
@@ -1426,8 +1781,8 @@ static void remove_files_and_dirs(
   std::sort(indices.begin(), indices.end(), pathname_length_greater);
   /* Process the directory names in descending order of their lengths */
   for (i = 0; i < outputs->get_path_notexist_count(); i++) {
-    const auto path = FileName::Get(outputs->get_path_notexist_at(indices[i]),
-                                    outputs->get_path_notexist_len_at(indices[i]));
+    const auto path = stored_path_to_file_name(outputs->get_path_notexist_at(indices[i]),
+                                               outputs->get_path_notexist_len_at(indices[i]));
     FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Deleting file or directory: " + d(path));
     if (unlink(path->c_str()) < 0 && errno == EISDIR) {
       rmdir(path->c_str());
@@ -1450,20 +1805,21 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
                                          const FBBSTORE_Serialized_process_inputs_outputs *inouts,
                                          std::vector<int> *fds_appended_to) {
   TRACK(FB_DEBUG_PROC, "proc=%s", D(proc));
+  PhaseTimer timer(FB_PHASE_APPLY_SHORTCUT);
 
   size_t i;
-  class BlobFds : public std::vector<int> {
+  class BlobFds : public std::vector<blob_fd_t> {
    public:
     ~BlobFds() {
-      for (int fd : *this) {
-        close(fd);
+      for (const blob_fd_t& blob : *this) {
+        close(blob.fd);
       }
     }
     bool add_from_hash(const XXH128_hash_t& fbb_hash) {
       Hash hash(fbb_hash);
-      int fd;
-      if ((fd = blob_cache->get_fd_for_file(hash)) != -1) {
-        push_back(fd);
+      blob_fd_t blob;
+      if (blob_cache->open_blob(hash, &blob)) {
+        push_back(blob);
         return true;
       } else {
         return false;
@@ -1509,13 +1865,25 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
 
     for (i = 0; i < inputs->get_path_count(); i++) {
       auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(inputs->get_path_at(i));
-      const auto path = FileName::Get(file->get_path(), file->get_path_len());
+      const auto path = stored_path_to_file_name(file->get_path(), file->get_path_len());
       FileInfo info = file_to_file_info(file);
+      if (file->has_alt_hash()) {
+        /* The input may have matched only by its normalized content, register the actual one. */
+        Hash hash;
+        ssize_t size;
+        if (hash_cache->get_hash(path, 0, &hash, nullptr, &size)) {
+          info.set_size(size);
+          info.set_hash(hash);
+        } else {
+          info.set_size(-1);
+          info.set_hash(nullptr);
+        }
+      }
       registration_point->register_file_usage_update(path, FileUsageUpdate(path, info));
     }
     for (i = 0; i < inputs->get_path_notexist_count(); i++) {
-      const auto path = FileName::Get(inputs->get_path_notexist_at(i),
-                                      inputs->get_path_notexist_len_at(i));
+      const auto path = stored_path_to_file_name(inputs->get_path_notexist_at(i),
+                                                 inputs->get_path_notexist_len_at(i));
       registration_point->register_file_usage_update(path, FileUsageUpdate(path, NOTEXIST));
     }
   }
@@ -1527,7 +1895,7 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
   size_t next_blob_fd_idx = 0;
   for (i = 0; i < outputs->get_path_isreg_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
-    const auto path = FileName::Get(file->get_path(), file->get_path_len());
+    const auto path = stored_path_to_file_name(file->get_path(), file->get_path_len());
     switch (file->get_type()) {
       case ISREG:
         {
@@ -1598,7 +1966,8 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
           /* Apply timestamp from source file if this was a touch -r operation */
           if (file->has_timestamp_source()) {
             const FileName* source_file =
-                FileName::Get(file->get_timestamp_source(), file->get_timestamp_source_len());
+                stored_path_to_file_name(file->get_timestamp_source(),
+                                         file->get_timestamp_source_len());
             struct stat64 st;
             if (stat64(source_file->c_str(), &st) == 0) {
               struct timespec times[2];
@@ -1660,24 +2029,23 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
         }
       } else {
         /* Data is in blob cache, use fd */
-        int fd = blob_fds[next_blob_fd_idx++];
-        struct stat64 st;
-        if (fstat64(fd, &st) < 0) {
-          assert(0 && "fstat");
-        }
+        const blob_fd_t& blob = blob_fds[next_blob_fd_idx++];
         if (serialized_append_to_fd->has_compressed_hash()) {
           /* Compressed data in blob cache.
-           * Mmap the blob, decompress it, then add to pipe from the buffer */
-          uint8_t* mapped =
-              static_cast<uint8_t*>(mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+           * Mmap the blob, decompress it, then add to pipe from the buffer. Packed blobs don't
+           * start at a page boundary, thus map from the page containing the blob's start. */
+          const loff_t map_offset = blob.offset & ~static_cast<loff_t>(sysconf(_SC_PAGESIZE) - 1);
+          const size_t map_size = blob.offset - map_offset + blob.size;
+          uint8_t* mapped = static_cast<uint8_t*>(mmap(NULL, map_size, PROT_READ, MAP_PRIVATE,
+                                                       blob.fd, map_offset));
           if (mapped == MAP_FAILED) {
             fb_perror("mmap compressed blob for pipe");
             assert(0);
           }
           size_t decompressed_size = 0;
           uint8_t* decompressed = decompress_zstd(
-              mapped, st.st_size, &decompressed_size);
-          munmap(mapped, st.st_size);
+              mapped + (blob.offset - map_offset), blob.size, &decompressed_size);
+          munmap(mapped, map_size);
           if (!decompressed) {
             FB_DEBUG(FB_DEBUG_SHORTCUT,
                      "│   Could not decompress pipe fragment from cache");
@@ -1688,13 +2056,14 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
           free(decompressed);
         } else {
           /* Regular data in blob cache */
-          pipe->add_data_from_fd(fd, st.st_size);
+          pipe->add_data_from_fd(blob.fd, blob.offset, blob.size);
 
           if (proc->parent()) {
             /* Bubble up the replayed pipe data. */
             std::vector<std::shared_ptr<PipeRecorder>>& recorders =
                 pipe->proc2recorders[proc->parent_exec_point()];
-            PipeRecorder::record_data_from_regular_fd(&recorders, fd, st.st_size);
+            PipeRecorder::record_data_from_regular_fd(&recorders, blob.fd, blob.offset,
+                                                      blob.size);
           }
         }
       }
@@ -1750,6 +2119,33 @@ bool ExecedProcessCacher::apply_shortcut(ExecedProcess *proc,
  *
  * Returns if it succeeded.
  */
+/**
+ * Download the blobs referenced by the entry and missing locally from the remote cache tier
+ * concurrently, instead of fetching them one by one while applying the shortcut.
+ */
+static void prefetch_blobs(const FBBSTORE_Serialized_process_inputs_outputs *inouts) {
+  std::vector<Hash> keys;
+  auto outputs =
+      reinterpret_cast<const FBBSTORE_Serialized_process_outputs *>(inouts->get_outputs());
+  for (size_t i = 0; i < outputs->get_path_isreg_count(); i++) {
+    auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(outputs->get_path_isreg_at(i));
+    if (file->get_type() == ISREG && file->get_inline_data_count() == 0
+        && (file->has_hash() || file->has_compressed_hash())) {
+      keys.push_back(Hash(file->has_compressed_hash()
+                          ? file->get_compressed_hash() : file->get_hash()));
+    }
+  }
+  for (size_t i = 0; i < outputs->get_append_to_fd_count(); i++) {
+    auto append_to_fd = reinterpret_cast<const FBBSTORE_Serialized_append_to_fd *>
+        (outputs->get_append_to_fd_at(i));
+    if (append_to_fd->get_inline_data_count() == 0) {
+      keys.push_back(Hash(append_to_fd->has_compressed_hash()
+                          ? append_to_fd->get_compressed_hash() : append_to_fd->get_hash()));
+    }
+  }
+  blob_cache->prefetch(keys);
+}
+
 bool ExecedProcessCacher::shortcut(ExecedProcess *proc, std::vector<int> *fds_appended_to) {
   TRACK(FB_DEBUG_PROC, "proc=%s", D(proc));
 
@@ -1785,16 +2181,20 @@ bool ExecedProcessCacher::shortcut(ExecedProcess *proc, std::vector<int> *fds_ap
   FB_DEBUG(FB_DEBUG_SHORTCUT, inouts ? "│ Shortcutting:" : "│ Not shortcutting.");
 
   if (inouts) {
+    if (remote_cache) {
+      prefetch_blobs(inouts);
+    }
     ret = apply_shortcut(proc, inouts, fds_appended_to);
     FB_DEBUG(FB_DEBUG_SHORTCUT, "│   Exiting with " + d(proc->fork_point()->exit_status()));
     if (ret) {
       Hash fp = fingerprints_[proc];
       obj_cache->mark_as_used(fp, subkey.c_str());
       shortcut_hits_++;
+      FB_PROBE2(shortcut_hit, proc->pid(), proc->executable()->c_str());
       if (inouts->has_cpu_time_ms()) {
         proc->add_shortcut_cpu_time_ms(inouts->get_cpu_time_ms());
       }
-    } else if (Options::generate_report()) {
+    } else if (Options::collect_shortcut_results()) {
       proc->set_shortcut_result("applying shortcut failed");
     }
     /* Trigger cleanup of ProcessInputsOutputs. */
@@ -1803,6 +2203,9 @@ bool ExecedProcessCacher::shortcut(ExecedProcess *proc, std::vector<int> *fds_ap
   }
   FB_DEBUG(FB_DEBUG_SHORTCUT, "└─");
 
+  if (!ret) {
+    FB_PROBE2(shortcut_miss, proc->pid(), proc->executable()->c_str());
+  }
   proc->set_was_shortcut(ret);
   return ret;
 }
@@ -1815,8 +2218,8 @@ static bool blob_present(const Hash& hash, tsl::hopscotch_set<AsciiHash>* refere
   hash.to_ascii(ascii_hash_buf);
   AsciiHash ascii_hash {ascii_hash_buf};
   if (referenced_blobs->find(ascii_hash) == referenced_blobs->end()) {
-    int fd = blob_cache->get_fd_for_file(hash);
-    if (fd == -1) {
+    blob_fd_t blob;
+    if (!blob_cache->open_blob(hash, &blob, true)) {
       FB_DEBUG(FB_DEBUG_CACHING,
                "Cache entry contains reference to an output blob missing from the cache: " +
                d(ascii_hash));
@@ -1824,7 +2227,7 @@ static bool blob_present(const Hash& hash, tsl::hopscotch_set<AsciiHash>* refere
       return false;
     } else {
       // TODO(rbalint) validate content's hash
-      close(fd);
+      close(blob.fd);
       referenced_blobs->insert(ascii_hash);
     }
   }
@@ -1851,7 +2254,7 @@ bool ExecedProcessCacher::is_entry_usable(uint8_t* entry_buf,
    */
   for (size_t i = 0; i < inputs->get_path_count(); i++) {
     auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(inputs->get_path_at(i));
-    const auto path {FileName::Get(file->get_path(), file->get_path_len())};
+    const auto path {stored_path_to_file_name(file->get_path(), file->get_path_len())};
     const FileInfo query {file_to_file_info(file)};
     if (query.type() == ISREG && path->is_in_read_only_location() &&
         !hash_cache->file_info_matches(path, query) &&
@@ -1960,108 +2363,173 @@ void ExecedProcessCacher::print_stats(stats_type what) {
   print_time(stdout, cache_saved_cpu_time_ms_ - self_cpu_time_ms_ +
              (proc_tree ? proc_tree->shortcut_cpu_time_ms() : 0));
   printf("\n");
-}
-
-void ExecedProcessCacher::add_stored_stats() {
-  /* Read cache statistics. */
-  FILE* f;
-  unsigned int shortcut_attempts, shortcut_hits, not_shortcutting, gc_runs;
-  const std::string stats_file = cache_dir_ + "/" + kCacheStatsFile;
-  if ((f = fopen(stats_file.c_str(), "r"))) {
-    if (fscanf(f, "attempts: %u\nhits: %u\nskips: %u\ngc_runs: %u\nsaved_cpu_ms: %" SCNd64 "\n",
-               &shortcut_attempts, &shortcut_hits, &not_shortcutting, &gc_runs,
-               &cache_saved_cpu_time_ms_) != 5) {
-      fb_error("Invalid stats file format at " + stats_file + ", using only current run's stats.");
-    } else {
-      shortcut_attempts_ += shortcut_attempts;
-      shortcut_hits_ += shortcut_hits;
-      not_shortcutting_ += not_shortcutting;
-      gc_runs_ += gc_runs;
+  /* Lookups are counted per tier only when there are multiple tiers. */
+  if (tier_hits_[FB_CACHE_TIER_LOCAL] > 0 || tier_misses_[FB_CACHE_TIER_LOCAL] > 0
+      || (what == FB_SHOW_STATS_CURRENT && remote_cache)) {
+    static const char * const tier_names[FB_CACHE_TIER_COUNT] = {"Local", "Lower", "Remote"};
+    printf("Cache entry lookups per tier:\n");
+    for (int tier = FB_CACHE_TIER_LOCAL; tier < FB_CACHE_TIER_COUNT; tier++) {
+      if (tier_hits_[tier] > 0 || tier_misses_[tier] > 0) {
+        printf("  %-7s hits: %6u, misses: %u\n", tier_names[tier], tier_hits_[tier],
+               tier_misses_[tier]);
+      }
+    }
+    if (what == FB_SHOW_STATS_CURRENT && remote_cache) {
+      printf("Downloaded:    ");
+      print_bytes(stdout, remote_cache->downloaded_bytes());
+      printf("\nUploaded:      ");
+      print_bytes(stdout, remote_cache->uploaded_bytes());
+      if (remote_cache->failed_uploads() > 0) {
+        printf(" (%u failed uploads)", remote_cache->failed_uploads());
+      }
+      printf("\n");
+    } else if (what == FB_SHOW_STATS_STORED && (remote_downloaded_bytes_ > 0
+                                                || remote_uploaded_bytes_ > 0)) {
+      printf("Downloaded:    ");
+      print_bytes(stdout, remote_downloaded_bytes_);
+      printf("\nUploaded:      ");
+      print_bytes(stdout, remote_uploaded_bytes_);
+      printf("\n");
     }
-    fclose(f);
   }
 }
 
-void ExecedProcessCacher::reset_stored_stats() {
-  const std::string stats_file = cache_dir_ + "/" + kCacheStatsFile;
-  if (unlink(stats_file.c_str()) == -1 && errno != ENOENT) {
-    fb_perror("removing stats file failed");
-    exit(EXIT_FAILURE);
-  }
+void ExecedProcessCacher::add_ack_waits(const FileName* exe, int64_t ns, int64_t waits) {
+  ack_waits_.ns += ns;
+  ack_waits_.waits += waits;
+  ack_waits_t& exe_waits = ack_waits_by_exe_[exe];
+  exe_waits.ns += ns;
+  exe_waits.waits += waits;
 }
 
-void ExecedProcessCacher::update_stored_stats() {
-  if (no_store_) {
-    /* In read-only mode, don't update cache metadata */
+void ExecedProcessCacher::write_stats_json(const char* path, stats_type what) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    fb_perror(path);
     return;
   }
-  // FIXME(rbalint) There is a slight chance for two parallel builds updating the stats at the
-  // same time making them inaccurate.
-  add_stored_stats();
-  const std::string stats_file = cache_dir_ + "/" + kCacheStatsFile;
-  if (file_overwrite_printf(
-          stats_file, "attempts: %u\nhits: %u\nskips: %u\ngc_runs: %u\nsaved_cpu_ms: %" PRId64 "\n",
-          shortcut_attempts_, shortcut_hits_, not_shortcutting_, gc_runs_,
-          cache_saved_cpu_time_ms_ - self_cpu_time_ms_ +
-          (proc_tree ? proc_tree->shortcut_cpu_time_ms() : 0)) < 0) {
-    fb_error("writing cache stats file failed");
-    exit(EXIT_FAILURE);
+  fprintf(f, "{\n  \"stats\": \"%s\",\n", what == FB_SHOW_STATS_CURRENT ? "current" : "stored");
+  fprintf(f, "  \"hits\": %u,\n  \"attempts\": %u,\n  \"uncacheable\": %u,\n"
+          "  \"gc_runs\": %u,\n", shortcut_hits_, shortcut_attempts_, not_shortcutting_, gc_runs_);
+  if (what == FB_SHOW_STATS_CURRENT) {
+    fprintf(f, "  \"newly_cached_bytes\": %" PRIoff ",\n", this_runs_cached_bytes_);
+  } else {
+    fprintf(f, "  \"cache_bytes\": %" PRIoff ",\n", get_stored_bytes_from_cache());
+  }
+  fprintf(f, "  \"saved_cpu_ms\": %" PRId64 ",\n", cache_saved_cpu_time_ms_ - self_cpu_time_ms_
+          + (proc_tree ? proc_tree->shortcut_cpu_time_ms() : 0));
+  fprintf(f, "  \"phases\": ");
+  PhaseTimers::write_json(f);
+  fprintf(f, ",\n  \"ack_waits\": {\"count\": %" PRId64 ", \"total_ms\": %.3f",
+          ack_waits_.waits, static_cast<double>(ack_waits_.ns) / 1000000);
+  if (what == FB_SHOW_STATS_CURRENT) {
+    /* The executables waiting the most first */
+    std::vector<std::pair<const FileName*, ack_waits_t>> by_exe(ack_waits_by_exe_.begin(),
+                                                                ack_waits_by_exe_.end());
+    std::sort(by_exe.begin(), by_exe.end(), [](const auto& a, const auto& b) {
+      return a.second.ns > b.second.ns;
+    });
+    fprintf(f, ",\n    \"by_executable\": [");
+    for (size_t i = 0; i < by_exe.size(); i++) {
+      fprintf(f, "%s\n      {\"executable\": \"%s\", \"count\": %" PRId64
+              ", \"total_ms\": %.3f}", i == 0 ? "" : ",",
+              escapeJsonString(by_exe[i].first->to_string()).c_str(), by_exe[i].second.waits,
+              static_cast<double>(by_exe[i].second.ns) / 1000000);
+    }
+    fprintf(f, "],\n    \"by_message\": {");
+    std::vector<std::pair<int, int64_t>> by_tag(ack_waits_by_tag_.begin(),
+                                                ack_waits_by_tag_.end());
+    std::sort(by_tag.begin(), by_tag.end());
+    for (size_t i = 0; i < by_tag.size(); i++) {
+      fprintf(f, "%s\"%s\": %" PRId64, i == 0 ? "" : ", ", fbbcomm_tag_to_string(by_tag[i].first),
+              by_tag[i].second);
+    }
+    fprintf(f, "}\n  ");
+  }
+  fprintf(f, "}\n}\n");
+  if (fclose(f) != 0) {
+    fb_perror(path);
   }
 }
 
-off_t ExecedProcessCacher::get_stored_bytes_from_cache() const {
-  FILE* f;
-  const std::string size_file = cache_dir_ + "/" + kCacheSizeFile;
-  off_t cached_bytes = 0;
-  if ((f = fopen(size_file.c_str(), "r"))) {
-    if (fscanf(f, "%" SCNoff "\n", &cached_bytes) != 1) {
-      fb_error("Invalid size file format in " + size_file + ", fixing it.");
-      fclose(f);
-      return fix_stored_bytes();
-    }
-    fclose(f);
-  }
-  if (cached_bytes < 0) {
-    fb_error("Invalid size in " + size_file + ", fixing it.");
-    cached_bytes = fix_stored_bytes();
+void ExecedProcessCacher::add_stored_stats() {
+  shortcut_attempts_ += counters_->get(FB_COUNTER_SHORTCUT_ATTEMPTS);
+  shortcut_hits_ += counters_->get(FB_COUNTER_SHORTCUT_HITS);
+  not_shortcutting_ += counters_->get(FB_COUNTER_NOT_SHORTCUTTING);
+  gc_runs_ += counters_->get(FB_COUNTER_GC_RUNS);
+  cache_saved_cpu_time_ms_ = counters_->get(FB_COUNTER_SAVED_CPU_MS);
+  for (int tier = FB_CACHE_TIER_LOCAL; tier < FB_CACHE_TIER_COUNT; tier++) {
+    tier_hits_[tier] += counters_->get(static_cast<cache_counter>(FB_COUNTER_TIER_HITS + tier));
+    tier_misses_[tier] +=
+        counters_->get(static_cast<cache_counter>(FB_COUNTER_TIER_MISSES + tier));
+  }
+  remote_downloaded_bytes_ += counters_->get(FB_COUNTER_REMOTE_DOWNLOADED_BYTES);
+  remote_uploaded_bytes_ += counters_->get(FB_COUNTER_REMOTE_UPLOADED_BYTES);
+  ack_waits_.ns += counters_->get(FB_COUNTER_ACK_WAIT_NS);
+  ack_waits_.waits += counters_->get(FB_COUNTER_ACK_WAITS);
+  for (int phase = 0; phase < FB_PHASE_COUNT; phase++) {
+    PhaseTimers::add_totals(
+        static_cast<timed_phase>(phase),
+        counters_->get(static_cast<cache_counter>(FB_COUNTER_PHASE_NS + phase)),
+        counters_->get(static_cast<cache_counter>(FB_COUNTER_PHASE_CALLS + phase)));
   }
-  return cached_bytes;
 }
 
-void ExecedProcessCacher::read_stored_cached_bytes() {
-  stored_cached_bytes_ = get_stored_bytes_from_cache();
+void ExecedProcessCacher::reset_stored_stats() {
+  for (int counter = FB_COUNTER_SHORTCUT_ATTEMPTS; counter < FB_COUNTER_COUNT; counter++) {
+    counters_->set(static_cast<cache_counter>(counter), 0);
+  }
 }
 
-void ExecedProcessCacher::update_stored_bytes() {
+void ExecedProcessCacher::update_stored_stats() {
   if (no_store_) {
     /* In read-only mode, don't update cache metadata */
     return;
   }
-  // FIXME(rbalint) There is a slight chance for two parallel builds updating the size at the
-  // same time making the file content inaccurate.
-  const std::string size_file = cache_dir_ + "/" + kCacheSizeFile;
-  const off_t new_size = this_runs_cached_bytes_ + stored_cached_bytes_;
-  if (file_overwrite_printf(size_file, "%ld\n", new_size) < 0) {
-    fb_error("writing cache size file failed");
-    exit(EXIT_FAILURE);
+  /* Add the current run's values, and keep the totals for printing them. */
+  shortcut_attempts_ += counters_->add(FB_COUNTER_SHORTCUT_ATTEMPTS, shortcut_attempts_);
+  shortcut_hits_ += counters_->add(FB_COUNTER_SHORTCUT_HITS, shortcut_hits_);
+  not_shortcutting_ += counters_->add(FB_COUNTER_NOT_SHORTCUTTING, not_shortcutting_);
+  gc_runs_ += counters_->add(FB_COUNTER_GC_RUNS, gc_runs_);
+  cache_saved_cpu_time_ms_ = counters_->add(
+      FB_COUNTER_SAVED_CPU_MS, cache_saved_cpu_time_ms_ - self_cpu_time_ms_ +
+      (proc_tree ? proc_tree->shortcut_cpu_time_ms() : 0));
+  for (int tier = FB_CACHE_TIER_LOCAL; tier < FB_CACHE_TIER_COUNT; tier++) {
+    tier_hits_[tier] += counters_->add(static_cast<cache_counter>(FB_COUNTER_TIER_HITS + tier),
+                                       tier_hits_[tier]);
+    tier_misses_[tier] += counters_->add(
+        static_cast<cache_counter>(FB_COUNTER_TIER_MISSES + tier), tier_misses_[tier]);
+  }
+  if (remote_cache) {
+    remote_downloaded_bytes_ += remote_cache->downloaded_bytes();
+    remote_uploaded_bytes_ += remote_cache->uploaded_bytes();
+  }
+  remote_downloaded_bytes_ +=
+      counters_->add(FB_COUNTER_REMOTE_DOWNLOADED_BYTES, remote_downloaded_bytes_);
+  remote_uploaded_bytes_ +=
+      counters_->add(FB_COUNTER_REMOTE_UPLOADED_BYTES, remote_uploaded_bytes_);
+  ack_waits_.ns += counters_->add(FB_COUNTER_ACK_WAIT_NS, ack_waits_.ns);
+  ack_waits_.waits += counters_->add(FB_COUNTER_ACK_WAITS, ack_waits_.waits);
+  for (int phase = 0; phase < FB_PHASE_COUNT; phase++) {
+    const timed_phase timed = static_cast<timed_phase>(phase);
+    PhaseTimers::add_totals(
+        timed,
+        counters_->add(static_cast<cache_counter>(FB_COUNTER_PHASE_NS + phase),
+                       PhaseTimers::total_ns(timed)),
+        counters_->add(static_cast<cache_counter>(FB_COUNTER_PHASE_CALLS + phase),
+                       PhaseTimers::count(timed)));
   }
 }
 
-off_t ExecedProcessCacher::fix_stored_bytes() const {
-  // FIXME(rbalint) There is a slight chance for two parallel builds updating the size at the
-  // same time making the file content inaccurate.
-  const std::string size_file = cache_dir_ + "/" + kCacheSizeFile;
-  off_t starting_cached_bytes =  obj_cache->gc_collect_total_objects_size()
-      + blob_cache->gc_collect_total_blobs_size() - this_runs_cached_bytes_;
-  if (file_overwrite_printf(size_file, "%ld\n", starting_cached_bytes) < 0) {
-    fb_error("writing cache size file failed");
-    exit(EXIT_FAILURE);
-  }
-  return starting_cached_bytes;
+off_t ExecedProcessCacher::fix_stored_bytes() {
+  const off_t cached_bytes = obj_cache->gc_collect_total_objects_size()
+      + blob_cache->gc_collect_total_blobs_size();
+  counters_->set(FB_COUNTER_CACHED_BYTES, cached_bytes);
+  return cached_bytes;
 }
 
 bool ExecedProcessCacher::is_gc_needed() const {
-  return (get_stored_bytes_from_cache() + this_runs_cached_bytes_) > max_cache_size;
+  return get_stored_bytes_from_cache() > max_cache_size;
 }
 
 void ExecedProcessCacher::gc() {
@@ -2069,31 +2537,37 @@ void ExecedProcessCacher::gc() {
     fb_info("Garbage collection is disabled in read-only and no-fetch mode, skipping.");
     return;
   }
+  PhaseTimer timer(FB_PHASE_GC);
   gc_runs_++;
   /* Remove unusable entries first. */
   tsl::hopscotch_set<AsciiHash> referenced_blobs {};
   off_t cache_bytes = 0, debug_bytes = 0, unexpected_file_bytes = 0;
   obj_cache->gc(&referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
+  FB_PROBE2(gc_obj_cache_done, 0, cache_bytes);
   blob_cache->gc(referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
+  FB_PROBE2(gc_blob_cache_done, 0, cache_bytes);
+  CacheAccessLog::gc(cache_dir_, &cache_bytes);
   if (unexpected_file_bytes > 0) {
     fb_error("There are " + d(unexpected_file_bytes) + " bytes in the cache stored in files "
              "with unexpected name.");
   }
-  stored_cached_bytes_ = cache_bytes + debug_bytes - this_runs_cached_bytes_;
-  if (FB_DEBUGGING(FB_DEBUG_CACHING)) {
-    if (cache_bytes + debug_bytes != this_runs_cached_bytes_ + get_stored_bytes_from_cache()) {
-      FB_DEBUG(FB_DEBUG_CACHING, "A parallel firebuild process modified the cache or the stored "
-               "cache size was wrong. Adjusting the stored cache size.");
-    }
+  const off_t counted_bytes = get_stored_bytes_from_cache();
+  if (cache_bytes + debug_bytes != counted_bytes) {
+    FB_DEBUG(FB_DEBUG_CACHING, "A parallel firebuild process modified the cache or the stored "
+             "cache size was wrong. Adjusting the stored cache size.");
+    /* Adjust by the difference to keep the parallel processes' updates made since collecting. */
+    counters_->add(FB_COUNTER_CACHED_BYTES, cache_bytes + debug_bytes - counted_bytes);
   }
+  /* Bytes in the cache excluding the current run's changes */
+  const off_t stored_cached_bytes = cache_bytes + debug_bytes - this_runs_cached_bytes_;
 
   /* Check if the cache size is within limits. */
-  if (stored_cached_bytes_ + this_runs_cached_bytes_ > max_cache_size) {
+  if (stored_cached_bytes + this_runs_cached_bytes_ > max_cache_size) {
     FB_DEBUG(FB_DEBUG_CACHING,
-             "Cache size (" + d(stored_cached_bytes_ + this_runs_cached_bytes_) + ") " +
+             "Cache size (" + d(stored_cached_bytes + this_runs_cached_bytes_) + ") " +
              "is above " + d(max_cache_size) + " bytes limit, removing older entries");
     /** Target for this_runs_cached_bytes_ to end up with a cache 20% below its size limit. */
-    const off_t target_this_runs_cached_bytes = (max_cache_size * 0.8) - stored_cached_bytes_;
+    const off_t target_this_runs_cached_bytes = (max_cache_size * 0.8) - stored_cached_bytes;
     std::vector<obj_timestamp_size_t> obj_ts_sizes =
         obj_cache->gc_collect_sorted_obj_timestamp_sizes();
     int round = 0;
@@ -2101,7 +2575,7 @@ void ExecedProcessCacher::gc() {
       /* Set kept_ratio to to keep ~80% of the objs to keep ~80% of targeted cache size
        * and target lower kept ratio in each round if the target 80% is not reached. */
       const double kept_ratio = (max_cache_size * (0.8 - round * 0.05))
-          / (stored_cached_bytes_ + this_runs_cached_bytes_);
+          / (stored_cached_bytes + this_runs_cached_bytes_);
       if (kept_ratio <= 0.0) {
         break;
       }
@@ -2125,11 +2599,17 @@ void ExecedProcessCacher::gc() {
       /* Not adjusting the stored cache size this time. */
       cache_bytes = debug_bytes = unexpected_file_bytes = 0;
       obj_cache->gc(&referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
+      FB_PROBE2(gc_obj_cache_done, round + 1, cache_bytes);
       blob_cache->gc(referenced_blobs, &cache_bytes, &debug_bytes, &unexpected_file_bytes);
+      FB_PROBE2(gc_blob_cache_done, round + 1, cache_bytes);
+      CacheAccessLog::gc(cache_dir_, &cache_bytes);
 
       round++;
     }
   }
+  if (cache_daemon) {
+    cache_daemon->forget_subkeys();
+  }
 }
 
 }  /* namespace firebuild */
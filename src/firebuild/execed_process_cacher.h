@@ -27,6 +27,7 @@
 #include <libconfig.h++>
 
 #include "firebuild/blob_cache.h"
+#include "firebuild/cache_counters.h"
 #include "firebuild/obj_cache.h"
 #include "firebuild/execed_process.h"
 #include "firebuild/file_name.h"
@@ -41,6 +42,12 @@ enum stats_type {
   FB_SHOW_STATS_STORED,
 };
 
+/** Time the intercepted processes spent waiting for the supervisor's ACKs */
+typedef struct {
+  int64_t ns;
+  int64_t waits;
+} ack_waits_t;
+
 class ExecedProcessCacher {
  public:
   /**
@@ -50,6 +57,8 @@ class ExecedProcessCacher {
    */
   static void init(const libconfig::Config* cfg);
   static unsigned int cache_format() {return cache_format_;}
+  /** The format of the entries stored by this version. */
+  static unsigned int current_cache_format();
   /**
    * Compute the fingerprint, store it keyed by the process in fingerprints_.
    * Also store fingerprint_msgs_ if debugging is enabled.
@@ -86,24 +95,38 @@ class ExecedProcessCacher {
     self_cpu_time_ms_ = time_ms;
   }
   void print_stats(stats_type what);
+  /**
+   * Write the statistics printed by print_stats(), the time spent in the phases and the ACK waits
+   * to path as JSON, with the histograms of the phases and the ACK waits by executable and by
+   * message for the current run.
+   */
+  void write_stats_json(const char* path, stats_type what);
   void update_stored_stats();
-  /** Get bytes stored in the cache reading cachedir/size file. */
-  off_t get_stored_bytes_from_cache() const;
-  void read_stored_cached_bytes();
-  /** Store number of bytes cached to cachedir/size file. */
-  void update_stored_bytes();
-  /** Read, update with current run, then save cached bytes and stats. */
-  void read_update_save_stats_and_bytes() {
-    read_stored_cached_bytes();
-    update_stored_bytes();
-    update_stored_stats();
+  /** Path of the socket the cache daemon listens on. */
+  std::string daemon_socket_path() const;
+  const std::string& cache_dir() const {return cache_dir_;}
+  /** Get bytes stored in the cache, including the ones stored in the current run. */
+  off_t get_stored_bytes_from_cache() const {
+    return counters_->get(FB_COUNTER_CACHED_BYTES);
   }
   /**
-   * Fix number of bytes cached in cachedir/size file and return fixed value.
+   * Fix number of bytes cached by counting the cache's files and return fixed value.
    */
-  off_t fix_stored_bytes() const;
+  off_t fix_stored_bytes();
   /** Register cache size change occurred in the current run. */
   void update_cached_bytes(off_t bytes);
+  /** Register the ACK waits reported by an intercepted process running exe. */
+  void add_ack_waits(const FileName* exe, int64_t ns, int64_t waits);
+  /** Register the ACK waits for messages with the FBBCOMM tag. */
+  void add_ack_waits_for_tag(int tag, int64_t waits) {ack_waits_by_tag_[tag] += waits;}
+  /** Register looking up a cache entry in a tier. */
+  void count_tier_lookup(cache_tier tier, bool hit) {
+    if (hit) {
+      tier_hits_[tier]++;
+    } else {
+      tier_misses_[tier]++;
+    }
+  }
   /* A garbage collection run is needed, e.g. because the cache is too big. */
   bool is_gc_needed() const;
   void gc();
@@ -124,6 +147,8 @@ class ExecedProcessCacher {
    * Helper for fingerprint() to decide which env vars matter
    */
   bool env_fingerprintable(const std::string& name_and_value) const;
+  /** Initialize the new counters file from the files used by earlier versions. */
+  void import_legacy_counters();
 
   bool no_store_;
   bool no_fetch_;
@@ -141,9 +166,20 @@ class ExecedProcessCacher {
    * multiple times in ExecedProcessCacher::gc().
    */
   off_t this_runs_cached_bytes_ {0};
-  /** Number of bytes in the cache as stored in the cachedir/size file. */
-  off_t stored_cached_bytes_ {0};
+  /** Counters shared with the parallel firebuild processes. */
+  CacheCounters* counters_ {nullptr};
   unsigned int gc_runs_ {0};
+  /** Cache entry lookups served, or not served by each tier in the current run. */
+  unsigned int tier_hits_[FB_CACHE_TIER_COUNT] {};
+  unsigned int tier_misses_[FB_CACHE_TIER_COUNT] {};
+  /** Bytes transferred from and to the remote cache, only used for the stored stats. */
+  off_t remote_downloaded_bytes_ {0};
+  off_t remote_uploaded_bytes_ {0};
+  /** ACK waits of the intercepted processes, in total and in the current run by executable and
+   *  by the FBBCOMM tag of the messages. */
+  ack_waits_t ack_waits_ {};
+  tsl::hopscotch_map<const FileName*, ack_waits_t> ack_waits_by_exe_ {};
+  tsl::hopscotch_map<int, int64_t> ack_waits_by_tag_ {};
 
   /** The hashed fingerprint of configured ignore locations. */
   Hash ignore_locations_hash_;
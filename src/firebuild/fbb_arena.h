@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Growable buffer for serializing FBB messages in a single pass.
+ */
+
+#ifndef FIREBUILD_FBB_ARENA_H_
+#define FIREBUILD_FBB_ARENA_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "firebuild/cxx_lang_utils.h"
+
+namespace firebuild {
+
+/**
+ * Buffer to serialize FBB messages to, reused for all the messages.
+ *
+ * Messages are serialized in a single pass into the current capacity of the buffer, and are
+ * measured only when they don't fit, to grow the buffer accordingly. This way after the first few
+ * messages the builders are walked only once, instead of measuring then serializing them.
+ */
+class FbbArena {
+ public:
+  FbbArena()
+      : buffer_(reinterpret_cast<char *>(malloc(size_))) {}
+  ~FbbArena() {free(buffer_);}
+  /** The buffer, beginning with the header_size bytes left for the caller's header. */
+  char * data() const {return buffer_;}
+
+  /**
+   * Serialize the message into the buffer after header_size bytes.
+   *
+   * @param msg FBBCOMM_Builder, FBBSTORE_Builder etc. message to serialize
+   * @param header_size bytes to leave at the beginning of the buffer, a multiple of 8
+   * @return length of the serialized message, not including the header
+   */
+  template <typename Builder>
+  size_t serialize(const Builder *msg, size_t header_size) {
+    size_t len = msg->serialize_bounded(buffer_ + header_size,
+                                        static_cast<uint32_t>(size_ - header_size));
+    if (len == 0) {
+      len = msg->measure();
+      /* Nothing to preserve, don't let realloc() copy the old content. */
+      size_ = std::max(header_size + len, size_ * 2);
+      free(buffer_);
+      buffer_ = reinterpret_cast<char *>(malloc(size_));
+      msg->serialize(buffer_ + header_size);
+    }
+    return len;
+  }
+
+ private:
+  size_t size_ = 64 * 1024;
+  char * buffer_;
+  DISALLOW_COPY_AND_ASSIGN(FbbArena);
+};
+
+}  /* namespace firebuild */
+
+#endif  // FIREBUILD_FBB_ARENA_H_
@@ -43,6 +43,9 @@
 #include "common/config.h"
 #include "firebuild/debug.h"
 #include "firebuild/sigchild_callback.h"
+#include "firebuild/cache_access_log.h"
+#include "firebuild/cache_bundle.h"
+#include "firebuild/cache_daemon.h"
 #include "firebuild/command_rewriter.h"
 #include "firebuild/config.h"
 #include "firebuild/connection_context.h"
@@ -51,10 +54,13 @@
 #include "firebuild/hash_cache.h"
 #include "firebuild/options.h"
 #include "firebuild/message_processor.h"
+#include "firebuild/message_trace.h"
 #include "firebuild/execed_process_cacher.h"
 #include "firebuild/process.h"
 #include "firebuild/process_tree.h"
+#include "firebuild/remote_cache.h"
 #include "firebuild/report.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 
 int sigchild_selfpipe[2];
@@ -163,7 +169,7 @@ static void accept_ic_conn(const struct epoll_event* event, void *arg) {
 
 static void sigterm_handler(int signum) {
   if (!stats_saved) {
-    firebuild::execed_process_cacher->read_update_save_stats_and_bytes();
+    firebuild::execed_process_cacher->update_stored_stats();
     stats_saved = true;
   }
   std::cerr << "FIREBUILD: Received signal " + std::to_string(signum) + ", exiting." << std::endl;
@@ -200,20 +206,38 @@ int main(const int argc, char *argv[]) {
   if (firebuild::Options::reset_stats()) {
     firebuild::execed_process_cacher->reset_stored_stats();
   }
-  if (!firebuild::Options::build_cmd()) {
+  if (firebuild::Options::cache_daemon()) {
+    exit(firebuild::CacheDaemon::serve(firebuild::execed_process_cacher->daemon_socket_path()));
+  }
+  if (!firebuild::Options::build_cmd() && !firebuild::Options::replay_trace_file()) {
+    int ret = EXIT_SUCCESS;
+    if (firebuild::Options::import_cache_file()
+        && !firebuild::CacheBundle::import_cache(firebuild::Options::import_cache_file())) {
+      ret = EXIT_FAILURE;
+    }
+    if (firebuild::Options::export_cache_file()
+        && !firebuild::CacheBundle::export_cache(firebuild::Options::export_cache_file(),
+                                                 firebuild::Options::export_runs())) {
+      ret = EXIT_FAILURE;
+    }
     if (firebuild::Options::do_gc()) {
       firebuild::execed_process_cacher->gc();
-      firebuild::execed_process_cacher->update_stored_bytes();
       /* Store GC runs, too. */
       firebuild::execed_process_cacher->update_stored_stats();
     }
-    if (firebuild::Options::print_stats()) {
+    if (firebuild::Options::print_stats() || firebuild::Options::stats_json_file()) {
       if (!firebuild::Options::do_gc()) {
         firebuild::execed_process_cacher->add_stored_stats();
       }
-      firebuild::execed_process_cacher->print_stats(firebuild::FB_SHOW_STATS_STORED);
+      if (firebuild::Options::print_stats()) {
+        firebuild::execed_process_cacher->print_stats(firebuild::FB_SHOW_STATS_STORED);
+      }
+      if (firebuild::Options::stats_json_file()) {
+        firebuild::execed_process_cacher->write_stats_json(
+            firebuild::Options::stats_json_file(), firebuild::FB_SHOW_STATS_STORED);
+      }
     }
-    exit(0);
+    exit(ret);
   }
 
 #ifndef __APPLE__
@@ -237,16 +261,24 @@ int main(const int argc, char *argv[]) {
   auto env_exec = firebuild::get_sanitized_env(firebuild::cfg, fb_conn_string,
                                                firebuild::Options::insert_trace_markers());
 
-  /* Set up sigchild handler */
-  if (fb_pipe2(sigchild_selfpipe, O_CLOEXEC | O_NONBLOCK) != 0) {
-    firebuild::fb_perror("pipe");
-    exit(EXIT_FAILURE);
+  if (firebuild::Options::replay_trace_file()
+      || (firebuild::pidfd_child_tracking && !firebuild::pidfd_child_tracking_supported())) {
+    /* The recorded pids don't belong to the supervisor's children, or the kernel is too old. */
+    firebuild::pidfd_child_tracking = false;
   }
+
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = sigchild_handler;
-  sa.sa_flags = SA_RESTART;
-  sigaction(SIGCHLD, &sa, NULL);
+  if (!firebuild::pidfd_child_tracking) {
+    /* Set up sigchild handler */
+    if (fb_pipe2(sigchild_selfpipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+      firebuild::fb_perror("pipe");
+      exit(EXIT_FAILURE);
+    }
+    sa.sa_handler = sigchild_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+  }
   sa.sa_handler = sigterm_handler;
   sa.sa_flags = 0;
   sigaction(SIGINT, &sa, NULL);
@@ -261,9 +293,18 @@ int main(const int argc, char *argv[]) {
   /* Configure epoll */
   firebuild::epoll = new firebuild::Epoll();
 
-  /* Open listener socket before forking child to always let the child connect */
-  listener = create_listener();
-  firebuild::epoll->add_fd(listener, EPOLLIN, accept_ic_conn, NULL);
+  if (!firebuild::Options::replay_trace_file()) {
+    /* Open listener socket before forking child to always let the child connect */
+    listener = create_listener();
+    firebuild::epoll->add_fd(listener, EPOLLIN, accept_ic_conn, NULL);
+  }
+
+  if (firebuild::Options::record_trace_file()) {
+    firebuild::message_trace = new firebuild::MessageTrace(firebuild::Options::record_trace_file());
+  }
+  if (firebuild::Options::trace_events_file()) {
+    firebuild::trace_events = new firebuild::TraceEvents(firebuild::Options::trace_events_file());
+  }
 
 #ifdef __linux__
   /* Collect orphan children */
@@ -273,7 +314,23 @@ int main(const int argc, char *argv[]) {
   firebuild::check_system_setup();
 
   /* run command and handle interceptor messages */
-  if ((child_pid = fork()) == 0) {
+  if (firebuild::Options::replay_trace_file()) {
+    /* supervisor process, processing the recorded messages instead of running the command */
+    firebuild::proc_tree = new firebuild::ProcessTree();
+
+    bump_limits();
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!firebuild::MessageTrace::replay(firebuild::Options::replay_trace_file())) {
+      child_ret = EXIT_FAILURE;
+    }
+
+    /* Finish all top pipes */
+    firebuild::proc_tree->FinishInheritedFdPipes();
+    /* Close the self-pipe */
+    close(sigchild_selfpipe[0]);
+    close(sigchild_selfpipe[1]);
+  } else if ((child_pid = fork()) == 0) {
     /* intercepted process */
 
     /* we don't need that */
@@ -347,23 +404,39 @@ int main(const int argc, char *argv[]) {
     firebuild::proc_tree = new firebuild::ProcessTree();
 
     /* Add a ForkedProcess for the supervisor's forked child we never directly saw. */
-    firebuild::proc_tree->insert_root(child_pid, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    firebuild::proc_tree->insert_root(child_pid, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+                                      getpid());
+
+    if (firebuild::message_trace) {
+      firebuild::message_trace->start(child_pid);
+    }
+    if (firebuild::cache_access_log) {
+      firebuild::cache_access_log->prefetch();
+    }
 
     bump_limits();
     /* no SIGPIPE if a supervised process we're writing to unexpectedly dies */
     signal(SIGPIPE, SIG_IGN);
 
-    firebuild::epoll->add_fd(sigchild_selfpipe[0], EPOLLIN, firebuild::sigchild_cb, NULL);
+    size_t fds_to_keep;
+    if (firebuild::pidfd_child_tracking) {
+      /* The children's exits are reported by the pidfds instead of SIGCHLD. */
+      firebuild::track_child_exit(child_pid);
+      fds_to_keep = 0;
+    } else {
+      firebuild::epoll->add_fd(sigchild_selfpipe[0], EPOLLIN, firebuild::sigchild_cb, NULL);
+      fds_to_keep = 1;
+    }
 
     /* Main loop for processing interceptor messages */
-    /* Runs until the only remaining epoll-monitored fd is the sigchild_selfpipe fd. */
-    while (firebuild::epoll->fds() > 1) {
+    /* Runs until the only remaining epoll-monitored fd is the sigchild_selfpipe fd, if any. */
+    while (firebuild::epoll->fds() > fds_to_keep) {
       /* This is where the process spends its idle time: waiting for an event over a fd, or a
        * sigchild.
        *
        * If our immediate child exited (rather than some orphan descendant thereof, see
-       * prctl(PR_SET_CHILD_SUBREAPER) above) then the handler sigchild_cb() will set listener to
-       * -1, that's how we'll break out of this loop. */
+       * prctl(PR_SET_CHILD_SUBREAPER) above) then the handler sigchild_cb(), or the pidfd's
+       * callback, will set listener to -1, that's how we'll break out of this loop. */
       firebuild::epoll->wait();
 
       /* Process the reported events, if any. */
@@ -372,11 +445,17 @@ int main(const int argc, char *argv[]) {
       firebuild::proc_tree->GcProcesses();
     }
 
+    if (firebuild::message_trace) {
+      delete firebuild::message_trace;
+      firebuild::message_trace = nullptr;
+    }
     /* Finish all top pipes */
     firebuild::proc_tree->FinishInheritedFdPipes();
-    /* Close the self-pipe */
-    close(sigchild_selfpipe[0]);
-    close(sigchild_selfpipe[1]);
+    if (!firebuild::pidfd_child_tracking) {
+      /* Close the self-pipe */
+      close(sigchild_selfpipe[0]);
+      close(sigchild_selfpipe[1]);
+    }
   }
 
   if (firebuild::debug_filter) {
@@ -437,6 +516,14 @@ int main(const int argc, char *argv[]) {
               static_cast<double>(ru_myslf.ru_maxrss) / 1024);
     }
 
+    if (firebuild::cache_access_log) {
+      /* Save the log before the garbage collection could touch the cache files. */
+      firebuild::cache_access_log->finish();
+    }
+    if (firebuild::remote_cache) {
+      /* Let the uploads finish before the garbage collection could remove the files. */
+      firebuild::remote_cache->finish_uploads();
+    }
     if (firebuild::execed_process_cacher->is_gc_needed()) {
       firebuild::execed_process_cacher->gc();
     }
@@ -445,8 +532,12 @@ int main(const int argc, char *argv[]) {
       fprintf(stdout, "\n");
       firebuild::execed_process_cacher->print_stats(firebuild::FB_SHOW_STATS_CURRENT);
     }
+    if (firebuild::Options::stats_json_file()) {
+      firebuild::execed_process_cacher->write_stats_json(firebuild::Options::stats_json_file(),
+                                                         firebuild::FB_SHOW_STATS_CURRENT);
+    }
     if (!stats_saved) {
-      firebuild::execed_process_cacher->read_update_save_stats_and_bytes();
+      firebuild::execed_process_cacher->update_stored_stats();
       stats_saved = true;
     }
     /* show process tree if needed */
@@ -457,6 +548,12 @@ int main(const int argc, char *argv[]) {
     }
   }
 
+  if (firebuild::trace_events) {
+    /* All processes are finalized and the cache's garbage collection is also done. */
+    delete firebuild::trace_events;
+    firebuild::trace_events = nullptr;
+  }
+
   unlink(fb_conn_string);
   rmdir(fb_tmp_dir);
 
@@ -24,6 +24,7 @@
 #include "firebuild/execed_process.h"
 #include "firebuild/forked_process.h"
 #include "firebuild/debug.h"
+#include "firebuild/sigchild_callback.h"
 
 namespace firebuild {
 
@@ -48,6 +49,14 @@ void ForkedProcess::set_been_waited_for() {
   last_exec_descendant()->maybe_finalize();
 }
 
+void ForkedProcess::set_orphan() {
+  if (!orphan_) {
+    orphan_ = true;
+    /* The orphan is reparented to the supervisor, watch its exit. */
+    track_child_exit(pid());
+  }
+}
+
 void ForkedProcess::set_has_orphan_descendant_bubble_up() {
   TRACKX(FB_DEBUG_PROC, 1, 1, Process, this, "");
 #ifdef FB_EXTRA_DEBUG
@@ -81,7 +81,7 @@ class ForkedProcess : public Process {
   bool been_waited_for() const {return been_waited_for_;}
   void set_been_waited_for();
   bool orphan() const {return orphan_;}
-  void set_orphan() {orphan_ = true;}
+  void set_orphan();
 
   /* Member debugging method. Not to be called directly, call the global d(obj_or_ptr) instead.
    * level is the nesting level of objects calling each other's d(), bigger means less info to print.
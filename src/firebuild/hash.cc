@@ -34,6 +34,7 @@
 #include "firebuild/base64.h"
 #include "firebuild/debug.h"
 #include "firebuild/file_name.h"
+#include "firebuild/phase_timers.h"
 #include "firebuild/utils.h"
 
 namespace firebuild  {
@@ -118,6 +119,7 @@ bool Hash::set_from_fd_pread(int fd, off_t* const size) {
 
 bool Hash::set_from_fd(int fd, const struct stat64 *stat_ptr, bool *is_dir_out, off_t *size_out) {
   TRACKX(FB_DEBUG_HASH, 0, 1, Hash, this, "fd=%d, stat=%s", fd, D(stat_ptr));
+  PhaseTimer timer(FB_PHASE_HASHING);
 
   struct stat64 st_local;
   if (!stat_ptr && fstat64(fd, &st_local) == -1) {
@@ -259,6 +261,17 @@ void Hash::to_ascii(char *out) const {
   out[kAsciiLength] = '\0';
 }
 
+bool Hash::set_from_ascii(const char* const str) {
+  if (!valid_ascii(str)) {
+    return false;
+  }
+  XXH128_canonical_t canonical;
+  if (!Base64::decode(str, canonical.digest, sizeof(canonical.digest))) {
+    return false;
+  }
+  hash_ = XXH128_hashFromCanonical(&canonical);
+  return true;
+}
 
 /* Global debugging methods.
  * level is the nesting level of objects calling each other's d(), bigger means less info to print.
@@ -119,6 +119,11 @@ class Hash {
   static bool valid_ascii(const char* const str) {
     return Base64::valid_ascii(str, kAsciiLength);
   }
+  /**
+   * Set the hash from its ASCII representation.
+   * @return whether str is a valid ASCII representation
+   */
+  bool set_from_ascii(const char* const str);
 
  private:
   /**
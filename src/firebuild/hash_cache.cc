@@ -18,12 +18,18 @@
 
 #include "firebuild/hash_cache.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <string>
 #include <vector>
 
 #include "firebuild/debug.h"
 #include "firebuild/blob_cache.h"
+#include "firebuild/cache_daemon.h"
 #include "firebuild/config.h"
+#include "firebuild/content_normalizer.h"
 #include "firebuild/file_info.h"
 #include "firebuild/file_name.h"
 #include "firebuild/utils.h"
@@ -83,6 +89,7 @@ static bool update_statinfo(const FileName* path, int fd, const struct stat64 *s
   entry->is_stored = false;
   entry->is_static = false;
   entry->is_static_checked = false;
+  entry->alt_hash_known = false;
   if (S_ISREG(st->st_mode)) {
     entry->info.set_type(ISREG);
     entry->info.set_mode_bits(st->st_mode & 07777, 07777 /* we know all the mode bits */);
@@ -157,10 +164,21 @@ static bool update_hash(const FileName* path, int fd, const struct stat64 *stat_
     st.st_mode = entry->info.type() == ISREG ? S_IFREG : S_IFDIR;
     st.st_size = entry->info.size();
 
-    if (fd == -1) {
-      ret = hash.set_from_file(path, &st, &is_dir);
+    /* Files in read-only locations are likely hashed by other supervisors, too. */
+    const bool shared = cache_daemon && entry->info.type() == ISREG
+        && path->is_in_read_only_location();
+    if (shared && cache_daemon->lookup_hash(path, *entry, &hash)) {
+      ret = true;
+      is_dir = false;
     } else {
-      ret = hash.set_from_fd(fd, &st, &is_dir);
+      if (fd == -1) {
+        ret = hash.set_from_file(path, &st, &is_dir);
+      } else {
+        ret = hash.set_from_fd(fd, &st, &is_dir);
+      }
+      if (ret && shared) {
+        cache_daemon->publish_hash(path, *entry, hash);
+      }
     }
     // FIXME verify that is_dir matches entry->info.type()
     if (ret) {
@@ -478,6 +496,44 @@ bool HashCache::file_info_matches(const FileName *path, const FileInfo& query) {
   return entry->info.hash() == query.hash();
 }
 
+bool HashCache::get_alt_hash(const FileName* path, Hash *alt_hash) {
+  TRACK(FB_DEBUG_HASH, "path=%s", D(path));
+
+  if (path->is_in_ignore_location() || path->writers_count() > 0) {
+    return false;
+  }
+  const ContentNormalizer* normalizer = ContentNormalizer::for_file(path);
+  if (!normalizer) {
+    return false;
+  }
+  const HashCacheEntry *entry = get_entry_with_statinfo(path, -1, nullptr);
+  if (entry->info.type() != ISREG) {
+    return false;
+  }
+
+  if (!entry->alt_hash_known) {
+    int fd = open(path->c_str(), O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+    const size_t size = entry->info.size();
+    const void* data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    const_cast<HashCacheEntry*>(entry)->alt_hash =
+        normalizer->hash(static_cast<const char*>(data), size);
+    const_cast<HashCacheEntry*>(entry)->alt_hash_known = true;
+    if (size > 0) {
+      munmap(const_cast<void*>(data), size);
+    }
+  }
+
+  *alt_hash = entry->alt_hash;
+  return true;
+}
+
 const FileName* HashCache::resolve_command(const char* cmd, size_t cmd_len,
                                           const char* path, size_t path_len, const FileName* wd,
                                           std::vector<const FileName*>* paths_checked,
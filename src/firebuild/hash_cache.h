@@ -41,6 +41,8 @@ struct HashCacheEntry {
   bool is_stored {};  /* it's known to be present in the blob cache because we stored it earlier */
   bool is_static {}; /* it's a static binary detected to be run via qemu-user */
   bool is_static_checked {}; /* whether we checked if it's a static binary */
+  Hash alt_hash {};  /* the hash of the normalized content, see ContentNormalizer */
+  bool alt_hash_known {};
 };
 
 /**
@@ -124,6 +126,15 @@ class HashCache {
    */
   bool file_info_matches(const FileName *path, const FileInfo& query);
 
+  /**
+   * Get the hash of the regular file's normalized content, see ContentNormalizer.
+   *
+   * @param path           file's path
+   * @param[out] alt_hash  hash to retrieve/calculate
+   * @return               false if the file's type has no normalizer or it is not a regular file
+   */
+  bool get_alt_hash(const FileName* path, Hash *alt_hash);
+
   /** Resolve a command on the PATH.
    *  Optionally populates paths_checked with the paths that were chhecked before the executable
    *  was found (i.e., paths where the executable was NOT found). */
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <memory>
 #include <string>
@@ -34,6 +35,7 @@
 
 #include "common/config.h"
 #include "common/firebuild_common.h"
+#include "common/probes.h"
 #include "firebuild/command_rewriter.h"
 #include "firebuild/config.h"
 #include "firebuild/debug.h"
@@ -46,6 +48,7 @@
 #include "firebuild/execed_process.h"
 #include "firebuild/execed_process_cacher.h"
 #include "firebuild/hash_cache.h"
+#include "firebuild/message_trace.h"
 #include "firebuild/pipe.h"
 #include "firebuild/pipe_recorder.h"
 #include "firebuild/process.h"
@@ -68,8 +71,82 @@ static void reject_exec_child(int fd_conn) {
     send_fbb(fd_conn, 0, reinterpret_cast<FBBCOMM_Builder *>(&sv_msg));
 }
 
+#ifndef __APPLE__
+/**
+ * Look up the interpreter of a script from its "#!" line.
+ *
+ * @param executable the file to be exec()-ed
+ * @param[out] interpreter the interpreter, or nullptr if executable is not a script
+ * @return whether the file could be checked
+ */
+static bool get_script_interpreter(const FileName* executable, const FileName** interpreter) {
+  /* The kernel also considers only the first 256 bytes. */
+  char buf[256];
+  const int fd = open(executable->c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  const ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+  close(fd);
+  if (len < 0) {
+    return false;
+  }
+  if (len < 2 || buf[0] != '#' || buf[1] != '!') {
+    *interpreter = nullptr;
+    return true;
+  }
+  buf[len] = '\0';
+  const char* name = buf + 2 + strspn(buf + 2, " \t");
+  const size_t name_len = strcspn(name, " \t\n");
+  if (name_len == 0 || name[name_len] == '\0') {
+    /* Missing or possibly truncated interpreter path. */
+    return false;
+  }
+  *interpreter = FileName::Get(name, name_len);
+  return true;
+}
+#endif
+
+/**
+ * Whether the image to be exec()-ed can take over the exec()-ing image's supervisor connection.
+ *
+ * Statically linked binaries would not load the interceptor and would keep the connection open
+ * without ever using it, delaying the finalization of the exec parent until they and all their
+ * descendants exit. Their children would also find the stale connection in the environment.
+ * Set-user-ID and set-group-ID binaries ignore LD_PRELOAD. For scripts the same applies to the
+ * interpreters.
+ */
+static bool can_inherit_conn(const FileName* executable) {
+  if (!inherit_supervisor_connection || !executable) {
+    return false;
+  }
+#ifdef __APPLE__
+  /* Statically linked binaries are not detected on macOS. */
+  return false;
+#else
+  /* Linux follows up to 4 levels of interpreters. */
+  for (int level = 0; level <= 4; level++) {
+    struct stat64 st;
+    if (stat64(executable->c_str(), &st) != 0 || (st.st_mode & (S_ISUID | S_ISGID))) {
+      return false;
+    }
+    const FileName* interpreter;
+    if (!get_script_interpreter(executable, &interpreter)) {
+      return false;
+    }
+    if (!interpreter) {
+      bool is_static = true;
+      return hash_cache->get_is_static(executable, &is_static) && !is_static;
+    }
+    executable = interpreter;
+  }
+  return false;
+#endif
+}
+
 static void send_maybe_rewritten_cmd(int fd_conn, const FileName* executable,
-                                     std::vector<std::string>* args) {
+                                     std::vector<std::string>* args,
+                                     bool offer_conn_inheritance = false) {
   FBBCOMM_Builder_rewritten_args sv_msg;
   bool rewritten_executable = false;
   bool rewritten_args = false;
@@ -80,6 +157,9 @@ static void send_maybe_rewritten_cmd(int fd_conn, const FileName* executable,
   if (rewritten_args) {
     sv_msg.set_arg(*args);
   }
+  if (offer_conn_inheritance && can_inherit_conn(executable)) {
+    sv_msg.set_inherit_conn(true);
+  }
   send_fbb(fd_conn, 0, reinterpret_cast<FBBCOMM_Builder *>(&sv_msg));
 }
 
@@ -133,7 +213,10 @@ void MessageProcessor::accept_exec_child(ExecedProcess* proc, int fd_conn,
     /* If we still potentially can, and prefer to cache / shortcut this process,
      * register the cacher object and calculate the process's fingerprint. */
     if (proc->can_shortcut()) {
-      if (!execed_process_cacher->fingerprint(proc)) {
+      FB_PROBE2(fingerprint_start, proc->pid(), proc->executable()->c_str());
+      const bool fingerprinted = execed_process_cacher->fingerprint(proc);
+      FB_PROBE2(fingerprint_end, proc->pid(), fingerprinted);
+      if (!fingerprinted) {
         proc->disable_shortcutting_bubble_up("Could not fingerprint the process");
       }
     }
@@ -195,6 +278,11 @@ void MessageProcessor::accept_exec_child(ExecedProcess* proc, int fd_conn,
           if (pipe->finished()) {
             /* Pipe may have been closed (or broken) before the supervisor started accepting
              * the new child*/
+            if (pipe->handed_over() && proc->can_shortcut()) {
+              /* The fd may still reach the destination directly, but it can't be recorded. */
+              proc->disable_shortcutting_bubble_up(
+                  "Inherited a pipe end which can't be recorded anymore", inherited_file.fds[0]);
+            }
             continue;
           }
 
@@ -213,31 +301,42 @@ void MessageProcessor::accept_exec_child(ExecedProcess* proc, int fd_conn,
             (*fds)[fd] = file_fd_dup;
           }
 
-          /* Create a new unnamed pipe. */
-          int fifo_fd[2];
-          int ret = fb_pipe2(fifo_fd, file_fd->flags() & ~O_ACCMODE);
-          (void)ret;
-          assert(ret == 0);
-          if (epoll->is_added_fd(fifo_fd[0])) {
-            fifo_fd[0] = epoll->remap_to_not_added_fd(fifo_fd[0]);
-          }
-          bump_fd_age(fifo_fd[0]);
-          /* The supervisor needs nonblocking fds for the pipes. */
-          fcntl(fifo_fd[0], F_SETFL, O_NONBLOCK);
-
           /* Find the recorders belonging to the parent process. We need to record to all those,
            * plus create a new recorder for ourselves (unless shortcutting is already disabled). */
           auto  recorders =  proc->parent() ? pipe->proc2recorders[proc->parent_exec_point()]
               : std::vector<std::shared_ptr<PipeRecorder>>();
-          if (proc->can_shortcut()) {
-            inherited_file.recorder = std::make_shared<PipeRecorder>(proc);
-            recorders.push_back(inherited_file.recorder);
+          int handoff_fd = -1;
+          if (direct_pipe_handoff && recorders.empty() && !proc->can_shortcut()) {
+            /* Nothing would be recorded, let the process write to the destination directly. */
+            handoff_fd = pipe->reopen_fd0_for_handoff(file_fd->flags());
           }
-          pipe->add_fd1_and_proc(fifo_fd[0], file_fd.get(), proc, std::move(recorders));
-          FB_DEBUG(FB_DEBUG_PIPE, "reopening process' fd: "+ d(inherited_file.fds[0])
-                   + " as new fd1: " + d(fifo_fd[0]) + " of " + d(pipe));
+          if (handoff_fd >= 0) {
+            FB_DEBUG(FB_DEBUG_PIPE, "handing over process' fd: " + d(inherited_file.fds[0])
+                     + " as: " + d(handoff_fd) + " to the destination of " + d(pipe));
+            fifo_fds.push_back(handoff_fd);
+          } else {
+            /* Create a new unnamed pipe. */
+            int fifo_fd[2];
+            int ret = fb_pipe2(fifo_fd, file_fd->flags() & ~O_ACCMODE);
+            (void)ret;
+            assert(ret == 0);
+            if (epoll->is_added_fd(fifo_fd[0])) {
+              fifo_fd[0] = epoll->remap_to_not_added_fd(fifo_fd[0]);
+            }
+            bump_fd_age(fifo_fd[0]);
+            /* The supervisor needs nonblocking fds for the pipes. */
+            fcntl(fifo_fd[0], F_SETFL, O_NONBLOCK);
 
-          fifo_fds.push_back(fifo_fd[1]);
+            if (proc->can_shortcut()) {
+              inherited_file.recorder = std::make_shared<PipeRecorder>(proc);
+              recorders.push_back(inherited_file.recorder);
+            }
+            pipe->add_fd1_and_proc(fifo_fd[0], file_fd.get(), proc, std::move(recorders));
+            FB_DEBUG(FB_DEBUG_PIPE, "reopening process' fd: "+ d(inherited_file.fds[0])
+                     + " as new fd1: " + d(fifo_fd[0]) + " of " + d(pipe));
+
+            fifo_fds.push_back(fifo_fd[1]);
+          }
           /* alloca()'s lifetime is the entire function, not just the brace-block. This is what we
            * need because the data has to live until the send_fbb() below.
            * Calling alloca() from a loop is often frowned upon because it can quickly eat up the
@@ -486,7 +585,7 @@ static void proc_new_process_msg(const FBBCOMM_Serialized *fbbcomm_buf, uint16_t
         *new_proc = proc;
         return;
       }
-    } else if (ppid == getpid()) {
+    } else if (ppid == proc_tree->root()->ppid()) {
       /* This is the first intercepted process. */
       parent = proc_tree->root();
       fds = parent->pass_on_fds();
@@ -761,6 +860,26 @@ static void process_posix_spawn_file_actions(const P * const ic_msg, Process* co
 #endif
 }
 
+/** Account the ACK waits reported in the exec or rusage message to the process' exec point. */
+template<class M>
+static void process_ack_waits(const M * const ic_msg, Process* const proc) {
+  int64_t waits = 0;
+  const fbb_size_t tag_count = std::min(ic_msg->get_ack_wait_tag_count(),
+                                        ic_msg->get_ack_wait_count_count());
+  for (fbb_size_t i = 0; i < tag_count; i++) {
+    const int tag = ic_msg->get_ack_wait_tag_at(i);
+    if (tag > FBBCOMM_TAG_UNUSED && tag < FBBCOMM_TAG_NEXT) {
+      execed_process_cacher->add_ack_waits_for_tag(tag, ic_msg->get_ack_wait_count_at(i));
+    }
+    waits += ic_msg->get_ack_wait_count_at(i);
+  }
+  ExecedProcess* ep = proc->exec_point();
+  if (ep) {
+    ep->add_ack_waits(ic_msg->get_ack_wait_ns(), waits);
+    execed_process_cacher->add_ack_waits(ep->executable(), ic_msg->get_ack_wait_ns(), waits);
+  }
+}
+
 template<typename T>
 static const FileName* resolve_command_from_msg(const T* ic_msg, const char* command,
                                                 size_t command_len, Process* proc) {
@@ -830,6 +949,7 @@ static void proc_ic_msg(const FBBCOMM_Serialized *fbbcomm_buf, uint16_t ack_num,
     case FBBCOMM_TAG_rusage: {
       auto ic_msg = reinterpret_cast<const FBBCOMM_Serialized_rusage *>(fbbcomm_buf);
       proc->resource_usage(ic_msg->get_utime_u(), ic_msg->get_stime_u());
+      process_ack_waits(ic_msg, proc);
       break;
     }
     case FBBCOMM_TAG_system: {
@@ -1100,6 +1220,7 @@ static void proc_ic_msg(const FBBCOMM_Serialized *fbbcomm_buf, uint16_t ack_num,
     case FBBCOMM_TAG_exec: {
       auto ic_msg = reinterpret_cast<const FBBCOMM_Serialized_exec *>(fbbcomm_buf);
       proc->update_rusage(ic_msg->get_utime_u(), ic_msg->get_stime_u());
+      process_ack_waits(ic_msg, proc);
       // FIXME(rbalint) save exec parameters
       proc->set_exec_pending(true);
       const FileName* executable = nullptr;
@@ -1117,7 +1238,7 @@ static void proc_ic_msg(const FBBCOMM_Serialized *fbbcomm_buf, uint16_t ack_num,
                                               proc);
       }
       std::vector<std::string> args = ic_msg->get_arg_as_vector();
-      send_maybe_rewritten_cmd(fd_conn, executable, &args);
+      send_maybe_rewritten_cmd(fd_conn, executable, &args, true);
       return;
     }
     case FBBCOMM_TAG_pre_open: {
@@ -1461,6 +1582,9 @@ void MessageProcessor::ic_conn_readcb(const struct epoll_event* event, void *ctx
     FB_DEBUG(FB_DEBUG_COMM, "socket " +
              d_fd(Epoll::event_fd(event)) +
              " hung up (" + d(proc) + ")");
+    if (message_trace) {
+      message_trace->record_hangup(Epoll::event_fd(event));
+    }
     delete conn_ctx;
     return;
   }
@@ -1475,6 +1599,9 @@ void MessageProcessor::ic_conn_readcb(const struct epoll_event* event, void *ctx
     FB_DEBUG(FB_DEBUG_COMM, "socket " +
              d_fd(Epoll::event_fd(event)) +
              " hung up (" + d(proc) + ")");
+    if (message_trace) {
+      message_trace->record_hangup(Epoll::event_fd(event));
+    }
     delete conn_ctx;
     return;
   }
@@ -1494,37 +1621,55 @@ void MessageProcessor::ic_conn_readcb(const struct epoll_event* event, void *ctx
 
     /* Have at least one full message. */
     auto fbbcomm_msg = reinterpret_cast<const FBBCOMM_Serialized *>(buf.data() + sizeof(*header));
-
-    if (!proc) {
-      /* Now the message is complete, the debug suppression can be correctly set. */
-      debug_suppressed =
-          ProcessFactory::peekProcessDebuggingSuppressed(fbbcomm_msg);
+    if (message_trace) {
+      message_trace->record_frame(Epoll::event_fd(event), header->ack_id, fbbcomm_msg,
+                                  header->msg_size);
     }
+    handle_msg(conn_ctx, Epoll::event_fd(event), header->ack_id, fbbcomm_msg);
+    buf.discard(full_length);
+  } while (buf.length() > 0);
+}
 
-    if (FB_DEBUGGING(FB_DEBUG_COMM)) {
-      if (!debug_suppressed) {
-        FB_DEBUG(FB_DEBUG_COMM, "fd " + d_fd(
-            Epoll::event_fd(event)) + ": (" + d(proc) + ")");
-        if (header->ack_id) {
-          fprintf(stderr, "ack_num: %d\n", header->ack_id);
-        }
-        fbbcomm_msg->debug(stderr);
-        fflush(stderr);
+void MessageProcessor::handle_msg(ConnectionContext *conn_ctx, int fd_conn, uint16_t ack_id,
+                                  const FBBCOMM_Serialized *fbbcomm_msg) {
+  const int tag = fbbcomm_msg->get_tag();
+  FB_PROBE3(msg_receive, fd_conn, tag, ack_id);
+  auto proc = conn_ctx->proc;
+  if (proc && tag == FBBCOMM_TAG_scproc_query) {
+    /* The exec()-ed image took over the connection, the exec parent is done. */
+    FB_DEBUG(FB_DEBUG_COMM, "fd " + d_fd(fd_conn)
+             + " is taken over by the exec child of " + d(proc));
+    conn_ctx->finish_proc();
+    proc = nullptr;
+  }
+
+  if (!proc) {
+    /* Now the message is complete, the debug suppression can be correctly set. */
+    debug_suppressed =
+        ProcessFactory::peekProcessDebuggingSuppressed(fbbcomm_msg);
+  }
+
+  if (FB_DEBUGGING(FB_DEBUG_COMM)) {
+    if (!debug_suppressed) {
+      FB_DEBUG(FB_DEBUG_COMM, "fd " + d_fd(fd_conn) + ": (" + d(proc) + ")");
+      if (ack_id) {
+        fprintf(stderr, "ack_num: %d\n", ack_id);
       }
+      fbbcomm_msg->debug(stderr);
+      fflush(stderr);
     }
+  }
 
-    /* Process the messaage. */
-    if (proc) {
-      proc_ic_msg(fbbcomm_msg, header->ack_id, Epoll::event_fd(event), proc);
-    } else {
-      /* Fist interceptor message */
-      proc_new_process_msg(
-          fbbcomm_msg, header->ack_id, Epoll::event_fd(event), &conn_ctx->proc);
-      /* Reset suppression which was set peeking at the message. */
-      debug_suppressed = false;
-    }
-    buf.discard(full_length);
-  } while (buf.length() > 0);
+  /* Process the messaage. */
+  if (proc) {
+    proc_ic_msg(fbbcomm_msg, ack_id, fd_conn, proc);
+  } else {
+    /* Fist interceptor message */
+    proc_new_process_msg(fbbcomm_msg, ack_id, fd_conn, &conn_ctx->proc);
+    /* Reset suppression which was set peeking at the message. */
+    debug_suppressed = false;
+  }
+  FB_PROBE2(msg_done, fd_conn, tag);
 }
 
 
@@ -24,11 +24,16 @@
 
 namespace firebuild {
 
+class ConnectionContext;
+
 /** Handles incoming FBB messages from the interceptor */
 class MessageProcessor {
  public:
   static void accept_exec_child(ExecedProcess* proc, int fd_conn, int fd0_reopen = -1);
   static void ic_conn_readcb(const struct epoll_event* event, void *ctx);
+  /** Process one complete message received on the connection. */
+  static void handle_msg(ConnectionContext *conn_ctx, int fd_conn, uint16_t ack_id,
+                         const FBBCOMM_Serialized *fbbcomm_msg);
 };
 
 }  /* namespace firebuild */
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/message_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/firebuild_common.h"
+#include "firebuild/connection_context.h"
+#include "firebuild/debug.h"
+#include "firebuild/epoll.h"
+#include "firebuild/firebuild.h"
+#include "firebuild/message_processor.h"
+#include "firebuild/process_tree.h"
+#include "firebuild/sigchild_callback.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+MessageTrace* message_trace = nullptr;
+
+static const char kTraceMagic[8] = {'F', 'B', 'T', 'R', 'A', 'C', 'E', '\0'};
+static const uint32_t kTraceVersion = 1;
+/* Frames to replay between processing the other events, roughly matching the main loop which
+ * processes up to 32 readable connections after each wait. */
+static const size_t kFramesPerEventRound = 32;
+
+static uint64_t ns_since(const struct timespec& start) {
+  struct timespec now, diff;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timespecsub(&now, &start, &diff);
+  return static_cast<uint64_t>(diff.tv_sec) * 1000000000 + diff.tv_nsec;
+}
+
+MessageTrace::MessageTrace(const char *path)
+    : file_(fopen(path, "we")) {
+  if (!file_) {
+    fb_perror(path);
+    exit(EXIT_FAILURE);
+  }
+  /* Most records are small, write them out in bigger chunks. */
+  setvbuf(file_, NULL, _IOFBF, 1024 * 1024);
+}
+
+MessageTrace::~MessageTrace() {
+  if (fclose(file_) != 0) {
+    fb_perror("Saving the message trace");
+  }
+}
+
+void MessageTrace::start(pid_t root_pid) {
+  header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+  header.version = kTraceVersion;
+  header.supervisor_pid = getpid();
+  header.root_pid = root_pid;
+  fwrite(&header, sizeof(header), 1, file_);
+  clock_gettime(CLOCK_MONOTONIC, &start_time_);
+}
+
+uint32_t MessageTrace::conn_id(int fd_conn) {
+  if (conn_ids_.size() <= static_cast<size_t>(fd_conn)) {
+    conn_ids_.resize(fd_conn + 1, 0);
+  }
+  if (conn_ids_[fd_conn] == 0) {
+    conn_ids_[fd_conn] = ++last_conn_id_;
+  }
+  return conn_ids_[fd_conn];
+}
+
+void MessageTrace::write_record(uint8_t type, uint32_t id, uint32_t value, uint16_t ack_id) {
+  record_t record;
+  memset(&record, 0, sizeof(record));
+  record.timestamp = ns_since(start_time_);
+  record.id = id;
+  record.value = value;
+  record.ack_id = ack_id;
+  record.type = type;
+  fwrite(&record, sizeof(record), 1, file_);
+}
+
+void MessageTrace::record_frame(int fd_conn, uint16_t ack_id, const FBBCOMM_Serialized *msg,
+                                uint32_t size) {
+  write_record(kFrame, conn_id(fd_conn), size, ack_id);
+  fwrite(msg, size, 1, file_);
+}
+
+void MessageTrace::record_hangup(int fd_conn) {
+  write_record(kHangup, conn_id(fd_conn), 0, 0);
+  /* The fd may be reused for a new connection. */
+  conn_ids_[fd_conn] = 0;
+}
+
+void MessageTrace::record_ack(int fd_conn, uint16_t ack_id) {
+  write_record(kAck, conn_id(fd_conn), 0, ack_id);
+}
+
+void MessageTrace::record_child_exit(pid_t pid, int status) {
+  write_record(kChildExit, pid, status, 0);
+}
+
+/** The replay's end of a connection, receiving the supervisor's messages. */
+typedef struct {
+  msg_header header;
+  /* The received bytes of header */
+  size_t header_len;
+  /* The bytes of the current message's payload still to be received */
+  size_t payload_left;
+} replay_peer_t;
+
+static size_t replayed_acks = 0;
+
+/** Drain the messages sent by the supervisor, closing the attached fds and counting the ACKs. */
+static void replay_peer_readcb(const struct epoll_event* event, void *ctx) {
+  auto peer = reinterpret_cast<replay_peer_t *>(ctx);
+  const int fd = Epoll::event_fd(event);
+  char buf[4096];
+  union {
+    char buf[CMSG_SPACE(64 * sizeof(int))];
+    struct cmsghdr align;
+  } anc;
+  while (true) {
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msgh = {};
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = anc.buf;
+    msgh.msg_controllen = sizeof(anc.buf);
+    ssize_t ret = TEMP_FAILURE_RETRY(recvmsg(fd, &msgh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC));
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (ret <= 0) {
+      /* The supervisor closed the connection. */
+      epoll->del_fd(fd, EPOLLIN);
+      close(fd);
+      delete peer;
+      return;
+    }
+    /* The fds would be used by the intercepted processes, which are not running. */
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        const size_t fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < fd_count; i++) {
+          int attached_fd;
+          memcpy(&attached_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+          close(attached_fd);
+        }
+      }
+    }
+    for (ssize_t i = 0; i < ret;) {
+      if (peer->payload_left > 0) {
+        const size_t len = std::min(peer->payload_left, static_cast<size_t>(ret - i));
+        peer->payload_left -= len;
+        i += len;
+        continue;
+      }
+      const size_t len = std::min(sizeof(peer->header) - peer->header_len,
+                                  static_cast<size_t>(ret - i));
+      memcpy(reinterpret_cast<char *>(&peer->header) + peer->header_len, buf + i, len);
+      peer->header_len += len;
+      i += len;
+      if (peer->header_len == sizeof(peer->header)) {
+        if (peer->header.ack_id != 0) {
+          replayed_acks++;
+        }
+        peer->payload_left = peer->header.msg_size;
+        peer->header_len = 0;
+      }
+    }
+  }
+}
+
+/** Open the supervisor's end of a replayed connection. */
+static ConnectionContext *open_replay_conn() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+    fb_perror("socketpair");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (epoll->is_added_fd(fds[i])) {
+      /* A closed fd's context may not have been cleaned up yet. */
+      fds[i] = epoll->remap_to_not_added_fd(fds[i]);
+    }
+  }
+  bump_fd_age(fds[0]);
+  epoll->add_fd(fds[1], EPOLLIN, replay_peer_readcb, new replay_peer_t());
+  return new ConnectionContext(fds[0]);
+}
+
+/** Let the supervisor handle the pipes and the peers, like the main loop does. */
+static void process_pending_events() {
+  do {
+    epoll->wait(false);
+    epoll->process_all_events();
+    proc_tree->GcProcesses();
+  } while (epoll->event_count() > 0);
+}
+
+bool MessageTrace::replay(const char *path) {
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    fb_perror(path);
+    return false;
+  }
+  header_t header;
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || memcmp(header.magic, kTraceMagic, sizeof(header.magic)) != 0
+      || header.version != kTraceVersion) {
+    fb_error("Invalid message trace: " + std::string(path));
+    fclose(file);
+    return false;
+  }
+
+  child_pid = header.root_pid;
+  proc_tree->insert_root(header.root_pid, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+                         header.supervisor_pid);
+
+  /* The replayed connections, indexed by the recorded connection ids */
+  std::vector<ConnectionContext *> conns;
+  /* FBB messages need 8 byte alignment */
+  std::vector<uint64_t> msg_buf;
+  size_t frames = 0, recorded_acks = 0;
+  uint64_t recording_ns = 0;
+  bool complete = false;
+  struct timespec start_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  record_t record;
+  size_t read_len;
+  bool truncated = false;
+  while ((read_len = fread(&record, 1, sizeof(record), file)) == sizeof(record)) {
+    recording_ns = record.timestamp;
+    if (record.type == kFrame || record.type == kHangup) {
+      if (conns.size() <= record.id) {
+        conns.resize(record.id + 1, nullptr);
+      }
+      if (!conns[record.id]) {
+        conns[record.id] = open_replay_conn();
+      }
+    }
+    if (record.type == kFrame) {
+      msg_buf.resize(record.value / sizeof(uint64_t) + 1);
+      if (fread(msg_buf.data(), 1, record.value, file) != record.value) {
+        truncated = true;
+        break;
+      }
+      ConnectionContext *conn_ctx = conns[record.id];
+      MessageProcessor::handle_msg(conn_ctx, conn_ctx->fd(), record.ack_id,
+                                   reinterpret_cast<const FBBCOMM_Serialized *>(msg_buf.data()));
+      frames++;
+    } else if (record.type == kHangup) {
+      delete conns[record.id];
+      conns[record.id] = nullptr;
+    } else if (record.type == kAck) {
+      recorded_acks++;
+    } else if (record.type == kChildExit) {
+      handle_exited_child(record.id, record.value);
+    } else {
+      break;
+    }
+    if (record.type != kFrame || frames % kFramesPerEventRound == 0) {
+      process_pending_events();
+    }
+  }
+  /* The trace is complete if it ended at a record's boundary. */
+  complete = !truncated && read_len == 0 && feof(file);
+  fclose(file);
+  if (!complete) {
+    fb_error("Invalid or truncated message trace: " + std::string(path));
+  }
+
+  /* Hang up the connections which were still open at the end of the recording. */
+  for (ConnectionContext *conn_ctx : conns) {
+    delete conn_ctx;
+  }
+  process_pending_events();
+
+  const double replay_s = static_cast<double>(ns_since(start_time)) / 1000000000;
+  fprintf(stdout, "Replayed %zu messages in %.3f s (%.0f messages/s), recorded in %.3f s.\n"
+          "ACKs sent: %zu, recorded: %zu\n",
+          frames, replay_s, replay_s > 0 ? frames / replay_s : 0.0,
+          static_cast<double>(recording_ns) / 1000000000, replayed_acks, recorded_acks);
+  return complete;
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_MESSAGE_TRACE_H_
+#define FIREBUILD_MESSAGE_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+#include "./fbbcomm.h"
+
+namespace firebuild {
+
+/**
+ * Binary trace of the events driving the supervisor: the frames received from the interceptors,
+ * the ACKs sent back, the connections hanging up and the exits of the supervisor's children.
+ *
+ * The trace starts with a header, followed by fixed size records in the order of the events.
+ * Frame records are followed by the FBBCOMM message. All values are in the host's byte order.
+ *
+ * Replaying the trace feeds the recorded messages to the same message processing as the real
+ * connections, over socket pairs whose other end is drained by the replay, without running the
+ * build. The files referenced by the messages are accessed for real, thus the trace should be
+ * replayed in the same, unmodified tree to get the same process tree, fingerprints and cache
+ * lookups as in the recorded run.
+ */
+class MessageTrace {
+ public:
+  /** Open the trace file for recording, exits on failure. */
+  explicit MessageTrace(const char *path);
+  ~MessageTrace();
+
+  /** Write the header, to be called when the build command's process is started. */
+  void start(pid_t root_pid);
+  void record_frame(int fd_conn, uint16_t ack_id, const FBBCOMM_Serialized *msg, uint32_t size);
+  void record_hangup(int fd_conn);
+  void record_ack(int fd_conn, uint16_t ack_id);
+  void record_child_exit(pid_t pid, int status);
+
+  /**
+   * Replay the trace to the message processing.
+   * @return whether the trace could be replayed completely
+   */
+  static bool replay(const char *path);
+
+  /* The record types */
+  static const uint8_t kFrame = 1;
+  static const uint8_t kHangup = 2;
+  static const uint8_t kAck = 3;
+  static const uint8_t kChildExit = 4;
+
+ private:
+  typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t supervisor_pid;
+    /* The pid of the build command's process */
+    int32_t root_pid;
+    uint32_t padding;
+  } header_t;
+
+  typedef struct {
+    /* Nanoseconds since the start of the recording */
+    uint64_t timestamp;
+    /* The connection's id for kFrame, kHangup and kAck, the pid for kChildExit */
+    uint32_t id;
+    /* The size of the message following the record for kFrame, the wait status for kChildExit */
+    uint32_t value;
+    /* The frame's or the sent ACK's ack_id */
+    uint16_t ack_id;
+    uint8_t type;
+    uint8_t padding[5];
+  } record_t;
+
+  /** The id of the connection, assigning a new one if needed. */
+  uint32_t conn_id(int fd_conn);
+  void write_record(uint8_t type, uint32_t id, uint32_t value, uint16_t ack_id);
+
+  FILE *file_;
+  struct timespec start_time_ {};
+  /* Connection ids indexed by the fds, 0 for fds not used for connections */
+  std::vector<uint32_t> conn_ids_ {};
+  uint32_t last_conn_id_ {0};
+  DISALLOW_COPY_AND_ASSIGN(MessageTrace);
+};
+
+/* singleton, NULL if the messages are not recorded */
+extern MessageTrace *message_trace;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_MESSAGE_TRACE_H_
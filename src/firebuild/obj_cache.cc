@@ -35,12 +35,15 @@
 #include <vector>
 
 #include "firebuild/blob_cache.h"
+#include "firebuild/cache_access_log.h"
+#include "firebuild/cache_daemon.h"
 #include "firebuild/config.h"
 #include "firebuild/debug.h"
 #include "firebuild/execed_process_cacher.h"
 #include "firebuild/hash.h"
 #include "firebuild/fbbfp.h"
 #include "firebuild/fbbstore.h"
+#include "firebuild/remote_cache.h"
 #include "firebuild/subkey.h"
 #include "firebuild/utils.h"
 
@@ -49,8 +52,12 @@ namespace firebuild {
 /* singleton */
 ObjCache *obj_cache;
 
-ObjCache::ObjCache(const std::string &base_dir) : base_dir_(base_dir) {
+ObjCache::ObjCache(const std::string &base_dir, const std::vector<std::string> &lower_dirs)
+    : base_dir_(base_dir), lower_dirs_(lower_dirs) {
   mkdir(base_dir_.c_str(), 0700);
+  for (const std::string& lower_dir : lower_dirs_) {
+    lower_dirs_max_length_ = std::max(lower_dirs_max_length_, lower_dir.length());
+  }
 }
 
 
@@ -157,44 +164,50 @@ bool ObjCache::store(const Hash &key,
 
   // FIXME Do we need to split large files into smaller writes?
   // FIXME add basic error handling
-  // FIXME Is it faster if we alloca() for small sizes instead of malloc()?
   // FIXME Is it faster to ftruncate() the file to the desired size, then mmap,
   // then serialize to the mapped memory, then ftruncate() again to the actual size?
-  off_t len = entry->measure();
+  off_t len = serialize_arena_.serialize(entry, kMagicHeaderSize);
   if (stored_blob_bytes + len > max_entry_size) {
     FB_DEBUG(FB_DEBUG_CACHING,
              "Could not store entry in cache because it would exceed max_entry_size");
-    free(tmpfile);
     close(fd_dst);
+    unlink(tmpfile);
+    free(tmpfile);
     return false;
   }
 
-  char *entry_serial = reinterpret_cast<char *>(malloc(len + kMagicHeaderSize));
+  char *entry_serial = serialize_arena_.data();
   memcpy(entry_serial, kMagicHeader, kMagicHeaderSize);
 
-  entry->serialize(entry_serial + kMagicHeaderSize);
-
   off_t final_size;
+  bool written;
   if (compress_cache) {
     /* Compress the serialized entry */
     size_t compressed_size = 0;
     char *compressed_data = compress_zstd(entry_serial, len + kMagicHeaderSize, &compressed_size,
                                           compression_level);
     if (!compressed_data) {
-      free(entry_serial);
       close(fd_dst);
+      unlink(tmpfile);
       free(tmpfile);
       return false;
     }
 
-    fb_write(fd_dst, compressed_data, compressed_size);
+    written = fb_write(fd_dst, compressed_data, compressed_size)
+        == static_cast<ssize_t>(compressed_size);
     final_size = compressed_size;
     free(compressed_data);
   } else {
     final_size = len + kMagicHeaderSize;
-    fb_write(fd_dst, entry_serial, final_size);
+    written = fb_write(fd_dst, entry_serial, final_size) == final_size;
   }
   close(fd_dst);
+  if (!written) {
+    fb_perror("Failed writing cache object");
+    unlink(tmpfile);
+    free(tmpfile);
+    return false;
+  }
 
   /* Create randomized object file */
   char* path_dst = reinterpret_cast<char*>(alloca(base_dir_.length() + kObjCachePathLength + 1));
@@ -217,12 +230,12 @@ bool ObjCache::store(const Hash &key,
   }
 
   construct_cached_file_name(base_dir_, key, subkey.c_str(), true, path_dst);
-  free(entry_serial);
 
   if (fb_renameat2(AT_FDCWD, tmpfile, AT_FDCWD, path_dst, RENAME_NOREPLACE) == -1) {
     if (errno == EEXIST) {
       FB_DEBUG(FB_DEBUG_CACHING, "cache object is already stored");
       unlink(tmpfile);
+      free(tmpfile);
       return true;
     } else {
       fb_perror("Failed rename() while storing cache object");
@@ -233,6 +246,16 @@ bool ObjCache::store(const Hash &key,
     }
   } else {
     execed_process_cacher->update_cached_bytes(final_size);
+    if (cache_access_log) {
+      /* Let the entry be prefetched and exported, too. */
+      cache_access_log->record(path_dst, 0, 0);
+    }
+    if (cache_daemon) {
+      cache_daemon->add_subkey(key, subkey);
+    }
+    if (remote_cache) {
+      remote_cache->upload_async("objs" + std::string(path_dst + base_dir_.length()), path_dst);
+    }
   }
 
   if (FB_DEBUGGING(FB_DEBUG_CACHING)) {
@@ -258,6 +281,78 @@ bool ObjCache::store(const Hash &key,
   return true;
 }
 
+bool ObjCache::import_entry(const std::string& name, const uint8_t* data, size_t len) {
+  /* The name must be in x/xx/<ascii key>/<ascii subkey> form. */
+  if (name.length() != kObjCachePathLength - 1
+      || name[1] != '/' || name[4] != '/' || name[5 + Hash::kAsciiLength] != '/') {
+    return false;
+  }
+  const std::string key_ascii = name.substr(5, Hash::kAsciiLength);
+  const std::string subkey_ascii = name.substr(5 + Hash::kAsciiLength + 1);
+  Hash key;
+  if (!key.set_from_ascii(key_ascii.c_str()) || !Subkey::valid_ascii(subkey_ascii.c_str())
+      || name[0] != key_ascii[0] || name[2] != key_ascii[0] || name[3] != key_ascii[1]) {
+    return false;
+  }
+  if (len < kMagicHeaderSize || (memcmp(data, kMagicHeader, kMagicHeaderSize) != 0
+                                 && memcmp(data, kZstdMagicHeader, kZstdMagicHeaderSize) != 0)) {
+    return false;
+  }
+
+  char* path_dst = reinterpret_cast<char*>(alloca(base_dir_.length() + kObjCachePathLength + 1));
+  construct_cached_file_name(base_dir_, key, subkey_ascii.c_str(), true, path_dst);
+  if (access(path_dst, F_OK) == 0) {
+    return true;
+  }
+  std::string tmpfile = base_dir_ + "/new.XXXXXX";
+  int fd_dst = mkstemp(&tmpfile[0]);
+  if (fd_dst == -1) {
+    fb_perror("Failed mkstemp() for importing cache object");
+    return false;
+  }
+  const bool written = fb_write(fd_dst, data, len) == static_cast<ssize_t>(len);
+  close(fd_dst);
+  if (!written) {
+    fb_perror("Failed writing cache object");
+    unlink(tmpfile.c_str());
+    return false;
+  }
+  if (fb_renameat2(AT_FDCWD, tmpfile.c_str(), AT_FDCWD, path_dst, RENAME_NOREPLACE) == -1) {
+    unlink(tmpfile.c_str());
+    return errno == EEXIST;
+  }
+  execed_process_cacher->update_cached_bytes(len);
+  if (remote_cache) {
+    remote_cache->upload_async("objs" + std::string(path_dst + base_dir_.length()), path_dst);
+  }
+  return true;
+}
+
+bool ObjCache::entry_file_valid(int fd) {
+  struct stat64 st;
+  if (fstat64(fd, &st) == -1 || st.st_size <= static_cast<off_t>(kMagicHeaderSize)) {
+    return false;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(p);
+  size_t size = st.st_size;
+  uint8_t* decompressed = nullptr;
+  if (memcmp(data, kZstdMagicHeader, kZstdMagicHeaderSize) == 0) {
+    decompressed = decompress_zstd(data, size, &size);
+    data = decompressed;
+  }
+  const bool valid = data && size > kMagicHeaderSize
+      && memcmp(data, kMagicHeader, kMagicHeaderSize) == 0
+      && reinterpret_cast<const FBBSTORE_Serialized *>(data + kMagicHeaderSize)
+      ->get_tag() == FBBSTORE_TAG_process_inputs_outputs;
+  free(decompressed);
+  munmap(p, st.st_size);
+  return valid;
+}
+
 bool ObjCache::retrieve(const Hash &key,
                         const char* const subkey,
                         uint8_t ** entry,
@@ -273,6 +368,53 @@ bool ObjCache::retrieve(const Hash &key,
 
   char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kObjCachePathLength + 1));
   construct_cached_file_name(base_dir_, key, subkey, false, path);
+  if (lower_dirs_.empty() && !remote_cache) {
+    if (cache_daemon && access(path, R_OK) != 0) {
+      /* The subkey came from the daemon, but a supervisor not using it removed the entry. */
+      return false;
+    }
+    return retrieve(path, entry, entry_len, compressed_len, munmap_entry);
+  }
+  if (access(path, R_OK) == 0) {
+    if (remote_prefetched_.erase(Subkey(subkey)) > 0) {
+      /* Downloaded by list_remote_subkeys(). */
+      execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_LOCAL, false);
+      if (!lower_dirs_.empty()) {
+        execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_LOWER, false);
+      }
+      execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_REMOTE, true);
+    } else {
+      execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_LOCAL, true);
+    }
+    return retrieve(path, entry, entry_len, compressed_len, munmap_entry);
+  }
+  execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_LOCAL, false);
+  char* path_lower =
+      reinterpret_cast<char*>(alloca(lower_dirs_max_length_ + kObjCachePathLength + 1));
+  for (const std::string& lower_dir : lower_dirs_) {
+    construct_cached_file_name(lower_dir, key, subkey, false, path_lower);
+    if (access(path_lower, R_OK) == 0) {
+      execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_LOWER, true);
+      return retrieve(path_lower, entry, entry_len, compressed_len, munmap_entry);
+    }
+  }
+  if (!lower_dirs_.empty()) {
+    execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_LOWER, false);
+  }
+  if (!remote_cache) {
+    /* The entry has been removed since listing the subkeys. */
+    return false;
+  }
+  /* Download the entry to the writable layer. If it does not match the file system it is
+   * removed later by the garbage collection. */
+  construct_cached_file_name(base_dir_, key, subkey, true, path);
+  const off_t size = remote_cache->download("objs" + std::string(path + base_dir_.length()),
+                                            base_dir_.c_str(), path, entry_file_valid);
+  execed_process_cacher->count_tier_lookup(FB_CACHE_TIER_REMOTE, size >= 0);
+  if (size < 0) {
+    return false;
+  }
+  execed_process_cacher->update_cached_bytes(size);
   return retrieve(path, entry, entry_len, compressed_len, munmap_entry);
 }
 
@@ -299,6 +441,9 @@ bool ObjCache::retrieve(const char* path, uint8_t ** entry, size_t * entry_len,
     close(fd);
     return false;
   }
+  if (cache_access_log) {
+    cache_access_log->record(path, 0, 0);
+  }
 
   bool compressed_obj;
   uint8_t *p = NULL;
@@ -373,7 +518,26 @@ void ObjCache::mark_as_used(const Hash &key,
   construct_cached_file_name(base_dir_, key, subkey, false, path);
   /* Touch the used file. */
   struct timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_NOW}};
-  utimensat(AT_FDCWD, path, times, 0);
+  if (utimensat(AT_FDCWD, path, times, 0) == 0 || errno != ENOENT) {
+    return;
+  }
+  /* The entry was found in a lower layer. Its blobs have already been promoted while
+   * shortcutting the process, now promote the entry, too. The copy is created as recently used. */
+  char* path_lower =
+      reinterpret_cast<char*>(alloca(lower_dirs_max_length_ + kObjCachePathLength + 1));
+  for (const std::string& lower_dir : lower_dirs_) {
+    construct_cached_file_name(lower_dir, key, subkey, false, path_lower);
+    if (access(path_lower, R_OK) != 0) {
+      continue;
+    }
+    construct_cached_file_name(base_dir_, key, subkey, true, path);
+    off_t size = copy_file_atomically(path_lower, base_dir_.c_str(), path);
+    if (size >= 0) {
+      FB_DEBUG(FB_DEBUG_CACHING, "ObjCache: promoted entry from " + lower_dir);
+      execed_process_cacher->update_cached_bytes(size);
+    }
+    return;
+  }
 }
 
 /**
@@ -438,9 +602,68 @@ static std::vector<Subkey> list_subkeys_internal(const char* path) {
 std::vector<Subkey> ObjCache::list_subkeys(const Hash &key) {
   TRACK(FB_DEBUG_CACHING, "key=%s", D(key));
 
+  std::vector<Subkey> ret;
+  if (cache_daemon && cache_daemon->list_subkeys(key, &ret)) {
+    return ret;
+  }
   char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kObjCachePathLength + 1));
   construct_cached_dir_name(base_dir_, key, false, path);
-  return list_subkeys_internal(path);
+  ret = list_subkeys_internal(path);
+  char* path_lower =
+      reinterpret_cast<char*>(alloca(lower_dirs_max_length_ + kObjCachePathLength + 1));
+  for (const std::string& lower_dir : lower_dirs_) {
+    construct_cached_dir_name(lower_dir, key, false, path_lower);
+    for (const Subkey& subkey : list_subkeys_internal(path_lower)) {
+      /* Entries promoted earlier are present in multiple layers. */
+      if (std::find(ret.begin(), ret.end(), subkey) == ret.end()) {
+        ret.push_back(subkey);
+      }
+    }
+  }
+  return ret;
+}
+
+void ObjCache::list_remote_subkeys(const Hash &key, std::vector<Subkey>* subkeys,
+                                   size_t max_downloads) {
+  TRACK(FB_DEBUG_CACHING, "key=%s, max_downloads=%zu", D(key), max_downloads);
+
+  if (!remote_cache) {
+    return;
+  }
+  char* path = reinterpret_cast<char*>(alloca(base_dir_.length() + kObjCachePathLength + 1));
+  construct_cached_dir_name(base_dir_, key, false, path);
+  std::string listing;
+  if (!remote_cache->get("objs" + std::string(path + base_dir_.length()) + "/", &listing)) {
+    return;
+  }
+  std::vector<remote_download_t> downloads;
+  std::vector<Subkey> download_subkeys;
+  size_t start = 0, end;
+  while ((end = listing.find('\n', start)) != std::string::npos) {
+    const std::string name = listing.substr(start, end - start);
+    start = end + 1;
+    if (name.length() != Subkey::kAsciiLength || !Subkey::valid_ascii(name.c_str())) {
+      continue;
+    }
+    const Subkey subkey(name.c_str());
+    if (std::find(subkeys->begin(), subkeys->end(), subkey) == subkeys->end()) {
+      subkeys->push_back(subkey);
+      if (downloads.size() < max_downloads) {
+        construct_cached_file_name(base_dir_, key, subkey.c_str(), true, path);
+        downloads.push_back({"objs" + std::string(path + base_dir_.length()), path, -1,
+                             entry_file_valid});
+        download_subkeys.push_back(subkey);
+      }
+    }
+  }
+  /* Download the candidates in parallel instead of one by one in retrieve(). */
+  remote_cache->download_parallel(base_dir_.c_str(), &downloads);
+  for (size_t i = 0; i < downloads.size(); i++) {
+    if (downloads[i].size >= 0) {
+      execed_process_cacher->update_cached_bytes(downloads[i].size);
+      remote_prefetched_.insert(download_subkeys[i]);
+    }
+  }
 }
 
 static void gc_collect_obj_timestamp_sizes_internal(
@@ -509,7 +732,9 @@ void ObjCache::gc_obj_cache_dir(const std::string& path,
   bool valid_ascii_found = false;
   struct dirent *dirent;
   std::vector<std::string> entries_to_delete;
+  std::vector<std::string> stale_tmp_files;
   std::vector<std::string> subdirs_to_visit;
+  bool stale;
   while ((dirent = readdir(dir)) != NULL) {
     const char* name = dirent->d_name;
     if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
@@ -557,6 +782,11 @@ void ObjCache::gc_obj_cache_dir(const std::string& path,
               /* Removing old debugging file later to not break next readdir(). */
               entries_to_delete.push_back(name);
             }
+          } else if (BlobCache::is_tmp_file(dir, name, &stale)) {
+            /* Being written by a parallel process, or left behind by a killed one. */
+            if (stale) {
+              stale_tmp_files.push_back(name);
+            }
           } else {
             fb_error("Regular file among cache objects has unexpected name, keeping it: " +
                      path + "/" + name);
@@ -573,6 +803,12 @@ void ObjCache::gc_obj_cache_dir(const std::string& path,
   /* This actually deletes entries from here, the ObjCache,
    * just uses the implementation in BlobCache. */
   BlobCache::delete_entries(path, entries_to_delete, kDebugPostfix, debug_bytes);
+  for (const auto& tmp_file : stale_tmp_files) {
+    /* Not counted in the cache size. */
+    if (unlinkat(dirfd(dir), tmp_file.c_str(), 0) != 0) {
+      fb_perror("unlinkat");
+    }
+  }
   for (const auto& subdir : subdirs_to_visit) {
     gc_obj_cache_dir(path + "/" + subdir, referenced_blobs, cache_bytes, debug_bytes,
                      unexpected_file_bytes);
@@ -26,6 +26,7 @@
 
 #include "firebuild/subkey.h"
 #include "firebuild/hash.h"
+#include "firebuild/fbb_arena.h"
 #include "firebuild/fbbfp.h"
 #include "firebuild/fbbstore.h"
 
@@ -61,7 +62,12 @@ typedef struct obj_timestamp_size_ {
  */
 class ObjCache {
  public:
-  explicit ObjCache(const std::string &base_dir);
+  /**
+   * @param base_dir the writable object cache directory
+   * @param lower_dirs read-only object cache directories to look up entries in, after base_dir
+   */
+  explicit ObjCache(const std::string &base_dir,
+                    const std::vector<std::string> &lower_dirs = {});
   ~ObjCache();
 
   /**
@@ -77,6 +83,15 @@ class ObjCache {
              const FBBSTORE_Builder * const entry,
              off_t stored_blob_bytes,
              const FBBFP_Serialized * const debug_key);
+  /**
+   * Place an entry exported from another cache in obj-cache, unless it is already present.
+   *
+   * @param name The entry's path relative to the obj-cache directory
+   * @param data The entry as stored on disk, possibly compressed
+   * @param len The entry's length
+   * @return Whether the name and the entry are valid and the entry is stored
+   */
+  bool import_entry(const std::string& name, const uint8_t* data, size_t len);
   /**
    * Retrieve an entry from the obj-cache.
    *
@@ -110,8 +125,21 @@ class ObjCache {
    * @param munmap_entry Whether the entry must be freed using munmap()
    */
   static void free_entry(uint8_t *entry, size_t entry_len, bool munmap_entry);
+  /**
+   * Mark the entry as recently used, promoting it to the writable layer if it was found in a
+   * lower layer.
+   */
   void mark_as_used(const Hash &key, const char * const subkey);
+  /**
+   * List the subkeys of key from all layers, the writable layer's subkeys first.
+   */
   std::vector<Subkey> list_subkeys(const Hash &key);
+  /**
+   * Append the subkeys of key found only in the remote cache tier, if it is configured.
+   * The entries of the first max_downloads of these subkeys are downloaded in parallel, the rest
+   * are downloaded by retrieve().
+   */
+  void list_remote_subkeys(const Hash &key, std::vector<Subkey>* subkeys, size_t max_downloads);
   /**
    * Garbage collect the object cache
    * @param referenced_blobs blobs referenced from the object cache entries. It is updated while
@@ -142,9 +170,23 @@ class ObjCache {
   void gc_obj_cache_dir(const std::string& path,
                         tsl::hopscotch_set<AsciiHash>* referenced_blobs, off_t* cache_bytes,
                         off_t* debug_bytes, off_t* unexpected_file_bytes);
+  /**
+   * Check if the entry in the file is well-formed, i.e. it has a known magic header and contains
+   * a process_inputs_outputs message. The entries' names are random, thus they can't be verified
+   * against their content's hash.
+   */
+  static bool entry_file_valid(int fd);
 
   /* Including the "objs" subdir. */
   std::string base_dir_;
+  /* Read-only lower layers, including the "objs" subdir, in lookup order. */
+  std::vector<std::string> lower_dirs_;
+  /* Length of the longest lower layer's path, for sizing path buffers */
+  size_t lower_dirs_max_length_ {0};
+  /* Subkeys of the entries downloaded by list_remote_subkeys() and not retrieved yet */
+  tsl::hopscotch_set<Subkey> remote_prefetched_ {};
+  /* Reused for serializing the entries to be stored */
+  FbbArena serialize_arena_ {};
   static constexpr char kDebugPostfix[] = "_debug.json";
   static constexpr char kDirDebugJson[] = "%_directory_debug.json";
   /* Magic string "FBB\0" followed by 4 bytes of padding for 8-byte alignment */
@@ -19,6 +19,7 @@
 #include <getopt.h>
 
 #include <cstdio>
+#include <cstdlib>
 #include <list>
 #include <string>
 
@@ -41,6 +42,14 @@ bool Options::insert_trace_markers_ = false;
 bool Options::do_gc_ = false;
 bool Options::print_stats_ = false;
 bool Options::reset_stats_ = false;
+bool Options::cache_daemon_ = false;
+const char* Options::export_cache_file_ = nullptr;
+size_t Options::export_runs_ = 0;
+const char* Options::import_cache_file_ = nullptr;
+const char* Options::record_trace_file_ = nullptr;
+const char* Options::replay_trace_file_ = nullptr;
+const char* Options::stats_json_file_ = nullptr;
+const char* Options::trace_events_file_ = nullptr;
 
 void Options::usage() {
   printf(
@@ -72,10 +81,25 @@ void Options::usage() {
       "  -q, --quiet                  Quiet; print error messages only from firebuild.\n"
       "                               The BUILD COMMAND's messages are not affected.\n"
       "  -s, --show-stats             Show cache hit statistics.\n"
+      "      --stats-json=FILE        Write the cache hit statistics and the time spent in the\n"
+      "                               main phases of caching to FILE as JSON.\n"
       "  -z, --zero-stats             Zero cache hit statistics.\n"
       "  -i, --insert-trace-markers   perform open(\"/FIREBUILD <debug_msg>\", 0) calls\n"
       "                               to let users find unintercepted calls using\n"
       "                               strace or ltrace. This works in debug builds only.\n"
+      "      --cache-daemon           Run the cache daemon shared by the firebuild processes\n"
+      "                               using the same cache directory with use_cache_daemon\n"
+      "                               enabled in their configuration.\n"
+      "      --export-cache=FILE      Export the cache entries used or stored by the recently\n"
+      "                               run build commands and the referenced blobs to FILE.\n"
+      "      --export-runs=N          Export the entries of the last N build commands only.\n"
+      "      --import-cache=FILE      Import the entries exported to FILE into the cache.\n"
+      "      --record-trace=FILE      Record the messages received from the BUILD COMMAND's\n"
+      "                               processes to FILE, to be replayed later.\n"
+      "      --replay-trace=FILE      Process the messages recorded in FILE again instead of\n"
+      "                               running a BUILD COMMAND, to profile the supervisor.\n"
+      "      --trace-events=FILE      Write the timeline of the processes and the supervisor's\n"
+      "                               main phases to FILE in Chrome's Trace Event format.\n"
       "      --version                output version information and exit\n"
       "Exit status:\n"
       " exit status of the BUILD COMMAND\n"
@@ -97,8 +121,16 @@ void Options::parse(const int argc, char *argv[]) {
       {"option",               required_argument, 0, 'o' },
       {"quiet",                no_argument,       0, 'q' },
       {"show-stats",           no_argument,       0, 's' },
+      {"stats-json",           required_argument, 0, 'J' },
       {"zero-stats",           no_argument,       0, 'z' },
       {"insert-trace-markers", no_argument,       0, 'i' },
+      {"cache-daemon",         no_argument,       0, 'M' },
+      {"export-cache",         required_argument, 0, 'E' },
+      {"export-runs",          required_argument, 0, 'R' },
+      {"import-cache",         required_argument, 0, 'I' },
+      {"record-trace",         required_argument, 0, 'T' },
+      {"replay-trace",         required_argument, 0, 'P' },
+      {"trace-events",         required_argument, 0, 'V' },
       {"version",              no_argument,       0, 'v' },
       {0,                                0,       0,  0  }
     };
@@ -135,6 +167,40 @@ void Options::parse(const int argc, char *argv[]) {
         exit(EXIT_SUCCESS);
         /* break; */
 
+      case 'M':
+        cache_daemon_ = true;
+        break;
+
+      case 'E':
+        export_cache_file_ = optarg;
+        break;
+
+      case 'R': {
+        char* end;
+        export_runs_ = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0') {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      }
+
+      case 'I':
+        import_cache_file_ = optarg;
+        break;
+
+      case 'T':
+        record_trace_file_ = optarg;
+        break;
+
+      case 'P':
+        replay_trace_file_ = optarg;
+        break;
+
+      case 'V':
+        trace_events_file_ = optarg;
+        break;
+
       case 'o':
         if (optarg != NULL) {
           config_strings_->push_back(std::string(optarg));
@@ -165,6 +231,10 @@ void Options::parse(const int argc, char *argv[]) {
         print_stats_ = true;
         break;
 
+      case 'J':
+        stats_json_file_ = optarg;
+        break;
+
       case 'v':
         printf("Firebuild " FIREBUILD_VERSION "\n\n"
                "Copyright (c) 2022 Firebuild Inc.\n"
@@ -193,15 +263,38 @@ void Options::parse(const int argc, char *argv[]) {
   }
 
   if (optind >= argc) {
-    if (!do_gc_ && !print_stats_ && !reset_stats_) {
+    if (!do_gc_ && !print_stats_ && !reset_stats_ && !cache_daemon_ && !export_cache_file_
+        && !import_cache_file_ && !replay_trace_file_ && !stats_json_file_) {
       usage();
       exit(EXIT_FAILURE);
     }
+    if (record_trace_file_) {
+      printf("The --record-trace option can be used only with a BUILD COMMAND.");
+      exit(EXIT_FAILURE);
+    }
+    if (trace_events_file_ && !replay_trace_file_) {
+      printf("The --trace-events option can be used only with a BUILD COMMAND or "
+             "--replay-trace.");
+      exit(EXIT_FAILURE);
+    }
   } else {
     if (do_gc_) {
       printf("The --gc (or -g) option can be used only without a BUILD COMMAND.");
       exit(EXIT_FAILURE);
     }
+    if (cache_daemon_) {
+      printf("The --cache-daemon option can be used only without a BUILD COMMAND.");
+      exit(EXIT_FAILURE);
+    }
+    if (export_cache_file_ || import_cache_file_) {
+      printf("The --export-cache and --import-cache options can be used only without a "
+             "BUILD COMMAND.");
+      exit(EXIT_FAILURE);
+    }
+    if (replay_trace_file_) {
+      printf("The --replay-trace option can be used only without a BUILD COMMAND.");
+      exit(EXIT_FAILURE);
+    }
   }
 
   if (argc > optind) {
@@ -59,6 +59,10 @@ class Options {
   static bool generate_report() {
     return generate_report_;
   }
+  /** Whether the shortcutting attempts' results are needed, for the report or the trace events. */
+  static bool collect_shortcut_results() {
+    return generate_report_ || trace_events_file_;
+  }
   static bool insert_trace_markers() {
     return insert_trace_markers_;
   }
@@ -71,6 +75,30 @@ class Options {
   static bool reset_stats() {
     return reset_stats_;
   }
+  static bool cache_daemon() {
+    return cache_daemon_;
+  }
+  static const char* export_cache_file() {
+    return export_cache_file_;
+  }
+  static size_t export_runs() {
+    return export_runs_;
+  }
+  static const char* import_cache_file() {
+    return import_cache_file_;
+  }
+  static const char* record_trace_file() {
+    return record_trace_file_;
+  }
+  static const char* replay_trace_file() {
+    return replay_trace_file_;
+  }
+  static const char* stats_json_file() {
+    return stats_json_file_;
+  }
+  static const char* trace_events_file() {
+    return trace_events_file_;
+  }
 
  private:
   static char* config_file_;
@@ -85,6 +113,14 @@ class Options {
   static bool do_gc_;
   static bool print_stats_;
   static bool reset_stats_;
+  static bool cache_daemon_;
+  static const char* export_cache_file_;
+  static size_t export_runs_;
+  static const char* import_cache_file_;
+  static const char* record_trace_file_;
+  static const char* replay_trace_file_;
+  static const char* stats_json_file_;
+  static const char* trace_events_file_;
 };
 
 }  /* namespace firebuild */
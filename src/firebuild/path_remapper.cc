@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/path_remapper.h"
+
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace firebuild {
+
+/* singleton */
+PathRemapper* path_remapper = nullptr;
+
+PathRemapper::PathRemapper(const std::string& root)
+    : root_(root) {
+  assert(root_.length() > 1 && root_[0] == '/' && root_.back() != '/');
+}
+
+cstring_view PathRemapper::stored_path(const FileName* path,
+                                       std::deque<std::string>* storage) const {
+  if (!in_root(path->c_str(), path->length())) {
+    return {path->c_str(), static_cast<uint32_t>(path->length())};
+  }
+  const std::string& remapped =
+      storage->emplace_back(kRootPlaceholder + std::string(path->c_str() + root_.length()));
+  return {remapped.c_str(), static_cast<uint32_t>(remapped.length())};
+}
+
+const FileName* PathRemapper::file_name(const char* stored_path, size_t length) const {
+  const size_t placeholder_len = strlen(kRootPlaceholder);
+  if (length < placeholder_len || memcmp(stored_path, kRootPlaceholder, placeholder_len) != 0) {
+    return FileName::Get(stored_path, length);
+  }
+  std::string path(root_);
+  path.append(stored_path + placeholder_len, length - placeholder_len);
+  return FileName::Get(path);
+}
+
+/** Whether c can continue a file name, i.e. a match of the root directory followed by c is just
+ *  the prefix of a different file name. */
+static bool file_name_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+      || c == '.' || c == '_' || c == '-' || c == '+' || c == '~';
+}
+
+std::string PathRemapper::remap_string(const std::string& str) const {
+  if (str.find(root_) == std::string::npos && str.find('$') == std::string::npos) {
+    return str;
+  }
+  std::string ret;
+  ret.reserve(str.length());
+  size_t i = 0;
+  while (i < str.length()) {
+    const size_t end = i + root_.length();
+    if (str.compare(i, root_.length(), root_) == 0
+        && (end == str.length() || !file_name_char(str[end]))) {
+      ret.append(kRootPlaceholder);
+      i = end;
+    } else {
+      /* Escape '$' to not let "$ROOT" in str collide with the placeholder. */
+      if (str[i] == '$') {
+        ret.push_back('$');
+      }
+      ret.push_back(str[i]);
+      i++;
+    }
+  }
+  return ret;
+}
+
+bool PathRemapper::embeds_root(const void* data, size_t length) const {
+  return memmem(data, length, root_.c_str(), root_.length()) != nullptr;
+}
+
+bool PathRemapper::fd_embeds_root(int fd, off_t offset, off_t length) const {
+  if (length < static_cast<off_t>(root_.length())) {
+    return false;
+  }
+  /* Map from the page containing offset. */
+  const off_t page_size = sysconf(_SC_PAGESIZE);
+  const off_t map_offset = offset - offset % page_size;
+  const size_t map_length = length + (offset - map_offset);
+  void* p = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, map_offset);
+  if (p == MAP_FAILED) {
+    /* Be on the safe side. */
+    return true;
+  }
+  const bool ret = embeds_root(static_cast<char*>(p) + (offset - map_offset), length);
+  munmap(p, map_length);
+  return ret;
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_PATH_REMAPPER_H_
+#define FIREBUILD_PATH_REMAPPER_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <string>
+
+#include "common/cstring_view.h"
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/file_name.h"
+
+namespace firebuild {
+
+/**
+ * Relocation of the build's root directory, to let the same project built in different
+ * directories share cache entries.
+ *
+ * The root directory's path is replaced by the "$ROOT" placeholder in the fingerprints and the
+ * paths stored in the cache entries, and the placeholder is replaced by the current root
+ * directory's path when shortcutting.
+ *
+ * Outputs containing the root directory's path would be wrong when shortcutting in a different
+ * directory, thus processes producing such outputs are not stored in the cache.
+ */
+class PathRemapper {
+ public:
+  /** @param root the absolute, canonical path of the root directory */
+  explicit PathRemapper(const std::string& root);
+
+  static constexpr char kRootPlaceholder[] = "$ROOT";
+
+  const std::string& root() const {return root_;}
+  /**
+   * The path to store in the cache entry.
+   * @param path the path used by the process
+   * @param storage holds the remapped path, if needed
+   * @return the path or the remapped path in storage
+   */
+  cstring_view stored_path(const FileName* path, std::deque<std::string>* storage) const;
+  /** The path a stored path refers to in the current root directory. */
+  const FileName* file_name(const char* stored_path, size_t length) const;
+  /**
+   * Replace occurrences of the root directory's path in an argument or an environment variable,
+   * e.g. in "-I/root/dir/include".
+   * '$' characters are doubled to keep the result unambiguous, i.e. "$ROOT" in str becomes
+   * "$$ROOT".
+   */
+  std::string remap_string(const std::string& str) const;
+  /** Whether the data contains the root directory's path. */
+  bool embeds_root(const void* data, size_t length) const;
+  /** Whether the region of the file contains the root directory's path. */
+  bool fd_embeds_root(int fd, off_t offset, off_t length) const;
+
+ private:
+  /** Whether path is the root directory or it is inside the root directory. */
+  bool in_root(const char* path, size_t length) const {
+    return length >= root_.length() && memcmp(path, root_.c_str(), root_.length()) == 0
+        && (length == root_.length() || path[root_.length()] == '/');
+  }
+  std::string root_;
+  DISALLOW_COPY_AND_ASSIGN(PathRemapper);
+};
+
+/* singleton, NULL if the root directory is not relocated */
+extern PathRemapper *path_remapper;
+
+/**
+ * The file a path stored in a cache entry refers to, considering the root directory's relocation.
+ */
+inline const FileName* stored_path_to_file_name(const char* stored_path, size_t length) {
+  return path_remapper ? path_remapper->file_name(stored_path, length)
+      : FileName::Get(stored_path, length);
+}
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_PATH_REMAPPER_H_
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/phase_timers.h"
+
+#include <assert.h>
+#include <inttypes.h>
+
+namespace firebuild {
+
+uint64_t PhaseTimers::total_ns_[FB_PHASE_COUNT] {};
+uint64_t PhaseTimers::count_[FB_PHASE_COUNT] {};
+uint64_t PhaseTimers::histogram_[FB_PHASE_COUNT][kHistogramBuckets] {};
+
+const char* PhaseTimers::phase_name(timed_phase phase) {
+  switch (phase) {
+    case FB_PHASE_HASHING: return "hashing";
+    case FB_PHASE_FINGERPRINT: return "fingerprint";
+    case FB_PHASE_FIND_SHORTCUT: return "find_shortcut";
+    case FB_PHASE_APPLY_SHORTCUT: return "apply_shortcut";
+    case FB_PHASE_STORE: return "store";
+    case FB_PHASE_PIPE_FORWARDING: return "pipe_forwarding";
+    case FB_PHASE_GC: return "gc";
+    default:
+      assert(0 && "unknown phase");
+      return "unknown";
+  }
+}
+
+void PhaseTimers::write_json(FILE* f) {
+  fprintf(f, "{");
+  for (int phase = 0; phase < FB_PHASE_COUNT; phase++) {
+    fprintf(f, "%s\n    \"%s\": {\"count\": %" PRIu64 ", \"total_ms\": %.3f, "
+            "\"histogram_us\": [", phase == 0 ? "" : ",",
+            phase_name(static_cast<timed_phase>(phase)), count_[phase],
+            static_cast<double>(total_ns_[phase]) / 1000000);
+    bool first = true;
+    for (int bucket = 0; bucket < kHistogramBuckets; bucket++) {
+      if (histogram_[phase][bucket] == 0) {
+        continue;
+      }
+      /* Each bucket is reported with its exclusive upper bound in us, like [4, 12] for 12 calls
+       * taking 2-4 us. The last one is unbounded. */
+      if (bucket == kHistogramBuckets - 1) {
+        fprintf(f, "%s[null, %" PRIu64 "]", first ? "" : ", ", histogram_[phase][bucket]);
+      } else {
+        fprintf(f, "%s[%" PRIu64 ", %" PRIu64 "]", first ? "" : ", ", uint64_t{1} << bucket,
+                histogram_[phase][bucket]);
+      }
+      first = false;
+    }
+    fprintf(f, "]}");
+  }
+  fprintf(f, "\n  }");
+}
+
+}  /* namespace firebuild */
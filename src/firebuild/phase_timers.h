@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_PHASE_TIMERS_H_
+#define FIREBUILD_PHASE_TIMERS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "common/probes.h"
+#include "firebuild/cxx_lang_utils.h"
+#include "firebuild/trace_events.h"
+
+namespace firebuild {
+
+/**
+ * The timed phases of the supervisor's work. Phases may nest, e.g. hashing is also counted in
+ * fingerprinting and storing, thus their times are not to be summed.
+ * New ones can be added to the end, they are stored in the cache counters.
+ */
+enum timed_phase {
+  FB_PHASE_HASHING,
+  FB_PHASE_FINGERPRINT,
+  FB_PHASE_FIND_SHORTCUT,
+  FB_PHASE_APPLY_SHORTCUT,
+  FB_PHASE_STORE,
+  FB_PHASE_PIPE_FORWARDING,
+  FB_PHASE_GC,
+  FB_PHASE_COUNT,
+};
+
+/**
+ * Time spent in each phase of the current run, with a latency histogram per phase.
+ *
+ * Measuring takes two clock_gettime() calls per timed call, thus it is always enabled.
+ */
+class PhaseTimers {
+ public:
+  static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+  static void add(timed_phase phase, uint64_t ns) {
+    total_ns_[phase] += ns;
+    count_[phase]++;
+    const uint64_t us = ns / 1000;
+    histogram_[phase][us == 0 ? 0 : std::min(64 - __builtin_clzll(us), kHistogramBuckets - 1)]++;
+  }
+  static uint64_t total_ns(timed_phase phase) {return total_ns_[phase];}
+  static uint64_t count(timed_phase phase) {return count_[phase];}
+  /** Add the time spent in earlier runs, which are not reflected in the histograms. */
+  static void add_totals(timed_phase phase, uint64_t ns, uint64_t count) {
+    total_ns_[phase] += ns;
+    count_[phase] += count;
+  }
+  static const char* phase_name(timed_phase phase);
+  /**
+   * Whether the phase's calls are added to the trace events. Hashing and pipe forwarding happen
+   * too frequently, they would make the traces of large builds huge.
+   */
+  static bool is_traced(timed_phase phase) {
+    return phase != FB_PHASE_HASHING && phase != FB_PHASE_PIPE_FORWARDING;
+  }
+  /** Write the phases' times and non-empty histogram buckets as a JSON object. */
+  static void write_json(FILE* f);
+
+  /**
+   * Bucket 0 counts the durations below 1 us, bucket i the ones in [2^(i-1), 2^i) us, the last
+   * one the longer ones, too.
+   */
+  static const int kHistogramBuckets {32};
+
+ private:
+  static uint64_t total_ns_[FB_PHASE_COUNT];
+  static uint64_t count_[FB_PHASE_COUNT];
+  static uint64_t histogram_[FB_PHASE_COUNT][kHistogramBuckets];
+};
+
+/** Count the time until going out of scope in the phase. */
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(timed_phase phase) : phase_(phase), start_ns_(PhaseTimers::now_ns()) {
+    FB_PROBE1(phase_start, phase_);
+  }
+  ~PhaseTimer() {
+    const uint64_t end_ns = PhaseTimers::now_ns();
+    const uint64_t ns = end_ns - start_ns_;
+    PhaseTimers::add(phase_, ns);
+    FB_PROBE2(phase_end, phase_, ns);
+    if (trace_events && PhaseTimers::is_traced(phase_)) {
+      trace_events->add_phase(PhaseTimers::phase_name(phase_), start_ns_, end_ns);
+    }
+  }
+
+ private:
+  timed_phase phase_;
+  uint64_t start_ns_;
+  DISALLOW_COPY_AND_ASSIGN(PhaseTimer);
+};
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_PHASE_TIMERS_H_
@@ -23,6 +23,7 @@
 #ifndef __APPLE__
 #include <sys/epoll.h>
 #endif
+#include <sys/stat.h>
 #include <tsl/hopscotch_set.h>
 #include <unistd.h>
 
@@ -39,6 +40,7 @@
 #include "firebuild/epoll.h"
 #include "firebuild/execed_process.h"
 #include "firebuild/file_fd.h"
+#include "firebuild/phase_timers.h"
 #include "firebuild/pipe_recorder.h"
 #include "firebuild/process.h"
 #include "firebuild/process_debug_suppressor.h"
@@ -112,6 +114,7 @@ Pipe::~Pipe() {
   if (fd1_timeout_id_ >= 0) {
     epoll->del_timer(fd1_timeout_id_);
   }
+  close_replay();
 }
 
 std::shared_ptr<Pipe> Pipe::fd0_shared_ptr() {
@@ -278,6 +281,8 @@ void Pipe::finish() {
     send_ret = send_buf();
   } while (!buffer_empty() && send_ret == FB_PIPE_SUCCESS);
 
+  close_replay();
+
   FB_DEBUG(FB_DEBUG_PIPE, "closing pipe fd0: " + d_fd(fd0_conn));
   epoll->maybe_del_fd(fd0_conn, EPOLLOUT);
   close(fd0_conn);
@@ -290,6 +295,36 @@ void Pipe::finish() {
   shared_self_ptr_.reset();
 }
 
+int Pipe::reopen_fd0_for_handoff(int flags) {
+  TRACKX(FB_DEBUG_PIPE, 1, 1, Pipe, this, "flags=%d", flags);
+
+#ifdef __APPLE__
+  (void)flags;
+  return -1;
+#else
+  /* Forward what the other writers have already written, but the supervisor has not read yet. */
+  drain();
+  if (finished() || !buffer_empty()) {
+    /* Data written directly would overtake the buffered data. */
+    return -1;
+  }
+  struct stat64 st;
+  if (fstat64(fd0_conn, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+    /* Reopening regular files would not preserve the offset, terminals and sockets may not be
+     * reopened safely or at all. */
+    return -1;
+  }
+  /* Opening the fifo through /proc creates a new open file description, thus the nonblocking
+   * mode of fd0_conn does not leak to the process. */
+  const std::string path = "/proc/self/fd/" + std::to_string(fd0_conn);
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC | (flags & O_NONBLOCK));
+  if (fd >= 0) {
+    handed_over_ = true;
+  }
+  return fd;
+#endif
+}
+
 void Pipe::pipe_fd1_read_cb(const struct epoll_event* event, void *arg) {
   auto pipe = reinterpret_cast<Pipe*>(arg);
   ProcessDebugSuppressor debug_suppressor(pipe->creator());
@@ -370,6 +405,10 @@ pipe_op_result Pipe::send_buf() {
   TRACKX(FB_DEBUG_PIPE, 1, 1, Pipe, this, "");
 
   assert(!finished());
+  if (replay_fd_ != -1) {
+    /* buf_ is empty while there is data to be replayed. */
+    return send_replay();
+  }
   if (!buffer_empty()) {
     /* There is data to be forwarded. */
     ssize_t sent;
@@ -411,9 +450,74 @@ pipe_op_result Pipe::send_buf() {
   return FB_PIPE_SUCCESS;
 }
 
+pipe_op_result Pipe::send_replay() {
+  TRACKX(FB_DEBUG_PIPE, 1, 1, Pipe, this, "");
+
+  assert(replay_fd_ != -1);
+#ifdef __linux__
+  while (replay_offset_ < replay_end_) {
+    ssize_t sent = splice(replay_fd_, &replay_offset_, fd0_conn, NULL,
+                          replay_end_ - replay_offset_, SPLICE_F_NONBLOCK);
+    FB_DEBUG(FB_DEBUG_PIPE, "sent " + d(sent) + " bytes via fd: "
+             + d_fd(fd0_conn) + " of " + d(this) + " using splice");
+    if (sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* This pipe should not receive more data. */
+        set_send_only_mode(true);
+        return FB_PIPE_WOULDBLOCK;
+      } else if (errno == EPIPE) {
+        FB_DEBUG(FB_DEBUG_PIPE, "ret: FB_PIPE_FD0_EPIPE");
+        return FB_PIPE_FD0_EPIPE;
+      } else {
+        /* fd0 may be a regular file or anything else not supporting splice(). */
+        break;
+      }
+    } else if (sent == 0) {
+      /* The file is shorter than expected. */
+      assert(0 && "unexpected EOF in cached pipe data");
+      replay_offset_ = replay_end_;
+    }
+  }
+#endif
+  if (replay_offset_ < replay_end_) {
+    move_replay_to_buf();
+    return send_buf();
+  }
+  close_replay();
+  if (send_only_mode_) {
+    /* This pipe can now receive more data. */
+    set_send_only_mode(false);
+  }
+  return FB_PIPE_SUCCESS;
+}
+
+void Pipe::move_replay_to_buf() {
+  TRACKX(FB_DEBUG_PIPE, 1, 1, Pipe, this, "");
+
+  assert(replay_fd_ != -1);
+  assert(buf_.length() == 0);
+  if (replay_offset_ < replay_end_) {
+    if (lseek(replay_fd_, replay_offset_, SEEK_SET) == -1) {
+      fb_perror("lseek");
+      assert(0);
+    }
+    buf_.read(replay_fd_, replay_end_ - replay_offset_);
+  }
+  close_replay();
+}
+
+void Pipe::close_replay() {
+  if (replay_fd_ != -1) {
+    close(replay_fd_);
+    replay_fd_ = -1;
+    replay_offset_ = replay_end_ = 0;
+  }
+}
+
 pipe_op_result Pipe::forward(int fd1, bool drain) {
   TRACKX(FB_DEBUG_PIPE, 1, 1, Pipe, this, "fd1=%s, drain=%s",
          D_FD(fd1), D(drain));
+  PhaseTimer timer(FB_PHASE_PIPE_FORWARDING);
 
   pipe_op_result send_ret;
   if (finished()) {
@@ -464,6 +568,10 @@ pipe_op_result Pipe::forward(int fd1, bool drain) {
       } while (received > 0);
     }
 #endif
+    if (replay_fd_ != -1) {
+      /* Keep the order of the replayed data and the data to be read. */
+      move_replay_to_buf();
+    }
     /* Read one round to the buffer and try to send it. */
     received = buf_.read(fd1, -1);
     if (received == -1) {
@@ -581,8 +689,27 @@ void Pipe::drain() {
   } while (restart_iteration);
 }
 
-void Pipe::add_data_from_fd(int fd, size_t len) {
+void Pipe::add_data_from_fd(int fd, loff_t offset, size_t len) {
   if (len > 0) {
+#ifdef __linux__
+    if (buffer_empty()) {
+      /* Let send_buf() splice the data from the file. The fd is kept open for that. */
+      replay_fd_ = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      if (replay_fd_ != -1) {
+        replay_offset_ = offset;
+        replay_end_ = offset + len;
+        send_buf();
+        return;
+      }
+    }
+#endif
+    if (replay_fd_ != -1) {
+      move_replay_to_buf();
+    }
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+      fb_perror("lseek");
+      assert(0);
+    }
     buf_.read(fd, len);
     /* Pipe might represent one of the top process's files inherited for writing, which might even
      * be a regular file (e.g. in case of "firebuild command args > outfile"). We can't directly
@@ -594,6 +721,9 @@ void Pipe::add_data_from_fd(int fd, size_t len) {
 
 void Pipe::add_data_from_buffer(const char* data, size_t len) {
   if (len > 0) {
+    if (replay_fd_ != -1) {
+      move_replay_to_buf();
+    }
     buf_.add(data, len);
     /* Pipe might represent one of the top process's files inherited for writing, which might even
      * be a regular file (e.g. in case of "firebuild command args > outfile"). We can't directly
@@ -193,8 +193,9 @@ class Pipe {
    * this method should successfully write the entire buffer, and thus not call set_send_only_mode().
    */
   pipe_op_result send_buf();
+  /** There is no buffered data nor cached data to be replayed waiting to be sent. */
   bool buffer_empty() {
-    return buf_.length() == 0;
+    return buf_.length() == 0 && replay_fd_ == -1;
   }
   void reset_fd0_ptrs_self_ptr_() {fd0_ptrs_held_self_ptr_.reset();}
   void reset_fd1_ptrs_self_ptr_() {fd1_ptrs_held_self_ptr_.reset();}
@@ -246,9 +247,25 @@ class Pipe {
   }
 
   /**
-   * Add the contents of the given file to the Pipe's buffer. This is used when shortcutting a
-   * process, the cached data is injected into the Pipe. */
-  void add_data_from_fd(int fd, size_t len);
+   * Open a new write end to the destination of the pipe to let an exec()-ed process write to it
+   * directly, bypassing the supervisor.
+   *
+   * The data already written to the incoming fd1 ends is forwarded first. Handing over is possible
+   * only when the destination is a fifo and there is no buffered data left to forward after that.
+   * @param flags flags of the process' FileFD, O_NONBLOCK is kept from them
+   * @return the new fd, or -1 if the pipe can't be handed over
+   */
+  int reopen_fd0_for_handoff(int flags);
+  /** Whether a process received an end of this pipe that bypasses the supervisor. */
+  bool handed_over() const {return handed_over_;}
+
+  /**
+   * Add len bytes of the given file from offset to the Pipe's buffer. This is used when
+   * shortcutting a process, the cached data is injected into the Pipe.
+   *
+   * When there is nothing else to send the data is spliced from the file to fd0 without copying
+   * it to the buffer. The caller may close fd after the call. */
+  void add_data_from_fd(int fd, loff_t offset, size_t len);
   /**
    * Add the given data to the Pipe's buffer. This is used when shortcutting a process, the cached
    * data is injected into the Pipe. */
@@ -261,9 +278,18 @@ class Pipe {
   bool send_only_mode_:1 = false;
   bool fd0_shared_ptr_generated_:1 = false;
   bool fd1_shared_ptr_generated_:1 = false;
+  /** A process received an end of this pipe bypassing the supervisor */
+  bool handed_over_:1 = false;
   /** Number of times the fd1 timeout callback visited the pipe. */
   unsigned int fd1_timeout_round_:3 = 0;
   LinearBuffer buf_;
+  /**
+   * File to be spliced to fd0 from replay_offset_ to replay_end_, or -1.
+   * Only set when buf_ is empty, and it is moved to buf_ before adding more data there, to keep
+   * the order of the data. */
+  int replay_fd_ = -1;
+  loff_t replay_offset_ = 0;
+  loff_t replay_end_ = 0;
   int fd1_timeout_id_ = -1;
   /**
    * Shared self pointer used by fd0 references to clean oneself up only after finish() and keep
@@ -293,6 +319,11 @@ class Pipe {
     }
   }
   void close_one_fd1(int fd);
+  /** Send the data to be replayed from replay_fd_. */
+  pipe_op_result send_replay();
+  /** Read the data still to be replayed to buf_ to be able to append more data after it. */
+  void move_replay_to_buf();
+  void close_replay();
   DISALLOW_COPY_AND_ASSIGN(Pipe);
 };
 
@@ -47,6 +47,11 @@ PipeRecorder::PipeRecorder(const ExecedProcess *for_proc)
 void PipeRecorder::open_backing_file() {
   TRACKX(FB_DEBUG_PIPE, 1, 0, PipeRecorder, this, "");
 
+  /* Prefer an unnamed file that BlobCache can link in place without ever copying the data. */
+  fd_ = fb_open_tmpfile(base_dir_);
+  if (fd_ >= 0) {
+    return;
+  }
   if (asprintf(&filename_, "%s/pipe.XXXXXX", base_dir_) < 0) {
     fb_perror("asprintf");
     assert(0 && "asprintf");
@@ -216,7 +221,7 @@ bool PipeRecorder::store(bool *is_empty_out, Hash *key_out, off_t* stored_bytes,
     /* Some data was seen and written to file. Place it in the blob cache, get its hash. */
     FB_DEBUG(FB_DEBUG_CACHING, "PipeRecorder: storing to blob cache, offset=" + d(offset_));
     *is_empty_out = false;
-    ret = blob_cache->move_store_file(filename_, fd_, offset_, key_out);
+    ret = blob_cache->move_store_file(filename_ ? filename_ : "", fd_, offset_, key_out);
     /* Note: move_store_file() closed the fd_. */
     fd_ = -1;
     *stored_bytes = ret ? offset_ : 0;
@@ -238,7 +243,9 @@ void PipeRecorder::abandon() {
 
   if (fd_ >= 0) {
     close(fd_);
-    unlink(filename_);
+    if (filename_) {
+      unlink(filename_);
+    }
     fd_ = -1;
   }
   free(filename_);
@@ -258,7 +265,9 @@ void PipeRecorder::deactivate() {
 
   if (fd_ >= 0) {
     close(fd_);
-    unlink(filename_);
+    if (filename_) {
+      unlink(filename_);
+    }
     fd_ = -1;
   }
   free(filename_);
@@ -334,15 +343,15 @@ void PipeRecorder::record_data_from_unix_pipe(std::vector<std::shared_ptr<PipeRe
 
 void PipeRecorder::record_data_from_regular_fd(
     std::vector<std::shared_ptr<PipeRecorder>> *recorders,
-    int fd, ssize_t len) {
-  TRACK(FB_DEBUG_PIPE, "#recorders=%" PRIsize ", fd=%d, len=%" PRIssize,
-        recorders->size(), fd, len);
+    int fd, loff_t off_in, ssize_t len) {
+  TRACK(FB_DEBUG_PIPE, "#recorders=%" PRIsize ", fd=%d, off_in=%" PRIloff ", len=%" PRIssize,
+        recorders->size(), fd, off_in, len);
 
   assert_cmp(len, >, 0);
 
   for (std::shared_ptr<PipeRecorder>& recorder : *recorders) {
     if (!recorder->deactivated_) {
-      recorder->add_data_from_regular_fd(fd, 0, len);
+      recorder->add_data_from_regular_fd(fd, off_in, len);
     }
   }
 }
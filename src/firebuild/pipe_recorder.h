@@ -175,6 +175,8 @@ class PipeRecorder {
    */
   bool store(bool *is_empty_out, Hash *key_out, off_t* stored_bytes,
              char **inline_data_out, size_t *inline_data_len_out);
+  /** Whether no data has been recorded so far. */
+  bool empty() const {return offset_ == 0;}
   /** Close the backing fd, drop the data that was written so far. Set to deactivated state. */
   void deactivate();
   /** Close the backing fd, drop the data that was written so far. Set to abandoned state. */
@@ -208,10 +210,10 @@ class PipeRecorder {
   static void record_data_from_unix_pipe(std::vector<std::shared_ptr<PipeRecorder>> *recorders,
                                          int fd, ssize_t len);
   /**
-   * Record the given data, from the beginning of the given regular file, to all the given recorders
-   * that are still active.
+   * Record len bytes of the given regular file from off_in to all the given recorders that are
+   * still active.
    *
-   * The current seek offset is irrelevant. len must match the file's size.
+   * The current seek offset is irrelevant.
    *
    * (This is used when replaying and bubbling up pipe traffic.)
    *
@@ -219,7 +221,7 @@ class PipeRecorder {
    * method taking multiple PipeRecorders at once.
    */
   static void record_data_from_regular_fd(std::vector<std::shared_ptr<PipeRecorder>> *recorders,
-                                          int fd, ssize_t len);
+                                          int fd, loff_t off_in, ssize_t len);
 
   static void set_base_dir(const char *dir);
 
@@ -272,7 +274,7 @@ class PipeRecorder {
    * be recorded by this PipeRecorder, data written to the Pipe by an ancestor of this process
    * won't. Used for debugging only. */
   const ExecedProcess *for_proc_;
-  /* The name of the backing file, if currently opened. */
+  /* The name of the backing file, if currently opened and it is not an unnamed file. */
   char *filename_ = NULL;
   /* The fd, -1 if not yet opened or already closed. */
   int fd_ {-1};
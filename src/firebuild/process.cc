@@ -53,6 +53,9 @@
 #include "firebuild/execed_process_env.h"
 #include "firebuild/process_tree.h"
 #include "firebuild/debug.h"
+#include "firebuild/options.h"
+#include "firebuild/phase_timers.h"
+#include "firebuild/trace_events.h"
 #include "firebuild/utils.h"
 
 namespace firebuild {
@@ -1966,7 +1969,10 @@ void Process::terminate_top_orphans() const {
      * then it is safe to assume that all orphans are still running or are zombies waiting for being
      * reaped, thus they can be kill()-ed by pid. */
     FB_DEBUG(FB_DEBUG_PROC, "Killing top orphan process " + d(this));
-    kill(pid(), SIGTERM);
+    if (!Options::replay_trace_file()) {
+      /* The pids of a replayed trace belong to processes which are long gone. */
+      kill(pid(), SIGTERM);
+    }
     /* Continue with all fork children of this exec chain. The processes of this exec chain are
      * not kill()-ed again. */
     const Process* curr = this;
@@ -2084,6 +2090,9 @@ void Process::finish() {
   }
 
   set_state(FB_PROC_TERMINATED);
+  if (trace_events && exec_started()) {
+    static_cast<ExecedProcess*>(this)->set_end_ns(PhaseTimers::now_ns());
+  }
   /* Here we check only the fork children. In theory this parent could exec() and the
    * execed process could wait for its children, but this is rare and costly to detect thus
    * we disable shortcutting in more cases than it is absolutely needed.
@@ -79,9 +79,10 @@ void ProcessTree::insert(Process *p) {
   insert_process(p);
 }
 
-void ProcessTree::insert_root(pid_t root_pid, int stdin_fd, int stdout_fd, int stderr_fd) {
-  TRACK(FB_DEBUG_PROCTREE, "root_pid=%d", root_pid);
-  root_ = new firebuild::ForkedProcess(root_pid, getpid(), nullptr,
+void ProcessTree::insert_root(pid_t root_pid, int stdin_fd, int stdout_fd, int stderr_fd,
+                              pid_t supervisor_pid) {
+  TRACK(FB_DEBUG_PROCTREE, "root_pid=%d, supervisor_pid=%d", root_pid, supervisor_pid);
+  root_ = new firebuild::ForkedProcess(root_pid, supervisor_pid, nullptr,
                                        new std::vector<std::shared_ptr<FileFD>>());
   root_->set_state(firebuild::FB_PROC_TERMINATED);
   // TODO(rbalint) support other inherited fds
@@ -51,6 +51,9 @@ struct subcmd_prof {
 struct cmd_prof {
   int64_t aggr_time_u = 0;
   int64_t cmd_time_u = 0;
+  /** Time spent waiting for ACKs in the command's processes and the number of waits */
+  int64_t ack_wait_ns = 0;
+  int64_t ack_waits = 0;
   /**  {time_u, count} */
   tsl::hopscotch_map<std::string, subcmd_prof> subcmds = {};
 };
@@ -122,7 +125,13 @@ class ProcessTree {
   ~ProcessTree();
 
   void insert(Process *p);
-  void insert_root(pid_t root_pid, int stdin_fd, int stdout_fd, int stderr_fd);
+  /**
+   * Add the process forked by the supervisor to run the build command.
+   * @param supervisor_pid the supervisor's pid, which differs from the current one when replaying
+   *        a recorded trace
+   */
+  void insert_root(pid_t root_pid, int stdin_fd, int stdout_fd, int stderr_fd,
+                   pid_t supervisor_pid);
   ForkedProcess* root() {return root_;}
   const FileName* top_dir() const {return top_dir_;}
   Process* pid2proc(int pid) {
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/remote_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/firebuild_common.h"
+#include "firebuild/debug.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+RemoteCache *remote_cache = nullptr;
+
+/* Give up on a request if the server does not respond in this many seconds. */
+static const int kRemoteCacheTimeoutSec = 10;
+/* Give up on connecting to the server after this many milliseconds. */
+static const int kRemoteCacheConnectTimeoutMs = 500;
+/* Maximum size of the response's status line and headers. */
+static const size_t kMaxResponseHeaderSize = 16 * 1024;
+static const size_t kTransferBufferSize = 64 * 1024;
+
+RemoteCache::RemoteCache(const std::string& url, int parallel_downloads)
+    : parallel_downloads_(std::max(parallel_downloads, 1)) {
+  if (!parse_url(url)) {
+    disable("invalid remote cache URL: " + url);
+  }
+}
+
+RemoteCache::~RemoteCache() {
+  finish_uploads();
+}
+
+bool RemoteCache::parse_url(const std::string& url) {
+  const std::string scheme = "http://";
+  if (url.compare(0, scheme.length(), scheme) != 0) {
+    return false;
+  }
+  const size_t host_start = scheme.length();
+  const size_t path_start = std::min(url.find('/', host_start), url.length());
+  const std::string host_port = url.substr(host_start, path_start - host_start);
+  const size_t colon = host_port.rfind(':');
+  if (colon != std::string::npos && host_port.find(']', colon) == std::string::npos) {
+    host_ = host_port.substr(0, colon);
+    port_ = host_port.substr(colon + 1);
+  } else {
+    host_ = host_port;
+    port_ = "80";
+  }
+  /* Strip the brackets around IPv6 addresses. */
+  if (host_.length() > 1 && host_.front() == '[' && host_.back() == ']') {
+    host_ = host_.substr(1, host_.length() - 2);
+  }
+  prefix_ = url.substr(path_start);
+  while (!prefix_.empty() && prefix_.back() == '/') {
+    prefix_.pop_back();
+  }
+  return !host_.empty() && !port_.empty();
+}
+
+void RemoteCache::disable(const std::string& reason) {
+  if (!disabled_.exchange(true)) {
+    fb_info("Not using the remote cache: " + reason);
+  }
+}
+
+/** Connect the blocking socket, giving up after timeout_ms milliseconds. */
+static bool connect_with_timeout(int sock, const struct sockaddr *addr, socklen_t addrlen,
+                                 int timeout_ms) {
+  const int flags = fcntl(sock, F_GETFL);
+  if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return false;
+  }
+  bool connected = connect(sock, addr, addrlen) == 0;
+  if (!connected && errno == EINPROGRESS) {
+    struct pollfd pfd = {sock, POLLOUT, 0};
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    connected = TEMP_FAILURE_RETRY(poll(&pfd, 1, timeout_ms)) == 1
+        && getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0;
+  }
+  return connected && fcntl(sock, F_SETFL, flags) == 0;
+}
+
+int RemoteCache::connect_to_server() {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addrs;
+  int ret = getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addrs);
+  if (ret != 0) {
+    disable("could not resolve " + host_ + ": " + gai_strerror(ret));
+    return -1;
+  }
+  int sock = -1;
+  for (struct addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock == -1) {
+      continue;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    struct timeval timeout = {kRemoteCacheTimeoutSec, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect_with_timeout(sock, addr->ai_addr, addr->ai_addrlen,
+                             kRemoteCacheConnectTimeoutMs)) {
+      break;
+    }
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(addrs);
+  if (sock == -1) {
+    disable("could not connect to " + host_ + ":" + port_);
+  }
+  return sock;
+}
+
+/** Write the whole buffer to the socket. */
+static bool send_all(int sock, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = fb_write(sock, buf, len);
+    if (ret <= 0) {
+      return false;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+/** Deliver a part of the response's body to its destination. */
+static bool deliver_body(const char* buf, size_t len, int dst_fd, std::string* dst_str) {
+  if (dst_fd != -1) {
+    return fb_write(dst_fd, buf, len) == static_cast<ssize_t>(len);
+  }
+  if (dst_str) {
+    dst_str->append(buf, len);
+  }
+  return true;
+}
+
+int RemoteCache::request(const char* method, const std::string& path, int body_fd,
+                         off_t body_size, int dst_fd, std::string* dst_str) {
+  if (disabled_) {
+    return -1;
+  }
+  int sock = connect_to_server();
+  if (sock == -1) {
+    return -1;
+  }
+  const std::string header = std::string(method) + " " + prefix_ + "/" + path + " HTTP/1.1\r\n"
+      + "Host: " + host_ + ":" + port_ + "\r\n"
+      + "Connection: close\r\n"
+      + (body_fd != -1 ? "Content-Length: " + std::to_string(body_size) + "\r\n" : "")
+      + "\r\n";
+  char* buf = static_cast<char*>(malloc(kTransferBufferSize));
+  bool ok = send_all(sock, header.c_str(), header.length());
+  off_t to_send = body_fd != -1 ? body_size : 0;
+  while (ok && to_send > 0) {
+    ssize_t got = TEMP_FAILURE_RETRY(
+        read(body_fd, buf, std::min(kTransferBufferSize, static_cast<size_t>(to_send))));
+    if (got <= 0) {
+      if (got < 0) {
+        fb_perror("read");
+      }
+      ok = false;
+      break;
+    }
+    ok = send_all(sock, buf, got);
+    to_send -= got;
+  }
+
+  /* Read the status line and the headers. */
+  size_t header_len = 0;
+  const char* header_end = nullptr;
+  while (ok && !header_end) {
+    if (header_len == kTransferBufferSize - 1) {
+      ok = false;
+      break;
+    }
+    ssize_t got = TEMP_FAILURE_RETRY(read(sock, buf + header_len,
+                                          kTransferBufferSize - 1 - header_len));
+    if (got <= 0) {
+      ok = false;
+      break;
+    }
+    header_len += got;
+    buf[header_len] = '\0';
+    header_end = strstr(buf, "\r\n\r\n");
+    if (!header_end && header_len > kMaxResponseHeaderSize) {
+      ok = false;
+    }
+  }
+  int status = -1;
+  if (ok && sscanf(buf, "HTTP/1.%*d %d", &status) != 1) {
+    ok = false;
+  }
+  off_t content_length = -1;
+  if (ok) {
+    for (const char* line = strstr(buf, "\r\n"); line && line < header_end;
+         line = strstr(line + 2, "\r\n")) {
+      if (strncasecmp(line + 2, "Content-Length:", strlen("Content-Length:")) == 0) {
+        content_length = strtoll(line + 2 + strlen("Content-Length:"), NULL, 10);
+      } else if (strncasecmp(line + 2, "Transfer-Encoding:", strlen("Transfer-Encoding:")) == 0) {
+        /* Chunked encoding is not supported, the reference server does not use it. */
+        ok = false;
+      }
+    }
+  }
+
+  /* Read the body. The connection is closed by the server after sending the response. */
+  if (ok) {
+    const bool want_body = status == 200;
+    const char* body_start = header_end + 4;
+    size_t buffered = buf + header_len - body_start;
+    off_t received = buffered;
+    if (want_body) {
+      ok = deliver_body(body_start, buffered, dst_fd, dst_str);
+    }
+    while (ok && (content_length == -1 || received < content_length)) {
+      ssize_t got = TEMP_FAILURE_RETRY(read(sock, buf, kTransferBufferSize));
+      if (got < 0) {
+        ok = false;
+      } else if (got == 0) {
+        /* EOF is OK only when the length is not known in advance. */
+        ok = content_length == -1;
+        break;
+      } else {
+        received += got;
+        if (want_body) {
+          ok = deliver_body(buf, got, dst_fd, dst_str);
+        }
+      }
+    }
+  }
+  free(buf);
+  close(sock);
+  return ok ? status : -1;
+}
+
+bool RemoteCache::get(const std::string& path, std::string* body) {
+  return request("GET", path, -1, 0, -1, body) == 200;
+}
+
+off_t RemoteCache::download(const std::string& path, const char* dst_dir, const char* dst_path,
+                            const std::function<bool(int fd)>& verify) {
+  if (disabled_) {
+    return -1;
+  }
+  char *tmpfile = NULL;
+  int fd_dst = fb_open_tmpfile(dst_dir);
+  if (fd_dst == -1) {
+    if (asprintf(&tmpfile, "%s/new.XXXXXX", dst_dir) < 0) {
+      return -1;
+    }
+    fd_dst = mkstemp(tmpfile);
+    if (fd_dst == -1) {
+      free(tmpfile);
+      return -1;
+    }
+  }
+  bool success = request("GET", path, -1, 0, fd_dst, nullptr) == 200;
+  struct stat64 st;
+  success = success && fstat64(fd_dst, &st) == 0;
+  if (success && verify && !verify(fd_dst)) {
+    fb_error("Downloaded " + path + " is corrupt, ignoring it");
+    success = false;
+  }
+  if (success) {
+    /* EEXIST means that the file has just been placed there by someone else, which is fine. */
+    success = (tmpfile ? fb_renameat2(AT_FDCWD, tmpfile, AT_FDCWD, dst_path, RENAME_NOREPLACE)
+               : fb_link_tmpfile(fd_dst, dst_path)) == 0 || errno == EEXIST;
+  }
+  close(fd_dst);
+  if (tmpfile) {
+    if (!success || access(tmpfile, F_OK) == 0) {
+      unlink(tmpfile);
+    }
+    free(tmpfile);
+  }
+  if (!success) {
+    return -1;
+  }
+  downloaded_bytes_ += st.st_size;
+  return st.st_size;
+}
+
+void RemoteCache::download_parallel(const char* dst_dir,
+                                    std::vector<remote_download_t>* downloads) {
+  if (disabled_ || downloads->empty()) {
+    return;
+  }
+  std::atomic<size_t> next {0};
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < downloads->size()) {
+      remote_download_t& item = (*downloads)[i];
+      item.size = download(item.path, dst_dir, item.dst_path.c_str(), item.verify);
+    }
+  };
+  std::vector<std::thread> threads;
+  const size_t thread_count =
+      std::min(static_cast<size_t>(parallel_downloads_), downloads->size());
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.push_back(start_thread_without_signals(worker));
+  }
+  /* The calling thread participates, too. */
+  worker();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+bool RemoteCache::upload(const remote_upload_t& item) {
+  int fd = open(item.src_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    /* The file may have been removed by garbage collection since. */
+    return false;
+  }
+  struct stat64 st;
+  int status = -1;
+  off_t size = 0;
+  if (fstat64(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    size = item.src_size >= 0 ? item.src_size : st.st_size;
+    if (item.src_offset + size <= st.st_size
+        && (item.src_offset == 0 || lseek(fd, item.src_offset, SEEK_SET) == item.src_offset)) {
+      status = request("PUT", item.path, fd, size, -1, nullptr);
+    }
+  }
+  close(fd);
+  if (status < 200 || status >= 300) {
+    return false;
+  }
+  uploaded_bytes_ += size;
+  return true;
+}
+
+void RemoteCache::upload_loop() {
+  std::unique_lock<std::mutex> lock(upload_mutex_);
+  while (true) {
+    upload_cond_.wait(lock, [this] {return !upload_queue_.empty() || stopping_;});
+    if (upload_queue_.empty()) {
+      return;
+    }
+    const remote_upload_t item = std::move(upload_queue_.front());
+    upload_queue_.pop_front();
+    lock.unlock();
+    if (!upload(item)) {
+      failed_uploads_++;
+    }
+    lock.lock();
+  }
+}
+
+void RemoteCache::upload_async(const std::string& path, const std::string& src_path,
+                               off_t src_offset, off_t src_size) {
+  if (disabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(upload_mutex_);
+  upload_queue_.push_back({path, src_path, src_offset, src_size});
+  if (!uploader_.joinable()) {
+    uploader_ = start_thread_without_signals([this] {upload_loop();});
+  }
+  upload_cond_.notify_one();
+}
+
+void RemoteCache::finish_uploads() {
+  {
+    std::lock_guard<std::mutex> lock(upload_mutex_);
+    stopping_ = true;
+  }
+  upload_cond_.notify_one();
+  if (uploader_.joinable()) {
+    uploader_.join();
+  }
+  stopping_ = false;
+}
+
+}  /* namespace firebuild */
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_REMOTE_CACHE_H_
+#define FIREBUILD_REMOTE_CACHE_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "firebuild/cxx_lang_utils.h"
+
+namespace firebuild {
+
+typedef struct remote_download_ {
+  /* Path relative to the cache's root, e.g. "blobs/x/xx/<key>" */
+  std::string path;
+  /* Where to place the downloaded file */
+  std::string dst_path;
+  /* Downloaded bytes, or -1 if the download failed */
+  off_t size {-1};
+  /* Check of the downloaded file's content, or empty */
+  std::function<bool(int fd)> verify {};
+} remote_download_t;
+
+typedef struct remote_upload_ {
+  /* Path relative to the cache's root */
+  std::string path;
+  /* The local file to upload */
+  std::string src_path;
+  /* The uploaded region of the local file, the whole file if src_size is -1 */
+  off_t src_offset {0};
+  off_t src_size {-1};
+} remote_upload_t;
+
+/**
+ * The remote cache tier, shared by multiple machines. It is consulted after the writable local
+ * cache directory and the read-only lower layers.
+ *
+ * The protocol is plain HTTP/1.1 (without TLS) mirroring the local cache directory's layout:
+ * - GET <url>/<path> returns the file, e.g. <url>/blobs/x/xx/<key> or
+ *   <url>/objs/x/xx/<key>/<subkey>, or 404 if it is missing.
+ * - GET <url>/<path>/ returns the names of the entries in the directory, one per line,
+ *   or 404 if it is missing.
+ * - PUT <url>/<path> stores the file.
+ *
+ * Downloaded files are placed in the writable local cache directory. Uploads are queued and
+ * performed by a background thread in the order they were requested, thus blobs stored for a
+ * process reach the server before the entry referencing them.
+ *
+ * The first failure to reach the server disables the remote tier for the rest of the run.
+ * Requests are performed synchronously, thus connecting to an unreachable server times out
+ * quickly.
+ */
+class RemoteCache {
+ public:
+  /**
+   * @param url the server's URL in http://host[:port][/prefix] form
+   * @param parallel_downloads maximum number of concurrent downloads in download_parallel()
+   */
+  RemoteCache(const std::string& url, int parallel_downloads);
+  ~RemoteCache();
+  /** Whether the remote tier is usable, i.e. the URL is valid and the server has not failed. */
+  bool usable() const {return !disabled_;}
+  /**
+   * Fetch a small resource into a string.
+   * @return whether the resource was found
+   */
+  bool get(const std::string& path, std::string* body);
+  /**
+   * Download a file atomically, creating it only when it is fully downloaded.
+   * @param path path relative to the cache's root
+   * @param dst_dir directory on the same file system as dst_path for the temporary file
+   * @param dst_path where to place the file
+   * @param verify if not empty, the downloaded file is placed only if this accepts its content
+   * @return the file's size, or -1 if it could not be downloaded
+   */
+  off_t download(const std::string& path, const char* dst_dir, const char* dst_path,
+                 const std::function<bool(int fd)>& verify = {});
+  /**
+   * Download multiple files concurrently, using up to parallel_downloads connections.
+   * @param dst_dir directory on the same file system as the destinations for the temporary files
+   * @param[in,out] downloads files to download, their size field is updated
+   */
+  void download_parallel(const char* dst_dir, std::vector<remote_download_t>* downloads);
+  /**
+   * Queue a file for uploading in the background.
+   * @param path path relative to the cache's root
+   * @param src_path the local file to upload, which is opened only when it gets uploaded
+   * @param src_offset the offset of the data to upload in the local file
+   * @param src_size the size of the data to upload, or -1 to upload the whole file
+   */
+  void upload_async(const std::string& path, const std::string& src_path, off_t src_offset = 0,
+                    off_t src_size = -1);
+  /** Wait until all queued uploads are finished. */
+  void finish_uploads();
+  off_t downloaded_bytes() const {return downloaded_bytes_;}
+  off_t uploaded_bytes() const {return uploaded_bytes_;}
+  unsigned int failed_uploads() const {return failed_uploads_;}
+
+ private:
+  bool parse_url(const std::string& url);
+  /** Connect to the server giving up after a short timeout, @return the socket or -1 */
+  int connect_to_server();
+  /**
+   * Perform a single request on a new connection.
+   * @param method "GET" or "PUT"
+   * @param path path relative to the cache's root
+   * @param body_fd file to send as the request's body, or -1
+   * @param body_size size of the request's body
+   * @param dst_fd the response's body is written here if it is not -1
+   * @param dst_str the response's body is appended here if it is not NULL
+   * @return the HTTP status code, or -1 on connection or protocol errors
+   */
+  int request(const char* method, const std::string& path, int body_fd, off_t body_size,
+              int dst_fd, std::string* dst_str);
+  bool upload(const remote_upload_t& item);
+  void upload_loop();
+  void disable(const std::string& reason);
+
+  std::string host_ {};
+  std::string port_ {};
+  /* Path prefix on the server, without the trailing '/' */
+  std::string prefix_ {};
+  int parallel_downloads_;
+  std::atomic<bool> disabled_ {false};
+  std::atomic<off_t> downloaded_bytes_ {0};
+  std::atomic<off_t> uploaded_bytes_ {0};
+  std::atomic<unsigned int> failed_uploads_ {0};
+
+  std::thread uploader_ {};
+  std::mutex upload_mutex_ {};
+  std::condition_variable upload_cond_ {};
+  std::deque<remote_upload_t> upload_queue_ {};
+  bool stopping_ {false};
+  DISALLOW_COPY_AND_ASSIGN(RemoteCache);
+};
+
+/* singleton, NULL if the remote tier is not configured */
+extern RemoteCache *remote_cache;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_REMOTE_CACHE_H_
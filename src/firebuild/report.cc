@@ -25,7 +25,6 @@
 #include <cstdio>
 #include <limits>
 #include <set>
-#include <sstream>
 #include <string>
 #include <vector>
 
@@ -70,28 +69,6 @@ struct string_vector_ptr_eq {
 tsl::hopscotch_map<const std::vector<std::string>*, int, struct string_vector_ptr_hash,
                    struct string_vector_ptr_eq> used_envs_index_map {};
 
-/**
- * Escape std::string for JavaScript
- * from http://stackoverflow.com/questions/7724448/simple-json-string-escape-for-c
- * TODO: use JSONCpp instead to handle all cases
- */
-static std::string escapeJsonString(const std::string& input) {
-  std::ostringstream ss;
-  for (auto iter = input.cbegin(); iter != input.cend(); iter++) {
-    switch (*iter) {
-      case '\\': ss << "\\\\"; break;
-      case '"': ss << "\\\""; break;
-      case '\b': ss << "\\b"; break;
-      case '\f': ss << "\\f"; break;
-      case '\n': ss << "\\n"; break;
-      case '\r': ss << "\\r"; break;
-      case '\t': ss << "\\t"; break;
-      default: ss << *iter; break;
-    }
-  }
-  return ss.str();
-}
-
 static const char* full_relative_path_or_basename(const char *name) {
   const char* name_last_slash = strrchr(name, '/');
   return name_last_slash && path_is_absolute(name) ? name_last_slash + 1 : name;
@@ -209,6 +186,8 @@ static void export2js(const ExecedProcess* proc, const unsigned int level,
   fprintf(stream, "%s utime_u: %" PRId64 ",\n", indent, proc->utime_u());
   fprintf(stream, "%s stime_u: %" PRId64 ",\n", indent, proc->stime_u());
   fprintf(stream, "%s aggr_time_u: %" PRId64 ",\n", indent, proc->aggr_cpu_time_u());
+  fprintf(stream, "%s ack_wait_ns: %" PRId64 ",\n", indent, proc->ack_wait_ns());
+  fprintf(stream, "%s ack_waits: %" PRId64 ",\n", indent, proc->ack_waits());
 }
 
 static void export2js_recurse_ep(const ExecedProcess* proc, const unsigned int level, FILE* stream,
@@ -334,6 +313,8 @@ static void build_profile(const Process &p,
       first_visited = true;
     }
     cmd_prof.cmd_time_u += e->utime_u() +  e->stime_u();
+    cmd_prof.ack_wait_ns += e->ack_wait_ns();
+    cmd_prof.ack_waits += e->ack_waits();
     profile_collect_cmds(p, &cmd_prof.subcmds, ancestors);
   }
   if (p.exec_child() != NULL) {
@@ -411,11 +392,14 @@ static void export_profile2dot(FILE* stream) {
   for (auto& pair : cmd_profs) {
     fprintf(stream, "    \"%s\" [label=<<B>%s</B><BR/>", pair.first.c_str(),
             full_relative_path_or_basename(pair.first.c_str()));
-    fprintf(stream, "%.2lf%%<BR/>(%.2lf%%)>, color=\"%s\"]\n",
-            percent_of(pair.second.aggr_time_u, build_time),
-            percent_of(pair.second.cmd_time_u, build_time),
-            pct_to_hsv_str(percent_of(pair.second.aggr_time_u,
-                                      build_time)).c_str());
+    fprintf(stream, "%.2lf%%<BR/>(%.2lf%%)", percent_of(pair.second.aggr_time_u, build_time),
+            percent_of(pair.second.cmd_time_u, build_time));
+    if (pair.second.ack_waits > 0) {
+      fprintf(stream, "<BR/>ACK waits: %.2lf ms ×%" PRId64,
+              static_cast<double>(pair.second.ack_wait_ns) / 1000000, pair.second.ack_waits);
+    }
+    fprintf(stream, ">, color=\"%s\"]\n",
+            pct_to_hsv_str(percent_of(pair.second.aggr_time_u, build_time)).c_str());
     for (auto& pair2 : pair.second.subcmds) {
       fprintf(stream, "    \"%s\" -> \"%s\" [label=\"",
               pair.first.c_str(), pair2.first.c_str());
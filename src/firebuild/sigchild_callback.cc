@@ -18,14 +18,26 @@
 
 #include "firebuild/sigchild_callback.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <tsl/hopscotch_map.h>
+#include <tsl/hopscotch_set.h>
+#include <unistd.h>
 
+#include <cstdint>
 #include <cstdio>
 #include <string>
 
+#include "firebuild/config.h"
 #include "firebuild/debug.h"
 #include "firebuild/firebuild.h"
+#include "firebuild/message_trace.h"
 #include "firebuild/process_debug_suppressor.h"
 #include "firebuild/process_tree.h"
 
@@ -44,48 +56,46 @@ static void save_child_status(pid_t pid, int status, int * ret, bool orphan) {
              + " process exited with status " + std::to_string(*ret) + ". ("
              + d(proc_tree->pid2proc(pid)) + ")");
   } else if (WIFSIGNALED(status)) {
-    fprintf(stderr, "%s process has been killed by signal %d\n",
+    fprintf(stderr, "%s process has been killed by signal %d%s\n",
             orphan ? "Orphan" : "Child",
-            WTERMSIG(status));
+            WTERMSIG(status), WCOREDUMP(status) ? " (core dumped)" : "");
   }
 }
 
-/* This is the actual business logic for SIGCHLD, called synchronously when processing the events
- * returned by epoll_wait(). */
-void sigchild_cb(const struct epoll_event* event, void *arg) {
-  TRACK(FB_DEBUG_PROC, "");
-
-  (void)event;  /* unused */
-  (void)arg;    /* unused */
-
-  char dummy;
-  int read_ret = read(sigchild_selfpipe[0], &dummy, 1);
-  (void)read_ret;  /* unused */
+void handle_exited_child(pid_t pid, int status) {
+  if (message_trace) {
+    message_trace->record_child_exit(pid, status);
+  }
+  if (pid == child_pid) {
+    /* This is the top process the supervisor started. */
+    Process* proc = proc_tree->pid2proc(child_pid);
+    assert(proc);
+    ProcessDebugSuppressor debug_suppressor(proc);
+    save_child_status(pid, status, &child_ret, false);
+    proc->set_been_waited_for();
+  } else {
+    /* This is an orphan process. Its fork parent quit without wait()-ing for it
+     * and as a subreaper the supervisor received the SIGCHLD for it. */
+    Process* proc = proc_tree->pid2proc(pid);
+    if (proc) {
+      /* Since the parent of this orphan process did not wait() for it, it will not be stored in
+       * the cache even when finalizing it. */
+      assert(!proc->been_waited_for());
+    }
+    int ret = -1;
+    save_child_status(pid, status, &ret, true);
+  }
+}
 
+static void collect_exited_children() {
   int status = 0;
   pid_t waitpid_ret;
 
   /* Collect exiting children. */
   do {
     waitpid_ret = waitpid(-1, &status, WNOHANG);
-    if (waitpid_ret == child_pid) {
-      /* This is the top process the supervisor started. */
-      Process* proc = proc_tree->pid2proc(child_pid);
-      assert(proc);
-      ProcessDebugSuppressor debug_suppressor(proc);
-      save_child_status(waitpid_ret, status, &child_ret, false);
-      proc->set_been_waited_for();
-    } else if (waitpid_ret > 0) {
-      /* This is an orphan process. Its fork parent quit without wait()-ing for it
-       * and as a subreaper the supervisor received the SIGCHLD for it. */
-      Process* proc = proc_tree->pid2proc(waitpid_ret);
-      if (proc) {
-        /* Since the parent of this orphan process did not wait() for it, it will not be stored in
-         * the cache even when finalizing it. */
-        assert(!proc->been_waited_for());
-      }
-      int ret = -1;
-      save_child_status(waitpid_ret, status, &ret, true);
+    if (waitpid_ret > 0) {
+      handle_exited_child(waitpid_ret, status);
     }
   } while (waitpid_ret > 0);
 
@@ -100,5 +110,154 @@ void sigchild_cb(const struct epoll_event* event, void *arg) {
   }
 }
 
+/* This is the actual business logic for SIGCHLD, called synchronously when processing the events
+ * returned by epoll_wait(). */
+void sigchild_cb(const struct epoll_event* event, void *arg) {
+  TRACK(FB_DEBUG_PROC, "");
+
+  (void)event;  /* unused */
+  (void)arg;    /* unused */
+
+  char dummy;
+  int read_ret = read(sigchild_selfpipe[0], &dummy, 1);
+  (void)read_ret;  /* unused */
+
+  collect_exited_children();
+}
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/** Tracked children and their pidfds */
+static tsl::hopscotch_map<pid_t, int> *pid2pidfd = nullptr;
+/** Processes that could not be tracked yet, like orphans not reparented to the supervisor yet */
+static tsl::hopscotch_set<pid_t> *untracked_pids = nullptr;
+/** Timer for collecting the children without pidfds, or -1 */
+static int poll_children_timer_id = -1;
+
+static void maybe_poll_children();
+static bool try_track_child_exit(pid_t pid);
+
+static void poll_children_timer_cb(void* arg) {
+  (void)arg;  /* unused */
+  poll_children_timer_id = -1;
+  collect_exited_children();
+  /* Track the processes that have become the supervisor's children since the last attempt and
+   * forget the ones that are gone. */
+  for (auto it = untracked_pids->begin(); it != untracked_pids->end();) {
+    if (try_track_child_exit(*it)) {
+      it = untracked_pids->erase(it);
+    } else {
+      ++it;
+    }
+  }
+  maybe_poll_children();
+}
+
+/**
+ * Without SIGCHLD only the tracked children's exits wake up the supervisor. Poll for the exits of
+ * the untracked children while there are any, or while there are no tracked children at all.
+ */
+static void maybe_poll_children() {
+  if (listener >= 0 && poll_children_timer_id == -1
+      && (pid2pidfd->empty() || !untracked_pids->empty())) {
+    poll_children_timer_id = epoll->add_timer(100, poll_children_timer_cb, nullptr);
+  }
+}
+
+static void pidfd_cb(const struct epoll_event* event, void *arg) {
+  const int pidfd = Epoll::event_fd(event);
+  const pid_t pid = static_cast<pid_t>(reinterpret_cast<intptr_t>(arg));
+  TRACK(FB_DEBUG_PROC, "pid=%d, pidfd=%d", pid, pidfd);
+
+  /* The child exited. The pidfd refers to this very process even if the pid got reused. */
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  const bool reaped = waitid(static_cast<idtype_t>(P_PIDFD), pidfd, &info, WEXITED | WNOHANG) == 0
+      && info.si_pid == pid;
+  epoll->del_fd(pidfd, EPOLLIN);
+  close(pidfd);
+  pid2pidfd->erase(pid);
+
+  if (reaped) {
+    int status;
+    if (info.si_code == CLD_EXITED) {
+      status = W_EXITCODE(info.si_status, 0);
+    } else {
+      status = W_EXITCODE(0, info.si_status) | (info.si_code == CLD_DUMPED ? WCOREFLAG : 0);
+    }
+    handle_exited_child(pid, status);
+  }
+  /* Collect the untracked children, too, and stop listening when there are no children left. */
+  collect_exited_children();
+  maybe_poll_children();
+}
+
+bool pidfd_child_tracking_supported() {
+  int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+  if (pidfd == -1) {
+    return false;
+  }
+  /* waitid(P_PIDFD, ...) is supported since a later kernel version than pidfd_open(). */
+  siginfo_t info;
+  const bool supported = waitid(static_cast<idtype_t>(P_PIDFD), pidfd, &info,
+                                WEXITED | WNOHANG | WNOWAIT) == -1 && errno == ECHILD;
+  close(pidfd);
+  return supported;
+}
+
+/**
+ * Start watching the exit of the process if it is the supervisor's child.
+ * @return whether the process is tracked now or it is already gone
+ */
+static bool try_track_child_exit(pid_t pid) {
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd == -1) {
+    /* The process is already gone. */
+    return true;
+  }
+  /* Check if the process is the supervisor's child. An orphan may not have been reparented yet,
+   * or it may have been reaped already and the pid may have been reused by an other process. */
+  siginfo_t info;
+  if (waitid(static_cast<idtype_t>(P_PIDFD), pidfd, &info, WEXITED | WNOHANG | WNOWAIT) == -1) {
+    close(pidfd);
+    return false;
+  }
+  fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+  if (epoll->is_added_fd(pidfd)) {
+    pidfd = epoll->remap_to_not_added_fd(pidfd);
+  }
+  (*pid2pidfd)[pid] = pidfd;
+  epoll->add_fd(pidfd, EPOLLIN, pidfd_cb, reinterpret_cast<void *>(static_cast<intptr_t>(pid)));
+  return true;
+}
+
+void track_child_exit(pid_t pid) {
+  if (!pidfd_child_tracking) {
+    return;
+  }
+  if (!pid2pidfd) {
+    pid2pidfd = new tsl::hopscotch_map<pid_t, int>();
+    untracked_pids = new tsl::hopscotch_set<pid_t>();
+  } else if (pid2pidfd->count(pid) > 0) {
+    /* Already tracked. */
+    return;
+  }
+  if (!try_track_child_exit(pid)) {
+    untracked_pids->insert(pid);
+  }
+  maybe_poll_children();
+}
+#else
+bool pidfd_child_tracking_supported() {
+  return false;
+}
+
+void track_child_exit(pid_t pid) {
+  (void)pid;
+}
+#endif
 
 }  /* namespace firebuild */
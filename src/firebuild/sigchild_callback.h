@@ -19,11 +19,30 @@
 #ifndef FIREBUILD_SIGCHILD_CALLBACK_H_
 #define FIREBUILD_SIGCHILD_CALLBACK_H_
 
+#include <sys/types.h>
+
 #include "firebuild/epoll.h"
 
 namespace firebuild {
 
 void sigchild_cb(const struct epoll_event* event, void *arg);
 
+/** Update the process tree about the reaped child of the supervisor with the wait status. */
+void handle_exited_child(pid_t pid, int status);
+
+/** Tell if the exits of the supervisor's children can be watched using pidfds. */
+bool pidfd_child_tracking_supported();
+
+/**
+ * Watch the exit of the supervisor's child with the given pid using a pidfd registered in epoll,
+ * if pidfd_child_tracking is enabled. The child is reaped when the pidfd reports its exit.
+ *
+ * Only the supervisor's children, the top process and the orphans reparented to the supervisor,
+ * can be tracked. Orphans not reparented to the supervisor yet are tracked later. Until then, and
+ * when there are no tracked children, the untracked children are collected by polling, since
+ * SIGCHLD is not handled when tracking pidfds.
+ */
+void track_child_exit(pid_t pid);
+
 }  /* namespace firebuild */
 #endif  // FIREBUILD_SIGCHILD_CALLBACK_H_
@@ -59,6 +59,9 @@ class Subkey {
   bool operator<(const Subkey& other) const {
     return memcmp(str_, other.str_, kAsciiLength) < 0;
   }
+  bool operator==(const Subkey& other) const {
+    return memcmp(str_, other.str_, kAsciiLength) == 0;
+  }
   const char * c_str() const {
     return str_;
   }
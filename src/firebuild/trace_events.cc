@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "firebuild/trace_events.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "firebuild/debug.h"
+#include "firebuild/execed_process.h"
+#include "firebuild/forked_process.h"
+#include "firebuild/phase_timers.h"
+#include "firebuild/utils.h"
+
+namespace firebuild {
+
+/* singleton */
+TraceEvents* trace_events = nullptr;
+
+/* The trace's "pid"s of the tracks */
+static const int kBuildTrack = 1;
+static const int kSupervisorTrack = 2;
+
+TraceEvents::TraceEvents(const char *path)
+    : file_(fopen(path, "we")), start_ns_(PhaseTimers::now_ns()) {
+  if (!file_) {
+    fb_perror(path);
+    exit(EXIT_FAILURE);
+  }
+  /* There is an event for every process and timed phase, write them out in bigger chunks. */
+  setvbuf(file_, NULL, _IOFBF, 1024 * 1024);
+  fprintf(file_, "{\"traceEvents\": [\n"
+          "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, "
+          "\"args\": {\"name\": \"build\"}},\n"
+          "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, "
+          "\"args\": {\"name\": \"firebuild supervisor\"}},\n"
+          "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %d, "
+          "\"args\": {\"name\": \"phases\"}}",
+          kBuildTrack, kSupervisorTrack, kSupervisorTrack, getpid());
+  /* Don't leave buffered data to the forked child which may exit() on errors. */
+  fflush(file_);
+}
+
+TraceEvents::~TraceEvents() {
+  fprintf(file_, "\n], \"displayTimeUnit\": \"ms\"}\n");
+  if (fclose(file_) != 0) {
+    fb_perror("Saving the trace events");
+  }
+}
+
+double TraceEvents::ts(uint64_t ns) const {
+  return static_cast<double>(ns > start_ns_ ? ns - start_ns_ : 0) / 1000;
+}
+
+double TraceEvents::dur(uint64_t start_ns, uint64_t end_ns) const {
+  /* Subtract the offsets in whole nanoseconds, to keep ts + dur exact. */
+  return static_cast<double>((end_ns > start_ns_ ? end_ns - start_ns_ : 0)
+                             - (start_ns > start_ns_ ? start_ns - start_ns_ : 0)) / 1000;
+}
+
+void TraceEvents::add_process(const ExecedProcess *proc) {
+  uint64_t start_ns = proc->start_ns();
+  const Process* parent = proc->parent();
+  if (parent && parent->exec_started() && parent->pid() == proc->pid()) {
+    /* The exec child is created before the exec parent is finished, don't let their slices
+     * overlap on the pid's thread. */
+    start_ns = std::max(start_ns, static_cast<const ExecedProcess*>(parent)->end_ns());
+  }
+  const uint64_t end_ns =
+      std::max(start_ns, proc->end_ns() ? proc->end_ns() : PhaseTimers::now_ns());
+  const char* result;
+  const char* reason;
+  if (proc->was_shortcut()) {
+    result = "shortcut";
+    reason = nullptr;
+  } else if (!proc->can_shortcut()) {
+    result = "not shortcutable";
+    reason = proc->cant_shortcut_reason();
+  } else {
+    result = "cache miss";
+    reason = proc->shortcut_result();
+  }
+  std::string cmd;
+  for (const std::string& arg : proc->args()) {
+    cmd += (cmd.empty() ? "" : " ") + arg;
+  }
+  const int exit_status = proc->fork_point() ? proc->fork_point()->exit_status() : -1;
+  fprintf(file_, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"cat\": \"%s\", \"pid\": %d, "
+          "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"ppid\": %d, "
+          "\"executable\": \"%s\", \"cmd\": \"%s\", \"exit_status\": %d, "
+          "\"cpu_time_ms\": %.3f, \"aggr_cpu_time_ms\": %.3f, "
+          "\"shortcut_cpu_time_ms\": %" PRId64 ", \"ack_wait_ms\": %.3f, "
+          "\"ack_waits\": %" PRId64 ", \"result\": \"%s\"",
+          escapeJsonString(proc->executable()->without_dirs()).c_str(), result, kBuildTrack,
+          proc->pid(), ts(start_ns), dur(start_ns, end_ns), proc->ppid(),
+          escapeJsonString(proc->executable()->c_str()).c_str(), escapeJsonString(cmd).c_str(),
+          exit_status, static_cast<double>(proc->cpu_time_u()) / 1000,
+          static_cast<double>(proc->aggr_cpu_time_u()) / 1000, proc->shortcut_cpu_time_ms(),
+          static_cast<double>(proc->ack_wait_ns()) / 1000000, proc->ack_waits(), result);
+  if (reason) {
+    fprintf(file_, ", \"reason\": \"%s\"", escapeJsonString(reason).c_str());
+  }
+  fprintf(file_, "}}");
+}
+
+void TraceEvents::add_phase(const char *name, uint64_t start_ns, uint64_t end_ns) {
+  fprintf(file_, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, "
+          "\"dur\": %.3f}", name, kSupervisorTrack, getpid(), ts(start_ns),
+          dur(start_ns, end_ns));
+}
+
+}  /* namespace firebuild */
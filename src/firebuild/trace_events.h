@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FIREBUILD_TRACE_EVENTS_H_
+#define FIREBUILD_TRACE_EVENTS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "firebuild/cxx_lang_utils.h"
+
+namespace firebuild {
+
+class ExecedProcess;
+
+/**
+ * Timeline of the build in Chrome's Trace Event format, to be loaded to ui.perfetto.dev or
+ * chrome://tracing.
+ *
+ * The exec()-ed processes are slices in the "build" process' track, one thread per pid, with the
+ * CPU time and the shortcutting attempt's result as arguments. The supervisor's coarse timed
+ * phases are slices in the "firebuild supervisor" process' track.
+ *
+ * Since the processes are garbage collected during the build, the events are written when they
+ * are finalized, thus the file is complete only after the object is deleted.
+ */
+class TraceEvents {
+ public:
+  /** Open the file and write the header, exits on failure. */
+  explicit TraceEvents(const char *path);
+  ~TraceEvents();
+
+  /** Add the process' slice, to be called when the process is finalized. */
+  void add_process(const ExecedProcess *proc);
+  /** Add a phase's slice. The times are from PhaseTimers::now_ns(). */
+  void add_phase(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+ private:
+  /** Microseconds since the start of the trace as expected in "ts". */
+  double ts(uint64_t ns) const;
+  /** Duration in microseconds as expected in "dur", end_ns must not be less than start_ns. */
+  double dur(uint64_t start_ns, uint64_t end_ns) const;
+
+  FILE *file_;
+  uint64_t start_ns_;
+  DISALLOW_COPY_AND_ASSIGN(TraceEvents);
+};
+
+/* singleton, NULL if the trace events are not written */
+extern TraceEvents *trace_events;
+
+}  /* namespace firebuild */
+#endif  // FIREBUILD_TRACE_EVENTS_H_
@@ -21,6 +21,7 @@
 #include <dirent.h>
 #include <errno.h>
 #ifdef __APPLE__
+#include <copyfile.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOKitKeys.h>
 #include <CoreFoundation/CoreFoundation.h>
@@ -29,7 +30,12 @@
 #include <gelf.h>
 #include <libelf.h>
 #endif
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 #include <stdio.h>
+#include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -39,6 +45,7 @@
 #include <unistd.h>
 #include <zstd.h>
 
+#include <sstream>
 #include <string>
 #include <cstdlib>
 #include <unordered_set>
@@ -47,7 +54,10 @@
 #include "./fbbcomm.h"
 #include "common/firebuild_common.h"
 #include "common/platform.h"
+#include "common/probes.h"
 #include "firebuild/debug.h"
+#include "firebuild/fbb_arena.h"
+#include "firebuild/message_trace.h"
 
 #ifdef __APPLE__
 /* Interesting CSR configuration flags. */
@@ -286,6 +296,10 @@ void ack_msg(const int conn, const uint16_t ack_num) {
   msg_header msg = {};
   msg.ack_id = ack_num;
   fb_write(conn, &msg, sizeof(msg));
+  FB_PROBE2(ack_send, conn, ack_num);
+  if (message_trace) {
+    message_trace->record_ack(conn, ack_num);
+  }
   FB_DEBUG(firebuild::FB_DEBUG_COMM, "ACK sent");
 }
 
@@ -298,9 +312,11 @@ void send_fbb(int conn, int ack_num, const FBBCOMM_Builder *msg, int *fds, int f
     msg->debug(stderr);
   }
 
-  int len = msg->measure();
+  /* The supervisor is single-threaded, the buffer can be reused for all messages. */
+  static FbbArena arena;
+  int len = arena.serialize(msg, sizeof(msg_header));
 
-  char *buf = reinterpret_cast<char *>(alloca(sizeof(msg_header) + len));
+  char *buf = arena.data();
   memset(buf, 0, sizeof(msg_header));
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-align"
@@ -309,8 +325,6 @@ void send_fbb(int conn, int ack_num, const FBBCOMM_Builder *msg, int *fds, int f
   reinterpret_cast<msg_header *>(buf)->fd_count = fd_count;
 #pragma GCC diagnostic pop
 
-  msg->serialize(buf + sizeof(msg_header));
-
   if (fd_count == 0) {
     /* No fds to attach. Send the header and the payload in a single step. */
     fb_write(conn, buf, sizeof(msg_header) + len);
@@ -348,6 +362,12 @@ void send_fbb(int conn, int ack_num, const FBBCOMM_Builder *msg, int *fds, int f
      * FIXME implement fb_sendmsg() which retries, just to be even safer. */
     sendmsg(conn, &msgh, 0);
   }
+  if (ack_num != 0) {
+    FB_PROBE2(ack_send, conn, ack_num);
+    if (message_trace) {
+      message_trace->record_ack(conn, ack_num);
+    }
+  }
 }
 
 void fb_perror(const char *s) {
@@ -380,6 +400,115 @@ int fb_renameat2(int olddirfd, const char *oldpath,
   }
 }
 
+int fb_open_tmpfile(const char *dir) {
+#ifdef O_TMPFILE
+  return open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#else
+  (void)dir;
+  errno = EOPNOTSUPP;
+  return -1;
+#endif
+}
+
+int fb_link_tmpfile(int fd, const char *path_dst) {
+  /* linkat(fd, "", ..., AT_EMPTY_PATH) would require CAP_DAC_READ_SEARCH. */
+  char proc_path[32];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  return linkat(AT_FDCWD, proc_path, AT_FDCWD, path_dst, AT_SYMLINK_FOLLOW);
+}
+
+bool copy_file(int fd_src, loff_t src_skip_bytes, int fd_dst, bool append,
+               const struct stat64 *src_stat_ptr) {
+  /* Try CoW first. */
+  if (src_skip_bytes == 0 && !append) {
+#ifdef __APPLE__
+  if (fcopyfile(fd_src, fd_dst, nullptr, COPYFILE_DATA) == 0) {
+#else
+    if (ioctl(fd_dst, FICLONE, fd_src) == 0) {
+#endif
+      /* CoW succeeded. Moo! */
+      return true;
+    }
+  } else {
+    // FIXME try FICLONERANGE
+  }
+
+  /* Try copy_file_range(). Gotta get the source file's size, and in append mode also the
+   * destination file's size */
+  struct stat64 src_st_local;
+  if (!src_stat_ptr && fstat64(fd_src, &src_st_local) == -1) {
+    fb_perror("fstat");
+    assert(0);
+    return false;
+  }
+  const struct stat64 *src_st = src_stat_ptr ? src_stat_ptr : &src_st_local;
+  if (!S_ISREG(src_st->st_mode)) {
+    FB_DEBUG(FB_DEBUG_CACHING, "not a regular file");
+    return false;
+  }
+
+  struct stat64 dst_st_local;
+  const struct stat64 *dst_st = nullptr;
+  if (append) {
+    if (fstat64(fd_dst, &dst_st_local) == -1) {
+      fb_perror("fstat");
+      assert(0);
+      return false;
+    }
+    dst_st = &dst_st_local;
+    if (!S_ISREG(dst_st->st_mode)) {
+      FB_DEBUG(FB_DEBUG_CACHING, "not a regular file");
+      return false;
+    }
+  }
+
+  off_t len = src_st->st_size >= src_skip_bytes ? src_st->st_size - src_skip_bytes : 0;
+  loff_t dst_skip_bytes = append ? dst_st->st_size : 0;
+  return fb_copy_file_range(fd_src, &src_skip_bytes, fd_dst, &dst_skip_bytes, len, 0) == len;
+}
+
+off_t copy_file_atomically(const char *src_path, const char *dst_dir, const char *dst_path) {
+  int fd_src = open(src_path, O_RDONLY | O_CLOEXEC);
+  if (fd_src == -1) {
+    return -1;
+  }
+  struct stat64 st;
+  if (fstat64(fd_src, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd_src);
+    return -1;
+  }
+  char *tmpfile = NULL;
+  int fd_dst = fb_open_tmpfile(dst_dir);
+  if (fd_dst == -1) {
+    if (asprintf(&tmpfile, "%s/new.XXXXXX", dst_dir) < 0) {
+      close(fd_src);
+      return -1;
+    }
+    fd_dst = mkstemp(tmpfile);
+    if (fd_dst == -1) {
+      free(tmpfile);
+      close(fd_src);
+      return -1;
+    }
+  }
+  bool success = copy_file(fd_src, 0, fd_dst, false, &st);
+  close(fd_src);
+  if (success) {
+    success = tmpfile ? fb_renameat2(AT_FDCWD, tmpfile, AT_FDCWD, dst_path, RENAME_NOREPLACE) == 0
+        : fb_link_tmpfile(fd_dst, dst_path) == 0;
+  }
+  const int saved_errno = errno;
+  close(fd_dst);
+  if (tmpfile) {
+    if (!success) {
+      unlink(tmpfile);
+    }
+    free(tmpfile);
+  }
+  errno = saved_errno;
+  return success ? st.st_size : -1;
+}
+
 const std::string& deduplicated_string(std::string str) {
   if (!deduplicated_strings) {
     deduplicated_strings = new std::unordered_set<std::string>();
@@ -443,6 +572,34 @@ bool check_system_setup() {
   return system_ok;
 }
 
+/* From http://stackoverflow.com/questions/7724448/simple-json-string-escape-for-c
+ * TODO: use JSONCpp instead to handle all cases */
+std::string escapeJsonString(const std::string& input) {
+  std::ostringstream ss;
+  for (auto iter = input.cbegin(); iter != input.cend(); iter++) {
+    switch (*iter) {
+      case '\\': ss << "\\\\"; break;
+      case '"': ss << "\\\""; break;
+      case '\b': ss << "\\b"; break;
+      case '\f': ss << "\\f"; break;
+      case '\n': ss << "\\n"; break;
+      case '\r': ss << "\\r"; break;
+      case '\t': ss << "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(*iter) < 0x20) {
+          /* Other control characters are not allowed in JSON strings either. */
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned char>(*iter));
+          ss << buf;
+        } else {
+          ss << *iter;
+        }
+        break;
+    }
+  }
+  return ss.str();
+}
+
 std::string base_name(const char* path) {
   assert(path);
   const char* last_slash = strrchr(path, '/');
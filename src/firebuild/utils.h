@@ -20,10 +20,14 @@
 #define FIREBUILD_UTILS_H_
 
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <string>
+#include <thread>
 
 #include "common/platform.h"
 #include "./fbbcomm.h"
@@ -118,6 +122,34 @@ void fb_perror(const char *s);
 int fb_renameat2(int olddirfd, const char *oldpath,
                  int newdirfd, const char *newpath, unsigned int flags);
 
+/**
+ * Open an unnamed temporary file (O_TMPFILE) in dir, to be named later using fb_link_tmpfile().
+ * @return the fd, or -1 if unnamed files are not supported, setting errno
+ */
+int fb_open_tmpfile(const char *dir);
+/**
+ * Link a file opened by fb_open_tmpfile() to path_dst on the same file system.
+ * Fails with EEXIST if path_dst already exists.
+ */
+int fb_link_tmpfile(int fd, const char *path_dst);
+
+/**
+ * Copy the contents from an open file descriptor to another,
+ * preferring advanced technologies like copy on write.
+ * Might skip the beginning of the input file.
+ * Might append to the target file instead of replacing its contents. O_APPEND should _not_ be set
+ * on fd_dst because then the fast copy_file_range() method doesn't work.
+ */
+bool copy_file(int fd_src, loff_t src_skip_bytes, int fd_dst, bool append,
+               const struct stat64 *src_stat_ptr = NULL);
+
+/**
+ * Copy a regular file to dst_path in the dst_dir directory, preferring copy on write.
+ * The copy appears at dst_path atomically, and it is not replaced if it already exists.
+ * @return the size of the copied file, or -1 on error, setting errno
+ */
+off_t copy_file_atomically(const char *src_path, const char *dst_dir, const char *dst_path);
+
 /**
  * Deduplicated strings allocated for the lifetime of the firebuild process.
  */
@@ -128,9 +160,25 @@ const std::string& deduplicated_string(std::string);
  */
 bool check_system_setup();
 
+/** Escape std::string for JSON and JavaScript string literals */
+std::string escapeJsonString(const std::string& input);
+
 /** Return the filename part of a path (after the last '/') */
 std::string base_name(const char* path);
 
+/**
+ * Start a thread with all signals blocked, to let the main thread handle them.
+ */
+template <typename F>
+std::thread start_thread_without_signals(F f) {
+  sigset_t all, orig;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &orig);
+  std::thread thread(f);
+  pthread_sigmask(SIG_SETMASK, &orig, NULL);
+  return thread;
+}
+
 /**
  * Decompress Zstd-compressed data from a buffer into a malloc()-allocated output buffer.
  *
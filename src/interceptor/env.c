@@ -21,6 +21,7 @@
 
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,7 @@
 /* Avoid typos in repetitive names */
 #define FB_INSERT_TRACE_MARKERS "FB_INSERT_TRACE_MARKERS"
 #define FB_SOCKET               "FB_SOCKET"
+#define FB_SOCKET_FD            "FB_SOCKET_FD"
 
 /* Like getenv(), but from a custom environment array */
 static char *getenv_from(char **env, const char *name) {
@@ -243,7 +245,8 @@ void env_purge(char **env) {
   /* Copy the environment, skipping the ones that need to be removed. */
   for (int i = 0; env[i] != NULL; i++) {
     if ((begins_with(env[i], FB_INSERT_TRACE_MARKERS "=")) ||
-        (begins_with(env[i], FB_SOCKET "="))) {
+        (begins_with(env[i], FB_SOCKET "=")) ||
+        (begins_with(env[i], FB_SOCKET_FD "="))) {
       continue;
     }
     if (begins_with(env[i], LD_PRELOAD "=")) {
@@ -274,3 +277,51 @@ void env_purge(char **env) {
 
   *cur = NULL;
 }
+
+int get_env_with_inherited_conn_size(char **env) {
+  /* Count the number of items. */
+  int i;
+  for (i = 0; env[i] != NULL; i++) {}
+  /* Room for FB_SOCKET_FD's pointer and the trailing NULL, then the "FB_SOCKET_FD=<fd>" string. */
+  return (i + 2) * sizeof(char *) + sizeof(FB_SOCKET_FD "=-2147483648");
+}
+
+void env_add_inherited_conn(char **env, int conn, void *buf) {
+  char **buf1 = (char **) buf;
+  assert(buf1 != NULL);  /* Make scan-build happy */
+
+  int i;
+  for (i = 0; env[i] != NULL; i++) {}
+  char *buf2 = (char *) buf + (i + 2) * sizeof(char *);
+
+  sprintf(buf2, "%s=%d", FB_SOCKET_FD, conn);  /* NOLINT */
+  *buf1++ = buf2;
+  /* Copy the environment, skipping a stale FB_SOCKET_FD, if any. */
+  for (i = 0; env[i] != NULL; i++) {
+    if (begins_with(env[i], FB_SOCKET_FD "=")) {
+      continue;
+    }
+    *buf1++ = env[i];
+  }
+  *buf1 = NULL;
+}
+
+int env_take_inherited_conn(char **env) {
+  int conn = -1;
+  char **cur = env;
+  assert(cur != NULL);  /* Make scan-build happy */
+
+  for (int i = 0; env[i] != NULL; i++) {
+    if (begins_with(env[i], FB_SOCKET_FD "=")) {
+      char *endptr;
+      long value = strtol(env[i] + strlen(FB_SOCKET_FD "="), &endptr, 10);
+      if (*endptr == '\0' && value >= 0 && value <= INT_MAX) {
+        conn = (int)value;
+      }
+      continue;
+    }
+    *cur++ = env[i];
+  }
+  *cur = NULL;
+  return conn;
+}
@@ -80,4 +80,26 @@ void env_fixup(char **env, void *buf);
  */
 void env_purge(char **env);
 
+/**
+ * Returns a size that's large enough to hold a copy of the environment's pointers with
+ * FB_SOCKET_FD added, and the FB_SOCKET_FD string itself.
+ */
+int get_env_with_inherited_conn_size(char **env);
+
+/**
+ * Places a copy of env at buf, with FB_SOCKET_FD set to conn, telling the execed image to take
+ * over the supervisor connection instead of opening a new one.
+ *
+ * buf has to be large enough to contain the data, as returned by
+ * get_env_with_inherited_conn_size().
+ */
+void env_add_inherited_conn(char **env, int conn, void *buf);
+
+/**
+ * Remove FB_SOCKET_FD from the environment.
+ *
+ * @return the supervisor connection fd passed in FB_SOCKET_FD, or -1 if it was not set or invalid
+ */
+int env_take_inherited_conn(char **env);
+
 #endif  // FIREBUILD_ENV_H_
@@ -32,6 +32,7 @@
 #ifdef __linux__
 #include <sys/auxv.h>
 #endif
+#include <sys/mman.h>
 #include <sys/un.h>
 #include <sys/resource.h>
 #include <spawn.h>
@@ -41,6 +42,7 @@
 #include "interceptor/ic_file_ops.h"
 #include "interceptor/interceptors.h"
 #include "common/firebuild_common.h"
+#include "common/probes.h"
 
 #if defined(__s390x__) || defined (__powerpc64__)
 #define VDSO_NAME "linux-vdso64.so.1"
@@ -120,9 +122,9 @@ static char **ic_argv;
 
 int ic_pid;
 
-__thread thread_data fb_thread_data = {NULL, 0, 0, 0, false};
+__thread thread_data fb_thread_data = {NULL, 0, 0, 0, false, FBBCOMM_TAG_UNUSED, {0}};
 #if !defined(FB_ALWAYS_USE_THREAD_LOCAL)
-thread_data fb_global_thread_data = {NULL, 0, 0, 0, false};
+thread_data fb_global_thread_data = {NULL, 0, 0, 0, false, FBBCOMM_TAG_UNUSED, {0}};
 bool thread_locals_usable = false;
 /* Optimization is disabled because when the function is optimized it tries to resolve
  * the address of fb_thread_data, which causes _tlv_bootstrap aborting until
@@ -290,6 +292,13 @@ bool insert_trace_markers = false;
 /** Next ACK id*/
 static uint16_t ack_id = 1;
 
+/** Time spent waiting for ACKs since the last exec() in nanoseconds, updated atomically by all
+ *  threads */
+static int64_t ack_wait_ns = 0;
+/** Number of ACK waits since the last exec(), by the tags of the messages, updated atomically by
+ *  all threads */
+static int ack_wait_counts[FBBCOMM_TAG_NEXT];
+
 voidp_set popened_streams;
 
 psfa *psfas = NULL;
@@ -360,10 +369,29 @@ static uint16_t fb_recv_ack(int fd) {
 /** Send the serialized version of the given message over the wire,
  *  prefixed with the ack num and the message length */
 static void fb_send_msg(int fd, const void /*FBBCOMM_Builder*/ *ic_msg, uint16_t ack_num) {
-  int len = fbbcomm_builder_measure(ic_msg);
-  char *buf = alloca(sizeof(msg_header) + len);
-  memset(buf, 0, sizeof(msg_header));
-  fbbcomm_builder_serialize(ic_msg, buf + sizeof(msg_header));
+  /* Serialize in a single pass to the thread's buffer that fits most of the messages. Messages
+   * carrying the environment, like exec, are measured first instead, because they often don't
+   * fit. The bigger ones are serialized to a precisely sized mapping, not to the stack that may be
+   * a small one of a thread or of a signal handler. */
+  char *buf = FB_THREAD_LOCAL(msg_buf);
+  int len = 0;
+  size_t map_size = 0;
+  const int tag = fbbcomm_builder_get_tag((const FBBCOMM_Builder *)ic_msg);
+  if (tag != FBBCOMM_TAG_exec && tag != FBBCOMM_TAG_posix_spawn) {
+    len = fbbcomm_builder_serialize_bounded(ic_msg, buf + sizeof(msg_header), IC_SMALL_MSG_SIZE);
+  }
+  if (len == 0) {
+    len = fbbcomm_builder_measure(ic_msg);
+    if (len > IC_SMALL_MSG_SIZE) {
+      map_size = sizeof(msg_header) + len;
+      buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buf == MAP_FAILED) {
+        /* The supervisor can't be notified without sending the message. */
+        abort();
+      }
+    }
+    fbbcomm_builder_serialize(ic_msg, buf + sizeof(msg_header));
+  }
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-align"
   memset(buf, 0, sizeof(msg_header));
@@ -371,6 +399,9 @@ static void fb_send_msg(int fd, const void /*FBBCOMM_Builder*/ *ic_msg, uint16_t
   ((msg_header *)buf)->msg_size = len;
 #pragma GCC diagnostic pop
   fb_write(fd, buf, sizeof(msg_header) + len);
+  if (map_size > 0) {
+    munmap(buf, map_size);
+  }
 }
 
 void fb_fbbcomm_send_msg(const void /*FBBCOMM_Builder*/ *ic_msg, int fd) {
@@ -385,12 +416,16 @@ uint16_t fb_fbbcomm_send_msg_with_ack(const void /*FBBCOMM_Builder*/ *ic_msg, in
   thread_signal_danger_zone_enter();
 
   uint16_t ack_num = get_next_ack_id();
+  FB_THREAD_LOCAL(ack_wait_tag) = fbbcomm_builder_get_tag((const FBBCOMM_Builder *)ic_msg);
   fb_send_msg(fd, ic_msg, ack_num);
 
   return ack_num;
 }
 
 void fb_fbbcomm_check_ack(int fd, uint16_t ack_num) {
+  struct timespec start, end;
+  FB_PROBE2(ack_wait_start, fd, ack_num);
+  get_ic_orig_clock_gettime()(CLOCK_MONOTONIC, &start);
 #ifdef NDEBUG
   (void)ack_num;
 #else
@@ -398,6 +433,11 @@ void fb_fbbcomm_check_ack(int fd, uint16_t ack_num) {
 #endif
       fb_recv_ack(fd);
   assert(ack_num_resp == ack_num);
+  get_ic_orig_clock_gettime()(CLOCK_MONOTONIC, &end);
+  FB_PROBE2(ack_wait_end, fd, ack_num);
+  __atomic_fetch_add(&ack_wait_ns, (int64_t)(end.tv_sec - start.tv_sec) * 1000000000
+                     + (end.tv_nsec - start.tv_nsec), __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ack_wait_counts[FB_THREAD_LOCAL(ack_wait_tag)], 1, __ATOMIC_RELAXED);
 
   thread_signal_danger_zone_leave();
 }
@@ -477,6 +517,30 @@ void reset_rusage() {
   timerclear(&initial_rusage.ru_utime);
 }
 
+int ack_waits_since_exec(int64_t *ns, const int **tags, const int **counts) {
+  static int wait_tags[FBBCOMM_TAG_NEXT], wait_counts[FBBCOMM_TAG_NEXT];
+  int tag_count = 0;
+  for (int tag = 0; tag < FBBCOMM_TAG_NEXT; tag++) {
+    const int count = __atomic_load_n(&ack_wait_counts[tag], __ATOMIC_RELAXED);
+    if (count > 0) {
+      wait_tags[tag_count] = tag;
+      wait_counts[tag_count] = count;
+      tag_count++;
+    }
+  }
+  *ns = __atomic_load_n(&ack_wait_ns, __ATOMIC_RELAXED);
+  *tags = wait_tags;
+  *counts = wait_counts;
+  return tag_count;
+}
+
+void reset_ack_waits() {
+  __atomic_store_n(&ack_wait_ns, 0, __ATOMIC_RELAXED);
+  for (int tag = 0; tag < FBBCOMM_TAG_NEXT; tag++) {
+    __atomic_store_n(&ack_wait_counts[tag], 0, __ATOMIC_RELAXED);
+  }
+}
+
 int clone_trampoline(void *arg) {
   clone_trampoline_arg *trampoline_arg = (clone_trampoline_arg *)arg;
   thread_signal_danger_zone_leave();
@@ -658,6 +722,8 @@ void atfork_child_handler(void) {
   pid_t ppid = ic_pid;
   /* Reset, getrusage will report the correct self resource usage. */
   reset_rusage();
+  /* The ACK waits until fork() are reported by the parent. */
+  reset_ack_waits();
   /* Reinitialize the lock, see #207.
    *
    * We don't know if the lock was previously held, we'd need to check
@@ -732,6 +798,13 @@ void handle_exit() {
     fbbcomm_builder_rusage_set_stime_u(&ic_msg,
         (int64_t)ru.ru_stime.tv_sec * 1000000 + (int64_t)ru.ru_stime.tv_usec);
 
+    int64_t wait_ns;
+    const int *wait_tags, *wait_counts;
+    int wait_tag_count = ack_waits_since_exec(&wait_ns, &wait_tags, &wait_counts);
+    fbbcomm_builder_rusage_set_ack_wait_ns(&ic_msg, wait_ns);
+    fbbcomm_builder_rusage_set_ack_wait_tag(&ic_msg, wait_tags, wait_tag_count);
+    fbbcomm_builder_rusage_set_ack_wait_count(&ic_msg, wait_counts, wait_tag_count);
+
     fb_fbbcomm_send_msg_and_check_ack(&ic_msg, fb_sv_conn);
 
     if (i_locked) {
@@ -845,11 +918,45 @@ int fb_connect_supervisor() {
   return conn;
 }
 
+/**
+ * Check if the fd handed over by the pre-exec image is still the supervisor connection.
+ *
+ * The fd number in FB_SOCKET_FD may be stale, for example when the environment was copied to
+ * a posix_spawn()-ed child or the fd was closed and reused by an unintercepted image.
+ */
+static bool is_supervisor_conn(int fd) {
+  struct sockaddr_un peer;
+  socklen_t peer_len = sizeof(peer);
+  memset(&peer, 0, sizeof(peer));
+  if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) != 0 || peer.sun_family != AF_UNIX) {
+    return false;
+  }
+  return strncmp(peer.sun_path, fb_conn_string, sizeof(peer.sun_path)) == 0;
+}
+
 void fb_init_supervisor_conn() {
   if (fb_conn_string[0] == '\0') {
     strncpy(fb_conn_string, getenv("FB_SOCKET"), sizeof(fb_conn_string));
     fb_conn_string_len = strlen(fb_conn_string);
   }
+  /* Take over the connection of the pre-exec image if it was handed over. */
+  int inherited_conn = env_take_inherited_conn(environ);
+  if (inherited_conn >= 0 && fb_sv_conn == -1 && is_supervisor_conn(inherited_conn)) {
+    insert_debug_msg("taking over the supervisor connection of the pre-exec image");
+#ifndef NDEBUG
+    int fcntl_ret =
+#endif
+        TEMP_FAILURE_RETRY(
+#if defined(_TIME_BITS) && (_TIME_BITS == 64)
+        get_ic_orig___fcntl_time64()(
+#else
+        get_ic_orig_fcntl()(
+#endif
+            inherited_conn, F_SETFD, FD_CLOEXEC));
+    assert(fcntl_ret != -1);
+    fb_sv_conn = inherited_conn;
+    return;
+  }
   /* Reconnect to supervisor.
    * POSIX says to retry close() on EINTR (e.g. wrap in TEMP_FAILURE_RETRY())
    * but Linux probably disagrees, see #723. */
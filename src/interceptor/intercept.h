@@ -93,6 +93,9 @@ extern fd_state ic_fd_states[];
 #define IC_CALLED_SYSCALL_SIZE 1024
 extern bool ic_called_syscall[];
 
+/** Size of the per-thread buffer messages to the supervisor are serialized to if they fit */
+#define IC_SMALL_MSG_SIZE 4096
+
 /** Global lock for preventing parallel system and popen calls */
 extern pthread_mutex_t ic_system_popen_lock;
 
@@ -149,6 +152,23 @@ void rusage_since_exec(struct rusage *ru);
 /** Reset rusage timers used for reporting rusage to the supervisor. */
 void reset_rusage();
 
+/**
+ * Get the time spent waiting for the supervisor's ACKs since the previous exec() and the number of
+ * waits for each message tag with at least one wait.
+ *
+ * The returned arrays are static, they are valid until the next call. The caller has to hold the
+ * global lock.
+ *
+ * @param[out] ns the time spent waiting in nanoseconds
+ * @param[out] tags the message tags
+ * @param[out] counts the number of waits, in the order of tags
+ * @return the number of tags set
+ */
+int ack_waits_since_exec(int64_t *ns, const int **tags, const int **counts);
+
+/** Reset the ACK wait statistics reported to the supervisor. */
+void reset_ack_waits();
+
 /** Connection string to supervisor */
 extern char fb_conn_string[FB_PATH_BUFSIZE];
 
@@ -425,6 +445,14 @@ typedef struct {
    *  If FB_THREAD_LOCAL(signal_danger_zone_depth) > 0, the contents are undefined and must not
    *  be relied on. */
   bool has_global_lock;
+
+  /** The tag of the last message sent with an ACK request by the thread, for
+   *  fb_fbbcomm_check_ack(). Signals are delayed until the ACK arrives. */
+  int ack_wait_tag;
+
+  /** Buffer the messages to the supervisor are serialized to, if they fit, see fb_send_msg().
+   *  Signals are delayed while it is in use, thus there are no nested users in the thread. */
+  char msg_buf[sizeof(msg_header) + IC_SMALL_MSG_SIZE] __attribute__((aligned(8)));
 } thread_data;
 
 extern __thread thread_data fb_thread_data;
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Benchmark of the cache with synthetic entries.
+ *
+ * Populates a cache with the given number of fingerprints, each having the given number of
+ * entries, each entry referencing blobs of sizes distributed log-uniformly in the given range.
+ * Then measures the latency of ObjCache::list_subkeys() and ObjCache::retrieve() for random
+ * fingerprints, the throughput of BlobCache::retrieve_file() and the wall time of
+ * ExecedProcessCacher::gc(), and prints the results and the peak RSS as JSON to stdout.
+ *
+ * The cache is read through the page cache, thus the measurements reflect a warm cache.
+ * With -d the cache is kept in DIR/cache and is reused by later runs with the same DIR,
+ * skipping the population. Garbage collection may shrink a reused cache, though.
+ *
+ * Usage: cache-bench [-c CONFIG] [-o KEY=VALUE]... [-d DIR] [-f FINGERPRINTS] [-e ENTRIES]
+ *                    [-i INPUTS] [-b BLOBS] [-s MIN-MAX] [-l LOOKUPS] [-S SEED] [-z]
+ */
+
+#include <getopt.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "firebuild/blob_cache.h"
+#include "firebuild/config.h"
+#include "firebuild/execed_process_cacher.h"
+#include "firebuild/file_name.h"
+#include "firebuild/hash.h"
+#include "firebuild/obj_cache.h"
+#include "firebuild/utils.h"
+
+/* Defined in firebuild.cc, which is not linked in. */
+int sigchild_selfpipe[2];
+int listener;
+int child_pid, child_ret = 1;
+
+namespace {
+
+struct bench_config {
+  const char *config_file = nullptr;
+  std::list<std::string> config_strings {};
+  std::string dir {};
+  bool keep_dir = false;
+  long fingerprints = 2000;
+  long entries = 2;
+  long inputs = 50;
+  long blobs = 2;
+  long blob_size_min = 16;
+  long blob_size_max = 64 * 1024;
+  long lookups = 10000;
+  uint64_t seed = 1;
+  bool compress = false;
+};
+
+/* xorshift64*, the benchmark has to be reproducible, not cryptographically random. */
+uint64_t rng_state;
+
+uint64_t rng_next() {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<double>(ts.tv_sec) * 1e9 + static_cast<double>(ts.tv_nsec);
+}
+
+long peak_rss_kb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+firebuild::Hash fingerprint_key(const bench_config& cfg, long idx) {
+  const uint64_t data[2] = {cfg.seed, static_cast<uint64_t>(idx)};
+  firebuild::Hash key;
+  key.set_from_data(data, sizeof(data));
+  return key;
+}
+
+XXH128_hash_t fake_hash(uint64_t seed) {
+  XXH128_hash_t hash;
+  hash.low64 = seed * 0x9e3779b97f4a7c15ULL;
+  hash.high64 = ~seed;
+  return hash;
+}
+
+/** Print the latency statistics of the measured operations as a JSON object. */
+void print_latencies(const char *name, std::vector<double>* ns, bool last = false) {
+  std::sort(ns->begin(), ns->end());
+  double sum = 0;
+  for (double n : *ns) {
+    sum += n;
+  }
+  auto pct_us = [&](double p) {
+    return ns->empty() ? 0.0 : (*ns)[std::min(ns->size() - 1,
+                                               static_cast<size_t>(p * ns->size()))] / 1000;
+  };
+  printf("  \"%s\": {\"count\": %zu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+         "\"p99_us\": %.3f, \"max_us\": %.3f}%s\n",
+         name, ns->size(), ns->empty() ? 0.0 : sum / ns->size() / 1000, pct_us(0.5),
+         pct_us(0.9), pct_us(0.99), ns->empty() ? 0.0 : ns->back() / 1000, last ? "" : ",");
+}
+
+/** Store the blobs and the entries of the synthetic fingerprints. */
+void populate(const bench_config& cfg, long *blobs_stored, off_t *blob_bytes) {
+  const std::string scratch = cfg.dir + "/scratch";
+  const firebuild::FileName *scratch_name = firebuild::FileName::Get(scratch);
+  const double log_min = std::log(static_cast<double>(cfg.blob_size_min));
+  const double log_range = std::log(static_cast<double>(cfg.blob_size_max)) - log_min;
+  std::vector<char> content(cfg.blob_size_max);
+  std::vector<std::string> in_path_storage;
+  for (long i = 0; i < cfg.inputs; i++) {
+    /* Missing system files are checked during GC like the existing ones. */
+    in_path_storage.push_back("/usr/include/fb-cache-bench/header_" + std::to_string(i) + ".h");
+  }
+
+  for (long fp = 0; fp < cfg.fingerprints; fp++) {
+    const firebuild::Hash key = fingerprint_key(cfg, fp);
+    for (long e = 0; e < cfg.entries; e++) {
+      std::vector<FBBSTORE_Builder_file> in_path(in_path_storage.size());
+      for (size_t i = 0; i < in_path_storage.size(); i++) {
+        in_path[i].set_path_with_length(in_path_storage[i].c_str(), in_path_storage[i].size());
+        in_path[i].set_type(firebuild::ISREG);
+        in_path[i].set_size(4096 + i);
+        in_path[i].set_hash(fake_hash(rng_next()));
+      }
+      /* The builders point to the strings, which must not be moved. */
+      std::vector<std::string> out_path_storage;
+      out_path_storage.reserve(cfg.blobs);
+      std::vector<FBBSTORE_Builder_file> out_path(cfg.blobs);
+      off_t stored_blob_bytes = 0;
+      for (long b = 0; b < cfg.blobs; b++) {
+        /* Log-uniform, using 53 random bits for the double in [0, 1) */
+        const double r = static_cast<double>(rng_next() >> 11) / 9007199254740992.0;
+        const size_t size = std::exp(log_min + log_range * r);
+        /* Text-like content, compressing like source code or object files. */
+        for (size_t pos = 0; pos < size;) {
+          pos += snprintf(&content[pos], size - pos, "%016lx %ld %ld %ld\n",
+                          static_cast<unsigned long>(rng_next() & 0xffff), fp, e, b);
+        }
+        const int fd = open(scratch.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1 || fb_write(fd, content.data(), size)
+            != static_cast<ssize_t>(size)) {
+          firebuild::fb_perror(scratch.c_str());
+          exit(EXIT_FAILURE);
+        }
+        close(fd);
+        firebuild::Hash blob_key;
+        if (!firebuild::blob_cache->store_file(scratch_name, 0, -1, 0, size, &blob_key)) {
+          fprintf(stderr, "Storing a blob failed\n");
+          exit(EXIT_FAILURE);
+        }
+        (*blobs_stored)++;
+        *blob_bytes += size;
+        stored_blob_bytes += size;
+        out_path_storage.push_back("out/" + std::to_string(fp) + "_" + std::to_string(e) + "_"
+                                   + std::to_string(b) + ".o");
+        out_path[b].set_path_with_length(out_path_storage.back().c_str(),
+                                         out_path_storage.back().size());
+        out_path[b].set_type(firebuild::ISREG);
+        out_path[b].set_size(size);
+        if (firebuild::compress_cache) {
+          out_path[b].set_compressed_hash(blob_key.get());
+        } else {
+          out_path[b].set_hash(blob_key.get());
+        }
+        out_path[b].set_mode(0644);
+        out_path[b].set_mode_mask(07777);
+      }
+      auto file_item_fn = [](int idx, const void *user_data) {
+        auto files = reinterpret_cast<const std::vector<FBBSTORE_Builder_file> *>(user_data);
+        return reinterpret_cast<const FBBSTORE_Builder *>(&(*files)[idx]);
+      };
+      FBBSTORE_Builder_process_inputs pi;
+      pi.set_path_item_fn(in_path.size(), file_item_fn, &in_path);
+      FBBSTORE_Builder_process_outputs po;
+      po.set_path_isreg_item_fn(out_path.size(), file_item_fn, &out_path);
+      po.set_exit_status(0);
+      FBBSTORE_Builder_process_inputs_outputs pio;
+      pio.set_inputs(reinterpret_cast<FBBSTORE_Builder *>(&pi));
+      pio.set_outputs(reinterpret_cast<FBBSTORE_Builder *>(&po));
+      pio.set_cpu_time_ms(1000);
+      if (!firebuild::obj_cache->store(key, reinterpret_cast<FBBSTORE_Builder *>(&pio),
+                                       stored_blob_bytes, nullptr)) {
+        fprintf(stderr, "Storing an entry failed, is max_entry_size too small?\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if ((fp + 1) % 10000 == 0) {
+      fprintf(stderr, "Stored %ld / %ld fingerprints\n", fp + 1, cfg.fingerprints);
+    }
+  }
+  unlink(scratch.c_str());
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [OPTIONS]\n"
+          "  -c CONFIG     read the configuration from CONFIG\n"
+          "  -o KEY=VALUE  override a configuration setting, can be repeated\n"
+          "  -d DIR        keep the cache in DIR/cache and reuse it if it exists\n"
+          "  -f N          number of fingerprints (default: 2000)\n"
+          "  -e N          entries per fingerprint (default: 2)\n"
+          "  -i N          input files per entry (default: 50)\n"
+          "  -b N          blobs per entry (default: 2)\n"
+          "  -s MIN-MAX    blob size range in bytes, log-uniform (default: 16-65536)\n"
+          "  -l N          number of lookups to measure (default: 10000)\n"
+          "  -S N          random seed (default: 1)\n"
+          "  -z            compress the cache\n",
+          name);
+  exit(EXIT_FAILURE);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bench_config cfg;
+  int c;
+  while ((c = getopt(argc, argv, "c:o:d:f:e:i:b:s:l:S:z")) != -1) {
+    switch (c) {
+      case 'c': cfg.config_file = optarg; break;
+      case 'o': cfg.config_strings.push_back(optarg); break;
+      case 'd': cfg.dir = optarg; cfg.keep_dir = true; break;
+      case 'f': cfg.fingerprints = atol(optarg); break;
+      case 'e': cfg.entries = atol(optarg); break;
+      case 'i': cfg.inputs = atol(optarg); break;
+      case 'b': cfg.blobs = atol(optarg); break;
+      case 's':
+        if (sscanf(optarg, "%ld-%ld", &cfg.blob_size_min, &cfg.blob_size_max) != 2) {
+          usage(argv[0]);
+        }
+        break;
+      case 'l': cfg.lookups = atol(optarg); break;
+      case 'S': cfg.seed = strtoull(optarg, nullptr, 10); break;
+      case 'z': cfg.compress = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || cfg.fingerprints <= 0 || cfg.entries <= 0 || cfg.inputs < 0
+      || cfg.blobs < 0 || cfg.blob_size_min <= 0 || cfg.blob_size_max < cfg.blob_size_min
+      || cfg.lookups <= 0) {
+    usage(argv[0]);
+  }
+  rng_state = cfg.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+  if (cfg.dir.empty()) {
+    const char *tmpdir = getenv("TMPDIR");
+    std::string pattern = std::string(tmpdir && tmpdir[0] != '\0' ? tmpdir : "/tmp")
+        + "/fb-cache-bench.XXXXXX";
+    if (!mkdtemp(&pattern[0])) {
+      firebuild::fb_perror("mkdtemp");
+      exit(EXIT_FAILURE);
+    }
+    cfg.dir = pattern;
+  }
+  const std::string cache_dir = cfg.dir + "/cache";
+  const bool reuse = std::filesystem::is_directory(cache_dir);
+  setenv("FIREBUILD_CACHE_DIR", cache_dir.c_str(), true);
+  if (cfg.compress) {
+    cfg.config_strings.push_back("compress_cache = true");
+  }
+
+  firebuild::cfg = new libconfig::Config();
+  firebuild::read_config(firebuild::cfg, cfg.config_file, cfg.config_strings);
+  firebuild::ExecedProcessCacher::init(firebuild::cfg);
+
+  printf("{\n  \"fingerprints\": %ld,\n  \"entries_per_fingerprint\": %ld,\n"
+         "  \"inputs_per_entry\": %ld,\n  \"blobs_per_entry\": %ld,\n"
+         "  \"blob_size_min\": %ld,\n  \"blob_size_max\": %ld,\n  \"compressed\": %s,\n"
+         "  \"seed\": %lu,\n",
+         cfg.fingerprints, cfg.entries, cfg.inputs, cfg.blobs, cfg.blob_size_min,
+         cfg.blob_size_max, firebuild::compress_cache ? "true" : "false",
+         static_cast<unsigned long>(cfg.seed));
+
+  /* Populate */
+  if (reuse) {
+    printf("  \"populate\": null,\n");
+  } else {
+    long blobs_stored = 0;
+    off_t blob_bytes = 0;
+    const double start = now_ns();
+    populate(cfg, &blobs_stored, &blob_bytes);
+    const double populate_s = (now_ns() - start) / 1e9;
+    printf("  \"populate\": {\"seconds\": %.3f, \"entries\": %ld, \"blobs\": %ld, "
+           "\"blob_bytes\": %jd, \"peak_rss_kb\": %ld},\n",
+           populate_s, cfg.fingerprints * cfg.entries, blobs_stored,
+           static_cast<intmax_t>(blob_bytes), peak_rss_kb());
+  }
+  printf("  \"cache_bytes\": %jd,\n",
+         static_cast<intmax_t>(recursive_total_file_size(cache_dir)));
+
+  /* ObjCache lookups of random fingerprints, like when looking for a shortcut */
+  std::vector<double> list_ns, list_miss_ns, retrieve_ns;
+  std::vector<XXH128_hash_t> blob_hashes;
+  std::vector<bool> blob_compressed;
+  for (long i = 0; i < cfg.lookups; i++) {
+    const long fp = rng_next() % cfg.fingerprints;
+    const firebuild::Hash key = fingerprint_key(cfg, fp);
+    double start = now_ns();
+    std::vector<firebuild::Subkey> subkeys = firebuild::obj_cache->list_subkeys(key);
+    list_ns.push_back(now_ns() - start);
+
+    const firebuild::Hash missing_key = fingerprint_key(cfg, cfg.fingerprints + fp);
+    start = now_ns();
+    std::vector<firebuild::Subkey> missing = firebuild::obj_cache->list_subkeys(missing_key);
+    list_miss_ns.push_back(now_ns() - start);
+
+    for (const firebuild::Subkey& subkey : subkeys) {
+      uint8_t *entry;
+      size_t entry_len;
+      bool munmap_entry;
+      start = now_ns();
+      if (!firebuild::obj_cache->retrieve(key, subkey.c_str(), &entry, &entry_len, nullptr,
+                                          &munmap_entry)) {
+        continue;
+      }
+      retrieve_ns.push_back(now_ns() - start);
+      /* Remember some blobs for measuring their retrieval. */
+      if (blob_hashes.size() < static_cast<size_t>(cfg.lookups)) {
+        auto pio = reinterpret_cast<const FBBSTORE_Serialized_process_inputs_outputs *>(entry);
+        auto po = reinterpret_cast<const FBBSTORE_Serialized_process_outputs *>(
+            pio->get_outputs());
+        for (fbb_size_t j = 0; j < po->get_path_isreg_count(); j++) {
+          auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(po->get_path_isreg_at(j));
+          if (file->has_compressed_hash() || file->has_hash()) {
+            blob_hashes.push_back(file->has_compressed_hash() ? file->get_compressed_hash()
+                                  : file->get_hash());
+            blob_compressed.push_back(file->has_compressed_hash());
+          }
+        }
+      }
+      firebuild::ObjCache::free_entry(entry, entry_len, munmap_entry);
+    }
+  }
+  print_latencies("list_subkeys", &list_ns);
+  print_latencies("list_subkeys_miss", &list_miss_ns);
+  print_latencies("retrieve", &retrieve_ns);
+
+  /* BlobCache::retrieve_file() of the blobs referenced by the retrieved entries */
+  {
+    const firebuild::FileName *dst = firebuild::FileName::Get(cfg.dir + "/retrieved");
+    off_t bytes = 0;
+    size_t files = 0;
+    const double start = now_ns();
+    for (size_t i = 0; i < blob_hashes.size(); i++) {
+      firebuild::blob_fd_t blob;
+      if (!firebuild::blob_cache->open_blob(firebuild::Hash(blob_hashes[i]), &blob)) {
+        continue;
+      }
+      if (firebuild::blob_cache->retrieve_file(blob, dst, false, blob_compressed[i])) {
+        files++;
+        bytes += file_size(nullptr, dst->c_str());
+      }
+      if (!blob.packed) {
+        close(blob.fd);
+      }
+    }
+    const double retrieve_s = (now_ns() - start) / 1e9;
+    unlink(dst->c_str());
+    printf("  \"retrieve_file\": {\"files\": %zu, \"bytes\": %jd, \"seconds\": %.3f, "
+           "\"mb_per_s\": %.1f, \"files_per_s\": %.0f},\n",
+           files, static_cast<intmax_t>(bytes), retrieve_s,
+           retrieve_s > 0 ? bytes / retrieve_s / 1e6 : 0.0,
+           retrieve_s > 0 ? files / retrieve_s : 0.0);
+  }
+
+  /* Garbage collection, evicting entries only if the cache is above max_cache_size */
+  {
+    const double start = now_ns();
+    firebuild::execed_process_cacher->gc();
+    const double gc_s = (now_ns() - start) / 1e9;
+    printf("  \"gc\": {\"seconds\": %.3f, \"cache_bytes_after\": %jd},\n", gc_s,
+           static_cast<intmax_t>(recursive_total_file_size(cache_dir)));
+  }
+  firebuild::execed_process_cacher->update_stored_stats();
+
+  printf("  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+
+  if (!cfg.keep_dir) {
+    std::error_code ec;
+    std::filesystem::remove_all(cfg.dir, ec);
+  }
+  return 0;
+}
@@ -0,0 +1,571 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Load generator measuring the supervisor's message throughput.
+ *
+ * Runs as the build command of a real supervisor and impersonates interceptor clients, speaking
+ * the protocol described in src/common/README_MSG_FRAME.txt. It is linked statically, thus the
+ * interceptor is not loaded into it and it signs in to the supervisor on its own as the outermost
+ * intercepted process.
+ *
+ * The process forks the requested number of clients, each of them sending a synthetic stream of
+ * open, fstatat and close messages, requesting an ACK for every Nth message, then optionally
+ * emulating exec()-s (exec message, reconnection and a new scproc_query) and repeating the
+ * stream in each new image. The clients exit with an rusage message and are waited for by the
+ * parent, like intercepted processes are.
+ *
+ * Shortcutting is disabled in every image to keep the results independent of the cache's state.
+ *
+ * Reports the messages/s, the ACK latency percentiles and the supervisor's CPU time.
+ *
+ * Usage: firebuild -- fb-load-gen [-c clients] [-n messages] [-a ack_every] [-e execs]
+ *                                 [-f file]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/config.h"
+#include "common/firebuild_common.h"
+#include "./fbbcomm.h"
+
+/** The fd number the synthetic stream reports to have opened the file on. */
+#define LOAD_GEN_FD 3
+
+typedef struct {
+  /* FBBCOMM messages sent */
+  uint64_t msgs;
+  /* number of items filled in latencies */
+  uint64_t acks;
+  /* ACK round trip times in nanoseconds, the array continues past the struct */
+  uint64_t latencies[];
+} client_stats;
+
+static const char *sv_socket;
+static char self_exe[FB_PATH_BUFSIZE];
+static char cwd[FB_PATH_BUFSIZE];
+static char **self_argv;
+
+static int n_clients = 4;
+static long n_msgs = 100000;
+static long ack_every = 16;
+static int n_execs = 0;
+static char file[FB_PATH_BUFSIZE];
+static struct stat64 file_st;
+
+static uint16_t last_ack_id = 0;
+static size_t stats_size;
+static size_t max_acks;
+static char *stats_area;
+
+static client_stats *stats_of(int client) {
+  return (client_stats *)(stats_area + client * stats_size);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+static void write_all(int fd, const void *buf, size_t count) {
+  const char *p = buf;
+  while (count > 0) {
+    ssize_t ret = write(fd, p, count);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      die("write");
+    }
+    p += ret;
+    count -= ret;
+  }
+}
+
+static void read_all(int fd, void *buf, size_t count) {
+  char *p = buf;
+  while (count > 0) {
+    ssize_t ret = read(fd, p, count);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      if (ret == 0) {
+        errno = ECONNRESET;
+      }
+      die("read");
+    }
+    p += ret;
+    count -= ret;
+  }
+}
+
+static int connect_supervisor() {
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn == -1) {
+    die("socket");
+  }
+  struct sockaddr_un remote;
+  memset(&remote, 0, sizeof(remote));
+  remote.sun_family = AF_UNIX;
+  strncpy(remote.sun_path, sv_socket, sizeof(remote.sun_path) - 1);
+  if (TEMP_FAILURE_RETRY(connect(conn, (struct sockaddr *)&remote, sizeof(remote))) == -1) {
+    die("connect");
+  }
+  return conn;
+}
+
+/** Send a message with the given ack_id (0 for none), like the interceptor's fb_send_msg(). */
+static void send_msg(client_stats *stats, int conn, const void /*FBBCOMM_Builder*/ *msg,
+                     uint16_t ack_id) {
+  char small_buf[sizeof(msg_header) + 4096] __attribute__((aligned(8)));
+  char *buf = small_buf;
+  fbb_size_t len = fbbcomm_builder_serialize_bounded(msg, buf + sizeof(msg_header),
+                                                     sizeof(small_buf) - sizeof(msg_header));
+  if (len == 0) {
+    len = fbbcomm_builder_measure(msg);
+    buf = alloca(sizeof(msg_header) + len);
+    fbbcomm_builder_serialize(msg, buf + sizeof(msg_header));
+  }
+  msg_header header = {len, ack_id, 0};
+  memcpy(buf, &header, sizeof(header));
+  write_all(conn, buf, sizeof(msg_header) + len);
+  if (stats) {
+    stats->msgs++;
+  }
+}
+
+/** Send a message and wait for its ACK, recording the round trip time. */
+static void send_msg_and_check_ack(client_stats *stats, int conn,
+                                   const void /*FBBCOMM_Builder*/ *msg) {
+  if (++last_ack_id == 0) {
+    last_ack_id = 1;
+  }
+  uint64_t start = now_ns();
+  send_msg(stats, conn, msg, last_ack_id);
+  msg_header header;
+  read_all(conn, &header, sizeof(header));
+  uint64_t end = now_ns();
+  if (header.msg_size != 0 || header.ack_id != last_ack_id) {
+    fprintf(stderr, "fb-load-gen: unexpected response to ack_id %u\n", last_ack_id);
+    exit(1);
+  }
+  if (stats && stats->acks < max_acks) {
+    stats->latencies[stats->acks++] = end - start;
+  }
+}
+
+/** Read a non-empty message, which is ignored, except for the attached fds. */
+static void recv_msg(int conn, FBBCOMM_Serialized **msg_out, int *fds_out, int max_fds) {
+  msg_header header;
+  read_all(conn, &header, sizeof(header));
+  if (header.msg_size == 0 || header.fd_count > max_fds) {
+    fprintf(stderr, "fb-load-gen: unexpected message from the supervisor\n");
+    exit(1);
+  }
+  FBBCOMM_Serialized *msg = malloc(header.msg_size);
+  union {
+    char buf[CMSG_SPACE(16 * sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  struct iovec iov = {msg, header.msg_size};
+  struct msghdr msgh = {0};
+  msgh.msg_iov = &iov;
+  msgh.msg_iovlen = 1;
+  if (header.fd_count > 0) {
+    msgh.msg_control = u.buf;
+    msgh.msg_controllen = CMSG_SPACE(header.fd_count * sizeof(int));
+  }
+  ssize_t ret = TEMP_FAILURE_RETRY(recvmsg(conn, &msgh, 0));
+  if (ret == -1) {
+    die("recvmsg");
+  }
+  if ((size_t)ret < header.msg_size) {
+    read_all(conn, (char *)msg + ret, header.msg_size - ret);
+  }
+  if (header.fd_count > 0) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+      fprintf(stderr, "fb-load-gen: missing attached fds\n");
+      exit(1);
+    }
+    memcpy(fds_out, CMSG_DATA(cmsg), header.fd_count * sizeof(int));
+  }
+  *msg_out = msg;
+}
+
+/**
+ * Sign in to the supervisor as a new exec()-ed image with the given pids, taking over the fds
+ * the supervisor asks for, like the interceptor's fb_init_supervisor_conn() and its caller do.
+ */
+static void sign_in(int conn, pid_t pid, pid_t ppid) {
+  FBBCOMM_Builder_scproc_query query;
+  fbbcomm_builder_scproc_query_init(&query);
+  fbbcomm_builder_scproc_query_set_version(&query, FIREBUILD_VERSION);
+  fbbcomm_builder_scproc_query_set_pid(&query, pid);
+  fbbcomm_builder_scproc_query_set_ppid(&query, ppid);
+  fbbcomm_builder_scproc_query_set_cwd(&query, cwd);
+  fbbcomm_builder_scproc_query_set_arg(&query, (const char **)self_argv);
+  fbbcomm_builder_scproc_query_set_env_var(&query, (const char **)environ);
+  mode_t mask = umask(0);
+  umask(mask);
+  fbbcomm_builder_scproc_query_set_umask(&query, mask);
+  fbbcomm_builder_scproc_query_set_executable(&query, self_exe);
+  send_msg(NULL, conn, &query, 0);
+
+  FBBCOMM_Serialized *resp_generic;
+  int fds[16];
+  recv_msg(conn, &resp_generic, fds, sizeof(fds) / sizeof(fds[0]));
+  if (fbbcomm_serialized_get_tag(resp_generic) != FBBCOMM_TAG_scproc_resp) {
+    fprintf(stderr, "fb-load-gen: expected scproc_resp\n");
+    exit(1);
+  }
+  const FBBCOMM_Serialized_scproc_resp *resp =
+      (const FBBCOMM_Serialized_scproc_resp *)resp_generic;
+  if (fbbcomm_serialized_scproc_resp_get_shortcut(resp)) {
+    fprintf(stderr, "fb-load-gen: the supervisor shortcut the load generator\n");
+    exit(1);
+  }
+  if (fbbcomm_serialized_scproc_resp_get_dont_intercept_with_fallback(resp, false)) {
+    fprintf(stderr, "fb-load-gen: the supervisor does not intercept the load generator\n");
+    exit(1);
+  }
+  for (fbb_size_t i = 0; i < fbbcomm_serialized_scproc_resp_get_reopen_fds_count(resp); i++) {
+    const FBBCOMM_Serialized_scproc_resp_reopen_fd *reopen =
+        (const FBBCOMM_Serialized_scproc_resp_reopen_fd *)
+        fbbcomm_serialized_scproc_resp_get_reopen_fds_at(resp, i);
+    for (fbb_size_t j = 0; j < fbbcomm_serialized_scproc_resp_reopen_fd_get_fds_count(reopen);
+         j++) {
+      dup2(fds[i], fbbcomm_serialized_scproc_resp_reopen_fd_get_fds_at(reopen, j));
+    }
+    close(fds[i]);
+  }
+  free(resp_generic);
+
+  /* Never store or shortcut the load generator. */
+  FBBCOMM_Builder_gen_call gen_call;
+  fbbcomm_builder_gen_call_init(&gen_call);
+  fbbcomm_builder_gen_call_set_call(&gen_call, "fb-load-gen");
+  send_msg(NULL, conn, &gen_call, 0);
+}
+
+/** Send the synthetic stream of file operations. */
+static void send_stream(client_stats *stats, int conn) {
+  char missing[FB_PATH_BUFSIZE + 32];
+  for (long i = 0; i < n_msgs; i++) {
+    FBBCOMM_Builder_open open_msg;
+    FBBCOMM_Builder_fstatat fstatat_msg;
+    FBBCOMM_Builder_close close_msg;
+    const void *msg;
+    switch (i % 4) {
+      case 0:
+        fbbcomm_builder_open_init(&open_msg);
+        fbbcomm_builder_open_set_pathname(&open_msg, file);
+        fbbcomm_builder_open_set_flags(&open_msg, O_RDONLY);
+        fbbcomm_builder_open_set_ret(&open_msg, LOAD_GEN_FD);
+        fbbcomm_builder_open_set_pre_open_sent(&open_msg, false);
+        msg = &open_msg;
+        break;
+      case 1:
+        fbbcomm_builder_fstatat_init(&fstatat_msg);
+        fbbcomm_builder_fstatat_set_fd(&fstatat_msg, LOAD_GEN_FD);
+        fbbcomm_builder_fstatat_set_st_mode(&fstatat_msg, file_st.st_mode);
+        fbbcomm_builder_fstatat_set_st_size(&fstatat_msg, file_st.st_size);
+        msg = &fstatat_msg;
+        break;
+      case 2:
+        fbbcomm_builder_close_init(&close_msg);
+        fbbcomm_builder_close_set_fd(&close_msg, LOAD_GEN_FD);
+        msg = &close_msg;
+        break;
+      default:
+        /* Like a header search in the include path. */
+        snprintf(missing, sizeof(missing), "%s/fb-load-gen-missing-%ld", cwd, i % 1024);
+        fbbcomm_builder_fstatat_init(&fstatat_msg);
+        fbbcomm_builder_fstatat_set_pathname(&fstatat_msg, missing);
+        fbbcomm_builder_fstatat_set_flags(&fstatat_msg, 0);
+        fbbcomm_builder_fstatat_set_error_no(&fstatat_msg, ENOENT);
+        msg = &fstatat_msg;
+        break;
+    }
+    if ((i + 1) % ack_every == 0) {
+      send_msg_and_check_ack(stats, conn, msg);
+    } else {
+      send_msg(stats, conn, msg, 0);
+    }
+  }
+}
+
+/** Emulate an exec() of the load generator itself, returning the new connection. */
+static int emulate_exec(client_stats *stats, int conn) {
+  FBBCOMM_Builder_exec exec_msg;
+  fbbcomm_builder_exec_init(&exec_msg);
+  fbbcomm_builder_exec_set_file(&exec_msg, self_exe);
+  fbbcomm_builder_exec_set_arg(&exec_msg, (const char **)self_argv);
+  fbbcomm_builder_exec_set_env(&exec_msg, (const char **)environ);
+  fbbcomm_builder_exec_set_with_p(&exec_msg, false);
+  fbbcomm_builder_exec_set_utime_u(&exec_msg, 0);
+  fbbcomm_builder_exec_set_stime_u(&exec_msg, 0);
+  fbbcomm_builder_exec_set_ack_wait_ns(&exec_msg, 0);
+  send_msg(stats, conn, &exec_msg, 0);
+
+  /* The supervisor may offer to hand over the connection, but the new image connects again. */
+  FBBCOMM_Serialized *rewritten_args;
+  recv_msg(conn, &rewritten_args, NULL, 0);
+  free(rewritten_args);
+  close(conn);
+
+  conn = connect_supervisor();
+  sign_in(conn, getpid(), getppid());
+  stats->msgs += 2;
+  return conn;
+}
+
+static void send_rusage(client_stats *stats, int conn) {
+  FBBCOMM_Builder_rusage rusage_msg;
+  fbbcomm_builder_rusage_init(&rusage_msg);
+  fbbcomm_builder_rusage_set_utime_u(&rusage_msg, 0);
+  fbbcomm_builder_rusage_set_stime_u(&rusage_msg, 0);
+  fbbcomm_builder_rusage_set_ack_wait_ns(&rusage_msg, 0);
+  send_msg_and_check_ack(stats, conn, &rusage_msg);
+}
+
+static void run_client(int client, int parent_conn) {
+  client_stats *stats = stats_of(client);
+  close(parent_conn);
+  int conn = connect_supervisor();
+  FBBCOMM_Builder_fork_child fork_child;
+  fbbcomm_builder_fork_child_init(&fork_child);
+  fbbcomm_builder_fork_child_set_pid(&fork_child, getpid());
+  fbbcomm_builder_fork_child_set_ppid(&fork_child, getppid());
+  send_msg_and_check_ack(stats, conn, &fork_child);
+
+  send_stream(stats, conn);
+  for (int i = 0; i < n_execs; i++) {
+    conn = emulate_exec(stats, conn);
+    send_stream(stats, conn);
+  }
+  send_rusage(stats, conn);
+  _exit(0);
+}
+
+/** Get the CPU time used by the process in seconds, from /proc/<pid>/stat. */
+static bool get_cpu_time(pid_t pid, double *utime, double *stime) {
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return false;
+  }
+  buf[len] = '\0';
+  /* The command name may contain spaces, the fields are counted from the closing paren. */
+  char *p = strrchr(buf, ')');
+  unsigned long long ut, st;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &ut, &st)
+      != 2) {
+    return false;
+  }
+  long ticks = sysconf(_SC_CLK_TCK);
+  *utime = (double)ut / ticks;
+  *stime = (double)st / ticks;
+  return true;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double p) {
+  if (count == 0) {
+    return 0.0;
+  }
+  size_t idx = (size_t)(p / 100.0 * (count - 1) + 0.5);
+  return sorted[idx] / 1000.0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: firebuild -- %s [-c clients] [-n messages] [-a ack_every] [-e execs] "
+          "[-f file]\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:a:e:f:")) != -1) {
+    switch (opt) {
+      case 'c':
+        n_clients = atoi(optarg);
+        break;
+      case 'n':
+        n_msgs = atol(optarg);
+        break;
+      case 'a':
+        ack_every = atol(optarg);
+        break;
+      case 'e':
+        n_execs = atoi(optarg);
+        break;
+      case 'f':
+        if (!realpath(optarg, file)) {
+          die(optarg);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc || n_clients < 1 || n_msgs < 0 || ack_every < 1 || n_execs < 0) {
+    usage(argv[0]);
+  }
+  sv_socket = getenv("FB_SOCKET");
+  if (!sv_socket) {
+    fprintf(stderr, "fb-load-gen: FB_SOCKET is not set, run it under firebuild\n");
+    usage(argv[0]);
+  }
+  self_argv = argv;
+  if (!realpath("/proc/self/exe", self_exe)) {
+    die("/proc/self/exe");
+  }
+  if (!getcwd(cwd, sizeof(cwd))) {
+    die("getcwd");
+  }
+  if (file[0] == '\0') {
+    strcpy(file, self_exe);
+  }
+  if (stat64(file, &file_st) != 0) {
+    die(file);
+  }
+
+  /* Every image sends the stream, plus the fork_child and rusage messages. */
+  max_acks = (n_execs + 1) * (n_msgs / ack_every) + 2;
+  stats_size = (sizeof(client_stats) + max_acks * sizeof(uint64_t) + 63) & ~(size_t)63;
+  stats_area = mmap(NULL, stats_size * n_clients, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats_area == MAP_FAILED) {
+    die("mmap");
+  }
+
+  const pid_t sv_pid = getppid();
+  int conn = connect_supervisor();
+  sign_in(conn, getpid(), sv_pid);
+
+  double sv_utime_start = 0, sv_stime_start = 0, sv_utime_end = 0, sv_stime_end = 0;
+  bool have_cpu = get_cpu_time(sv_pid, &sv_utime_start, &sv_stime_start);
+  const uint64_t start = now_ns();
+
+  pid_t *pids = calloc(n_clients, sizeof(pid_t));
+  for (int i = 0; i < n_clients; i++) {
+    fflush(NULL);
+    pids[i] = fork();
+    if (pids[i] == -1) {
+      die("fork");
+    } else if (pids[i] == 0) {
+      run_client(i, conn);
+    }
+    FBBCOMM_Builder_fork_parent fork_parent;
+    fbbcomm_builder_fork_parent_init(&fork_parent);
+    send_msg_and_check_ack(NULL, conn, &fork_parent);
+  }
+  int failed = 0;
+  for (int i = 0; i < n_clients; i++) {
+    int wstatus;
+    if (TEMP_FAILURE_RETRY(waitpid(pids[i], &wstatus, 0)) == -1) {
+      die("waitpid");
+    }
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+      failed++;
+    }
+    FBBCOMM_Builder_wait wait_msg;
+    fbbcomm_builder_wait_init(&wait_msg);
+    fbbcomm_builder_wait_set_pid(&wait_msg, pids[i]);
+    fbbcomm_builder_wait_set_wstatus(&wait_msg, wstatus);
+    send_msg_and_check_ack(NULL, conn, &wait_msg);
+  }
+
+  const double wall = (now_ns() - start) / 1e9;
+  have_cpu = have_cpu && get_cpu_time(sv_pid, &sv_utime_end, &sv_stime_end);
+
+  uint64_t total_msgs = 0;
+  size_t total_acks = 0;
+  for (int i = 0; i < n_clients; i++) {
+    total_msgs += stats_of(i)->msgs;
+    total_acks += stats_of(i)->acks;
+  }
+  uint64_t *latencies = malloc((total_acks + 1) * sizeof(uint64_t));
+  size_t n_latencies = 0;
+  for (int i = 0; i < n_clients; i++) {
+    memcpy(latencies + n_latencies, stats_of(i)->latencies, stats_of(i)->acks * sizeof(uint64_t));
+    n_latencies += stats_of(i)->acks;
+  }
+  qsort(latencies, n_latencies, sizeof(uint64_t), compare_u64);
+
+  printf("%-28s %12d\n", "clients", n_clients);
+  printf("%-28s %12d\n", "emulated execs per client", n_execs);
+  printf("%-28s %12llu\n", "messages", (unsigned long long)total_msgs);
+  printf("%-28s %12.3f\n", "wall time (s)", wall);
+  printf("%-28s %12.0f\n", "messages/s", total_msgs / wall);
+  printf("%-28s %12zu\n", "ACKs", n_latencies);
+  printf("%-28s %12.1f\n", "ACK latency p50 (us)", percentile_us(latencies, n_latencies, 50));
+  printf("%-28s %12.1f\n", "ACK latency p90 (us)", percentile_us(latencies, n_latencies, 90));
+  printf("%-28s %12.1f\n", "ACK latency p99 (us)", percentile_us(latencies, n_latencies, 99));
+  printf("%-28s %12.1f\n", "ACK latency max (us)",
+         n_latencies > 0 ? latencies[n_latencies - 1] / 1000.0 : 0.0);
+  if (have_cpu) {
+    const double sv_utime = sv_utime_end - sv_utime_start;
+    const double sv_stime = sv_stime_end - sv_stime_start;
+    printf("%-28s %12.3f\n", "supervisor user CPU (s)", sv_utime);
+    printf("%-28s %12.3f\n", "supervisor sys CPU (s)", sv_stime);
+    printf("%-28s %12.2f\n", "supervisor CPU/message (us)",
+           total_msgs > 0 ? (sv_utime + sv_stime) * 1e6 / total_msgs : 0.0);
+  }
+  if (failed > 0) {
+    fprintf(stderr, "fb-load-gen: %d client(s) failed\n", failed);
+  }
+  fflush(NULL);
+  free(latencies);
+  free(pids);
+
+  send_rusage(NULL, conn);
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2022 Firebuild Inc.
+ * All rights reserved.
+ *
+ * Free for personal use and commercial trial.
+ * Non-trial commercial use requires licenses available from https://firebuild.com.
+ * Modification and redistribution are permitted, but commercial use of derivative
+ * works is subject to the same requirements of this license
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the FBB serialization and deserialization.
+ *
+ * Measures the builder construction, measure(), serialize() and field access on the serialized
+ * form of messages representative of the interceptor - supervisor communication and of cache
+ * entries, reporting ns/op and the serialized size.
+ *
+ * Usage: fbb-bench [iterations]
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "./fbbcomm.h"
+#include "firebuild/fbbstore.h"
+
+namespace firebuild {
+
+/* The FBB debug output is not benchmarked, provide the helpers it refers to here instead of
+ * linking in most of the supervisor. */
+
+const char *file_type_to_string(FileType type) {
+  (void)type;
+  return "?";
+}
+
+void Hash::to_ascii(char *out) const {
+  memset(out, '?', kAsciiLength);
+  out[kAsciiLength] = '\0';
+}
+
+}  // namespace firebuild
+
+/* Sink for the results of the measured operations so that they are not optimized out. */
+static volatile uint64_t sink;
+
+/* Make the compiler assume that the object is used, so that filling it is not optimized out. */
+static inline void escape(const void *ptr) {
+  asm volatile("" : : "g"(ptr) : "memory");
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<double>(ts.tv_sec) * 1e9 + static_cast<double>(ts.tv_nsec);
+}
+
+/**
+ * Run the benchmark of one message type.
+ *
+ * @param name name of the benchmark to print
+ * @param iterations number of iterations of each measured operation
+ * @param fill sets all fields of the builder
+ * @param access reads the fields of the serialized message, returns a checksum of them
+ */
+template <typename GenericBuilder, typename Builder, typename Fill, typename Access>
+static void bench(const char *name, long iterations, Fill fill, Access access) {
+  uint64_t acc = 0;
+
+  double start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    Builder builder;
+    fill(&builder);
+    escape(&builder);
+  }
+  const double build_ns = (now_ns() - start) / static_cast<double>(iterations);
+
+  Builder builder;
+  fill(&builder);
+  const GenericBuilder *generic = reinterpret_cast<const GenericBuilder *>(&builder);
+
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    acc += generic->measure();
+  }
+  const double measure_ns = (now_ns() - start) / static_cast<double>(iterations);
+
+  const size_t len = generic->measure();
+  /* The serialized form needs to be aligned like the supervisor's buffers are. */
+  std::vector<uint64_t> buf((len + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  char *data = reinterpret_cast<char *>(buf.data());
+
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    acc += generic->serialize(data);
+  }
+  const double serialize_ns = (now_ns() - start) / static_cast<double>(iterations);
+
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    acc += access(data);
+  }
+  const double access_ns = (now_ns() - start) / static_cast<double>(iterations);
+
+  sink = sink + acc;
+  printf("%-28s %10zu %12.1f %12.1f %12.1f %12.1f\n",
+         name, len, build_ns, measure_ns, serialize_ns, access_ns);
+}
+
+static XXH128_hash_t fake_hash(uint64_t seed) {
+  XXH128_hash_t hash;
+  hash.low64 = seed * 0x9e3779b97f4a7c15ULL;
+  hash.high64 = ~seed;
+  return hash;
+}
+
+int main(int argc, char *argv[]) {
+  const long iterations = argc > 1 ? atol(argv[1]) : 100000;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-28s %10s %12s %12s %12s %12s\n", "benchmark (ns/op)", "bytes",
+         "build", "measure", "serialize", "access");
+
+  bench<FBBCOMM_Builder, FBBCOMM_Builder_open>(
+      "fbbcomm open", iterations,
+      [](FBBCOMM_Builder_open *open) {
+        open->set_dirfd(AT_FDCWD);
+        open->set_pathname("/usr/include/x86_64-linux-gnu/bits/types/struct_timespec.h");
+        open->set_flags(O_RDONLY | O_CLOEXEC);
+        open->set_ret(3);
+        open->set_pre_open_sent(false);
+      },
+      [](const char *data) {
+        auto open = reinterpret_cast<const FBBCOMM_Serialized_open *>(data);
+        return static_cast<uint64_t>(open->get_flags()) + open->get_pathname_len()
+            + static_cast<uint64_t>(open->get_ret_with_fallback(-1))
+            + static_cast<uint64_t>(open->get_pathname()[0]);
+      });
+
+  bench<FBBCOMM_Builder, FBBCOMM_Builder_fstatat>(
+      "fbbcomm fstatat", iterations,
+      [](FBBCOMM_Builder_fstatat *fstatat) {
+        fstatat->set_fd(AT_FDCWD);
+        fstatat->set_pathname("src/firebuild/execed_process_cacher.cc");
+        fstatat->set_flags(0);
+        fstatat->set_st_mode(S_IFREG | 0644);
+        fstatat->set_st_size(98765);
+        fstatat->set_st_mtim_sec(1700000000);
+        fstatat->set_st_mtim_nsec(123456789);
+      },
+      [](const char *data) {
+        auto fstatat = reinterpret_cast<const FBBCOMM_Serialized_fstatat *>(data);
+        return static_cast<uint64_t>(fstatat->get_st_mode_with_fallback(0))
+            + static_cast<uint64_t>(fstatat->get_st_size_with_fallback(0))
+            + static_cast<uint64_t>(fstatat->get_st_mtim_sec_with_fallback(0))
+            + fstatat->get_pathname_len();
+      });
+
+  /* A compiler invocation with a big environment, like in a CI job. */
+  std::vector<std::string> exec_args_storage {"/usr/bin/x86_64-linux-gnu-g++-12", "-std=c++17",
+    "-O2", "-g", "-Wall", "-Wextra", "-fPIC", "-DNDEBUG", "-I/home/user/project/src",
+    "-I/home/user/project/build/src", "-MD", "-MT", "src/foo/CMakeFiles/foo.dir/bar.cc.o",
+    "-MF", "src/foo/CMakeFiles/foo.dir/bar.cc.o.d", "-o", "src/foo/CMakeFiles/foo.dir/bar.cc.o",
+    "-c", "/home/user/project/src/foo/bar.cc"};
+  std::vector<std::string> exec_env_storage;
+  for (int i = 0; i < 200; i++) {
+    exec_env_storage.push_back("BENCH_ENVIRONMENT_VARIABLE_" + std::to_string(i)
+                               + "=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin");
+  }
+  std::vector<const char *> exec_args, exec_env;
+  for (const auto& arg : exec_args_storage) {
+    exec_args.push_back(arg.c_str());
+  }
+  for (const auto& env : exec_env_storage) {
+    exec_env.push_back(env.c_str());
+  }
+
+  bench<FBBCOMM_Builder, FBBCOMM_Builder_exec>(
+      "fbbcomm exec (200 env vars)", iterations,
+      [&](FBBCOMM_Builder_exec *exec) {
+        exec->set_file("/usr/bin/x86_64-linux-gnu-g++-12");
+        exec->set_arg(exec_args);
+        exec->set_env(exec_env);
+        exec->set_with_p(true);
+        exec->set_path("/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin");
+        exec->set_utime_u(1234);
+        exec->set_stime_u(567);
+        exec->set_ack_wait_ns(0);
+      },
+      [](const char *data) {
+        auto exec = reinterpret_cast<const FBBCOMM_Serialized_exec *>(data);
+        uint64_t sum = 0;
+        for (fbb_size_t i = 0; i < exec->get_arg_count(); i++) {
+          sum += exec->get_arg_len_at(i);
+        }
+        for (fbb_size_t i = 0; i < exec->get_env_count(); i++) {
+          sum += static_cast<uint64_t>(exec->get_env_at(i)[0]);
+        }
+        return sum;
+      });
+
+  /* A cache entry of a compilation reading many headers. */
+  std::vector<std::string> in_path_storage, in_path_notexist_storage;
+  for (int i = 0; i < 1000; i++) {
+    in_path_storage.push_back("/usr/include/c++/12/bits/header_" + std::to_string(i) + ".h");
+  }
+  for (int i = 0; i < 300; i++) {
+    in_path_notexist_storage.push_back("/home/user/project/src/foo/missing_" + std::to_string(i)
+                                       + ".h");
+  }
+  std::vector<FBBSTORE_Builder_file> in_path(in_path_storage.size());
+  for (size_t i = 0; i < in_path_storage.size(); i++) {
+    in_path[i].set_path_with_length(in_path_storage[i].c_str(), in_path_storage[i].size());
+    in_path[i].set_type(firebuild::ISREG);
+    in_path[i].set_size(4096 + i);
+    in_path[i].set_hash(fake_hash(i));
+  }
+  FBBSTORE_Builder_file out_file;
+  out_file.set_path("src/foo/CMakeFiles/foo.dir/bar.cc.o");
+  out_file.set_type(firebuild::ISREG);
+  out_file.set_hash(fake_hash(424242));
+  out_file.set_mode(0644);
+  out_file.set_mode_mask(07777);
+  std::vector<const FBBSTORE_Builder *> out_path_isreg {
+    reinterpret_cast<const FBBSTORE_Builder *>(&out_file)};
+  /* The nested builders are only referenced by the outer one, they have to outlive it. */
+  FBBSTORE_Builder_process_inputs pi;
+  FBBSTORE_Builder_process_outputs po;
+
+  bench<FBBSTORE_Builder, FBBSTORE_Builder_process_inputs_outputs>(
+      "fbbstore entry (1000 files)", iterations / 100 + 1,
+      [&](FBBSTORE_Builder_process_inputs_outputs *pio) {
+        pi = FBBSTORE_Builder_process_inputs();
+        po = FBBSTORE_Builder_process_outputs();
+        pi.set_path_item_fn(in_path.size(), [](int idx, const void *user_data) {
+          auto files = reinterpret_cast<const std::vector<FBBSTORE_Builder_file> *>(user_data);
+          return reinterpret_cast<const FBBSTORE_Builder *>(&(*files)[idx]);
+        }, &in_path);
+        pi.set_path_notexist(in_path_notexist_storage);
+        po.set_path_isreg(out_path_isreg);
+        po.set_exit_status(0);
+        pio->set_inputs(reinterpret_cast<FBBSTORE_Builder *>(&pi));
+        pio->set_outputs(reinterpret_cast<FBBSTORE_Builder *>(&po));
+        pio->set_cpu_time_ms(1500);
+      },
+      [](const char *data) {
+        auto pio = reinterpret_cast<const FBBSTORE_Serialized_process_inputs_outputs *>(data);
+        auto pi = reinterpret_cast<const FBBSTORE_Serialized_process_inputs *>(pio->get_inputs());
+        uint64_t sum = 0;
+        for (fbb_size_t i = 0; i < pi->get_path_count(); i++) {
+          auto file = reinterpret_cast<const FBBSTORE_Serialized_file *>(pi->get_path_at(i));
+          sum += file->get_path_len() + file->get_hash().low64;
+        }
+        for (fbb_size_t i = 0; i < pi->get_path_notexist_count(); i++) {
+          sum += pi->get_path_notexist_len_at(i);
+        }
+        return sum;
+      });
+
+  return 0;
+}
@@ -150,6 +150,17 @@ int main(int argc, char *argv[]) {
   char *p = reinterpret_cast<char *>(malloc(len));
   assert(fbbtest_builder_serialize(reinterpret_cast<FBBTEST_Builder *>(&builder), p) == len);
 
+  /* single pass serialization fails without writing beyond the capacity if the buffer is small */
+  char *p2 = reinterpret_cast<char *>(malloc(len + 8));
+  memset(p2, 'X', len + 8);
+  assert(fbbtest_builder_serialize_bounded(reinterpret_cast<FBBTEST_Builder *>(&builder), p2,
+                                           len - 1) == 0);
+  assert(p2[len - 1] == 'X');
+  assert(fbbtest_builder_serialize_bounded(reinterpret_cast<FBBTEST_Builder *>(&builder), p2,
+                                           len + 8) == len);
+  assert(memcmp(p, p2, len) == 0);
+  free(p2);
+
   /* dump to file for easier debugging */
 
   int fd = open("fbb_test.bin", O_CREAT|O_RDWR|O_TRUNC, 0666);
@@ -241,6 +252,30 @@ int main(int argc, char *argv[]) {
   assert(strcmp(fbbtest_serialized_testing_get_arrstr_at(fbb0, 2), "three") == 0);
   assert(strcmp(fbbtest_serialized_testing_get_arrstr_at(fbb0, 3), "four") == 0);
 
+  /* look up items of indexed arrays */
+  assert(fbbtest_serialized_testing_find_arrstr2_idx(msg, "the", 3) == 0);
+  assert(fbbtest_serialized_testing_find_arrstr2_idx(msg, "fox", 3) == 3);
+  assert(fbbtest_serialized_testing_find_arrstr2_idx(msg, "fo", 2) == -1);
+  assert(fbbtest_serialized_testing_find_arrstr2_idx(fbb0, "the", 3) == -1);
+
+  FBBTEST_Builder_testing4 builder7;
+  fbbtest_builder_testing4_init(&builder7);
+  const FBBTEST_Builder *indexed_builder_array[] = {
+    reinterpret_cast<FBBTEST_Builder *>(&builder4),
+    reinterpret_cast<FBBTEST_Builder *>(&builder),
+    reinterpret_cast<FBBTEST_Builder *>(&builder4),
+    NULL};
+  fbbtest_builder_testing4_set_arrfbb4(&builder7, indexed_builder_array);
+
+  size_t len7 = fbbtest_builder_measure(reinterpret_cast<FBBTEST_Builder *>(&builder7));
+  char *p7 = reinterpret_cast<char *>(malloc(len7));
+  assert(fbbtest_builder_serialize(reinterpret_cast<FBBTEST_Builder *>(&builder7), p7) == len7);
+  const FBBTEST_Serialized_testing4 *msg7 = reinterpret_cast<FBBTEST_Serialized_testing4 *>(p7);
+  /* the first one of the duplicate keys is found, like with a linear search */
+  assert(msg7->find_arrfbb4_idx("hi there", 8) == 0);
+  assert(msg7->find_arrfbb4_idx("foo", 3) == 1);
+  assert(msg7->find_arrfbb4_idx("bar", 3) == -1);
+
   printf("fbb testing succeeded\n");
   return 0;
 }
@@ -143,6 +143,33 @@ setup() {
   done
 }
 
+@test "watching the children's exits with pidfds" {
+  [ "$(uname)" = "Linux" ] && [ "$(systemd-detect-virt)" != "wsl" ] || skip
+  pidfd="pidfd_child_tracking = true"
+  for i in 1 2; do
+    ret=0
+    result=$(timeout 10 ./run-firebuild -o "$pidfd" -- bash -c 'ls integration.bats; exit 3') || ret=$?
+    assert_streq "$result" "integration.bats"
+    assert_streq "$ret" "3"
+    assert_streq "$(strip_stderr stderr)" ""
+
+    timeout 10 ./run-firebuild -o "$pidfd" -- bash -c 'kill -TERM $$' || true
+    assert_streq "$(strip_stderr stderr)" "Child process has been killed by signal 15"
+
+    # Orphans are reparented to the supervisor and are watched, too
+    result=$(timeout 10 ./run-firebuild -o "$pidfd" -o 'processes.dont_shortcut += "sleep"' -- bash -c 'for i in $(seq 3); do (sleep 0.3; ls integration.bats; false)& done; /bin/echo foo')
+    assert_streq "$result" "foo"
+    assert_streq "$(strip_stderr stderr | uniq -c)" "      3 Orphan process has been killed by signal 15"
+
+    # Children of intercepted processes are not the supervisor's children
+    if [ -x ./test_static ]; then
+      result=$(timeout 10 ./run-firebuild -o "$pidfd" -- ./test_cmd_fork_exec ./test_static)
+      assert_streq "$result" "I am statically linked."
+      assert_streq "$(strip_stderr stderr)" ""
+    fi
+  done
+}
+
 @test "system()" {
   for i in 1 2; do
     result=$(./run-firebuild -- ./test_system)
@@ -392,6 +419,41 @@ SCRIPT
   done
 }
 
+@test "inherit the supervisor connection across exec()" {
+  inherit="inherit_supervisor_connection = true"
+  printf '#!/bin/sh\necho "script: $1"\n' > test_dynamic_script
+  chmod +x test_dynamic_script
+  for i in 1 2; do
+    # Dynamically linked images and scripts take over the connection along the exec() chain
+    result=$(./run-firebuild -o "$inherit" -- bash -c 'exec bash -c "exec ./test_dynamic_script foo"')
+    assert_streq "$result" "script: foo"
+    assert_streq "$(strip_stderr stderr)" ""
+  done
+  if [ -x ./test_static ]; then
+    # Statically linked binaries and the scripts they interpret connect their children anew
+    printf '#!%s\n' "$PWD/test_static" > test_static_script
+    chmod +x test_static_script
+    for i in 1 2; do
+      result=$(timeout 10 ./run-firebuild -o "$inherit" -- bash -c 'exec ./test_static')
+      assert_streq "$result" "I am statically linked."
+      assert_streq "$(strip_stderr stderr)" ""
+      result=$(timeout 10 ./run-firebuild -o "$inherit" -- bash -c 'exec ./test_static_script')
+      assert_streq "$result" "$(printf 'I am statically linked.\nend')"
+      assert_streq "$(strip_stderr stderr)" ""
+    done
+  fi
+  rm -f test_dynamic_script test_static_script
+}
+
+@test "direct pipe handoff keeps the output's order" {
+  handoff="direct_pipe_handoff = true"
+  for i in $(seq 1 20); do
+    result=$(./run-firebuild -o "$handoff" -o 'processes.dont_shortcut += "head"' -- bash -c '{ echo a; head -n1 integration.bats; echo b; } | cat')
+    assert_streq "$result" "$(printf 'a\n#!/usr/bin/env bats\nb')"
+    assert_streq "$(strip_stderr stderr)" ""
+  done
+}
+
 @test "posix_spawn() a binary" {
   for i in 1 2; do
     result=$(./run-firebuild -r -q -- ./test_cmd_posix_spawn bash -c 'echo ok')
@@ -445,7 +507,7 @@ SCRIPT
 
 @test "pipe replaying" {
   # Disable compression for this test since it directly manipulates blob content
-  result=$(./run-firebuild -o 'processes.skip_cache -= "echo"' -o 'max_inline_blob_size = 0' -o 'min_cpu_time = -1.0' -o 'compress_cache = false' -- echo foo)
+  result=$(./run-firebuild -o 'processes.skip_cache -= "echo"' -o 'max_inline_blob_size = 0' -o 'max_packed_blob_size = 0' -o 'min_cpu_time = -1.0' -o 'compress_cache = false' -- echo foo)
   assert_streq "$result" "foo"
   assert_streq "$(strip_stderr stderr)" ""
 
@@ -459,6 +521,95 @@ SCRIPT
   assert_streq "$(strip_stderr stderr)" ""
 }
 
+@test "pack files" {
+  rm -f test_pack_out
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -- bash -c 'head -c 10000 integration.bats > test_pack_out; head -n 300 integration.bats')
+  assert_streq "$result" "$(head -n 300 integration.bats)"
+  assert_streq "$(strip_stderr stderr)" ""
+  # The blobs are stored in a pack instead of separate files
+  [ -f test_cache_dir/blobs/packs/index ]
+  assert_streq "$(find test_cache_dir/blobs -type f -not -path '*/packs/*' | wc -l | sed 's/ *//g')" "0"
+
+  result=$(./run-firebuild -o 'shortcut_tries = 18' --gc)
+  assert_streq "$result" ""
+  assert_streq "$(strip_stderr stderr)" ""
+
+  rm -f test_pack_out
+  result=$(./run-firebuild -s -o 'processes.skip_cache = []' -- bash -c 'head -c 10000 integration.bats > test_pack_out; head -n 300 integration.bats' | tail -n 8 | sed 's/  */ /g;s/seconds/ms/;s/[0-9-][0-9\.]* ms/N ms/;s/[0-9-][0-9\.]* kB/N kB/')
+  assert_streq "$result" "$(printf '\nStatistics of current run:\n Hits: 1 / 1 (100.00 %%)\n Misses: 0\n Uncacheable: 0\n GC runs: 0\nNewly cached: N kB\nSaved CPU time: N ms\n')"
+  assert_streq "$(strip_stderr stderr)" ""
+  head -c 10000 integration.bats | cmp - test_pack_out
+  rm -f test_pack_out
+}
+
+@test "prefetching from the access log" {
+  rm -rf test_cache_dir/access-logs
+  for i in 1 2 3; do
+    result=$(./run-firebuild -o 'processes.skip_cache = []' -- bash -c 'head -n 10 integration.bats')
+    assert_streq "$result" "$(head -n 10 integration.bats)"
+    assert_streq "$(strip_stderr stderr)" ""
+  done
+  # The entry and the blob used by the shortcut are logged for the next run
+  grep -q '^0 0 objs/' test_cache_dir/access-logs/*
+  grep -q ' blobs/' test_cache_dir/access-logs/*
+
+  # Old logs and leftover temporary files are garbage collected
+  log=$(ls test_cache_dir/access-logs/)
+  old_log=0123456789abcdefghijkl
+  cp test_cache_dir/access-logs/$log test_cache_dir/access-logs/$old_log
+  touch -d '40 days ago' test_cache_dir/access-logs/$old_log
+  touch -d '2 hours ago' test_cache_dir/access-logs/$log.tmpXYZ
+  result=$(./run-firebuild --gc)
+  assert_streq "$result" ""
+  assert_streq "$(strip_stderr stderr)" ""
+  assert_streq "$(ls test_cache_dir/access-logs/)" "$log"
+
+  rm -rf test_cache_dir/access-logs
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -o 'prefetch_cache = false' -- bash -c 'head -n 10 integration.bats')
+  assert_streq "$result" "$(head -n 10 integration.bats)"
+  [ ! -d test_cache_dir/access-logs ]
+}
+
+@test "relocating the build directory" {
+  for dir in test_reloc1 test_reloc2; do
+    rm -rf $dir
+    mkdir $dir
+    head -n 10 integration.bats > $dir/in
+  done
+  # cp's entry is shared, readlink's output contains the root directory, thus it is not stored
+  result=$(./run-firebuild -o 'relocation_root = "test_reloc1"' -- bash -c 'cd test_reloc1 && cp in out && readlink -f out > path && true')
+  assert_streq "$result" ""
+  result=$(./run-firebuild -s -o 'relocation_root = "test_reloc2"' -- bash -c 'cd test_reloc2 && cp in out && readlink -f out > path && true' | grep Hits | sed 's/  */ /g')
+  assert_streq "$result" " Hits: 1 / 3 (33.33 %)"
+  assert_streq "$(cat test_reloc2/out)" "$(head -n 10 integration.bats)"
+  assert_streq "$(cat test_reloc2/path)" "$(readlink -f test_reloc2)/out"
+  # a literal "$ROOT" argument and the root directory's path don't share entries
+  result=$(./run-firebuild -o 'relocation_root = "test_reloc1"' -- sh -c 'sh -c "echo \"\$0\" > test_reloc1/arg" "$1"; true' sh '$ROOT')
+  assert_streq "$result" ""
+  assert_streq "$(cat test_reloc1/arg)" '$ROOT'
+  result=$(./run-firebuild -s -o 'relocation_root = "test_reloc1"' -- sh -c 'sh -c "echo \"\$0\" > test_reloc1/arg" "$1"; true' sh "$(readlink -f test_reloc1)" | grep Hits | sed 's/  */ /g')
+  assert_streq "$result" " Hits: 0 / 2 (0.00 %)"
+  assert_streq "$(cat test_reloc1/arg)" "$(readlink -f test_reloc1)"
+  rm -rf test_reloc1 test_reloc2
+}
+
+@test "format insensitive processes" {
+  printf 'int a; /* one */\n' > test_fmt.h
+  result=$(./run-firebuild -o 'processes.format_insensitive = ["wc"]' -- bash -c 'wc -l test_fmt.h > test_fmt.out && true')
+  assert_streq "$result" ""
+  # wc is shortcut after changing only the formatting
+  printf 'int   a; // two\n' > test_fmt.h
+  result=$(./run-firebuild -s -o 'processes.format_insensitive = ["wc"]' -- bash -c 'wc -l test_fmt.h > test_fmt.out && true' | grep Hits | sed 's/  */ /g')
+  assert_streq "$result" " Hits: 1 / 2 (50.00 %)"
+  assert_streq "$(cat test_fmt.out)" "1 test_fmt.h"
+  # but not after changing the line count
+  printf 'int a;\n\n' > test_fmt.h
+  result=$(./run-firebuild -s -o 'processes.format_insensitive = ["wc"]' -- bash -c 'wc -l test_fmt.h > test_fmt.out && true' | grep Hits | sed 's/  */ /g')
+  assert_streq "$result" " Hits: 0 / 2 (0.00 %)"
+  assert_streq "$(cat test_fmt.out)" "2 test_fmt.h"
+  rm -f test_fmt.h test_fmt.out
+}
+
 @test "parallel sleeps" {
   for i in 1 2; do
     # Valgrind ignores the limit bumped internally in firebuild
@@ -481,7 +632,7 @@ SCRIPT
 
 @test "gc" {
   rm -f foo
-  result=$(./run-firebuild -d cache -o 'max_inline_blob_size = 0' -- bash -c 'echo foo > foo')
+  result=$(./run-firebuild -d cache -o 'max_inline_blob_size = 0' -o 'max_packed_blob_size = 0' -- bash -c 'echo foo > foo')
   assert_streq "$result" ""
   if [ "$SKIP_GC_INVALID_ENTRIES_TEST" != 1 ]; then
     echo foo > test_cache_dir/blobs/invalid_blob_name
@@ -491,21 +642,19 @@ SCRIPT
   fi
   mkdir test_cache_dir/blobs/to_be_removed test_cache_dir/objs/to_be_removed
   touch test_cache_dir/objs/to_be_removed/%_directory_debug.json
+  # stale temporary files left behind by killed processes
+  touch -d '2 hours ago' test_cache_dir/blobs/new.Abc123 test_cache_dir/objs/new.Abc123
   mkdir test_cache_dir/objs/many-entries
   for i in $(seq -w 30); do
     cp test_cache_dir/objs/?/??/*/??????????? test_cache_dir/objs/many-entries/12345678${i}+
   done
-  # update cache size
-  if [ "$(uname)" = "Linux" ]; then
-    du="du --apparent-size -b"
-  else
-    du="stat -f %z"
-  fi
-  new_cache_size=$((cat test_cache_dir/size | tr '\n' ' ' ; printf '+ 30 *' ; ($du test_cache_dir/objs/?/??/*/??????????? | cut -f1) ) | bc)
-  echo $new_cache_size > test_cache_dir/size
+  # let firebuild count the cache size again, including the copied entries
+  rm test_cache_dir/counters
 
   result=$(./run-firebuild -o 'shortcut_tries = 18' -d cache --gc)
   assert_streq "$result" ""
+  ! [ -e test_cache_dir/blobs/new.Abc123 ]
+  ! [ -e test_cache_dir/objs/new.Abc123 ]
   if [ "$SKIP_GC_INVALID_ENTRIES_TEST" != 1 ]; then
     assert_streq "$(grep 'invalid_.*_name' stderr | wc -l | sed 's/ *//g')" "2"
     assert_streq "$(strip_stderr stderr | grep -v 'invalid_.*_name' | grep -v 'type is unexpected')" "FIREBUILD ERROR: There are 8 bytes in the cache stored in files with unexpected name."
@@ -544,14 +693,14 @@ SCRIPT
   result=$(./run-firebuild -d cache -- bash -c 'echo foo > foo')
   assert_streq "$result" ""
   assert_streq "$(strip_stderr stderr)" ""
-  assert_streq "$(cat test_cache_dir/cache-format)" "3"
+  assert_streq "$(cat test_cache_dir/cache-format)" "5"
 
   # older cache versions are upgraded
   echo 0 > test_cache_dir/cache-format
   result=$(./run-firebuild -d cache -- bash -c 'echo foo > foo')
   assert_streq "$result" "FIREBUILD: Cache format version is outdated, clearing the cache"
   assert_streq "$(strip_stderr stderr)" ""
-  assert_streq "$(cat test_cache_dir/cache-format)" "3"
+  assert_streq "$(cat test_cache_dir/cache-format)" "5"
 
   # future cache versions prevent using the cache
   echo 9 > test_cache_dir/cache-format
@@ -640,3 +789,154 @@ SCRIPT
   
   unset FIREBUILD_CACHE_DIR
 }
+
+@test "lower cache layers" {
+  rm -rf test_cache_dir.lower
+  # Populate the cache, then turn it into a read-only lower layer
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -- bash -c 'head -n1 integration.bats')
+  assert_streq "$result" "#!/usr/bin/env bats"
+  mv test_cache_dir test_cache_dir.lower
+  result=$(./run-firebuild -s -o 'processes.skip_cache = []' -o 'lower_cache_dirs = ["test_cache_dir.lower"]' -- bash -c 'head -n1 integration.bats' | sed 's/  */ /g;s/seconds/ms/;s/[0-9-][0-9\.]* ms/N ms/;s/[0-9-][0-9\.]* kB/N kB/')
+  assert_streq "$result" "$(printf '#!/usr/bin/env bats\n\nStatistics of current run:\n Hits: 1 / 1 (100.00 %%)\n Misses: 0\n Uncacheable: 0\n GC runs: 0\nNewly cached: N kB\nSaved CPU time: N ms\nCache entry lookups per tier:\n Local hits: 0, misses: 1\n Lower hits: 1, misses: 0\n')"
+  assert_streq "$(strip_stderr stderr)" ""
+  # The entry got promoted to the local layer
+  result=$(./run-firebuild -s -o 'processes.skip_cache = []' -- bash -c 'head -n1 integration.bats' | sed 's/  */ /g;s/seconds/ms/;s/[0-9-][0-9\.]* ms/N ms/;s/[0-9-][0-9\.]* kB/N kB/')
+  assert_streq "$result" "$(printf '#!/usr/bin/env bats\n\nStatistics of current run:\n Hits: 1 / 1 (100.00 %%)\n Misses: 0\n Uncacheable: 0\n GC runs: 0\nNewly cached: N kB\nSaved CPU time: N ms\n')"
+  rm -rf test_cache_dir.lower
+}
+
+@test "cache export and import" {
+  rm -f test_bundle test_empty_out
+  # The empty output file is stored as an empty blob
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -- bash -c 'head -n1 integration.bats; : > test_empty_out')
+  assert_streq "$result" "#!/usr/bin/env bats"
+  result=$(./run-firebuild --export-cache=test_bundle --export-runs=1)
+  assert_streq "$result" ""
+  assert_streq "$(strip_stderr stderr)" ""
+  # Import the bundle into an empty cache
+  rm -rf test_cache_dir
+  result=$(./run-firebuild --import-cache=test_bundle)
+  assert_streq "$result" ""
+  assert_streq "$(strip_stderr stderr)" ""
+  rm -f test_empty_out
+  result=$(./run-firebuild -s -o 'processes.skip_cache = []' -- bash -c 'head -n1 integration.bats; : > test_empty_out' | sed 's/  */ /g;s/seconds/ms/;s/[0-9-][0-9\.]* ms/N ms/;s/[0-9-][0-9\.]* kB/N kB/')
+  assert_streq "$result" "$(printf '#!/usr/bin/env bats\n\nStatistics of current run:\n Hits: 1 / 1 (100.00 %%)\n Misses: 0\n Uncacheable: 0\n GC runs: 0\nNewly cached: N kB\nSaved CPU time: N ms\n')"
+  assert_streq "$(strip_stderr stderr)" ""
+  test -f test_empty_out && ! test -s test_empty_out
+  # Broken bundles are rejected
+  head -c 100 test_bundle > test_bundle.broken
+  ! ./run-firebuild --import-cache=test_bundle.broken 2>/dev/null
+  rm -f test_bundle test_bundle.broken test_empty_out
+}
+
+@test "message trace record and replay" {
+  rm -f test_trace
+  result=$(./run-firebuild --record-trace=test_trace -- bash -c 'ls integration.bats; (ls integration.bats)')
+  assert_streq "$result" "$(printf 'integration.bats\nintegration.bats')"
+  assert_streq "$(strip_stderr stderr)" ""
+  result=$(./run-firebuild --replay-trace=test_trace | sed 's/[0-9][0-9\.]*/N/g')
+  assert_streq "$result" "$(printf 'Replayed N messages in N s (N messages/s), recorded in N s.\nACKs sent: N, recorded: N')"
+  assert_streq "$(strip_stderr stderr)" ""
+  # Truncated traces are rejected
+  head -c 100 test_trace > test_trace.broken
+  ! ./run-firebuild --replay-trace=test_trace.broken > /dev/null 2>&1
+  rm -f test_trace test_trace.broken
+}
+
+@test "stats json" {
+  rm -f test_stats.json test_stats_out
+  # Opening a file for writing waits for the supervisor's ACK
+  result=$(./run-firebuild --stats-json=test_stats.json -- bash -c 'ls integration.bats > test_stats_out; cat test_stats_out')
+  assert_streq "$result" "integration.bats"
+  assert_streq "$(strip_stderr stderr)" ""
+  grep -q '"stats": "current"' test_stats.json
+  grep -q '"fingerprint": {"count": [1-9]' test_stats.json
+  grep -q '"ack_waits": {"count": [1-9]' test_stats.json
+  grep -q '"by_executable": \[' test_stats.json
+  ./run-firebuild --stats-json=test_stats.json
+  assert_streq "$(strip_stderr stderr)" ""
+  grep -q '"stats": "stored"' test_stats.json
+  grep -q '"hashing": {"count": [1-9]' test_stats.json
+  rm -f test_stats.json test_stats_out
+}
+
+@test "trace events" {
+  rm -f test_trace_events.json
+  # the command line contains an ESC character to be escaped
+  result=$(./run-firebuild --trace-events=test_trace_events.json -- bash -c 'exec ls integration.bats' "$(printf 'esc\033')")
+  assert_streq "$result" "integration.bats"
+  assert_streq "$(strip_stderr stderr)" ""
+  grep -q 'esc\\u001b' test_trace_events.json
+  grep -q '^{"traceEvents": \[' test_trace_events.json
+  grep -q '"ph": "X", "name": "bash", "cat": "[a-z ]*", "pid": 1,' test_trace_events.json
+  grep -q '"ph": "X", "name": "fingerprint", "pid": 2,' test_trace_events.json
+  tail -n1 test_trace_events.json | grep -q '^\], "displayTimeUnit": "ms"}$'
+  # The file is valid JSON and the slices on each thread don't overlap partially
+  python3 - test_trace_events.json <<'EOF'
+import json, sys
+slices = {}
+for e in json.load(open(sys.argv[1]))["traceEvents"]:
+    if e["ph"] == "X":
+        slices.setdefault((e["pid"], e["tid"]), []).append((e["ts"], -e["dur"]))
+for thread in slices.values():
+    open_ends = []
+    for ts, neg_dur in sorted(thread):
+        while open_ends and open_ends[-1] <= ts + 0.001:
+            open_ends.pop()
+        assert not open_ends or ts - neg_dur <= open_ends[-1] + 0.001, "partially overlapping slices"
+        open_ends.append(ts - neg_dur)
+EOF
+  rm -f test_trace_events.json
+}
+
+@test "remote cache" {
+  rm -rf test_remote_cache_dir test_remote_cache_url test_remote_out
+  timeout 120 "$TEST_SOURCE_DIR"/../tools/firebuild-cache-server -p 0 test_remote_cache_dir > test_remote_cache_url 2>/dev/null &
+  server_pid=$!
+  while [ ! -s test_remote_cache_url ]; do sleep 0.1; done
+  remote_cfg="remote_cache_url = \"$(cat test_remote_cache_url)\""
+  # Populate the remote cache, with the output file stored as a blob
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -o "$remote_cfg" -- bash -c 'head -c 10000 integration.bats > test_remote_out')
+  assert_streq "$result" ""
+  assert_streq "$(strip_stderr stderr)" ""
+  # Shortcut from the remote cache with an empty local cache
+  rm -rf test_cache_dir test_remote_out
+  result=$(./run-firebuild -s -o 'processes.skip_cache = []' -o "$remote_cfg" -- bash -c 'head -c 10000 integration.bats > test_remote_out' | sed 's/  */ /g;s/seconds/ms/;s/[0-9-][0-9\.]* ms/N ms/;s/[0-9-][0-9\.]* kB/N kB/')
+  assert_streq "$result" "$(printf '\nStatistics of current run:\n Hits: 1 / 1 (100.00 %%)\n Misses: 0\n Uncacheable: 0\n GC runs: 0\nNewly cached: N kB\nSaved CPU time: N ms\nCache entry lookups per tier:\n Local hits: 0, misses: 1\n Remote hits: 1, misses: 0\nDownloaded: N kB\nUploaded: N kB\n')"
+  head -c 10000 integration.bats | cmp - test_remote_out
+  # Corrupt blobs are not downloaded and the command is run instead
+  find test_remote_cache_dir/blobs -type f -exec sh -c 'echo corrupt > "$1"' sh {} \;
+  rm -rf test_cache_dir test_remote_out
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -o "$remote_cfg" -- bash -c 'head -c 10000 integration.bats > test_remote_out')
+  assert_streq "$result" ""
+  strip_stderr stderr | grep -q "is corrupt, ignoring it"
+  head -c 10000 integration.bats | cmp - test_remote_out
+  kill $server_pid
+  rm -rf test_remote_cache_dir test_remote_cache_url test_remote_out
+}
+
+@test "cache daemon" {
+  rm -f test_daemon_out test_daemon_log
+  timeout 120 $FIREBUILD_CMD -c "$TEST_SOURCE_DIR"/../etc/firebuild.conf -d caching --cache-daemon > /dev/null 2> test_daemon_log &
+  daemon_pid=$!
+  while [ ! -S test_cache_dir/daemon.sock ]; do sleep 0.1; done
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -o 'use_cache_daemon = true' -- bash -c 'head -c 10000 integration.bats > test_daemon_out')
+  assert_streq "$result" ""
+  assert_streq "$(strip_stderr stderr)" ""
+  rm -f test_daemon_out
+  result=$(./run-firebuild -s -o 'processes.skip_cache = []' -o 'use_cache_daemon = true' -- bash -c 'head -c 10000 integration.bats > test_daemon_out' | sed 's/  */ /g;s/seconds/ms/;s/[0-9-][0-9\.]* ms/N ms/;s/[0-9-][0-9\.]* kB/N kB/')
+  assert_streq "$result" "$(printf '\nStatistics of current run:\n Hits: 1 / 1 (100.00 %%)\n Misses: 0\n Uncacheable: 0\n GC runs: 0\nNewly cached: N kB\nSaved CPU time: N ms\n')"
+  assert_streq "$(strip_stderr stderr)" ""
+  head -c 10000 integration.bats | cmp - test_daemon_out
+  kill $daemon_pid
+  # The second run was served by the daemon
+  grep -q 'Cache daemon serving the hash of ' test_daemon_log
+  grep -q 'Cache daemon serving the subkeys of ' test_daemon_log
+  # Without the daemon the cache is still used
+  rm -f test_daemon_out
+  result=$(./run-firebuild -o 'processes.skip_cache = []' -o 'use_cache_daemon = true' -- bash -c 'head -c 10000 integration.bats > test_daemon_out')
+  assert_streq "$result" "FIREBUILD: The cache daemon is not running, start it with \"firebuild --cache-daemon\""
+  assert_streq "$(strip_stderr stderr)" ""
+  head -c 10000 integration.bats | cmp - test_daemon_out
+  rm -f test_daemon_out test_daemon_log
+}